@@ -8,13 +8,20 @@
 #include <unistd.h>
 
 static const char *usage_s =
-    "Usage: imaged -r [PATH] [COMMAND] [ARGS...]\nCommands:"
+    "Usage: imaged -r [PATH] -t [TILE_SIZE] -z -m [LEVELS] -a -e -d [COMMAND] "
+    "[ARGS...]\nCommands:"
     "\n\tlist"
     "\n\tget [KEY]"
     "\n\tset [KEY] [WIDTH] [HEIGHT] [COLOR] [TYPE]"
     "\n\tremove [KEY]"
     "\n\timport [KEY] [PATH]"
     "\n\texport [KEY] [PATH]"
+    "\n\tmip [KEY] [LEVELS]"
+    "\n\trebuild"
+    "\n\twatch [PATTERN]"
+    "\n\tclone [SRC] [DST]"
+    "\n\tsnapshot [PATH]"
+    "\n\tcapacity [MAX_BYTES] [MAX_KEYS]"
     "\n";
 
 static void usage() { fputs(usage_s, stderr); }
@@ -23,12 +30,31 @@ int main(int argc, char *argv[]) {
   int opt;
 
   const char *root = NULL;
+  ImagedSetOptions options = {0};
 
-  while ((opt = getopt(argc, argv, "r:")) != -1) {
+  while ((opt = getopt(argc, argv, "r:t:zm:aed")) != -1) {
     switch (opt) {
     case 'r':
       root = optarg;
       break;
+    case 't':
+      options.tile_width = options.tile_height = strtoul(optarg, NULL, 10);
+      break;
+    case 'z':
+      options.compress = true;
+      break;
+    case 'm':
+      options.levels = strtoul(optarg, NULL, 10);
+      break;
+    case 'a':
+      options.atomic = true;
+      break;
+    case 'e':
+      options.ephemeral = true;
+      break;
+    case 'd':
+      options.dedup = true;
+      break;
     default:
       fprintf(stderr, "Unknown flag %c\n", opt);
       usage();
@@ -50,14 +76,14 @@ int main(int argc, char *argv[]) {
   const char *cmd = argv[optind++];
 
   if (strncasecmp(cmd, "list", 4) == 0) {
+    // Only the metadata is needed, so images are never opened
     ImagedIter *iter = imagedIterNew(db);
 
-    while (imagedIterNext(iter) != NULL) {
-      printf("%s\t%" PRIu64 "x%" PRIu64 "\t%s\t%s\n", iter->key,
-             iter->handle.image.meta.width, iter->handle.image.meta.height,
-             imageColorName(iter->handle.image.meta.color),
-             imageTypeName(iter->handle.image.meta.kind,
-                           iter->handle.image.meta.bits));
+    const ImageMeta *meta;
+    while ((meta = imagedIterNextMeta(iter)) != NULL) {
+      printf("%s\t%" PRIu64 "x%" PRIu64 "\t%s\t%s\n", iter->key, meta->width,
+             meta->height, imageColorName(meta->color),
+             imageTypeName(meta->kind, meta->bits));
     }
 
     imagedIterFree(iter);
@@ -123,7 +149,8 @@ int main(int argc, char *argv[]) {
     };
 
     ImagedStatus rc;
-    if ((rc = imagedSet(db, key, -1, &meta, NULL, NULL)) != IMAGED_OK) {
+    if ((rc = imagedSetWithOptions(db, key, -1, &meta, NULL, &options,
+                                   NULL)) != IMAGED_OK) {
       imagedPrintError(rc, "Unable to set image");
       return 1;
     }
@@ -142,8 +169,13 @@ int main(int argc, char *argv[]) {
       return 1;
     }
 
-    imagedSet(db, key, -1, &image->meta, image->data, NULL);
+    ImagedStatus rc = imagedSetWithOptions(db, key, -1, &image->meta,
+                                           image->data, &options, NULL);
     imageFree(image);
+    if (rc != IMAGED_OK) {
+      imagedPrintError(rc, "Unable to import image");
+      return 1;
+    }
     puts("OK");
   } else if (strncasecmp(cmd, "export", 6) == 0) {
     if (argc < optind + 2) {
@@ -160,11 +192,114 @@ int main(int argc, char *argv[]) {
       return 1;
     }
 
-    if (imageWrite(filename, &handle.image) != IMAGED_OK) {
+    Image *image = &handle.image;
+    $Image(tmp) = NULL;
+    if (image->data == NULL) {
+      tmp = imageNew(image->meta);
+      if (tmp == NULL ||
+          imagedHandleReadRegion(&handle, 0, 0, tmp) != IMAGED_OK) {
+        fprintf(stderr, "Unable to read image: %s\n", key);
+        return 1;
+      }
+      image = tmp;
+    }
+
+    if (imageWrite(filename, image) != IMAGED_OK) {
       fprintf(stderr, "Unable to write image: %s\n", filename);
     } else {
       puts("OK");
     }
+  } else if (strncasecmp(cmd, "mip", 3) == 0) {
+    if (argc < optind + 2) {
+      usage();
+      return 1;
+    }
+    const char *key = argv[optind++];
+    uint32_t levels = strtoul(argv[optind++], NULL, 10);
+
+    ImagedStatus rc;
+    if ((rc = imagedSetLevels(db, key, -1, levels)) != IMAGED_OK) {
+      imagedPrintError(rc, "Unable to generate mip levels");
+      return 1;
+    }
+    puts("OK");
+  } else if (strncasecmp(cmd, "rebuild", 7) == 0) {
+    ImagedStatus rc;
+    if ((rc = imagedCatalogRebuild(db)) != IMAGED_OK) {
+      imagedPrintError(rc, "Unable to rebuild catalog");
+      return 1;
+    }
+    puts("OK");
+  } else if (strncasecmp(cmd, "watch", 5) == 0) {
+    const char *pattern = argc > optind ? argv[optind++] : NULL;
+    $ImagedWatch(watch) = imagedWatchNew(db, pattern);
+    if (watch == NULL) {
+      perror("Unable to watch database");
+      return 1;
+    }
+
+    ImagedWatchEvent event;
+    while (imagedWatchNext(watch, -1, &event)) {
+      switch (event.kind) {
+      case IMAGED_WATCH_SET:
+        printf("set %s\n", event.key);
+        break;
+      case IMAGED_WATCH_REMOVE:
+        printf("remove %s\n", event.key);
+        break;
+      case IMAGED_WATCH_OVERFLOW:
+        puts("overflow");
+        break;
+      }
+      fflush(stdout);
+    }
+  } else if (strncasecmp(cmd, "clone", 5) == 0) {
+    if (argc < optind + 2) {
+      usage();
+      return 1;
+    }
+
+    const char *src = argv[optind++];
+    const char *dst = argv[optind++];
+    ImagedStatus rc;
+    if ((rc = imagedClone(db, src, -1, dst, -1)) != IMAGED_OK) {
+      imagedPrintError(rc, "Unable to clone image");
+      return 1;
+    }
+    puts("OK");
+  } else if (strncasecmp(cmd, "snapshot", 8) == 0) {
+    if (argc < optind + 1) {
+      usage();
+      return 1;
+    }
+
+    ImagedSnapshotStats stats;
+    ImagedStatus rc;
+    if ((rc = imagedSnapshot(db, argv[optind++], &stats)) != IMAGED_OK) {
+      imagedPrintError(rc, "Unable to create snapshot");
+      return 1;
+    }
+    printf("%" PRIu64 " keys, %" PRIu64 " reflinked, %" PRIu64 " locked\n",
+           stats.keys, stats.reflinked, stats.locked);
+  } else if (strncasecmp(cmd, "capacity", 8) == 0) {
+    // Without arguments the current limit and usage are printed
+    if (argc >= optind + 2) {
+      uint64_t max_bytes = strtoull(argv[optind++], NULL, 10);
+      uint64_t max_keys = strtoull(argv[optind++], NULL, 10);
+      ImagedStatus rc;
+      if ((rc = imagedSetCapacity(db, max_bytes, max_keys)) != IMAGED_OK) {
+        imagedPrintError(rc, "Unable to set capacity");
+        return 1;
+      }
+    }
+
+    ImagedCapacityStats stats;
+    imagedGetCapacityStats(db, &stats);
+    printf("%" PRIu64 "/%" PRIu64 " bytes, %" PRIu64 "/%" PRIu64
+           " keys, %" PRIu64 " evictions (%" PRIu64 " bytes), %" PRIu64
+           " locked skipped\n",
+           stats.bytes, stats.max_bytes, stats.keys, stats.max_keys,
+           stats.evictions, stats.evicted_bytes, stats.skipped_locked);
   } else {
     fprintf(stderr, "Invalid command: %s\n", cmd);
     usage();
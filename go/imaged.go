@@ -98,11 +98,21 @@ func (db *Imaged) Set(key string, image *Image) (*Handle, error) {
 
 // Get an image
 func (db *Imaged) Get(key string) (*Handle, error) {
+	return db.get(key, true)
+}
+
+// GetReadOnly gets a read-only image, repeated reads of the same key reuse a
+// cached mapping
+func (db *Imaged) GetReadOnly(key string) (*Handle, error) {
+	return db.get(key, false)
+}
+
+func (db *Imaged) get(key string, editable bool) (*Handle, error) {
 	cKey := C.CString(key)
 	defer C.free(unsafe.Pointer(cKey))
 
 	ref := C.ImagedHandle{}
-	rc := C.imagedGet(db.ptr, cKey, C.long(len(key)), true, &ref)
+	rc := C.imagedGet(db.ptr, cKey, C.long(len(key)), C.bool(editable), &ref)
 	if rc != C.IMAGED_OK {
 		err := C.GoString(C.imagedError(rc))
 		return nil, errors.New(err)
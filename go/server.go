@@ -98,7 +98,7 @@ func (c *Context) GetPixel(client *worm.Client, key, x, y *worm.Value) error {
 	xPos := x.ToInt64()
 	yPos := y.ToInt64()
 	pixel := EmptyPixel()
-	handle, err := c.DB.Get(keyStr)
+	handle, err := c.DB.GetReadOnly(keyStr)
 	if err != nil {
 		return err
 	}
@@ -161,7 +161,7 @@ func tempFileName(prefix, suffix string) string {
 
 // Export command
 func (c *Context) Export(client *worm.Client, key, fmt *worm.Value) error {
-	handle, err := c.DB.Get(key.ToString())
+	handle, err := c.DB.GetReadOnly(key.ToString())
 	if err != nil {
 		return err
 	}
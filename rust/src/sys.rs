@@ -351,17 +351,95 @@ extern "C" {
     #[doc = " Dump ImagedStatus error message to stderr"]
     pub fn imagedPrintError(status: ImagedStatus, message: *const ::std::os::raw::c_char);
 }
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct ImagedCatalog {
+    _unused: [u8; 0],
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct ImagedHandleCache {
+    _unused: [u8; 0],
+}
+#[doc = " Lock contention counters, only lock acquisitions that had to wait are"]
+#[doc = " counted"]
+#[repr(C)]
+#[derive(Debug, Copy, Clone, PartialOrd, PartialEq)]
+pub struct ImagedLockStats {
+    pub waits: u64,
+    pub timeouts: u64,
+    pub wait_ns: u64,
+    pub max_wait_ns: u64,
+}
+#[test]
+fn bindgen_test_layout_ImagedLockStats() {
+    assert_eq!(
+        ::std::mem::size_of::<ImagedLockStats>(),
+        32usize,
+        concat!("Size of: ", stringify!(ImagedLockStats))
+    );
+    assert_eq!(
+        ::std::mem::align_of::<ImagedLockStats>(),
+        8usize,
+        concat!("Alignment of ", stringify!(ImagedLockStats))
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedLockStats>())).waits as *const _ as usize },
+        0usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedLockStats),
+            "::",
+            stringify!(waits)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedLockStats>())).timeouts as *const _ as usize },
+        8usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedLockStats),
+            "::",
+            stringify!(timeouts)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedLockStats>())).wait_ns as *const _ as usize },
+        16usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedLockStats),
+            "::",
+            stringify!(wait_ns)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedLockStats>())).max_wait_ns as *const _ as usize },
+        24usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedLockStats),
+            "::",
+            stringify!(max_wait_ns)
+        )
+    );
+}
 #[doc = " Image database"]
 #[repr(C)]
 #[derive(Debug, Copy, Clone, PartialOrd, PartialEq)]
 pub struct Imaged {
     pub root: *mut ::std::os::raw::c_char,
+    pub catalog: *mut ImagedCatalog,
+    pub handles: *mut ImagedHandleCache,
+    pub lock_table: *mut ImagedLockTable,
+    pub locks: ImagedLockStats,
+    pub recency: *mut ImagedRecency,
 }
 #[test]
 fn bindgen_test_layout_Imaged() {
     assert_eq!(
         ::std::mem::size_of::<Imaged>(),
-        8usize,
+        72usize,
         concat!("Size of: ", stringify!(Imaged))
     );
     assert_eq!(
@@ -379,6 +457,56 @@ fn bindgen_test_layout_Imaged() {
             stringify!(root)
         )
     );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<Imaged>())).catalog as *const _ as usize },
+        8usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(Imaged),
+            "::",
+            stringify!(catalog)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<Imaged>())).handles as *const _ as usize },
+        16usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(Imaged),
+            "::",
+            stringify!(handles)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<Imaged>())).lock_table as *const _ as usize },
+        24usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(Imaged),
+            "::",
+            stringify!(lock_table)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<Imaged>())).locks as *const _ as usize },
+        32usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(Imaged),
+            "::",
+            stringify!(locks)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<Imaged>())).recency as *const _ as usize },
+        64usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(Imaged),
+            "::",
+            stringify!(recency)
+        )
+    );
 }
 #[repr(u32)]
 #[doc = " Image kinds, specifies the image data base type"]
@@ -521,6 +649,108 @@ fn bindgen_test_layout_ImageMeta() {
         )
     );
 }
+#[repr(C)]
+#[derive(Debug, Copy, Clone, PartialOrd, PartialEq)]
+pub struct ImagedTile {
+    pub offset: u64,
+    pub size: u64,
+}
+#[test]
+fn bindgen_test_layout_ImagedTile() {
+    assert_eq!(
+        ::std::mem::size_of::<ImagedTile>(),
+        16usize,
+        concat!("Size of: ", stringify!(ImagedTile))
+    );
+    assert_eq!(
+        ::std::mem::align_of::<ImagedTile>(),
+        8usize,
+        concat!("Alignment of ", stringify!(ImagedTile))
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedTile>())).offset as *const _ as usize },
+        0usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedTile),
+            "::",
+            stringify!(offset)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedTile>())).size as *const _ as usize },
+        8usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedTile),
+            "::",
+            stringify!(size)
+        )
+    );
+}
+#[doc = " A key lock taken by imagedLockKey, `table` is NULL when the key is locked"]
+#[doc = " with flock on the open file"]
+#[repr(C)]
+#[derive(Debug, Copy, Clone, PartialOrd, PartialEq)]
+pub struct ImagedKeyLock {
+    pub table: *mut ImagedLockTable,
+    pub slot: *mut ImagedLockSlot,
+    pub hash: u64,
+    pub gen: u32,
+}
+#[test]
+fn bindgen_test_layout_ImagedKeyLock() {
+    assert_eq!(
+        ::std::mem::size_of::<ImagedKeyLock>(),
+        32usize,
+        concat!("Size of: ", stringify!(ImagedKeyLock))
+    );
+    assert_eq!(
+        ::std::mem::align_of::<ImagedKeyLock>(),
+        8usize,
+        concat!("Alignment of ", stringify!(ImagedKeyLock))
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedKeyLock>())).table as *const _ as usize },
+        0usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedKeyLock),
+            "::",
+            stringify!(table)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedKeyLock>())).slot as *const _ as usize },
+        8usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedKeyLock),
+            "::",
+            stringify!(slot)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedKeyLock>())).hash as *const _ as usize },
+        16usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedKeyLock),
+            "::",
+            stringify!(hash)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedKeyLock>())).gen as *const _ as usize },
+        24usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedKeyLock),
+            "::",
+            stringify!(gen)
+        )
+    );
+}
 extern "C" {
     #[doc = " Get the number of pixels in an image"]
     pub fn imageMetaNumPixels(meta: *const ImageMeta) -> size_t;
@@ -539,6 +769,31 @@ extern "C" {
         meta: *mut ImageMeta,
     );
 }
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct ImagedTileCache {
+    _unused: [u8; 0],
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct ImagedHandleCacheEntry {
+    _unused: [u8; 0],
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct ImagedLockTable {
+    _unused: [u8; 0],
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct ImagedRecency {
+    _unused: [u8; 0],
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct ImagedLockSlot {
+    _unused: [u8; 0],
+}
 #[doc = " Stores image data with associated metadata"]
 #[repr(C)]
 #[derive(Debug, Copy, Clone, PartialOrd, PartialEq)]
@@ -846,12 +1101,22 @@ extern "C" {
 pub struct ImagedHandle {
     pub fd: ::std::os::raw::c_int,
     pub image: Image,
+    pub map: *mut ::std::os::raw::c_void,
+    pub mapsize: size_t,
+    pub flags: u64,
+    pub tile_width: u32,
+    pub tile_height: u32,
+    pub tiles: *const ImagedTile,
+    pub cache: *mut ImagedTileCache,
+    pub shared: *mut ImagedHandleCacheEntry,
+    pub lock: ImagedKeyLock,
+    pub exclusive: bool,
 }
 #[test]
 fn bindgen_test_layout_ImagedHandle() {
     assert_eq!(
         ::std::mem::size_of::<ImagedHandle>(),
-        56usize,
+        152usize,
         concat!("Size of: ", stringify!(ImagedHandle))
     );
     assert_eq!(
@@ -879,6 +1144,106 @@ fn bindgen_test_layout_ImagedHandle() {
             stringify!(image)
         )
     );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedHandle>())).map as *const _ as usize },
+        56usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedHandle),
+            "::",
+            stringify!(map)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedHandle>())).mapsize as *const _ as usize },
+        64usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedHandle),
+            "::",
+            stringify!(mapsize)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedHandle>())).flags as *const _ as usize },
+        72usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedHandle),
+            "::",
+            stringify!(flags)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedHandle>())).tile_width as *const _ as usize },
+        80usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedHandle),
+            "::",
+            stringify!(tile_width)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedHandle>())).tile_height as *const _ as usize },
+        84usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedHandle),
+            "::",
+            stringify!(tile_height)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedHandle>())).tiles as *const _ as usize },
+        88usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedHandle),
+            "::",
+            stringify!(tiles)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedHandle>())).cache as *const _ as usize },
+        96usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedHandle),
+            "::",
+            stringify!(cache)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedHandle>())).shared as *const _ as usize },
+        104usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedHandle),
+            "::",
+            stringify!(shared)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedHandle>())).lock as *const _ as usize },
+        112usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedHandle),
+            "::",
+            stringify!(lock)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedHandle>())).exclusive as *const _ as usize },
+        144usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedHandle),
+            "::",
+            stringify!(exclusive)
+        )
+    );
 }
 extern "C" {
     #[doc = " Remove all image locks"]
@@ -976,12 +1341,15 @@ pub struct ImagedIter {
     pub key: *const ::std::os::raw::c_char,
     pub keylen: size_t,
     pub handle: ImagedHandle,
+    pub catalog: bool,
+    pub index: size_t,
+    pub keybuf: [::std::os::raw::c_char; 256usize],
 }
 #[test]
 fn bindgen_test_layout_ImagedIter() {
     assert_eq!(
         ::std::mem::size_of::<ImagedIter>(),
-        96usize,
+        464usize,
         concat!("Size of: ", stringify!(ImagedIter))
     );
     assert_eq!(
@@ -1049,6 +1417,36 @@ fn bindgen_test_layout_ImagedIter() {
             stringify!(handle)
         )
     );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedIter>())).catalog as *const _ as usize },
+        192usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedIter),
+            "::",
+            stringify!(catalog)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedIter>())).index as *const _ as usize },
+        200usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedIter),
+            "::",
+            stringify!(index)
+        )
+    );
+    assert_eq!(
+        unsafe { &(*(::std::ptr::null::<ImagedIter>())).keybuf as *const _ as usize },
+        208usize,
+        concat!(
+            "Offset of field: ",
+            stringify!(ImagedIter),
+            "::",
+            stringify!(keybuf)
+        )
+    );
 }
 extern "C" {
     #[doc = " Create a new iterator"]
@@ -0,0 +1,421 @@
+#define _DEFAULT_SOURCE
+#include "imaged.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The handle cache keeps the file descriptor and mapping of read-only handles
+// open after they are closed. Every handle for a key shares one entry, the
+// shared lock on the key is taken when the first handle is opened and
+// released with the last one, so writers behave the same as with uncached
+// handles. Before an unused entry is reused the file is checked using stat
+// and by comparing the mapped header, since another process may have replaced
+// or rewritten it in the meantime. Entries that are in use cannot be rewritten
+// while their lock is held, but the key can still be replaced by an atomic
+// write, so every hit checks that the path still refers to the mapped file
+
+#define HANDLE_CACHE_BUCKETS 64
+
+struct ImagedHandleCacheEntry {
+  struct ImagedHandleCache *cache;
+  char *key;
+  size_t keylen;
+  char *path;
+  uint64_t hash;
+  struct stat st;
+  ImagedHeader header;
+  size_t headersize;
+  ImagedHandle handle;
+  size_t refs;
+  bool stale;
+  struct ImagedHandleCacheEntry *next;       // hash chain or stale list
+  struct ImagedHandleCacheEntry *prev, *lru; // unused entries
+};
+
+typedef struct ImagedHandleCacheEntry Entry;
+
+struct ImagedHandleCache {
+  pthread_mutex_t lock;
+  size_t size;
+  Entry **buckets;
+  size_t nbuckets, count;
+  Entry *head, *tail; // unused entries, most recently used first
+  size_t unused;
+  Entry *stale; // entries removed from the table that are still in use
+  ImagedHandleCacheStats stats;
+};
+
+static bool statEqual(const struct stat *a, const struct stat *b) {
+#ifdef __APPLE__
+  const struct timespec *am = &a->st_mtimespec, *bm = &b->st_mtimespec;
+  const struct timespec *ac = &a->st_ctimespec, *bc = &b->st_ctimespec;
+#else
+  const struct timespec *am = &a->st_mtim, *bm = &b->st_mtim;
+  const struct timespec *ac = &a->st_ctim, *bc = &b->st_ctim;
+#endif
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+         a->st_size == b->st_size && am->tv_sec == bm->tv_sec &&
+         am->tv_nsec == bm->tv_nsec && ac->tv_sec == bc->tv_sec &&
+         ac->tv_nsec == bc->tv_nsec;
+}
+
+static Entry **cacheFind(struct ImagedHandleCache *cache, const char *key,
+                         size_t keylen, uint64_t hash) {
+  Entry **e = &cache->buckets[hash & (cache->nbuckets - 1)];
+  while (*e != NULL && ((*e)->hash != hash || (*e)->keylen != keylen ||
+                        memcmp((*e)->key, key, keylen) != 0)) {
+    e = &(*e)->next;
+  }
+  return e;
+}
+
+static void lruRemove(struct ImagedHandleCache *cache, Entry *e) {
+  if (e->prev) {
+    e->prev->lru = e->lru;
+  } else {
+    cache->head = e->lru;
+  }
+
+  if (e->lru) {
+    e->lru->prev = e->prev;
+  } else {
+    cache->tail = e->prev;
+  }
+
+  e->prev = e->lru = NULL;
+  cache->unused -= 1;
+}
+
+static void lruPush(struct ImagedHandleCache *cache, Entry *e) {
+  e->prev = NULL;
+  e->lru = cache->head;
+  if (cache->head) {
+    cache->head->prev = e;
+  } else {
+    cache->tail = e;
+  }
+  cache->head = e;
+  cache->unused += 1;
+}
+
+static void entryFree(Entry *e) {
+  munmap(e->handle.map, e->handle.mapsize);
+  close(e->handle.fd);
+  free(e->key);
+  free(e->path);
+  free(e);
+}
+
+// Remove an entry from the table, unused entries are freed immediately and
+// entries that are still in use are freed by the last imagedHandleClose
+static void cacheDrop(struct ImagedHandleCache *cache, Entry *e) {
+  Entry **p = cacheFind(cache, e->key, e->keylen, e->hash);
+  if (*p == e) {
+    *p = e->next;
+    cache->count -= 1;
+  }
+
+  if (e->refs > 0) {
+    e->stale = true;
+    e->next = cache->stale;
+    cache->stale = e;
+    return;
+  }
+
+  lruRemove(cache, e);
+  entryFree(e);
+}
+
+static void cacheTrim(struct ImagedHandleCache *cache) {
+  while (cache->unused > cache->size) {
+    cacheDrop(cache, cache->tail);
+    cache->stats.evictions += 1;
+  }
+}
+
+static void cacheGrow(struct ImagedHandleCache *cache) {
+  size_t n = cache->nbuckets * 2;
+  Entry **buckets = calloc(n, sizeof(Entry *));
+  if (buckets == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < cache->nbuckets; i++) {
+    Entry *e = cache->buckets[i];
+    while (e != NULL) {
+      Entry *next = e->next;
+      e->next = buckets[e->hash & (n - 1)];
+      buckets[e->hash & (n - 1)] = e;
+      e = next;
+    }
+  }
+
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->nbuckets = n;
+}
+
+// Check that the file has not changed since the entry was created, called
+// with the shared lock held so no writer can be modifying it
+static bool entryIsValid(const Entry *e) {
+  struct stat st;
+  return stat(e->path, &st) == 0 && statEqual(&st, &e->st) &&
+         memcmp(e->handle.map, &e->header, e->headersize) == 0;
+}
+
+// Check that the key still refers to the mapped file, the lock held by the
+// handles using the entry does not prevent an atomic write from replacing it
+static bool entryIsCurrent(const Entry *e) {
+  struct stat st;
+  return stat(e->path, &st) == 0 && st.st_dev == e->st.st_dev &&
+         st.st_ino == e->st.st_ino;
+}
+
+struct ImagedHandleCache *imagedHandleCacheNew(size_t size) {
+  struct ImagedHandleCache *cache =
+      calloc(1, sizeof(struct ImagedHandleCache));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->nbuckets = HANDLE_CACHE_BUCKETS;
+  cache->buckets = calloc(cache->nbuckets, sizeof(Entry *));
+  if (cache->buckets == NULL) {
+    free(cache);
+    return NULL;
+  }
+
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->size = size;
+  return cache;
+}
+
+static void entryOrphan(Entry *e) {
+  if (e->refs > 0) {
+    // Still in use, freed when the last handle is closed
+    e->cache = NULL;
+    e->stale = true;
+  } else {
+    entryFree(e);
+  }
+}
+
+void imagedHandleCacheFree(struct ImagedHandleCache *cache) {
+  if (cache == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < cache->nbuckets; i++) {
+    Entry *e = cache->buckets[i];
+    while (e != NULL) {
+      Entry *next = e->next;
+      entryOrphan(e);
+      e = next;
+    }
+  }
+
+  while (cache->stale != NULL) {
+    Entry *next = cache->stale->next;
+    entryOrphan(cache->stale);
+    cache->stale = next;
+  }
+
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->buckets);
+  free(cache);
+}
+
+static void handleFromEntry(ImagedHandle *handle, Entry *e) {
+  *handle = e->handle;
+  handle->cache = NULL;
+  handle->shared = e;
+}
+
+ImagedStatus imagedHandleCacheGet(struct ImagedHandleCache *cache,
+                                  const char *key, ssize_t keylen,
+                                  ImagedHandle *handle) {
+  if (cache == NULL || handle == NULL) {
+    return IMAGED_ERR_FILE_DOES_NOT_EXIST;
+  }
+
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  uint64_t hash = imagedHashKey(key, keylen);
+  ImagedStatus status = IMAGED_ERR_FILE_DOES_NOT_EXIST;
+
+  pthread_mutex_lock(&cache->lock);
+  Entry *e = *cacheFind(cache, key, keylen, hash);
+  if (e == NULL) {
+    cache->stats.misses += 1;
+    goto done;
+  }
+
+  if (e->refs == 0) {
+    if (imagedRelockKey(e->handle.fd, &e->handle.lock, false) != IMAGED_OK) {
+      status = IMAGED_ERR_LOCKED;
+      goto done;
+    }
+
+    if (!entryIsValid(e)) {
+      imagedUnlockKey(e->handle.fd, &e->handle.lock, false);
+      cacheDrop(cache, e);
+      cache->stats.invalidations += 1;
+      cache->stats.misses += 1;
+      goto done;
+    }
+
+    lruRemove(cache, e);
+  } else if (!entryIsCurrent(e)) {
+    // Handles that are still open keep the previous file
+    cacheDrop(cache, e);
+    cache->stats.invalidations += 1;
+    cache->stats.misses += 1;
+    goto done;
+  }
+
+  e->refs += 1;
+  cache->stats.hits += 1;
+  handleFromEntry(handle, e);
+  status = IMAGED_OK;
+
+done:
+  pthread_mutex_unlock(&cache->lock);
+  return status;
+}
+
+void imagedHandleCachePut(struct ImagedHandleCache *cache, const char *key,
+                          ssize_t keylen, const char *path,
+                          ImagedHandle *handle) {
+  if (cache == NULL || cache->size == 0 || handle == NULL ||
+      handle->map == NULL || handle->shared != NULL) {
+    return;
+  }
+
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  Entry *e = calloc(1, sizeof(Entry));
+  if (e == NULL) {
+    return;
+  }
+
+  e->key = strndup(key, keylen);
+  e->path = strdup(path);
+  if (e->key == NULL || e->path == NULL ||
+      fstat(handle->fd, &e->st) != 0) {
+    free(e->key);
+    free(e->path);
+    free(e);
+    return;
+  }
+
+  e->cache = cache;
+  e->keylen = keylen;
+  e->hash = imagedHashKey(key, keylen);
+  e->headersize = handle->mapsize < sizeof(ImagedHeader) ? handle->mapsize
+                                                          : sizeof(ImagedHeader);
+  memcpy(&e->header, handle->map, e->headersize);
+  e->handle = *handle;
+  e->handle.cache = NULL;
+  e->refs = 1;
+
+  pthread_mutex_lock(&cache->lock);
+  Entry **p = cacheFind(cache, key, keylen, e->hash);
+  if (*p != NULL) {
+    // Another thread opened the same key concurrently, replace its entry so
+    // the most recent mapping is the one that is reused
+    cacheDrop(cache, *p);
+  }
+
+  e->next = cache->buckets[e->hash & (cache->nbuckets - 1)];
+  cache->buckets[e->hash & (cache->nbuckets - 1)] = e;
+  cache->count += 1;
+  if (cache->count > cache->nbuckets) {
+    cacheGrow(cache);
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  handle->shared = e;
+}
+
+void imagedHandleCacheRelease(struct ImagedHandleCacheEntry *e) {
+  if (e == NULL) {
+    return;
+  }
+
+  struct ImagedHandleCache *cache = e->cache;
+  if (cache == NULL) {
+    // The cache was freed while the handle was open
+    if (--e->refs == 0) {
+      entryFree(e);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  if (--e->refs == 0) {
+    imagedUnlockKey(e->handle.fd, &e->handle.lock, false);
+    if (e->stale) {
+      Entry **p = &cache->stale;
+      while (*p != e) {
+        p = &(*p)->next;
+      }
+      *p = e->next;
+      entryFree(e);
+    } else {
+      lruPush(cache, e);
+      cacheTrim(cache);
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void imagedHandleCacheInvalidate(struct ImagedHandleCache *cache,
+                                 const char *key, ssize_t keylen) {
+  if (cache == NULL) {
+    return;
+  }
+
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  Entry *e = *cacheFind(cache, key, keylen, imagedHashKey(key, keylen));
+  if (e != NULL) {
+    cacheDrop(cache, e);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void imagedSetHandleCacheSize(Imaged *db, size_t size) {
+  struct ImagedHandleCache *cache = db->handles;
+  if (cache == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  cache->size = size;
+  cacheTrim(cache);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void imagedGetHandleCacheStats(const Imaged *db,
+                               ImagedHandleCacheStats *stats) {
+  struct ImagedHandleCache *cache = db->handles;
+  if (cache == NULL) {
+    bzero(stats, sizeof(ImagedHandleCacheStats));
+    return;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  stats->entries = cache->count;
+  pthread_mutex_unlock(&cache->lock);
+}
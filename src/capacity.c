@@ -0,0 +1,413 @@
+#define _DEFAULT_SOURCE
+#include "imaged.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// The recency table is a header page holding the limits and eviction counters
+// followed by one access time per slot. Keys are mapped to slots by hash, so
+// recording an access is a single store to shared memory and keys that share
+// a slot also share their access time. The file is sparse, pages are only
+// allocated for slots that have been used. When a set would go over the limit
+// the catalog is scanned and the least recently used keys are removed until
+// usage is back under CAPACITY_LOW_PERCENT of the limit, so the scan is not
+// repeated for every set
+
+#define CAPACITY_VERSION 1
+#define CAPACITY_HEADER_SIZE 4096
+#define CAPACITY_LOW_PERCENT 90
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t nslots;
+  uint64_t max_bytes;
+  uint64_t max_keys;
+  uint64_t evictions;
+  uint64_t evicted_bytes;
+  uint64_t skipped_locked;
+} RecencyHeader;
+
+// flock only excludes other processes, threads of the same process sharing
+// the table also take `evicting`
+struct ImagedRecency {
+  pthread_mutex_t evicting;
+  int fd;
+  RecencyHeader *header;
+  uint64_t *slots;
+  size_t mapsize;
+};
+
+typedef struct {
+  int64_t atime;
+  uint64_t size;
+  size_t key; // offset of the key in the key buffer
+  size_t keylen;
+} Candidate;
+
+static const char _recency_magic[4] = "IMGA";
+
+static int64_t nowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct ImagedRecency *imagedRecencyOpen(const char *path, bool create) {
+  int fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  // The header is initialized while holding the lock, other processes opening
+  // the table at the same time wait for it
+  flock(fd, LOCK_EX);
+  struct stat st;
+  RecencyHeader header;
+  bool ok = fstat(fd, &st) == 0;
+  if (ok && st.st_size == 0) {
+    bzero(&header, sizeof(header));
+    memcpy(header.magic, _recency_magic, sizeof(_recency_magic));
+    header.version = CAPACITY_VERSION;
+    header.nslots = IMAGED_RECENCY_SLOTS;
+    ok = ftruncate(fd, CAPACITY_HEADER_SIZE +
+                           IMAGED_RECENCY_SLOTS * sizeof(uint64_t)) == 0 &&
+         pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+         fstat(fd, &st) == 0;
+  }
+
+  ok = ok && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+       memcmp(header.magic, _recency_magic, sizeof(_recency_magic)) == 0 &&
+       header.version == CAPACITY_VERSION && header.nslots > 0 &&
+       (header.nslots & (header.nslots - 1)) == 0 &&
+       (uint64_t)st.st_size ==
+           CAPACITY_HEADER_SIZE + header.nslots * sizeof(uint64_t);
+  flock(fd, LOCK_UN);
+
+  void *map = ok ? mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                        0)
+                 : MAP_FAILED;
+  struct ImagedRecency *r =
+      map != MAP_FAILED ? malloc(sizeof(struct ImagedRecency)) : NULL;
+  if (r == NULL) {
+    if (map != MAP_FAILED) {
+      munmap(map, st.st_size);
+    }
+    close(fd);
+    return NULL;
+  }
+
+  pthread_mutex_init(&r->evicting, NULL);
+  r->fd = fd;
+  r->header = map;
+  r->slots = (uint64_t *)((uint8_t *)map + CAPACITY_HEADER_SIZE);
+  r->mapsize = st.st_size;
+  return r;
+}
+
+void imagedRecencyClose(struct ImagedRecency *recency) {
+  if (recency == NULL) {
+    return;
+  }
+
+  munmap(recency->header, recency->mapsize);
+  close(recency->fd);
+  pthread_mutex_destroy(&recency->evicting);
+  free(recency);
+}
+
+static uint64_t *recencySlot(const struct ImagedRecency *r, const char *key,
+                             size_t keylen) {
+  return &r->slots[imagedHashKey(key, keylen) & (r->header->nslots - 1)];
+}
+
+void imagedCapacityTouch(Imaged *db, const char *key, ssize_t keylen) {
+  if (db->recency == NULL) {
+    return;
+  }
+
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  // Only store when the time changed, so repeated reads of a hot key do not
+  // keep dirtying the same cache line
+  uint64_t *slot = recencySlot(db->recency, key, keylen);
+  uint64_t now = (uint64_t)nowMs();
+  if (__atomic_load_n(slot, __ATOMIC_RELAXED) != now) {
+    __atomic_store_n(slot, now, __ATOMIC_RELAXED);
+  }
+}
+
+static int compareCandidate(const void *a, const void *b) {
+  int64_t x = ((const Candidate *)a)->atime;
+  int64_t y = ((const Candidate *)b)->atime;
+  return (x > y) - (x < y);
+}
+
+// Collect every key except `skip` with its access time, keys are copied since
+// removing keys can cause the catalog to be compacted
+static void collectCandidates(Imaged *db, const char *skip, size_t skiplen,
+                              Candidate **out, size_t *count, char **keys) {
+  Candidate *list = NULL;
+  char *buf = NULL;
+  size_t n = 0, cap = 0, used = 0, bufcap = 0;
+  size_t index = 0;
+  ImagedCatalogEntry entry;
+  while (imagedCatalogNext(db, &index, &entry)) {
+    if (entry.keylen == skiplen && memcmp(entry.key, skip, skiplen) == 0) {
+      continue;
+    }
+
+    if (n == cap) {
+      cap = cap ? cap * 2 : 1024;
+      Candidate *tmp = realloc(list, cap * sizeof(Candidate));
+      if (tmp == NULL) {
+        break;
+      }
+      list = tmp;
+    }
+
+    if (used + entry.keylen > bufcap) {
+      bufcap = bufcap ? bufcap * 2 : 65536;
+      while (used + entry.keylen > bufcap) {
+        bufcap *= 2;
+      }
+      char *tmp = realloc(buf, bufcap);
+      if (tmp == NULL) {
+        break;
+      }
+      buf = tmp;
+    }
+
+    // Keys that were never accessed since the limit was set use the time they
+    // were written
+    int64_t atime = (int64_t)__atomic_load_n(
+        recencySlot(db->recency, entry.key, entry.keylen), __ATOMIC_RELAXED);
+    int64_t mtime = entry.mtime / 1000000;
+    Candidate *c = &list[n++];
+    c->atime = atime > mtime ? atime : mtime;
+    c->size = entry.size;
+    c->key = used;
+    c->keylen = entry.keylen;
+    memcpy(buf + used, entry.key, entry.keylen);
+    used += entry.keylen;
+  }
+
+  if (n > 0) {
+    qsort(list, n, sizeof(Candidate), compareCandidate);
+  }
+
+  *out = list;
+  *count = n;
+  *keys = buf;
+}
+
+// Remove least recently used keys until `keys` and `bytes` are within the low
+// watermark, the table is locked
+static void evict(Imaged *db, const char *key, size_t keylen, size_t keys,
+                  uint64_t bytes) {
+  RecencyHeader *h = db->recency->header;
+  uint64_t max_keys = __atomic_load_n(&h->max_keys, __ATOMIC_RELAXED);
+  uint64_t max_bytes = __atomic_load_n(&h->max_bytes, __ATOMIC_RELAXED);
+  uint64_t low_keys = max_keys - max_keys * (100 - CAPACITY_LOW_PERCENT) / 100;
+  uint64_t low_bytes =
+      max_bytes - max_bytes / 100 * (100 - CAPACITY_LOW_PERCENT);
+
+  Candidate *list;
+  size_t n;
+  char *buf;
+  collectCandidates(db, key, keylen, &list, &n, &buf);
+
+  for (size_t i = 0; i < n; i++) {
+    if ((max_keys == 0 || keys <= low_keys) &&
+        (max_bytes == 0 || bytes <= low_bytes)) {
+      break;
+    }
+
+    ImagedStatus status =
+        imagedRemove(db, buf + list[i].key, (ssize_t)list[i].keylen);
+    if (status == IMAGED_OK) {
+      keys -= 1;
+      bytes -= bytes > list[i].size ? list[i].size : bytes;
+      __atomic_add_fetch(&h->evictions, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&h->evicted_bytes, list[i].size, __ATOMIC_RELAXED);
+    } else if (status == IMAGED_ERR_LOCKED) {
+      __atomic_add_fetch(&h->skipped_locked, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  free(list);
+  free(buf);
+}
+
+static bool capacityIsLimited(const Imaged *db) {
+  RecencyHeader *h = db->recency->header;
+  return __atomic_load_n(&h->max_keys, __ATOMIC_RELAXED) > 0 ||
+         __atomic_load_n(&h->max_bytes, __ATOMIC_RELAXED) > 0;
+}
+
+static uint64_t addDelta(uint64_t n, int64_t delta) {
+  return delta < 0 && (uint64_t)-delta > n ? 0 : n + (uint64_t)delta;
+}
+
+// Get the usage once `dkeys` keys and `dbytes` bytes are added, returns true
+// when it is over the limit
+static bool capacityIsOver(Imaged *db, int64_t dkeys, int64_t dbytes,
+                           size_t *keys, uint64_t *bytes) {
+  RecencyHeader *h = db->recency->header;
+  uint64_t max_keys = __atomic_load_n(&h->max_keys, __ATOMIC_RELAXED);
+  uint64_t max_bytes = __atomic_load_n(&h->max_bytes, __ATOMIC_RELAXED);
+  if (imagedCatalogTotals(db, keys, bytes) != IMAGED_OK) {
+    return false;
+  }
+
+  *keys = (size_t)addDelta(*keys, dkeys);
+  *bytes = addDelta(*bytes, dbytes);
+  return (max_keys > 0 && *keys > max_keys) ||
+         (max_bytes > 0 && *bytes > max_bytes);
+}
+
+// Count a key of `size` bytes being set, it replaces the current file
+static void capacityAdd(Imaged *db, const char *key, size_t keylen,
+                        uint64_t size, int64_t *dkeys, int64_t *dbytes) {
+  ImagedCatalogEntry entry;
+  if (imagedCatalogGet(db, key, keylen, &entry) == IMAGED_OK) {
+    *dkeys -= 1;
+    *dbytes -= (int64_t)entry.size;
+  }
+  *dkeys += 1;
+  *dbytes += (int64_t)size;
+}
+
+// Evict keys other than `key` when adding `dkeys` keys and `dbytes` bytes
+// would go over the limit
+static void capacityEnsure(Imaged *db, const char *key, size_t keylen,
+                           int64_t dkeys, int64_t dbytes) {
+  size_t keys;
+  uint64_t bytes;
+  if (!capacityIsOver(db, dkeys, dbytes, &keys, &bytes)) {
+    return;
+  }
+
+  // Only one thread of one process evicts at a time, the others go ahead with
+  // their set. The usage is read again since another one may have just
+  // finished evicting
+  struct ImagedRecency *r = db->recency;
+  if (pthread_mutex_trylock(&r->evicting) != 0) {
+    return;
+  }
+
+  if (flock(r->fd, LOCK_EX | LOCK_NB) == 0) {
+    if (capacityIsOver(db, dkeys, dbytes, &keys, &bytes)) {
+      evict(db, key, keylen, keys, bytes);
+    }
+    flock(r->fd, LOCK_UN);
+  }
+  pthread_mutex_unlock(&r->evicting);
+}
+
+void imagedCapacityReserve(Imaged *db, const char *key, ssize_t keylen,
+                           uint64_t size) {
+  if (db->recency == NULL) {
+    return;
+  }
+
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  imagedCapacityTouch(db, key, keylen);
+  if (capacityIsLimited(db)) {
+    int64_t dkeys = 0, dbytes = 0;
+    capacityAdd(db, key, keylen, size, &dkeys, &dbytes);
+    capacityEnsure(db, key, keylen, dkeys, dbytes);
+  }
+}
+
+void imagedCapacityReserveBatch(Imaged *db, const ImagedSetRequest *reqs,
+                                size_t n, const uint64_t *sizes) {
+  if (db->recency == NULL) {
+    return;
+  }
+
+  // The keys of the batch have just been accessed, so they are the last
+  // candidates for eviction
+  for (size_t i = 0; i < n; i++) {
+    if (sizes[i] > 0) {
+      imagedCapacityTouch(db, reqs[i].key, reqs[i].keylen);
+    }
+  }
+
+  if (!capacityIsLimited(db)) {
+    return;
+  }
+
+  int64_t dkeys = 0, dbytes = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (sizes[i] > 0) {
+      size_t keylen = reqs[i].keylen > 0 ? (size_t)reqs[i].keylen
+                                         : strlen(reqs[i].key);
+      capacityAdd(db, reqs[i].key, keylen, sizes[i], &dkeys, &dbytes);
+    }
+  }
+  capacityEnsure(db, NULL, 0, dkeys, dbytes);
+}
+
+ImagedStatus imagedSetCapacity(Imaged *db, uint64_t max_bytes,
+                               uint64_t max_keys) {
+  if (db->recency == NULL) {
+    char *path = imagedStringPrintf("%s%c%s", db->root, IMAGED_PATH_SEP,
+                                    IMAGED_RECENCY);
+    db->recency = path != NULL ? imagedRecencyOpen(path, true) : NULL;
+    free(path);
+    if (db->recency == NULL) {
+      return IMAGED_ERR_MAP_FAILED;
+    }
+  }
+
+  RecencyHeader *h = db->recency->header;
+  __atomic_store_n(&h->max_bytes, max_bytes, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->max_keys, max_keys, __ATOMIC_RELAXED);
+
+  // Shrinking the limit evicts right away, waiting for any eviction already
+  // running in this or another process
+  size_t keys;
+  uint64_t bytes;
+  if ((max_keys > 0 || max_bytes > 0) &&
+      capacityIsOver(db, 0, 0, &keys, &bytes)) {
+    pthread_mutex_lock(&db->recency->evicting);
+    flock(db->recency->fd, LOCK_EX);
+    if (capacityIsOver(db, 0, 0, &keys, &bytes)) {
+      evict(db, NULL, 0, keys, bytes);
+    }
+    flock(db->recency->fd, LOCK_UN);
+    pthread_mutex_unlock(&db->recency->evicting);
+  }
+  return IMAGED_OK;
+}
+
+void imagedGetCapacityStats(const Imaged *db, ImagedCapacityStats *stats) {
+  bzero(stats, sizeof(ImagedCapacityStats));
+  size_t keys = 0;
+  if (imagedCatalogTotals(db, &keys, &stats->bytes) == IMAGED_OK) {
+    stats->keys = keys;
+  }
+
+  if (db->recency == NULL) {
+    return;
+  }
+
+  RecencyHeader *h = db->recency->header;
+  stats->max_bytes = __atomic_load_n(&h->max_bytes, __ATOMIC_RELAXED);
+  stats->max_keys = __atomic_load_n(&h->max_keys, __ATOMIC_RELAXED);
+  stats->evictions = __atomic_load_n(&h->evictions, __ATOMIC_RELAXED);
+  stats->evicted_bytes = __atomic_load_n(&h->evicted_bytes, __ATOMIC_RELAXED);
+  stats->skipped_locked = __atomic_load_n(&h->skipped_locked, __ATOMIC_RELAXED);
+}
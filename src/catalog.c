@@ -0,0 +1,513 @@
+#define _DEFAULT_SOURCE
+#include "imaged.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The catalog is an ImagedLog of set/remove records stored in IMAGED_CATALOG,
+// the values of a record are the file size and modification time of the key.
+// Appends are serialized using flock on the catalog file. When the catalog is
+// rewritten (by imagedCatalogRebuild or compaction) the new file is renamed
+// into place and the old one is marked as replaced, which causes other
+// processes to reopen it. A rebuild holds an flock on CATALOG_REBUILD for the
+// whole scan, so a catalog that is still incomplete while nobody holds that
+// lock was left behind by a process that died and is rebuilt. The lock is a
+// separate file so writers appending to the catalog do not wait for the scan
+
+#define CATALOG_VERSION 1
+#define CATALOG_MIN_COMPACT 4096
+#define CATALOG_REBUILD IMAGED_CATALOG ".rebuild"
+
+// Set once a rebuilt catalog contains every key
+#define CATALOG_COMPLETE 1
+
+// Fields of ImagedLogRecord.value
+enum {
+  CATALOG_FILESIZE,
+  CATALOG_MTIME,
+};
+
+struct ImagedCatalog {
+  pthread_mutex_t lock;
+  ImagedLog log;
+};
+
+static const char _catalog_magic[4] = "IMGC";
+
+static int64_t statMtime(const struct stat *st) {
+#ifdef __APPLE__
+  return (int64_t)st->st_mtimespec.tv_sec * 1000000000 +
+         st->st_mtimespec.tv_nsec;
+#else
+  return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+// Live keys count their file size
+static uint64_t recordSize(const ImagedLogRecord *rec) {
+  return rec->value[CATALOG_FILESIZE];
+}
+
+static char *catalogPath(const Imaged *db, const char *name) {
+  size_t n = strlen(db->root) + strlen(name) + 2;
+  char *path = malloc(n);
+  if (path != NULL) {
+    snprintf(path, n, "%s%c%s", db->root, IMAGED_PATH_SEP, name);
+  }
+  return path;
+}
+
+static bool catalogOpenFile(const Imaged *db, ImagedLog *log) {
+  char *path = catalogPath(db, IMAGED_CATALOG);
+  if (path == NULL) {
+    return false;
+  }
+
+  int fd = open(path, O_RDWR);
+  free(path);
+  if (fd < 0) {
+    return false;
+  }
+
+  if (!imagedLogMap(log, fd, _catalog_magic, CATALOG_VERSION)) {
+    close(fd);
+    return false;
+  }
+
+  return true;
+}
+
+// Create a new catalog file at `tmp` containing the live entries of `log`, on
+// success the file is left open and mapped in `out`
+static bool catalogWriteFile(const ImagedLog *log, const char *tmp,
+                             ImagedLog *out) {
+  int fd = open(tmp, O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  bool ok = imagedLogWriteHeader(fd, _catalog_magic, CATALOG_VERSION) &&
+            imagedLogMap(out, fd, _catalog_magic, CATALOG_VERSION);
+  if (!ok) {
+    close(fd);
+    unlink(tmp);
+    return false;
+  }
+
+  for (size_t i = 0; ok && i < log->count; i++) {
+    const ImagedLogEntry *entry = &log->entries[i];
+    if (!entry->live) {
+      continue;
+    }
+
+    ImagedLogRecord rec = imagedLogRecord(IMAGED_LOG_SET, entry->keylen);
+    rec.meta = entry->meta;
+    rec.value[CATALOG_FILESIZE] = entry->value[CATALOG_FILESIZE];
+    rec.value[CATALOG_MTIME] = entry->value[CATALOG_MTIME];
+    ok = imagedLogWrite(fd, out->header, &rec, entry->key);
+  }
+
+  if (!ok) {
+    imagedLogUnmap(out);
+    unlink(tmp);
+    return false;
+  }
+
+  out->header->flags = CATALOG_COMPLETE;
+  out->loaded = out->header->end;
+  return true;
+}
+
+// Replace the catalog file with the contents of `next`. `old` refers to the
+// current catalog file, which must be locked, records appended to it after
+// `start` are applied to `next` first. On success `next` refers to the new
+// catalog file
+static bool catalogReplace(const Imaged *db, ImagedLog *next,
+                           const ImagedLog *old, uint64_t start) {
+  // Another process already replaced the catalog
+  if (imagedLogReplaced(old)) {
+    return false;
+  }
+
+  int nextfd = next->fd;
+  ImagedLogHeader *nextheader = next->header;
+  next->fd = old->fd;
+  next->header = old->header;
+  next->loaded = start;
+  bool ok = imagedLogReplay(
+      next, __atomic_load_n(&old->header->end, __ATOMIC_ACQUIRE));
+  next->fd = nextfd;
+  next->header = nextheader;
+  if (!ok) {
+    return false;
+  }
+
+  char *path = catalogPath(db, IMAGED_CATALOG);
+  char *tmp = catalogPath(db, IMAGED_CATALOG ".tmp");
+  ImagedLog out;
+  imagedLogInit(&out, NULL, NULL);
+  ok = path != NULL && tmp != NULL && catalogWriteFile(next, tmp, &out);
+  if (ok && rename(tmp, path) != 0) {
+    unlink(tmp);
+    imagedLogUnmap(&out);
+    ok = false;
+  }
+
+  if (ok) {
+    __atomic_or_fetch(&old->header->flags, IMAGED_LOG_REPLACED,
+                      __ATOMIC_RELEASE);
+    next->fd = out.fd;
+    next->header = out.header;
+    next->loaded = out.loaded;
+    next->records = next->live;
+  }
+
+  free(path);
+  free(tmp);
+  return ok;
+}
+
+// Fill in a set record from an open key, the record is left unchanged when
+// the file is not a valid image
+static void catalogReadKey(int fd, ImagedLogRecord *rec) {
+  struct stat st;
+  ImagedHeader header;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      imagedReadHeader(fd, &header) == IMAGED_OK) {
+    rec->op = IMAGED_LOG_SET;
+    rec->meta = header.meta;
+    rec->value[CATALOG_FILESIZE] = st.st_size;
+    rec->value[CATALOG_MTIME] = (uint64_t)statMtime(&st);
+  }
+}
+
+// Read the header of a key and add it to `log`
+static void catalogScanKey(ImagedLog *log, int dirfd, const char *name) {
+  int fd = openat(dirfd, name, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+
+  ImagedLogRecord rec = imagedLogRecord(0, strlen(name));
+  catalogReadKey(fd, &rec);
+  if (rec.op == IMAGED_LOG_SET) {
+    imagedLogApply(log, &rec, name);
+  }
+
+  close(fd);
+}
+
+static void catalogRelease(ImagedLog *log) {
+  imagedLogClear(log);
+  imagedLogUnmap(log);
+}
+
+// Open the catalog file, creating an empty one when there is none. An
+// unreadable catalog is replaced
+static bool catalogCreate(const Imaged *db, ImagedLog *log) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s.%ld", IMAGED_CATALOG, (long)getpid());
+  char *path = catalogPath(db, IMAGED_CATALOG);
+  char *tmp = catalogPath(db, name);
+
+  for (int attempt = 0; path && tmp && attempt < 2 && log->header == NULL;
+       attempt++) {
+    int fd = imagedLogOpenFile(path, tmp, _catalog_magic, CATALOG_VERSION);
+    if (fd >= 0 && !imagedLogMap(log, fd, _catalog_magic, CATALOG_VERSION)) {
+      close(fd);
+      unlink(path);
+    }
+  }
+
+  free(path);
+  free(tmp);
+  return log->header != NULL;
+}
+
+// Take the rebuild lock, returns the locked file descriptor or -1
+static int catalogLockRebuild(const Imaged *db, bool wait) {
+  char *path = catalogPath(db, CATALOG_REBUILD);
+  int fd = path != NULL ? open(path, O_CREAT | O_RDWR, 0644) : -1;
+  free(path);
+  if (fd >= 0 && flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB)) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+// Rebuild the catalog from the directory, `cat` must be locked. Writers keep
+// appending to the current catalog while the directory is scanned, those
+// records are applied after the scan
+static bool catalogRebuild(const Imaged *db, struct ImagedCatalog *cat) {
+  ImagedLog next;
+  imagedLogInit(&next, recordSize, NULL);
+  bool ok = false;
+
+  // Without the lock file, for example in a read-only directory, the rebuild
+  // still goes ahead
+  int lock = catalogLockRebuild(db, true);
+  for (int attempt = 0; !ok && attempt < 4; attempt++) {
+    ImagedLog old;
+    imagedLogInit(&old, NULL, NULL);
+    if (!catalogCreate(db, &old)) {
+      break;
+    }
+
+    uint64_t start = __atomic_load_n(&old.header->end, __ATOMIC_ACQUIRE);
+    DIR *dir = opendir(db->root);
+    if (dir == NULL) {
+      imagedLogUnmap(&old);
+      break;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+      if (ent->d_type == DT_DIR || strncmp(ent->d_name, IMAGED_RESERVED,
+                                           strlen(IMAGED_RESERVED)) == 0) {
+        continue;
+      }
+      catalogScanKey(&next, dirfd(dir), ent->d_name);
+    }
+    closedir(dir);
+
+    // The scan is repeated if the catalog was replaced in the meantime
+    flock(old.fd, LOCK_EX);
+    ok = catalogReplace(db, &next, &old, start);
+    flock(old.fd, LOCK_UN);
+    imagedLogUnmap(&old);
+
+    if (!ok) {
+      imagedLogClear(&next);
+    }
+  }
+
+  if (lock >= 0) {
+    close(lock);
+  }
+
+  if (!ok) {
+    return false;
+  }
+
+  catalogRelease(&cat->log);
+  cat->log = next;
+  return true;
+}
+
+// Make sure the in-memory catalog is up to date, `cat` must be locked.
+// Returns false when the catalog cannot be used
+static bool catalogRefresh(const Imaged *db, struct ImagedCatalog *cat) {
+  ImagedLog *log = &cat->log;
+  if (log->header != NULL && imagedLogReplaced(log)) {
+    catalogRelease(log);
+  }
+
+  if (log->header == NULL) {
+    imagedLogClear(log);
+    if (!catalogOpenFile(db, log) && !catalogRebuild(db, cat)) {
+      return false;
+    }
+  }
+
+  // A catalog is incomplete while it is being rebuilt by another process, when
+  // nobody holds the rebuild lock that process is gone
+  uint64_t flags = __atomic_load_n(&log->header->flags, __ATOMIC_ACQUIRE);
+  if (!(flags & CATALOG_COMPLETE)) {
+    catalogRelease(log);
+    int lock = catalogLockRebuild(db, false);
+    if (lock < 0) {
+      return false;
+    }
+    close(lock);
+
+    if (!catalogRebuild(db, cat)) {
+      return false;
+    }
+  }
+
+  if (!imagedLogReplay(log,
+                       __atomic_load_n(&log->header->end, __ATOMIC_ACQUIRE))) {
+    catalogRelease(log);
+    return false;
+  }
+
+  // Compact the log once most of the records are overwritten
+  if (log->records > CATALOG_MIN_COMPACT && log->records > log->live * 4) {
+    ImagedLog old = {.fd = log->fd, .header = log->header};
+    flock(old.fd, LOCK_EX);
+    bool replaced = catalogReplace(db, log, &old, log->loaded);
+    flock(old.fd, LOCK_UN);
+    if (replaced) {
+      imagedLogUnmap(&old);
+    }
+  }
+
+  return true;
+}
+
+struct ImagedCatalog *imagedCatalogNew(void) {
+  struct ImagedCatalog *cat = calloc(1, sizeof(struct ImagedCatalog));
+  if (cat == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&cat->lock, NULL);
+  imagedLogInit(&cat->log, recordSize, NULL);
+  return cat;
+}
+
+void imagedCatalogFree(struct ImagedCatalog *cat) {
+  if (cat == NULL) {
+    return;
+  }
+
+  catalogRelease(&cat->log);
+  pthread_mutex_destroy(&cat->lock);
+  free(cat);
+}
+
+ImagedStatus imagedCatalogRebuild(Imaged *db) {
+  struct ImagedCatalog *cat = db->catalog;
+  pthread_mutex_lock(&cat->lock);
+  catalogRelease(&cat->log);
+  bool ok = catalogRebuild(db, cat);
+  pthread_mutex_unlock(&cat->lock);
+  return ok ? IMAGED_OK : IMAGED_ERR;
+}
+
+ImagedStatus imagedCatalogLoad(const Imaged *db) {
+  struct ImagedCatalog *cat = db->catalog;
+  pthread_mutex_lock(&cat->lock);
+  bool ok = catalogRefresh(db, cat);
+  pthread_mutex_unlock(&cat->lock);
+  return ok ? IMAGED_OK : IMAGED_ERR;
+}
+
+ImagedStatus imagedCatalogUpdate(Imaged *db, const char *key, ssize_t keylen) {
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  char *name = strndup(key, keylen);
+  char *path = name != NULL ? catalogPath(db, name) : NULL;
+  free(name);
+  if (path == NULL) {
+    return IMAGED_ERR;
+  }
+
+  struct ImagedCatalog *cat = db->catalog;
+  ImagedLog *log = &cat->log;
+  pthread_mutex_lock(&cat->lock);
+
+  // Records are only appended to an existing catalog, a missing catalog is
+  // built from the directory when it is first used. The key is read while the
+  // catalog is locked so records are written in the same order as the changes
+  // they describe
+  ImagedStatus status = IMAGED_OK;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (log->header == NULL && !catalogOpenFile(db, log)) {
+      break;
+    }
+
+    flock(log->fd, LOCK_EX);
+    if (imagedLogReplaced(log)) {
+      flock(log->fd, LOCK_UN);
+      catalogRelease(log);
+      continue;
+    }
+
+    ImagedLogRecord rec = imagedLogRecord(IMAGED_LOG_REMOVE, keylen);
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+      catalogReadKey(fd, &rec);
+      close(fd);
+    }
+
+    if (!imagedLogWrite(log->fd, log->header, &rec, key)) {
+      status = IMAGED_ERR;
+    }
+    flock(log->fd, LOCK_UN);
+    break;
+  }
+
+  pthread_mutex_unlock(&cat->lock);
+  free(path);
+  return status;
+}
+
+static void entryInit(ImagedCatalogEntry *entry, const ImagedLogEntry *e) {
+  entry->keylen =
+      e->keylen <= IMAGED_MAX_KEYLEN ? e->keylen : IMAGED_MAX_KEYLEN;
+  memcpy(entry->key, e->key, entry->keylen);
+  entry->key[entry->keylen] = '\0';
+  entry->meta = e->meta;
+  entry->size = e->value[CATALOG_FILESIZE];
+  entry->mtime = (int64_t)e->value[CATALOG_MTIME];
+}
+
+ImagedStatus imagedCatalogGet(const Imaged *db, const char *key,
+                              ssize_t keylen, ImagedCatalogEntry *entry) {
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  struct ImagedCatalog *cat = db->catalog;
+  pthread_mutex_lock(&cat->lock);
+  if (!catalogRefresh(db, cat)) {
+    pthread_mutex_unlock(&cat->lock);
+    return IMAGED_ERR;
+  }
+
+  ImagedStatus status = IMAGED_ERR_FILE_DOES_NOT_EXIST;
+  const ImagedLogEntry *e = imagedLogFind(&cat->log, key, keylen);
+  if (e != NULL && e->live) {
+    if (entry != NULL) {
+      entryInit(entry, e);
+    }
+    status = IMAGED_OK;
+  }
+
+  pthread_mutex_unlock(&cat->lock);
+  return status;
+}
+
+ImagedStatus imagedCatalogTotals(const Imaged *db, size_t *keys,
+                                 uint64_t *bytes) {
+  struct ImagedCatalog *cat = db->catalog;
+  pthread_mutex_lock(&cat->lock);
+  bool ok = catalogRefresh(db, cat);
+  if (ok) {
+    *keys = cat->log.live;
+    *bytes = cat->log.live_bytes;
+  }
+  pthread_mutex_unlock(&cat->lock);
+  return ok ? IMAGED_OK : IMAGED_ERR;
+}
+
+bool imagedCatalogNext(const Imaged *db, size_t *index,
+                       ImagedCatalogEntry *entry) {
+  struct ImagedCatalog *cat = db->catalog;
+  pthread_mutex_lock(&cat->lock);
+
+  bool found = false;
+  while (!found && *index < cat->log.count) {
+    // Longer keys cannot be stored as files
+    const ImagedLogEntry *e = &cat->log.entries[(*index)++];
+    if (e->live && e->keylen <= IMAGED_MAX_KEYLEN) {
+      entryInit(entry, e);
+      found = true;
+    }
+  }
+
+  pthread_mutex_unlock(&cat->lock);
+  return found;
+}
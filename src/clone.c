@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#include "imaged.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+// Keys are copied with a reflink when the filesystem supports it (btrfs, XFS,
+// bcachefs...), so the copy shares its data with the original until either one
+// is written. Otherwise copy_file_range lets the kernel copy the data without
+// passing it through userspace, and read/write is used when both fail
+
+static bool validKey(const char *key, size_t keylen) {
+  size_t n = strlen(IMAGED_RESERVED);
+  return keylen > 0 && memchr(key, IMAGED_PATH_SEP, keylen) == NULL &&
+         !(keylen >= n && memcmp(key, IMAGED_RESERVED, n) == 0);
+}
+
+ImagedStatus imagedCopyFile(int src, int dst, ImagedCopyMethod *method) {
+  struct stat st;
+  if (fstat(src, &st) != 0 || ftruncate(dst, 0) != 0) {
+    return IMAGED_ERR_SEEK;
+  }
+
+#ifdef FICLONE
+  if (ioctl(dst, FICLONE, src) == 0) {
+    if (method != NULL) {
+      *method = IMAGED_COPY_REFLINK;
+    }
+    return IMAGED_OK;
+  }
+#endif
+
+  off_t size = st.st_size, offset = 0;
+
+#ifdef __linux__
+  off_t in = 0, out = 0;
+  while (in < size) {
+    ssize_t n = copy_file_range(src, &in, dst, &out, size - in, 0);
+    if (n <= 0) {
+      break;
+    }
+  }
+
+  if (in == size) {
+    if (method != NULL) {
+      *method = IMAGED_COPY_RANGE;
+    }
+    return IMAGED_OK;
+  }
+
+  // Not supported between these files, anything copied so far is kept
+  offset = in == out ? in : 0;
+#endif
+
+  char buf[65536];
+  while (offset < size) {
+    ssize_t n = pread(src, buf, sizeof(buf), offset);
+    if (n <= 0 || pwrite(dst, buf, n, offset) != n) {
+      return IMAGED_ERR_SEEK;
+    }
+    offset += n;
+  }
+
+  if (method != NULL) {
+    *method = IMAGED_COPY_READ_WRITE;
+  }
+  return IMAGED_OK;
+}
+
+// Copy the file of `key` to a new file at `path`, holding a shared lock on the
+// key so it is not copied while it is being edited
+static ImagedStatus cloneFile(Imaged *db, const char *key, size_t keylen,
+                              int dst, ImagedCopyMethod *method) {
+  char *path = imagedStringPrintf("%s%c%.*s", db->root, IMAGED_PATH_SEP,
+                                  (int)keylen, key);
+  int src = path != NULL ? open(path, O_RDONLY) : -1;
+  free(path);
+  if (src < 0) {
+    return errno == ENOENT ? IMAGED_ERR_FILE_DOES_NOT_EXIST : IMAGED_ERR;
+  }
+
+  ImagedKeyLock lock;
+  ImagedStatus status = imagedLockKey(db, key, keylen, src, false, 0, &lock);
+  if (status == IMAGED_OK) {
+    struct stat st;
+    if (fstat(src, &st) == 0) {
+      fchmod(dst, st.st_mode & 0777);
+    }
+    status = imagedCopyFile(src, dst, method);
+    imagedUnlockKey(src, &lock, false);
+  }
+
+  close(src);
+  return status;
+}
+
+ImagedStatus imagedClone(Imaged *db, const char *src, ssize_t srclen,
+                         const char *dst, ssize_t dstlen) {
+  if (srclen <= 0) {
+    srclen = (ssize_t)strlen(src);
+  }
+
+  if (dstlen <= 0) {
+    dstlen = (ssize_t)strlen(dst);
+  }
+
+  if (!validKey(src, srclen) || !validKey(dst, dstlen)) {
+    return IMAGED_ERR_INVALID_KEY;
+  }
+
+  if (imagedEphemeralExists(db, dst, dstlen)) {
+    return IMAGED_ERR_FILE_ALREADY_EXISTS;
+  }
+
+  char *path = imagedStringPrintf("%s%c%.*s", db->root, IMAGED_PATH_SEP,
+                                  (int)dstlen, dst);
+  char *tmp = imagedStringPrintf("%s%c%s", db->root, IMAGED_PATH_SEP,
+                                 IMAGED_RESERVED "tmp.XXXXXX");
+  int fd = path != NULL && tmp != NULL ? mkstemp(tmp) : -1;
+  if (fd < 0) {
+    free(path);
+    free(tmp);
+    return IMAGED_ERR_CANNOT_CREATE_FILE;
+  }
+
+  ImagedStatus status = cloneFile(db, src, srclen, fd, NULL);
+
+  // The copy replaces the destination the same way as an atomic write,
+  // readers of the previous file keep their mapping
+  ImagedKeyLock lock = {0};
+  int old = -1;
+  struct stat st;
+  if (status == IMAGED_OK && fstat(fd, &st) == 0) {
+    imagedCapacityReserve(db, dst, dstlen, st.st_size);
+  }
+
+  if (status == IMAGED_OK) {
+    old = open(path, O_RDONLY);
+    if ((old >= 0 || db->lock_table != NULL) &&
+        imagedLockKey(db, dst, dstlen, old, false, 0, &lock) != IMAGED_OK) {
+      status = IMAGED_ERR_LOCKED;
+    } else {
+      imagedHandleCacheInvalidate(db->handles, dst, dstlen);
+      status = rename(tmp, path) == 0 ? IMAGED_OK : IMAGED_ERR;
+      imagedUnlockKey(old, &lock, false);
+    }
+  }
+
+  if (status == IMAGED_OK) {
+    imagedDedupRelease(db, old);
+    imagedCatalogUpdate(db, dst, dstlen);
+  } else {
+    unlink(tmp);
+  }
+
+  if (old >= 0) {
+    close(old);
+  }
+  close(fd);
+  free(path);
+  free(tmp);
+  return status;
+}
+
+// Remove a partial snapshot, it only contains files
+static void removeTree(const char *path) {
+  DIR *dir = opendir(path);
+  if (dir != NULL) {
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+      unlinkat(dirfd(dir), ent->d_name, 0);
+    }
+    closedir(dir);
+  }
+  rmdir(path);
+}
+
+ImagedStatus imagedSnapshot(Imaged *db, const char *path,
+                            ImagedSnapshotStats *stats) {
+  if (stats != NULL) {
+    bzero(stats, sizeof(ImagedSnapshotStats));
+  }
+
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    return IMAGED_ERR_FILE_ALREADY_EXISTS;
+  }
+
+  // Keys are copied into a temporary directory next to the snapshot, which is
+  // renamed into place once every key has been copied
+  char *tmp = imagedStringPrintf("%s%s", path, IMAGED_RESERVED "tmp.XXXXXX");
+  if (tmp == NULL || mkdtemp(tmp) == NULL) {
+    free(tmp);
+    return IMAGED_ERR_CANNOT_CREATE_FILE;
+  }
+  chmod(tmp, 0755);
+
+  ImagedIter *iter = imagedIterNew(db);
+  ImagedStatus status = iter != NULL ? IMAGED_OK : IMAGED_ERR;
+  const char *key;
+  while (status == IMAGED_OK && (key = imagedIterNextKey(iter)) != NULL) {
+    size_t keylen = strlen(key);
+    char *dst = imagedStringPrintf("%s%c%s", tmp, IMAGED_PATH_SEP, key);
+    int fd = dst != NULL ? open(dst, O_CREAT | O_EXCL | O_WRONLY, 0644) : -1;
+    free(dst);
+    if (fd < 0) {
+      status = IMAGED_ERR_CANNOT_CREATE_FILE;
+      break;
+    }
+
+    ImagedCopyMethod method;
+    status = cloneFile(db, key, keylen, fd, &method);
+    close(fd);
+
+    // Keys removed while the snapshot is taken are skipped, so are keys open
+    // for editing since their contents may be half written
+    if (status == IMAGED_ERR_FILE_DOES_NOT_EXIST ||
+        status == IMAGED_ERR_LOCKED) {
+      dst = imagedStringPrintf("%s%c%s", tmp, IMAGED_PATH_SEP, key);
+      if (dst != NULL) {
+        unlink(dst);
+      }
+      free(dst);
+      if (status == IMAGED_ERR_LOCKED && stats != NULL) {
+        stats->locked += 1;
+      }
+      status = IMAGED_OK;
+      continue;
+    }
+
+    if (status == IMAGED_OK && stats != NULL) {
+      stats->keys += 1;
+      if (method == IMAGED_COPY_REFLINK) {
+        stats->reflinked += 1;
+      }
+    }
+  }
+  imagedIterFree(iter);
+
+  if (status == IMAGED_OK && rename(tmp, path) != 0) {
+    status = errno == EEXIST || errno == ENOTEMPTY
+                 ? IMAGED_ERR_FILE_ALREADY_EXISTS
+                 : IMAGED_ERR;
+  }
+
+  if (status != IMAGED_OK) {
+    removeTree(tmp);
+  }
+  free(tmp);
+  return status;
+}
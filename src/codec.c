@@ -0,0 +1,283 @@
+#include "imaged.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Tile codec: every channel value is replaced by the difference from the same
+// channel of the previous pixel in the row, the bytes of the resulting values
+// are grouped into planes (all low bytes, then all high bytes, ...) and the
+// result is compressed using a small LZ77 coder with an LZ4-style sequence
+// format. Smooth images produce long runs of small deltas which compress well,
+// and decoding is a single pass over the data
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+static inline uint32_t read32(const uint8_t *p) {
+  uint32_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+static inline uint32_t lzHash(uint32_t x) {
+  return (x * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lzWriteLength(uint8_t *op, const uint8_t *oend, size_t len) {
+  while (len >= 255) {
+    if (op >= oend) {
+      return NULL;
+    }
+    *op++ = 255;
+    len -= 255;
+  }
+
+  if (op >= oend) {
+    return NULL;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+static uint8_t *lzWriteSequence(uint8_t *op, const uint8_t *oend,
+                                const uint8_t *literals, size_t nliterals,
+                                size_t offset, size_t matchlen) {
+  if (op >= oend) {
+    return NULL;
+  }
+
+  uint8_t *token = op++;
+  size_t m = matchlen ? matchlen - LZ_MIN_MATCH : 0;
+  *token = (uint8_t)(((nliterals < 15 ? nliterals : 15) << 4) |
+                     (m < 15 ? m : 15));
+
+  if (nliterals >= 15 && !(op = lzWriteLength(op, oend, nliterals - 15))) {
+    return NULL;
+  }
+
+  if ((size_t)(oend - op) < nliterals) {
+    return NULL;
+  }
+  memcpy(op, literals, nliterals);
+  op += nliterals;
+
+  if (matchlen == 0) {
+    return op;
+  }
+
+  if (oend - op < 2) {
+    return NULL;
+  }
+  *op++ = (uint8_t)(offset & 0xff);
+  *op++ = (uint8_t)(offset >> 8);
+
+  if (m >= 15 && !(op = lzWriteLength(op, oend, m - 15))) {
+    return NULL;
+  }
+
+  return op;
+}
+
+static size_t lzCompress(const uint8_t *src, size_t n, uint8_t *dst,
+                         size_t cap) {
+  uint32_t *table = calloc(1 << LZ_HASH_BITS, sizeof(uint32_t));
+  if (table == NULL) {
+    return 0;
+  }
+
+  const uint8_t *anchor = src, *ip = src, *iend = src + n;
+  uint8_t *op = dst, *oend = dst + cap;
+
+  while (op != NULL && ip + LZ_MIN_MATCH <= iend) {
+    uint32_t seq = read32(ip);
+    uint32_t h = lzHash(seq);
+    const uint8_t *ref = src + table[h];
+    table[h] = (uint32_t)(ip - src);
+
+    if (ref >= ip || (size_t)(ip - ref) > LZ_MAX_OFFSET || read32(ref) != seq) {
+      ip++;
+      continue;
+    }
+
+    size_t len = LZ_MIN_MATCH;
+    while (ip + len < iend && ref[len] == ip[len]) {
+      len++;
+    }
+
+    op = lzWriteSequence(op, oend, anchor, ip - anchor, ip - ref, len);
+    ip += len;
+    anchor = ip;
+  }
+
+  if (op != NULL) {
+    op = lzWriteSequence(op, oend, anchor, iend - anchor, 0, 0);
+  }
+
+  free(table);
+  return op == NULL ? 0 : (size_t)(op - dst);
+}
+
+static bool lzReadLength(const uint8_t **ip, const uint8_t *iend,
+                         size_t *len) {
+  uint8_t b;
+  do {
+    if (*ip >= iend) {
+      return false;
+    }
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+static bool lzDecompress(const uint8_t *src, size_t n, uint8_t *dst,
+                         size_t size) {
+  const uint8_t *ip = src, *iend = src + n;
+  uint8_t *op = dst, *oend = dst + size;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+    size_t nliterals = token >> 4;
+    if (nliterals == 15 && !lzReadLength(&ip, iend, &nliterals)) {
+      return false;
+    }
+
+    if ((size_t)(iend - ip) < nliterals || (size_t)(oend - op) < nliterals) {
+      return false;
+    }
+    memcpy(op, ip, nliterals);
+    ip += nliterals;
+    op += nliterals;
+
+    if (ip == iend) {
+      break;
+    }
+
+    if (iend - ip < 2) {
+      return false;
+    }
+    size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+
+    size_t len = token & 15;
+    if (len == 15 && !lzReadLength(&ip, iend, &len)) {
+      return false;
+    }
+    len += LZ_MIN_MATCH;
+
+    if (offset == 0 || offset > (size_t)(op - dst) ||
+        (size_t)(oend - op) < len) {
+      return false;
+    }
+
+    // Matches may overlap the output, so copy byte by byte
+    const uint8_t *ref = op - offset;
+    for (size_t i = 0; i < len; i++) {
+      op[i] = ref[i];
+    }
+    op += len;
+  }
+
+  return op == oend;
+}
+
+#define DELTA(t)                                                               \
+  static void delta_##t(void *_data, size_t width, size_t height,             \
+                        size_t channels, bool encode) {                        \
+    t *data = _data;                                                           \
+    size_t stride = width * channels;                                          \
+    for (size_t y = 0; y < height; y++) {                                      \
+      t *row = data + y * stride;                                              \
+      if (encode) {                                                            \
+        for (size_t i = stride - 1; i >= channels; i--) {                      \
+          row[i] -= row[i - channels];                                         \
+        }                                                                      \
+      } else {                                                                 \
+        for (size_t i = channels; i < stride; i++) {                           \
+          row[i] += row[i - channels];                                         \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+  }
+
+DELTA(uint8_t)
+DELTA(uint16_t)
+DELTA(uint32_t)
+DELTA(uint64_t)
+
+static void delta(const ImageMeta *meta, void *data, size_t width,
+                  size_t height, bool encode) {
+  size_t channels = imageColorNumChannels(meta->color);
+  if (width * channels <= channels) {
+    return;
+  }
+
+  switch (meta->bits) {
+  case 8:
+    delta_uint8_t(data, width, height, channels, encode);
+    break;
+  case 16:
+    delta_uint16_t(data, width, height, channels, encode);
+    break;
+  case 32:
+    delta_uint32_t(data, width, height, channels, encode);
+    break;
+  case 64:
+    delta_uint64_t(data, width, height, channels, encode);
+    break;
+  }
+}
+
+static void shuffle(const uint8_t *src, uint8_t *dst, size_t n,
+                    size_t elemsize, bool encode) {
+  size_t count = n / elemsize;
+  for (size_t e = 0; e < count; e++) {
+    for (size_t b = 0; b < elemsize; b++) {
+      if (encode) {
+        dst[b * count + e] = src[e * elemsize + b];
+      } else {
+        dst[e * elemsize + b] = src[b * count + e];
+      }
+    }
+  }
+}
+
+size_t imagedTileEncode(const ImageMeta *meta, const void *tile, size_t width,
+                        size_t height, void *dst, size_t cap) {
+  size_t elemsize = meta->bits / 8;
+  size_t n = width * height * imageColorNumChannels(meta->color) * elemsize;
+  uint8_t *a = malloc(n), *b = malloc(n);
+  size_t rc = 0;
+  if (a == NULL || b == NULL) {
+    goto done;
+  }
+
+  memcpy(a, tile, n);
+  delta(meta, a, width, height, true);
+  shuffle(a, b, n, elemsize, true);
+  rc = lzCompress(b, n, dst, cap);
+
+done:
+  free(a);
+  free(b);
+  return rc;
+}
+
+bool imagedTileDecode(const ImageMeta *meta, const void *src, size_t n,
+                      void *tile, size_t width, size_t height) {
+  size_t elemsize = meta->bits / 8;
+  size_t size = width * height * imageColorNumChannels(meta->color) * elemsize;
+  uint8_t *tmp = malloc(size);
+  if (tmp == NULL) {
+    return false;
+  }
+
+  bool ok = lzDecompress(src, n, tmp, size);
+  if (ok) {
+    shuffle(tmp, tile, size, elemsize, false);
+    delta(meta, tile, width, height, false);
+  }
+
+  free(tmp);
+  return ok;
+}
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,9 +14,14 @@
 
 #include <assert.h>
 
+// Magic string used by files written before the header was versioned
 static const char _header[4] = "imgd";
 static size_t _header_size = sizeof(_header);
 
+static const char _magic[4] = "IMGD";
+
+#define alignUp(n, a) (((n) + (a)-1) / (a) * (a))
+
 static void mkdirAll(const char *dir) {
   char tmp[PATH_MAX];
   char *p = NULL;
@@ -39,6 +45,29 @@ static void close_unlock(int fd) {
   close(fd);
 }
 
+static void close_unlock_key(int fd, const ImagedKeyLock *lock,
+                             bool exclusive) {
+  imagedUnlockKey(fd, lock, exclusive);
+  close(fd);
+}
+
+// Open the file backing a key, keys that have no file in the database
+// directory are looked up among the ephemeral keys
+static int openKey(const Imaged *db, const char *path, const char *key,
+                   ssize_t keylen, int flags, bool *ephemeral) {
+  int fd = open(path, flags);
+  bool shm = false;
+  if (fd < 0 && errno == ENOENT) {
+    fd = imagedEphemeralOpen(db, key, keylen, flags);
+    shm = fd >= 0;
+  }
+
+  if (ephemeral != NULL) {
+    *ephemeral = shm;
+  }
+  return fd;
+}
+
 static bool fileExists(const char *path, struct stat *st) {
   struct stat tmp;
   if (stat(path, &tmp) == -1) {
@@ -83,6 +112,11 @@ static bool isValidKey(const char *key, ssize_t len) {
     len = (ssize_t)strlen(key);
   }
 
+  size_t n = strlen(IMAGED_RESERVED);
+  if ((size_t)len >= n && memcmp(key, IMAGED_RESERVED, n) == 0) {
+    return false;
+  }
+
   for (ssize_t i = 0; i < len; i++) {
     if (key[i] == IMAGED_PATH_SEP) {
       return false;
@@ -136,49 +170,384 @@ size_t imageMetaTotalBytes(const ImageMeta *meta) {
          ((size_t)meta->bits / 8);
 }
 
-bool imagedIsValidFile(const Imaged *db, const char *key, ssize_t keylen) {
-  char *path = pathJoin(db->root, key, keylen);
-  int fd = open(path, O_RDONLY);
-  if (fd < 0) {
-    free(path);
+static uint64_t headerNumTiles(const ImagedHeader *header) {
+  uint64_t nx = (header->meta.width + header->tile_width - 1) /
+                header->tile_width;
+  uint64_t ny = (header->meta.height + header->tile_height - 1) /
+                header->tile_height;
+  return nx * ny;
+}
+
+static uint64_t headerTileBytes(const ImagedHeader *header) {
+  return (uint64_t)header->tile_width * header->tile_height *
+         imageColorNumChannels(header->meta.color) * (header->meta.bits / 8);
+}
+
+// Size of a mip level along one axis given the size of the previous level
+static uint64_t levelSize(uint64_t n) { return n > 1 ? n / 2 : 1; }
+
+static bool headerLevelsAreValid(const ImagedHeader *header) {
+  if (header->levels > IMAGED_MAX_LEVELS) {
     return false;
   }
 
-  struct stat st;
-  stat(path, &st);
+  size_t pixelBytes = imageColorNumChannels(header->meta.color) *
+                      ((size_t)header->meta.bits / 8);
+  uint64_t width = header->meta.width, height = header->meta.height;
+  uint64_t end = header->offset + header->size;
+  for (uint64_t i = 0; i < header->levels; i++) {
+    const ImagedLevel *level = &header->level[i];
+    width = levelSize(width);
+    height = levelSize(height);
+    if (level->width != width || level->height != height ||
+        level->size != width * height * pixelBytes ||
+        level->offset % IMAGED_DATA_ALIGN != 0 || level->offset < end) {
+      return false;
+    }
+    end = level->offset + level->size;
+  }
 
-  char header[4];
-  if (read(fd, header, 4) != 4 || strncmp(header, _header, _header_size) != 0) {
-    close(fd);
-    free(path);
-    return false;
+  return true;
+}
+
+// Size of the header for each format version, version 1 had no mip levels
+static size_t headerSize(uint32_t version) {
+  return version == 1 ? offsetof(ImagedHeader, levels) : sizeof(ImagedHeader);
+}
+
+// Parse the first `n` bytes of a file, at most sizeof(ImagedHeader) are used
+static ImagedStatus parseHeader(const uint8_t *buf, ssize_t n,
+                                ImagedHeader *header) {
+  if (n < (ssize_t)_header_size) {
+    return IMAGED_ERR_INVALID_FILE;
   }
 
-  ImageMeta meta;
+  if (memcmp(buf, _magic, sizeof(_magic)) == 0) {
+    uint32_t version;
+    if ((size_t)n < sizeof(_magic) + sizeof(version)) {
+      return IMAGED_ERR_INVALID_FILE;
+    }
 
-  if (read(fd, &meta, sizeof(ImageMeta)) != sizeof(ImageMeta)) {
-    close(fd);
-    free(path);
-    return false;
+    memcpy(&version, buf + sizeof(_magic), sizeof(version));
+    size_t size = headerSize(version);
+    if (version == 0 || version > IMAGED_FORMAT_VERSION || (size_t)n < size) {
+      return IMAGED_ERR_INVALID_FILE;
+    }
+
+    bzero(header, sizeof(ImagedHeader));
+    memcpy(header, buf, size);
+    uint64_t known = IMAGED_FLAG_TILED | IMAGED_FLAG_COMPRESSED;
+    if (header->offset < size || (header->flags & ~known) != 0 ||
+        (header->flags & known) == IMAGED_FLAG_COMPRESSED ||
+        !headerLevelsAreValid(header)) {
+      return IMAGED_ERR_INVALID_FILE;
+    }
+
+    if (!(header->flags & IMAGED_FLAG_TILED)) {
+      return header->size == imageMetaTotalBytes(&header->meta)
+                 ? IMAGED_OK
+                 : IMAGED_ERR_INVALID_FILE;
+    }
+
+    if (header->tile_width == 0 || header->tile_height == 0) {
+      return IMAGED_ERR_INVALID_FILE;
+    }
+
+    uint64_t ntiles = headerNumTiles(header);
+    if (header->tiles < size ||
+        header->tiles + ntiles * sizeof(ImagedTile) > header->offset) {
+      return IMAGED_ERR_INVALID_FILE;
+    }
+
+    // Compressed tiles are variable length, their bounds are checked when
+    // they are decoded
+    if (!(header->flags & IMAGED_FLAG_COMPRESSED) &&
+        header->size != ntiles * headerTileBytes(header)) {
+      return IMAGED_ERR_INVALID_FILE;
+    }
+
+    return IMAGED_OK;
   }
 
-  close(fd);
+  if (memcmp(buf, _header, _header_size) == 0) {
+    if ((size_t)n < _header_size + sizeof(ImageMeta)) {
+      return IMAGED_ERR_INVALID_FILE;
+    }
+
+    bzero(header, sizeof(ImagedHeader));
+    memcpy(header->magic, _header, _header_size);
+    header->version = 0;
+    header->offset = _header_size + sizeof(ImageMeta);
+    header->flags = 0;
+    memcpy(&header->meta, buf + _header_size, sizeof(ImageMeta));
+    header->size = imageMetaTotalBytes(&header->meta);
+    return IMAGED_OK;
+  }
+
+  return IMAGED_ERR_INVALID_FILE;
+}
+
+ImagedStatus imagedReadHeader(int fd, ImagedHeader *header) {
+  uint8_t buf[sizeof(ImagedHeader)];
+  return parseHeader(buf, pread(fd, buf, sizeof(buf), 0), header);
+}
+
+static void headerInit(ImagedHeader *header, const ImageMeta *meta,
+                       const ImagedSetOptions *options) {
+  bzero(header, sizeof(ImagedHeader));
+  memcpy(header->magic, _magic, sizeof(_magic));
+  header->version = IMAGED_FORMAT_VERSION;
+  header->offset = alignUp(sizeof(ImagedHeader), IMAGED_DATA_ALIGN);
+  header->size = imageMetaTotalBytes(meta);
+  header->meta = *meta;
+
+  if (options == NULL) {
+    return;
+  }
+
+  uint32_t tile_width = options->tile_width, tile_height = options->tile_height;
+  if (options->compress && (tile_width == 0 || tile_height == 0)) {
+    tile_width = meta->width > 0 ? meta->width : 1;
+    tile_height = IMAGED_COMPRESS_ROWS;
+  }
+
+  if (tile_width > 0 && tile_height > 0) {
+    header->flags |= IMAGED_FLAG_TILED;
+    header->tile_width = tile_width;
+    header->tile_height = tile_height;
+    header->tiles = alignUp(sizeof(ImagedHeader), 64);
+
+    uint64_t ntiles = headerNumTiles(header);
+    header->size = ntiles * headerTileBytes(header);
+    header->offset = alignUp(header->tiles + ntiles * sizeof(ImagedTile),
+                             IMAGED_DATA_ALIGN);
+
+    if (options->compress) {
+      header->flags |= IMAGED_FLAG_COMPRESSED;
+    }
+  }
+}
+
+// Compress each tile of `imagedata` and write the tiles after the tile index,
+// tiles that do not shrink are stored as-is. On success `header->size` is
+// updated to the number of bytes used by the tiles
+static ImagedStatus writeCompressed(int fd, ImagedHeader *header,
+                                    const void *imagedata) {
+  const ImageMeta *meta = &header->meta;
+  uint64_t nx = (meta->width + header->tile_width - 1) / header->tile_width;
+  uint64_t ntiles = headerNumTiles(header);
+  size_t tileBytes = headerTileBytes(header);
+  size_t pixelBytes =
+      imageColorNumChannels(meta->color) * ((size_t)meta->bits / 8);
+
+  ImagedTile *tiles = malloc(ntiles * sizeof(ImagedTile));
+  uint8_t *tile = calloc(1, tileBytes);
+  uint8_t *buf = malloc(tileBytes);
+  ImagedStatus status = IMAGED_OK;
+  if (tiles == NULL || tile == NULL || buf == NULL) {
+    status = IMAGED_ERR;
+    goto done;
+  }
+
+  uint64_t offset = header->offset;
+  for (uint64_t i = 0; i < ntiles; i++) {
+    // Empty images are all zero, every tile can share a single chunk
+    if (imagedata == NULL && i > 0) {
+      tiles[i] = tiles[0];
+      continue;
+    }
+
+    if (imagedata != NULL) {
+      uint64_t x = (i % nx) * header->tile_width;
+      uint64_t y = (i / nx) * header->tile_height;
+      size_t w = meta->width - x < header->tile_width ? meta->width - x
+                                                      : header->tile_width;
+      size_t h = meta->height - y < header->tile_height ? meta->height - y
+                                                        : header->tile_height;
+      bzero(tile, tileBytes);
+      for (size_t j = 0; j < h; j++) {
+        memcpy(tile + j * header->tile_width * pixelBytes,
+               (const uint8_t *)imagedata +
+                   ((y + j) * meta->width + x) * pixelBytes,
+               w * pixelBytes);
+      }
+    }
+
+    const uint8_t *chunk = buf;
+    size_t n = imagedTileEncode(meta, tile, header->tile_width,
+                                header->tile_height, buf, tileBytes - 1);
+    if (n == 0) {
+      chunk = tile;
+      n = tileBytes;
+    }
+
+    if (pwrite(fd, chunk, n, offset) != (ssize_t)n) {
+      status = IMAGED_ERR_SEEK;
+      goto done;
+    }
+
+    tiles[i].offset = offset;
+    tiles[i].size = n;
+    offset += n;
+  }
+
+  header->size = offset - header->offset;
+  size_t indexBytes = ntiles * sizeof(ImagedTile);
+  if (pwrite(fd, tiles, indexBytes, header->tiles) != (ssize_t)indexBytes) {
+    status = IMAGED_ERR_SEEK;
+  }
+
+done:
+  free(tiles);
+  free(tile);
+  free(buf);
+  return status;
+}
+
+// Expected size of an imgd file, the unversioned format was written with an
+// extra trailing byte
+static size_t headerFileSize(const ImagedHeader *header) {
+  if (header->levels > 0) {
+    const ImagedLevel *last = &header->level[header->levels - 1];
+    return last->offset + last->size;
+  }
+  return header->offset + header->size + (header->version == 0 ? 1 : 0);
+}
+
+// Generate mip levels from `base`, each level is resized from the previous one
+// and written at the next aligned offset after the pixel data. When `base` is
+// NULL the levels are left zeroed. The header is updated but not written
+static ImagedStatus writeLevels(int fd, ImagedHeader *header, Image *base,
+                                uint32_t levels) {
+  size_t pixelBytes = imageColorNumChannels(header->meta.color) *
+                      ((size_t)header->meta.bits / 8);
+  uint64_t width = header->meta.width, height = header->meta.height;
+  uint64_t offset = header->offset + header->size;
+  ImagedStatus status = IMAGED_OK;
+  Image *prev = base;
+
+  header->levels = 0;
+  bzero(header->level, sizeof(header->level));
+  for (uint32_t i = 0; i < levels && i < IMAGED_MAX_LEVELS; i++) {
+    if (width == 1 && height == 1) {
+      break;
+    }
+
+    ImagedLevel *level = &header->level[i];
+    width = levelSize(width);
+    height = levelSize(height);
+    offset = alignUp(offset, IMAGED_DATA_ALIGN);
+    level->width = width;
+    level->height = height;
+    level->offset = offset;
+    level->size = width * height * pixelBytes;
+
+    if (base != NULL) {
+      Image *next = imageResize(prev, width, height);
+      if (prev != base) {
+        imageFree(prev);
+      }
+      prev = next;
+
+      if (next == NULL) {
+        status = IMAGED_ERR;
+        break;
+      }
+
+      if (pwrite(fd, next->data, level->size, offset) !=
+          (ssize_t)level->size) {
+        status = IMAGED_ERR_SEEK;
+        break;
+      }
+    }
+
+    offset += level->size;
+    header->levels = i + 1;
+  }
+
+  if (prev != base) {
+    imageFree(prev);
+  }
+
+  if (status == IMAGED_OK && ftruncate(fd, headerFileSize(header)) != 0) {
+    status = IMAGED_ERR_SEEK;
+  }
+
+  return status;
+}
+
+// Check that every tile of a tiled image lies within the file, so tiles can be
+// read without any further bounds checks. Uncompressed tiles all have the same
+// size
+static bool tilesAreValid(const ImagedHeader *header, const ImagedTile *tiles,
+                          uint64_t filesize) {
+  uint64_t ntiles = headerNumTiles(header);
+  uint64_t size = headerTileBytes(header);
+  bool compressed = header->flags & IMAGED_FLAG_COMPRESSED;
+  for (uint64_t i = 0; i < ntiles; i++) {
+    if (tiles[i].offset < header->offset || tiles[i].offset > filesize ||
+        tiles[i].size > filesize - tiles[i].offset ||
+        (!compressed && tiles[i].size != size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void handleInitFromMap(ImagedHandle *handle, int fd, void *data,
+                              size_t map_size, const ImagedHeader *header) {
+  handle->fd = fd;
+  handle->map = data;
+  handle->mapsize = map_size;
+  handle->flags = header->flags;
+  handle->image.meta = header->meta;
+  handle->image.owner = false;
+
+  if (header->flags & IMAGED_FLAG_TILED) {
+    handle->image.data = NULL;
+    handle->tile_width = header->tile_width;
+    handle->tile_height = header->tile_height;
+    handle->tiles = (const ImagedTile *)((uint8_t *)data + header->tiles);
+  } else {
+    handle->image.data = (uint8_t *)data + header->offset;
+  }
+}
+
+bool imagedIsValidFile(const Imaged *db, const char *key, ssize_t keylen) {
+  char *path = pathJoin(db->root, key, keylen);
+  int fd = openKey(db, path, key, keylen, O_RDONLY, NULL);
   free(path);
+  if (fd < 0) {
+    return false;
+  }
 
-  return imageMetaTotalBytes(&meta) + _header_size + sizeof(ImageMeta) + 1 ==
-         (size_t)st.st_size;
+  struct stat st;
+  ImagedHeader header;
+  bool ok = fstat(fd, &st) == 0 && imagedReadHeader(fd, &header) == IMAGED_OK &&
+            headerFileSize(&header) == (size_t)st.st_size;
+  if (ok && (header.flags & IMAGED_FLAG_TILED)) {
+    size_t n = headerNumTiles(&header) * sizeof(ImagedTile);
+    ImagedTile *tiles = malloc(n);
+    ok = tiles != NULL && pread(fd, tiles, n, header.tiles) == (ssize_t)n &&
+         tilesAreValid(&header, tiles, st.st_size);
+    free(tiles);
+  }
+  close(fd);
+  return ok;
 }
 
 bool imagedKeyIsLocked(const Imaged *db, const char *key, ssize_t keylen) {
   char *path = pathJoin(db->root, key, keylen);
-  int fd = open(path, O_RDONLY);
+  int fd = openKey(db, path, key, keylen, O_RDONLY, NULL);
   if (fd < 0) {
     free(path);
     return false;
   }
 
-  bool r = flock(fd, LOCK_EX | LOCK_NB) != 0;
-  if (!r) {
+  bool r;
+  if (db->lock_table != NULL) {
+    r = imagedLockTableIsLocked(db->lock_table, key, keylen);
+  } else if (!(r = flock(fd, LOCK_EX | LOCK_NB) != 0)) {
     flock(fd, LOCK_UN);
   }
 
@@ -188,6 +557,8 @@ bool imagedKeyIsLocked(const Imaged *db, const char *key, ssize_t keylen) {
 }
 
 void imagedResetLocks(Imaged *db) {
+  imagedLockTableReset(db->lock_table);
+
   DIR *dir = opendir(db->root);
   if (!dir) {
     return;
@@ -231,11 +602,48 @@ Imaged *imagedOpen(const char *path) {
   }
 
   db->root = root;
+  bzero(&db->locks, sizeof(ImagedLockStats));
+  db->catalog = imagedCatalogNew();
+  db->handles = imagedHandleCacheNew(IMAGED_HANDLE_CACHE_SIZE);
+
+  // Once a lock table exists every process has to use it, so failing to map
+  // it is an error rather than a fallback to flock
+  db->lock_table = NULL;
+  db->lock_table_mtime = imagedLockTableStamp(db);
+  char *locks = pathJoin(root, IMAGED_LOCK_TABLE, -1);
+  bool lockTableFailed =
+      locks == NULL ||
+      (fileExists(locks, NULL) &&
+       (db->lock_table = imagedLockTableOpen(locks, false)) == NULL);
+  free(locks);
+
+  db->recency = NULL;
+  char *recency = pathJoin(root, IMAGED_RECENCY, -1);
+  bool recencyFailed =
+      recency == NULL ||
+      (fileExists(recency, NULL) &&
+       (db->recency = imagedRecencyOpen(recency, false)) == NULL);
+  free(recency);
+
+  if (db->catalog == NULL || db->handles == NULL || lockTableFailed ||
+      recencyFailed) {
+    imagedCatalogFree(db->catalog);
+    imagedHandleCacheFree(db->handles);
+    imagedLockTableClose(db->lock_table);
+    free(root);
+    free(db);
+    return NULL;
+  }
+
   return db;
 }
 
 void imagedClose(Imaged *db) {
   if (db != NULL) {
+    imagedCatalogFree(db->catalog);
+    imagedHandleCacheFree(db->handles);
+    imagedLockTableClose(db->lock_table);
+    imagedRecencyClose(db->recency);
     free(db->root);
     free(db);
   }
@@ -248,6 +656,20 @@ ImagedStatus imagedDestroy(Imaged *db) {
     imagedRemove(db, iter->key, -1);
   }
 
+  // Remove the catalog and any temporary files left behind by writers
+  DIR *dir = opendir(db->root);
+  if (dir != NULL) {
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+      if (strncmp(ent->d_name, IMAGED_RESERVED, strlen(IMAGED_RESERVED)) ==
+          0) {
+        unlinkat(dirfd(dir), ent->d_name, 0);
+      }
+    }
+    closedir(dir);
+  }
+
+  imagedEphemeralRemoveAll(db);
   rmdir(db->root);
   return IMAGED_OK;
 }
@@ -257,201 +679,1571 @@ bool imagedHasKey(const Imaged *db, const char *key, ssize_t keylen) {
     return IMAGED_ERR_INVALID_KEY;
   }
 
-  char *path = pathJoin(db->root, key, keylen);
-  bool res = fileExists(path, NULL);
-  free(path);
-  return res;
+  ImagedStatus status = imagedCatalogGet(db, key, keylen, NULL);
+  bool res = status == IMAGED_OK;
+  if (status == IMAGED_ERR) {
+    char *path = pathJoin(db->root, key, keylen);
+    res = fileExists(path, NULL);
+    free(path);
+  }
+
+  return res || imagedEphemeralExists(db, key, keylen);
 }
 
 ImagedStatus imagedSet(Imaged *db, const char *key, ssize_t keylen,
                        const ImageMeta *meta, const void *imagedata,
                        ImagedHandle *handle) {
-  imagedHandleInit(handle);
-  if (!isValidKey(key, keylen)) {
-    return IMAGED_ERR_INVALID_KEY;
+  return imagedSetWithOptions(db, key, keylen, meta, imagedata, NULL, handle);
+}
+
+static ImagedStatus writerSetObject(ImagedWriter *w, const char *object);
+
+// Write the image to a temporary file and rename it over the key. When
+// `object` is not NULL the new file is also linked to it
+static ImagedStatus setAtomic(Imaged *db, const char *key, ssize_t keylen,
+                              const ImageMeta *meta, const void *imagedata,
+                              const ImagedSetOptions *options,
+                              const char *object, ImagedHandle *handle) {
+  ImagedWriter *writer;
+  ImagedStatus status =
+      imagedWriterBegin(db, key, keylen, meta, options, &writer);
+  if (status != IMAGED_OK) {
+    return status;
   }
 
-  char *path = pathJoin(db->root, key, keylen);
+  if (object != NULL) {
+    status = writerSetObject(writer, object);
+  }
 
-  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0655);
-  if (fd < 0) {
-    free(path);
-    return IMAGED_ERR;
+  if (status == IMAGED_OK && imagedata != NULL && meta->height > 0) {
+    status = imagedWriterWriteRows(writer, 0, meta->height, imagedata);
   }
 
-  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
-    close(fd);
-    free(path);
-    return IMAGED_ERR_LOCKED;
+  if (status == IMAGED_OK) {
+    status = imagedWriterCommit(writer, handle);
   }
 
-  size_t map_size =
-      _header_size + sizeof(ImageMeta) + imageMetaTotalBytes(meta);
-  if (lseek(fd, map_size, SEEK_SET) == -1) {
-    close_unlock(fd);
-    free(path);
-    return IMAGED_ERR_SEEK;
+  if (status != IMAGED_OK) {
+    imagedWriterAbort(writer);
   }
+  return status;
+}
 
-  if (write(fd, "", 1) != 1) {
-    close_unlock(fd);
+// Link the key to an existing file with the same contents, the key is
+// replaced the same way as an atomic write
+static ImagedStatus linkKey(Imaged *db, const char *key, ssize_t keylen,
+                            const char *object, int objectfd) {
+  char *path = pathJoin(db->root, key, keylen);
+  char *tmp = pathJoin(db->root, IMAGED_RESERVED "tmp.XXXXXX", -1);
+  int fd = path != NULL && tmp != NULL ? mkstemp(tmp) : -1;
+  if (fd < 0) {
     free(path);
-    return IMAGED_ERR;
+    free(tmp);
+    return IMAGED_ERR_CANNOT_CREATE_FILE;
   }
 
-  void *data = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (data == MAP_FAILED) {
-    close_unlock(fd);
+  // The temporary name is reused for the link, once it exists the object is
+  // referenced and can no longer be collected
+  close(fd);
+  unlink(tmp);
+  int lock = imagedDedupLock(db);
+  struct stat st, obj;
+  bool linked = fstat(objectfd, &obj) == 0 && stat(object, &st) == 0 &&
+                st.st_ino == obj.st_ino && link(object, tmp) == 0;
+  imagedDedupUnlock(lock);
+  if (!linked) {
     free(path);
-    return IMAGED_ERR_MAP_FAILED;
+    free(tmp);
+    return IMAGED_ERR;
   }
 
-  bzero(data, map_size);
-  memcpy(data, _header, _header_size);
-  memcpy((uint8_t *)data + _header_size, meta, sizeof(ImageMeta));
-
-  if (imagedata != NULL) {
-    memcpy((uint8_t *)data + _header_size + sizeof(ImageMeta), imagedata,
-           imageMetaTotalBytes(meta));
+  ImagedKeyLock keylock = {0};
+  int old = open(path, O_RDONLY);
+  ImagedStatus status = IMAGED_OK;
+  if ((old >= 0 || db->lock_table != NULL) &&
+      imagedLockKey(db, key, keylen, old, false, 0, &keylock) != IMAGED_OK) {
+    status = IMAGED_ERR_LOCKED;
+  } else {
+    imagedHandleCacheInvalidate(db->handles, key, keylen);
+    status = rename(tmp, path) == 0 ? IMAGED_OK : IMAGED_ERR;
+    imagedUnlockKey(old, &keylock, false);
   }
 
-  if (handle == NULL) {
-    close_unlock(fd);
-    free(path);
-    return IMAGED_OK;
+  // rename does nothing when the key is already linked to the object
+  unlink(tmp);
+  if (status == IMAGED_OK) {
+    imagedDedupRelease(db, old);
+    imagedCatalogUpdate(db, key, keylen);
   }
 
-  handle->fd = fd;
-  handle->image.meta = *(ImageMeta *)((uint8_t *)data + _header_size);
-  handle->image.data = (uint8_t *)data + _header_size + sizeof(ImageMeta);
-  handle->image.owner = false;
-
+  if (old >= 0) {
+    close(old);
+  }
   free(path);
-
-  return IMAGED_OK;
+  free(tmp);
+  return status;
 }
 
-ImagedStatus imagedStat(Imaged *db, const char *key, ssize_t keylen,
-                        struct stat *st) {
+// Store the image as a link to the object with the same contents, creating the
+// object when there is none. Images that only share the hash of another
+// object are stored normally
+static ImagedStatus setDedup(Imaged *db, const char *key, ssize_t keylen,
+                             const ImageMeta *meta, const void *imagedata,
+                             const ImagedSetOptions *options) {
+  char *object = imagedDedupObjectPath(db, meta, imagedata);
+  if (object == NULL) {
+    return IMAGED_ERR;
+  }
+
+  ImagedStatus status;
   char *path = pathJoin(db->root, key, keylen);
-  ImagedStatus status = stat(path, st) == -1 ? IMAGED_ERR : IMAGED_OK;
+  struct stat st, obj;
+  int fd = open(object, O_RDONLY);
+  if (fd >= 0 && path != NULL && fstat(fd, &obj) == 0 &&
+      stat(path, &st) == 0 && st.st_dev == obj.st_dev &&
+      st.st_ino == obj.st_ino) {
+    // The key is already linked to the object
+    status = IMAGED_OK;
+  } else if (fd >= 0 && imagedDedupMatch(fd, meta, imagedata)) {
+    imagedCapacityReserve(db, key, keylen, obj.st_size);
+    status = linkKey(db, key, keylen, object, fd);
+  } else {
+    status = setAtomic(db, key, keylen, meta, imagedata, options,
+                       fd < 0 ? object : NULL, NULL);
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
   free(path);
+  free(object);
   return status;
 }
 
-ImagedStatus imagedGet(Imaged *db, const char *key, ssize_t keylen,
-                       bool editable, ImagedHandle *handle) {
+ImagedStatus imagedSetWithOptions(Imaged *db, const char *key, ssize_t keylen,
+                                  const ImageMeta *meta, const void *imagedata,
+                                  const ImagedSetOptions *options,
+                                  ImagedHandle *handle) {
+  return imagedSetWithTimeout(db, key, keylen, meta, imagedata, options, 0,
+                              handle);
+}
+
+ImagedStatus imagedSetWithTimeout(Imaged *db, const char *key, ssize_t keylen,
+                                  const ImageMeta *meta, const void *imagedata,
+                                  const ImagedSetOptions *options,
+                                  int64_t timeout_ms, ImagedHandle *handle) {
   imagedHandleInit(handle);
   if (!isValidKey(key, keylen)) {
     return IMAGED_ERR_INVALID_KEY;
   }
 
-  char *path = pathJoin(db->root, key, keylen);
+  // A file would shadow the ephemeral key, which comes back once the file is
+  // removed
+  bool ephemeral = options != NULL && options->ephemeral;
+  if (!ephemeral && imagedEphemeralExists(db, key, keylen)) {
+    return IMAGED_ERR_FILE_ALREADY_EXISTS;
+  }
 
-  struct stat st;
-  if (!fileExists(path, &st)) {
-    free(path);
-    return IMAGED_ERR_FILE_DOES_NOT_EXIST;
+  if (options != NULL && options->dedup && !options->ephemeral &&
+      imagedata != NULL && handle == NULL && options->tile_width == 0 &&
+      !options->compress && options->levels == 0) {
+    return setDedup(db, key, keylen, meta, imagedata, options);
   }
 
-  size_t map_size = st.st_size;
-  if (map_size <= _header_size + sizeof(ImageMeta)) {
-    free(path);
-    return IMAGED_ERR_INVALID_FILE;
+  if (options != NULL && options->atomic && !options->ephemeral) {
+    return setAtomic(db, key, keylen, meta, imagedata, options, NULL, handle);
   }
 
-  if (handle == NULL) {
+  char *path = pathJoin(db->root, key, keylen);
+  if (ephemeral && fileExists(path, NULL)) {
     free(path);
-    return IMAGED_OK;
+    return IMAGED_ERR_FILE_ALREADY_EXISTS;
   }
 
-  int fd = open(path, (editable ? O_RDWR : O_RDONLY), 0655);
-  if (fd < 0) {
-    free(path);
-    return IMAGED_ERR;
+  ImagedHeader header;
+  headerInit(&header, meta, options);
+  if (!ephemeral) {
+    imagedCapacityReserve(db, key, keylen, headerFileSize(&header));
   }
 
-  if (flock(fd, (editable ? LOCK_EX : LOCK_SH) | LOCK_NB) < 0) {
+  // The file is truncated after it has been locked, truncating it while
+  // another process has it mapped would cause that process to crash
+  int fd = ephemeral ? imagedEphemeralOpen(db, key, keylen, O_CREAT | O_RDWR)
+                     : open(path, O_CREAT | O_RDWR, 0655);
+  if (fd < 0) {
     free(path);
-    close(fd);
-    return IMAGED_ERR_LOCKED;
+    return ephemeral && errno == ENAMETOOLONG ? IMAGED_ERR_INVALID_KEY
+                                              : IMAGED_ERR;
   }
 
-  int flags = PROT_READ;
-  if (editable) {
-    flags |= PROT_WRITE;
-  }
-  void *data = mmap(0, map_size, flags, MAP_SHARED, fd, 0);
-  if (data == MAP_FAILED) {
-    close_unlock(fd);
+  // Deduplicated files are shared with other keys, so they are replaced by an
+  // atomic write rather than overwritten. This is checked before locking, an
+  // exclusive lock on the file would also block the other keys sharing it
+  struct stat st;
+  if (!ephemeral && fstat(fd, &st) == 0 && st.st_nlink > 1) {
+    close(fd);
     free(path);
-    return IMAGED_ERR_MAP_FAILED;
+    ImagedSetOptions atomic = {0};
+    if (options != NULL) {
+      atomic = *options;
+    }
+    atomic.atomic = true;
+    return setAtomic(db, key, keylen, meta, imagedata, &atomic, NULL, handle);
   }
 
-  if (strncmp(data, _header, _header_size) != 0) {
-    munmap(data, map_size);
-    close_unlock(fd);
+  ImagedKeyLock lock;
+  ImagedStatus status =
+      imagedLockKey(db, key, keylen, fd, true, timeout_ms, &lock);
+  if (status != IMAGED_OK) {
+    close(fd);
     free(path);
-    return IMAGED_ERR_INVALID_FILE;
+    return status;
   }
 
-  handle->fd = fd;
-
-  memcpy(&handle->image.meta, (uint8_t *)data + _header_size,
-         sizeof(ImageMeta));
-  handle->image.data = (uint8_t *)data + _header_size + sizeof(ImageMeta);
-  handle->image.owner = false;
-
-  if (imageMetaTotalBytes(&handle->image.meta) + _header_size +
-          sizeof(ImageMeta) + 1 !=
-      (size_t)st.st_size) {
+  imagedHandleCacheInvalidate(db->handles, key, keylen);
 
-    imagedHandleClose(handle);
+  if (ftruncate(fd, 0) != 0) {
+    close_unlock_key(fd, &lock, true);
     free(path);
-    return IMAGED_ERR_INVALID_FILE;
+    return IMAGED_ERR_SEEK;
   }
 
-  free(path);
-  return IMAGED_OK;
-}
+  if (header.flags & IMAGED_FLAG_COMPRESSED) {
+    status = writeCompressed(fd, &header, imagedata);
+    if (status == IMAGED_OK &&
+        pwrite(fd, &header, sizeof(ImagedHeader), 0) != sizeof(ImagedHeader)) {
+      status = IMAGED_ERR_SEEK;
+    }
 
-ImagedStatus imagedRemove(Imaged *db, const char *key, ssize_t keylen) {
-  if (!isValidKey(key, keylen)) {
-    return IMAGED_ERR_INVALID_KEY;
+    if (status != IMAGED_OK) {
+      close_unlock_key(fd, &lock, true);
+      free(path);
+      return status;
+    }
   }
 
-  char *path = pathJoin(db->root, key, keylen);
-
-  int fd = open(path, O_RDONLY);
-  if (fd < 0) {
+  size_t map_size = header.offset + header.size;
+  if (ftruncate(fd, map_size) != 0) {
+    close_unlock_key(fd, &lock, true);
     free(path);
-    return IMAGED_ERR_FILE_DOES_NOT_EXIST;
+    return IMAGED_ERR_SEEK;
   }
 
-  char header[4];
-  if ((read(fd, &header, _header_size)) != 4 ||
-      strncmp(header, _header, _header_size) != 0) {
+  void *data = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    close_unlock_key(fd, &lock, true);
     free(path);
-    close(fd);
-    return IMAGED_ERR_INVALID_FILE;
+    return IMAGED_ERR_MAP_FAILED;
   }
 
-  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
-    free(path);
-    close(fd);
-    return IMAGED_ERR_LOCKED;
+  // Compressed tiles have already been written. The file was truncated, so
+  // the rest of the mapping is already zero
+  bool compressed = header.flags & IMAGED_FLAG_COMPRESSED;
+  if (!compressed) {
+    memcpy(data, &header, sizeof(ImagedHeader));
+  }
+
+  if ((header.flags & IMAGED_FLAG_TILED) && !compressed) {
+    ImagedTile *tiles = (ImagedTile *)((uint8_t *)data + header.tiles);
+    uint64_t ntiles = headerNumTiles(&header);
+    uint64_t tileBytes = headerTileBytes(&header);
+    for (uint64_t i = 0; i < ntiles; i++) {
+      tiles[i].offset = header.offset + i * tileBytes;
+      tiles[i].size = tileBytes;
+    }
+  }
+
+  ImagedHandle tmp;
+  imagedHandleInit(&tmp);
+  handleInitFromMap(&tmp, fd, data, map_size, &header);
+  tmp.lock = lock;
+  tmp.exclusive = true;
+
+  if (imagedata != NULL && !compressed) {
+    Image src = {
+        .owner = false,
+        .meta = *meta,
+        .data = (void *)imagedata,
+    };
+    imagedHandleWriteRegion(&tmp, 0, 0, &src);
   }
 
-  remove(path);
   free(path);
-  close_unlock(fd);
+
+  if (options != NULL && options->levels > 0) {
+    Image base = {
+        .owner = false,
+        .meta = *meta,
+        .data = (void *)imagedata,
+    };
+    status = writeLevels(fd, &header, imagedata != NULL ? &base : NULL,
+                         options->levels);
+    if (status == IMAGED_OK &&
+        pwrite(fd, &header, sizeof(ImagedHeader), 0) != sizeof(ImagedHeader)) {
+      status = IMAGED_ERR_SEEK;
+    }
+
+    if (status != IMAGED_OK) {
+      imagedHandleClose(&tmp);
+      return status;
+    }
+  }
+
+  if (!ephemeral) {
+    imagedCatalogUpdate(db, key, keylen);
+  }
+
+  if (handle == NULL) {
+    imagedHandleClose(&tmp);
+    return IMAGED_OK;
+  }
+
+  *handle = tmp;
+  return IMAGED_OK;
+}
+
+struct ImagedWriter {
+  Imaged *db;
+  char *key;
+  size_t keylen;
+  char *path, *tmp;
+  int fd;
+  ImagedHeader header;
+  uint32_t levels;
+  bool atomic; // readers of the current file do not block the commit
+  size_t pixelBytes, tileBytes;
+  ImagedTile *tiles;
+  uint64_t ntiles, nx;
+  uint64_t end;  // end of the compressed tile data
+  uint8_t *band; // one row of tiles, for row writes to tiled images
+  uint64_t row;  // next row expected by imagedWriterWriteRows
+  uint8_t *tile, *buf;
+  bool finished; // the header has been written
+  char *object;  // dedup object the new file is linked to, may be NULL
+};
+
+static void writerFree(ImagedWriter *w) {
+  if (w->fd >= 0) {
+    close_unlock(w->fd);
+  }
+  free(w->key);
+  free(w->path);
+  free(w->tmp);
+  free(w->tiles);
+  free(w->band);
+  free(w->tile);
+  free(w->buf);
+  free(w->object);
+  free(w);
+}
+
+static ImagedStatus writerSetObject(ImagedWriter *w, const char *object) {
+  w->object = strdup(object);
+  return w->object != NULL ? IMAGED_OK : IMAGED_ERR;
+}
+
+ImagedStatus imagedWriterBegin(Imaged *db, const char *key, ssize_t keylen,
+                               const ImageMeta *meta,
+                               const ImagedSetOptions *options,
+                               ImagedWriter **writer) {
+  *writer = NULL;
+  if (!isValidKey(key, keylen)) {
+    return IMAGED_ERR_INVALID_KEY;
+  }
+
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  ImagedWriter *w = calloc(1, sizeof(ImagedWriter));
+  if (w == NULL) {
+    return IMAGED_ERR;
+  }
+
+  w->db = db;
+  w->fd = -1;
+  w->keylen = keylen;
+  w->key = strndup(key, keylen);
+  w->path = pathJoin(db->root, key, keylen);
+  w->tmp = pathJoin(db->root, IMAGED_RESERVED "tmp.XXXXXX", -1);
+  if (w->key == NULL || w->path == NULL || w->tmp == NULL) {
+    writerFree(w);
+    return IMAGED_ERR;
+  }
+
+  headerInit(&w->header, meta, options);
+  imagedCapacityReserve(db, key, keylen, headerFileSize(&w->header));
+  w->levels = options != NULL ? options->levels : 0;
+  w->atomic = options != NULL && options->atomic;
+  w->pixelBytes =
+      imageColorNumChannels(meta->color) * ((size_t)meta->bits / 8);
+
+  // The file is extended without writing anything, so rows that are never
+  // written read back as zero without the pages being touched
+  w->fd = mkstemp(w->tmp);
+  if (w->fd < 0) {
+    writerFree(w);
+    return IMAGED_ERR_CANNOT_CREATE_FILE;
+  }
+
+  fchmod(w->fd, 0644);
+  flock(w->fd, LOCK_EX);
+
+  ImagedHeader *header = &w->header;
+  if (header->flags & IMAGED_FLAG_TILED) {
+    w->ntiles = headerNumTiles(header);
+    w->nx = (meta->width + header->tile_width - 1) / header->tile_width;
+    w->tileBytes = headerTileBytes(header);
+    w->tiles = calloc(w->ntiles, sizeof(ImagedTile));
+    w->tile = malloc(w->tileBytes);
+    w->buf = malloc(w->tileBytes);
+    if (w->tiles == NULL || w->tile == NULL || w->buf == NULL) {
+      imagedWriterAbort(w);
+      return IMAGED_ERR;
+    }
+
+    if (!(header->flags & IMAGED_FLAG_COMPRESSED)) {
+      for (uint64_t i = 0; i < w->ntiles; i++) {
+        w->tiles[i].offset = header->offset + i * w->tileBytes;
+        w->tiles[i].size = w->tileBytes;
+      }
+    }
+  }
+
+  w->end = header->offset;
+  if (!(header->flags & IMAGED_FLAG_COMPRESSED) &&
+      ftruncate(w->fd, header->offset + header->size) != 0) {
+    imagedWriterAbort(w);
+    return IMAGED_ERR_SEEK;
+  }
+
+  *writer = w;
+  return IMAGED_OK;
+}
+
+static ImagedStatus writerTile(ImagedWriter *w, uint64_t index,
+                               const uint8_t *tile) {
+  if (!(w->header.flags & IMAGED_FLAG_COMPRESSED)) {
+    return pwrite(w->fd, tile, w->tileBytes, w->tiles[index].offset) ==
+                   (ssize_t)w->tileBytes
+               ? IMAGED_OK
+               : IMAGED_ERR_SEEK;
+  }
+
+  // Tiles that do not shrink are stored as-is
+  const uint8_t *chunk = w->buf;
+  size_t n = imagedTileEncode(&w->header.meta, tile, w->header.tile_width,
+                              w->header.tile_height, w->buf, w->tileBytes - 1);
+  if (n == 0) {
+    chunk = tile;
+    n = w->tileBytes;
+  }
+
+  if (pwrite(w->fd, chunk, n, w->end) != (ssize_t)n) {
+    return IMAGED_ERR_SEEK;
+  }
+
+  w->tiles[index].offset = w->end;
+  w->tiles[index].size = n;
+  w->end += n;
+  return IMAGED_OK;
+}
+
+// Split the buffered row of tiles into tiles and write them
+static ImagedStatus writerFlushBand(ImagedWriter *w) {
+  uint64_t tw = w->header.tile_width, th = w->header.tile_height;
+  uint64_t ty = (w->row - 1) / th;
+  uint64_t width = w->header.meta.width;
+  uint64_t rows = w->row - ty * th;
+  size_t stride = width * w->pixelBytes;
+
+  for (uint64_t tx = 0; tx < w->nx; tx++) {
+    uint64_t x = tx * tw;
+    size_t n = (width - x < tw ? width - x : tw) * w->pixelBytes;
+    bzero(w->tile, w->tileBytes);
+    for (uint64_t j = 0; j < rows; j++) {
+      memcpy(w->tile + j * tw * w->pixelBytes,
+             w->band + j * stride + x * w->pixelBytes, n);
+    }
+
+    ImagedStatus status = writerTile(w, ty * w->nx + tx, w->tile);
+    if (status != IMAGED_OK) {
+      return status;
+    }
+  }
+
+  return IMAGED_OK;
+}
+
+ImagedStatus imagedWriterWriteRows(ImagedWriter *writer, uint64_t y,
+                                   uint64_t nrows, const void *rows) {
+  ImagedWriter *w = writer;
+  const ImageMeta *meta = &w->header.meta;
+  if (w->finished || rows == NULL || y > meta->height || nrows > meta->height - y) {
+    return IMAGED_ERR;
+  }
+
+  size_t stride = meta->width * w->pixelBytes;
+  if (!(w->header.flags & IMAGED_FLAG_TILED)) {
+    size_t n = nrows * stride;
+    return pwrite(w->fd, rows, n, w->header.offset + y * stride) ==
+                   (ssize_t)n
+               ? IMAGED_OK
+               : IMAGED_ERR_SEEK;
+  }
+
+  if (y != w->row) {
+    return IMAGED_ERR;
+  }
+
+  uint64_t th = w->header.tile_height;
+  if (w->band == NULL && (w->band = malloc(th * stride)) == NULL) {
+    return IMAGED_ERR;
+  }
+
+  const uint8_t *src = rows;
+  for (uint64_t j = 0; j < nrows; j++) {
+    memcpy(w->band + (w->row % th) * stride, src + j * stride, stride);
+    w->row += 1;
+    if (w->row % th == 0 || w->row == meta->height) {
+      ImagedStatus status = writerFlushBand(w);
+      if (status != IMAGED_OK) {
+        return status;
+      }
+    }
+  }
+
   return IMAGED_OK;
 }
 
+ImagedStatus imagedWriterWriteTile(ImagedWriter *writer, uint64_t tx,
+                                   uint64_t ty, const void *tile) {
+  if (writer->finished || tile == NULL ||
+      !(writer->header.flags & IMAGED_FLAG_TILED) ||
+      tx >= writer->nx || ty * writer->nx + tx >= writer->ntiles) {
+    return IMAGED_ERR;
+  }
+
+  return writerTile(writer, ty * writer->nx + tx, tile);
+}
+
+// Write the tile index and header, and generate mip levels
+static ImagedStatus writerFinish(ImagedWriter *w) {
+  ImagedHeader *header = &w->header;
+  ImagedStatus status = IMAGED_OK;
+
+  if (w->band != NULL && w->row % header->tile_height != 0 &&
+      w->row < header->meta.height) {
+    // Partially written row of tiles
+    status = writerFlushBand(w);
+  }
+
+  if (status == IMAGED_OK && header->flags & IMAGED_FLAG_COMPRESSED) {
+    // Tiles that were never written share a single zero chunk
+    uint64_t zero = UINT64_MAX;
+    for (uint64_t i = 0; i < w->ntiles && status == IMAGED_OK; i++) {
+      if (w->tiles[i].size > 0) {
+        continue;
+      }
+
+      if (zero == UINT64_MAX) {
+        bzero(w->tile, w->tileBytes);
+        status = writerTile(w, i, w->tile);
+        zero = i;
+      } else {
+        w->tiles[i] = w->tiles[zero];
+      }
+    }
+    header->size = w->end - header->offset;
+  }
+
+  if (status == IMAGED_OK && header->flags & IMAGED_FLAG_TILED) {
+    size_t indexBytes = w->ntiles * sizeof(ImagedTile);
+    if (pwrite(w->fd, w->tiles, indexBytes, header->tiles) !=
+        (ssize_t)indexBytes) {
+      status = IMAGED_ERR_SEEK;
+    }
+  }
+
+  if (status == IMAGED_OK &&
+      ftruncate(w->fd, header->offset + header->size) != 0) {
+    status = IMAGED_ERR_SEEK;
+  }
+
+  if (status == IMAGED_OK && w->levels > 0) {
+    size_t size = header->offset + header->size;
+    void *data = mmap(0, size, PROT_READ, MAP_SHARED, w->fd, 0);
+    if (data == MAP_FAILED) {
+      return IMAGED_ERR_MAP_FAILED;
+    }
+
+    ImagedHandle tmp;
+    imagedHandleInit(&tmp);
+    handleInitFromMap(&tmp, w->fd, data, size, header);
+
+    Image *base = &tmp.image, *copy = NULL;
+    if (header->flags & IMAGED_FLAG_TILED) {
+      const ImageMeta *meta = &header->meta;
+      copy = imageAlloc(meta->width, meta->height, meta->color, meta->kind,
+                        meta->bits, NULL);
+      if (copy == NULL ||
+          imagedHandleReadRegion(&tmp, 0, 0, copy) != IMAGED_OK) {
+        status = IMAGED_ERR;
+      }
+      base = copy;
+    }
+
+    if (status == IMAGED_OK) {
+      status = writeLevels(w->fd, header, base, w->levels);
+    }
+
+    imageFree(copy);
+    imagedHandleFreeTileCache(&tmp);
+    munmap(data, size);
+  }
+
+  if (status == IMAGED_OK &&
+      pwrite(w->fd, header, sizeof(ImagedHeader), 0) != sizeof(ImagedHeader)) {
+    status = IMAGED_ERR_SEEK;
+  }
+
+  return status;
+}
+
+ImagedStatus imagedWriterCommit(ImagedWriter *writer, ImagedHandle *handle) {
+  ImagedWriter *w = writer;
+  imagedHandleInit(handle);
+
+  // The header is written last, so the temporary file is never a valid image
+  // before this point
+  if (!w->finished) {
+    ImagedStatus status = writerFinish(w);
+    if (status != IMAGED_OK) {
+      return status;
+    }
+    w->finished = true;
+  }
+
+  // Handles open on the current file keep their lock, the new file is only
+  // published when nobody is using the key. Atomic writers only wait for
+  // editable handles, readers keep their mapping of the previous file. The
+  // lock table locks the key rather than the file, so there a writer that
+  // returns a handle needs the exclusive lock even when it is atomic
+  Imaged *db = w->db;
+  bool exclusive = !w->atomic || (handle != NULL && db->lock_table != NULL);
+  ImagedKeyLock lock = {0};
+  int old = open(w->path, O_RDONLY);
+  if ((old >= 0 || db->lock_table != NULL) &&
+      imagedLockKey(db, w->key, w->keylen, old, exclusive, 0, &lock) !=
+          IMAGED_OK) {
+    if (old >= 0) {
+      close(old);
+    }
+    return IMAGED_ERR_LOCKED;
+  }
+
+  // A new object only becomes visible once the image is complete, when
+  // another writer created it first the key is simply not shared
+  if (w->object != NULL) {
+    link(w->tmp, w->object);
+  }
+
+  imagedHandleCacheInvalidate(db->handles, w->key, w->keylen);
+  if (rename(w->tmp, w->path) != 0) {
+    imagedUnlockKey(old, &lock, exclusive);
+    if (old >= 0) {
+      close(old);
+    }
+    return IMAGED_ERR;
+  }
+
+  if (old >= 0) {
+    imagedDedupRelease(db, old);
+    close_unlock(old);
+  }
+
+  imagedCatalogUpdate(db, w->key, w->keylen);
+
+  ImagedStatus status = IMAGED_OK;
+  if (handle != NULL) {
+    size_t size = headerFileSize(&w->header);
+    void *data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+    if (data != MAP_FAILED) {
+      // The handle takes over the file descriptor and its lock
+      handleInitFromMap(handle, w->fd, data, size, &w->header);
+      handle->lock = lock;
+      handle->exclusive = true;
+      w->fd = -1;
+      lock.table = NULL;
+    } else {
+      status = IMAGED_ERR_MAP_FAILED;
+    }
+  }
+
+  if (lock.table != NULL) {
+    imagedUnlockKey(-1, &lock, exclusive);
+  }
+
+  writerFree(w);
+  return status;
+}
+
+void imagedWriterAbort(ImagedWriter *writer) {
+  if (writer == NULL) {
+    return;
+  }
+
+  if (writer->tmp != NULL) {
+    unlink(writer->tmp);
+  }
+  writerFree(writer);
+}
+
+ImagedStatus imagedStat(Imaged *db, const char *key, ssize_t keylen,
+                        struct stat *st) {
+  char *path = pathJoin(db->root, key, keylen);
+  int fd = openKey(db, path, key, keylen, O_RDONLY, NULL);
+  ImagedStatus status = fd < 0 || fstat(fd, st) == -1 ? IMAGED_ERR : IMAGED_OK;
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(path);
+  return status;
+}
+
+// Map the locked file of a key once its header has been read, the file and
+// its lock are owned by the handle on success and released on failure
+static ImagedStatus mapKey(Imaged *db, const char *key, ssize_t keylen,
+                           const char *path, int fd,
+                           const ImagedKeyLock *lock, bool editable,
+                           bool cache, const ImagedHeader *header,
+                           ImagedHandle *handle) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || headerFileSize(header) != (size_t)st.st_size) {
+    close_unlock_key(fd, lock, editable);
+    return IMAGED_ERR_INVALID_FILE;
+  }
+
+  size_t map_size = st.st_size;
+
+  int flags = PROT_READ;
+  if (editable) {
+    flags |= PROT_WRITE;
+  }
+  void *data = mmap(0, map_size, flags, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    close_unlock_key(fd, lock, editable);
+    return IMAGED_ERR_MAP_FAILED;
+  }
+
+  if ((header->flags & IMAGED_FLAG_TILED) &&
+      !tilesAreValid(header,
+                     (const ImagedTile *)((uint8_t *)data + header->tiles),
+                     map_size)) {
+    munmap(data, map_size);
+    close_unlock_key(fd, lock, editable);
+    return IMAGED_ERR_INVALID_FILE;
+  }
+
+  handleInitFromMap(handle, fd, data, map_size, header);
+  handle->lock = *lock;
+  handle->exclusive = editable;
+
+  if (cache) {
+    imagedHandleCachePut(db->handles, key, keylen, path, handle);
+  }
+  return IMAGED_OK;
+}
+
+ImagedStatus imagedGet(Imaged *db, const char *key, ssize_t keylen,
+                       bool editable, ImagedHandle *handle) {
+  return imagedGetWithTimeout(db, key, keylen, editable, 0, handle);
+}
+
+ImagedStatus imagedGetWithTimeout(Imaged *db, const char *key, ssize_t keylen,
+                                  bool editable, int64_t timeout_ms,
+                                  ImagedHandle *handle) {
+  imagedHandleInit(handle);
+  if (!isValidKey(key, keylen)) {
+    return IMAGED_ERR_INVALID_KEY;
+  }
+
+  imagedCapacityTouch(db, key, keylen);
+
+  // Cached entries are never waited on, when a timeout is given the file is
+  // opened and locked separately instead
+  if (!editable && handle != NULL) {
+    ImagedStatus status =
+        imagedHandleCacheGet(db->handles, key, keylen, handle);
+    if (status == IMAGED_OK ||
+        (status == IMAGED_ERR_LOCKED && timeout_ms == 0)) {
+      return status;
+    }
+  }
+
+  char *path = pathJoin(db->root, key, keylen);
+
+  bool ephemeral;
+  int fd = openKey(db, path, key, keylen, (editable ? O_RDWR : O_RDONLY),
+                   &ephemeral);
+  if (fd < 0) {
+    free(path);
+    return errno == ENOENT ? IMAGED_ERR_FILE_DOES_NOT_EXIST : IMAGED_ERR;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size <= _header_size + sizeof(ImageMeta)) {
+    close(fd);
+    free(path);
+    return IMAGED_ERR_INVALID_FILE;
+  }
+
+  // Writing to a deduplicated file would change every key that shares it, so
+  // the key gets its own copy first
+  if (editable && handle != NULL && st.st_nlink > 1) {
+    close(fd);
+    ImagedStatus status = imagedDedupUnshare(db, key, keylen);
+    fd = status == IMAGED_OK ? open(path, O_RDWR) : -1;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      free(path);
+      return status != IMAGED_OK ? status : IMAGED_ERR;
+    }
+  }
+
+  if (handle == NULL) {
+    close(fd);
+    free(path);
+    return IMAGED_OK;
+  }
+
+  ImagedKeyLock lock;
+  ImagedStatus status =
+      imagedLockKey(db, key, keylen, fd, editable, timeout_ms, &lock);
+  if (status != IMAGED_OK) {
+    free(path);
+    close(fd);
+    return status;
+  }
+
+  ImagedHeader header;
+  status = imagedReadHeader(fd, &header);
+  if (status != IMAGED_OK) {
+    close_unlock_key(fd, &lock, editable);
+    free(path);
+    return IMAGED_ERR_INVALID_FILE;
+  }
+
+  // The handle cache checks that a key is unchanged using its path, so only
+  // keys stored in the database directory are cached
+  status = mapKey(db, key, keylen, path, fd, &lock, editable,
+                  !editable && !ephemeral, &header, handle);
+  free(path);
+  return status;
+}
+
+// Open and lock the file of a key and read its header, used to pick a level
+// and map it without the key changing in between
+static ImagedStatus openLevels(Imaged *db, const char *key, ssize_t keylen,
+                               int *fd, ImagedKeyLock *lock,
+                               ImagedHeader *header) {
+  imagedCapacityTouch(db, key, keylen);
+
+  char *path = pathJoin(db->root, key, keylen);
+  *fd = openKey(db, path, key, keylen, O_RDONLY, NULL);
+  free(path);
+  if (*fd < 0) {
+    return IMAGED_ERR_FILE_DOES_NOT_EXIST;
+  }
+
+  if (imagedLockKey(db, key, keylen, *fd, false, 0, lock) != IMAGED_OK) {
+    close(*fd);
+    return IMAGED_ERR_LOCKED;
+  }
+
+  if (imagedReadHeader(*fd, header) != IMAGED_OK) {
+    close_unlock_key(*fd, lock, false);
+    return IMAGED_ERR_INVALID_FILE;
+  }
+
+  return IMAGED_OK;
+}
+
+// Map a level of the file opened by openLevels, the file and its lock are
+// owned by the handle on success and released on failure
+static ImagedStatus mapLevel(int fd, const ImagedKeyLock *lock,
+                             const ImagedHeader *header, uint32_t level,
+                             ImagedHandle *handle) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || headerFileSize(header) != (size_t)st.st_size) {
+    close_unlock_key(fd, lock, false);
+    return IMAGED_ERR_INVALID_FILE;
+  }
+
+  if (level > header->levels) {
+    close_unlock_key(fd, lock, false);
+    return IMAGED_ERR;
+  }
+
+  if (handle == NULL) {
+    close_unlock_key(fd, lock, false);
+    return IMAGED_OK;
+  }
+
+  // Levels are page aligned, so only the level itself is mapped
+  const ImagedLevel *l = &header->level[level - 1];
+  void *data = mmap(0, l->size, PROT_READ, MAP_SHARED, fd, l->offset);
+  if (data == MAP_FAILED) {
+    close_unlock_key(fd, lock, false);
+    return IMAGED_ERR_MAP_FAILED;
+  }
+
+  handle->fd = fd;
+  handle->lock = *lock;
+  handle->map = data;
+  handle->mapsize = l->size;
+  handle->image.owner = false;
+  handle->image.meta = header->meta;
+  handle->image.meta.width = l->width;
+  handle->image.meta.height = l->height;
+  handle->image.data = data;
+  return IMAGED_OK;
+}
+
+ImagedStatus imagedGetLevel(Imaged *db, const char *key, ssize_t keylen,
+                            uint32_t level, ImagedHandle *handle) {
+  if (level == 0) {
+    return imagedGet(db, key, keylen, false, handle);
+  }
+
+  imagedHandleInit(handle);
+  if (!isValidKey(key, keylen)) {
+    return IMAGED_ERR_INVALID_KEY;
+  }
+
+  int fd;
+  ImagedKeyLock lock;
+  ImagedHeader header;
+  ImagedStatus status = openLevels(db, key, keylen, &fd, &lock, &header);
+  if (status != IMAGED_OK) {
+    return status;
+  }
+
+  return mapLevel(fd, &lock, &header, level, handle);
+}
+
+ImagedStatus imagedGetLevelForSize(Imaged *db, const char *key, ssize_t keylen,
+                                   uint64_t width, uint64_t height,
+                                   ImagedHandle *handle) {
+  imagedHandleInit(handle);
+  if (!isValidKey(key, keylen)) {
+    return IMAGED_ERR_INVALID_KEY;
+  }
+
+  // The level is picked and mapped under the same lock, so a concurrent set
+  // can not change the levels in between
+  int fd;
+  ImagedKeyLock lock;
+  ImagedHeader header;
+  ImagedStatus status = openLevels(db, key, keylen, &fd, &lock, &header);
+  if (status != IMAGED_OK) {
+    return status;
+  }
+
+  uint32_t level = 0;
+  while (level < header.levels && header.level[level].width >= width &&
+         header.level[level].height >= height) {
+    level += 1;
+  }
+
+  // Every key has a base image, so there is nothing to check when it is used
+  if (level == 0) {
+    close_unlock_key(fd, &lock, false);
+    return imagedGet(db, key, keylen, false, handle);
+  }
+
+  return mapLevel(fd, &lock, &header, level, handle);
+}
+
+// Replace a key that is locked by the caller with a new file. Committing the
+// writer would wait for that lock, so the file is renamed into place directly
+static ImagedStatus rewriteKey(Imaged *db, const char *key, ssize_t keylen,
+                               const Image *image,
+                               const ImagedSetOptions *options) {
+  ImagedWriter *w;
+  ImagedStatus status =
+      imagedWriterBegin(db, key, keylen, &image->meta, options, &w);
+  if (status != IMAGED_OK) {
+    return status;
+  }
+
+  status = imagedWriterWriteRows(w, 0, image->meta.height, image->data);
+  if (status == IMAGED_OK) {
+    status = writerFinish(w);
+  }
+
+  if (status == IMAGED_OK && rename(w->tmp, w->path) != 0) {
+    status = IMAGED_ERR;
+  }
+
+  if (status != IMAGED_OK) {
+    imagedWriterAbort(w);
+    return status;
+  }
+
+  writerFree(w);
+  return IMAGED_OK;
+}
+
+ImagedStatus imagedSetLevels(Imaged *db, const char *key, ssize_t keylen,
+                             uint32_t levels) {
+  ImagedHandle handle;
+  ImagedStatus status = imagedGet(db, key, keylen, true, &handle);
+  if (status != IMAGED_OK) {
+    return status;
+  }
+
+  imagedHandleCacheInvalidate(db->handles, key, keylen);
+
+  ImagedHeader header;
+  status = imagedReadHeader(handle.fd, &header);
+  if (status != IMAGED_OK) {
+    imagedHandleClose(&handle);
+    return status;
+  }
+
+  Image *base = &handle.image;
+  Image *tmp = NULL;
+  if (handle.flags & IMAGED_FLAG_TILED ||
+      header.version != IMAGED_FORMAT_VERSION) {
+    tmp = imageAlloc(header.meta.width, header.meta.height, header.meta.color,
+                     header.meta.kind, header.meta.bits, NULL);
+    if (tmp == NULL ||
+        imagedHandleReadRegion(&handle, 0, 0, tmp) != IMAGED_OK) {
+      imageFree(tmp);
+      imagedHandleClose(&handle);
+      return IMAGED_ERR;
+    }
+    base = tmp;
+  }
+
+  // Older headers have no room for the level table, so the key is rewritten
+  // in the current format
+  if (header.version != IMAGED_FORMAT_VERSION) {
+    ImagedSetOptions options = {
+        .tile_width = header.tile_width,
+        .tile_height = header.tile_height,
+        .compress = (header.flags & IMAGED_FLAG_COMPRESSED) != 0,
+        .levels = levels,
+    };
+    status = rewriteKey(db, key, keylen, tmp, &options);
+    imageFree(tmp);
+    imagedHandleClose(&handle);
+    imagedCatalogUpdate(db, key, keylen);
+    return status;
+  }
+
+  status = writeLevels(handle.fd, &header, base, levels);
+  if (status == IMAGED_OK && pwrite(handle.fd, &header, sizeof(ImagedHeader),
+                                    0) != sizeof(ImagedHeader)) {
+    status = IMAGED_ERR_SEEK;
+  }
+
+  imageFree(tmp);
+  imagedHandleClose(&handle);
+  imagedCatalogUpdate(db, key, keylen);
+  return status;
+}
+
+ImagedStatus imagedRemove(Imaged *db, const char *key, ssize_t keylen) {
+  return imagedRemoveWithTimeout(db, key, keylen, 0);
+}
+
+ImagedStatus imagedRemoveWithTimeout(Imaged *db, const char *key,
+                                     ssize_t keylen, int64_t timeout_ms) {
+  if (!isValidKey(key, keylen)) {
+    return IMAGED_ERR_INVALID_KEY;
+  }
+
+  char *path = pathJoin(db->root, key, keylen);
+
+  bool ephemeral;
+  int fd = openKey(db, path, key, keylen, O_RDONLY, &ephemeral);
+  if (fd < 0) {
+    free(path);
+    return IMAGED_ERR_FILE_DOES_NOT_EXIST;
+  }
+
+  ImagedHeader header;
+  if (imagedReadHeader(fd, &header) != IMAGED_OK) {
+    free(path);
+    close(fd);
+    return IMAGED_ERR_INVALID_FILE;
+  }
+
+  // Deduplicated files are never written in place, so like an atomic write a
+  // shared lock is enough, and other keys sharing the file are not blocked
+  struct stat st;
+  bool exclusive = ephemeral || fstat(fd, &st) != 0 || st.st_nlink <= 1;
+  ImagedKeyLock lock;
+  if (imagedLockKey(db, key, keylen, fd, exclusive, timeout_ms, &lock) !=
+      IMAGED_OK) {
+    free(path);
+    close(fd);
+    return IMAGED_ERR_LOCKED;
+  }
+
+  imagedHandleCacheInvalidate(db->handles, key, keylen);
+  if (ephemeral) {
+    imagedEphemeralUnlink(db, key, keylen);
+  } else {
+    remove(path);
+    imagedDedupRelease(db, fd);
+  }
+  free(path);
+  close_unlock_key(fd, &lock, exclusive);
+  if (!ephemeral) {
+    imagedCatalogUpdate(db, key, keylen);
+  }
+  return IMAGED_OK;
+}
+
+// Batches go through io_uring in steps: every request of the batch submits
+// the same kind of operation (open, read or write, rename) together and waits
+// for all of them, the cheap work in between (locking, mapping, catalog
+// updates) is done on the calling thread. Requests that need anything else,
+// for example ephemeral keys, use the regular functions. Without io_uring the
+// requests are handed out to the thread pool instead
+
+typedef struct {
+  char *path, *tmp;
+  int fd, old;
+  ImagedKeyLock lock;
+  ImagedHeader header;
+  uint8_t buf[sizeof(ImagedHeader)];
+} BatchItem;
+
+typedef struct {
+  Imaged *db;
+  void *reqs;
+  ImagedSetOptions options;
+} BatchState;
+
+static uint64_t _batch_tmp = 0;
+
+static void getBatchTask(size_t index, size_t worker, void *ud) {
+  (void)worker;
+  BatchState *state = ud;
+  ImagedGetRequest *r = &((ImagedGetRequest *)state->reqs)[index];
+  r->status = imagedGet(state->db, r->key, r->keylen, false, &r->handle);
+}
+
+static void setBatchTask(size_t index, size_t worker, void *ud) {
+  (void)worker;
+  BatchState *state = ud;
+  ImagedSetRequest *r = &((ImagedSetRequest *)state->reqs)[index];
+  r->status = imagedSetWithOptions(state->db, r->key, r->keylen, &r->meta,
+                                   r->data, &state->options, NULL);
+}
+
+static ImagedStatus batchFinish(const ImagedBatchOptions *options,
+                                ImagedBatchStats *stats) {
+  if (options->stats != NULL) {
+    *options->stats = *stats;
+  }
+  return stats->failed > 0 ? IMAGED_ERR : IMAGED_OK;
+}
+
+static void getBatchUring(Imaged *db, ImagedUring *ring, ImagedGetRequest *reqs,
+                          size_t n, BatchItem *items, ImagedUringRequest *ops,
+                          size_t *index, ImagedBatchStats *stats) {
+  // Cached keys are returned without opening anything
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    ImagedGetRequest *r = &reqs[i];
+    imagedHandleInit(&r->handle);
+    if (!isValidKey(r->key, r->keylen)) {
+      r->status = IMAGED_ERR_INVALID_KEY;
+      continue;
+    }
+
+    imagedCapacityTouch(db, r->key, r->keylen);
+    r->status = imagedHandleCacheGet(db->handles, r->key, r->keylen, &r->handle);
+    if (r->status == IMAGED_OK || r->status == IMAGED_ERR_LOCKED) {
+      continue;
+    }
+
+    items[i].path = pathJoin(db->root, r->key, r->keylen);
+    if (items[i].path == NULL) {
+      r->status = IMAGED_ERR;
+      continue;
+    }
+
+    ops[m] = (ImagedUringRequest){
+        .op = IMAGED_URING_OPEN, .path = items[i].path, .flags = O_RDONLY};
+    index[m++] = i;
+  }
+  imagedUringRun(ring, ops, m);
+  stats->submitted += m;
+
+  // Keys are locked before their header is read, the same as imagedGet
+  size_t k = 0;
+  for (size_t j = 0; j < m; j++) {
+    size_t i = index[j];
+    ImagedGetRequest *r = &reqs[i];
+    int64_t fd = ops[j].result;
+    if (fd == -ENOENT) {
+      // Ephemeral keys have no file in the database directory
+      r->status = imagedGet(db, r->key, r->keylen, false, &r->handle);
+      stats->fallback += 1;
+      continue;
+    } else if (fd < 0) {
+      errno = -fd;
+      r->status = IMAGED_ERR;
+      continue;
+    }
+
+    r->status = imagedLockKey(db, r->key, r->keylen, fd, false, 0,
+                              &items[i].lock);
+    if (r->status != IMAGED_OK) {
+      close(fd);
+      continue;
+    }
+
+    items[i].fd = fd;
+    ops[k] = (ImagedUringRequest){.op = IMAGED_URING_READ,
+                                  .fd = fd,
+                                  .buf = items[i].buf,
+                                  .size = sizeof(items[i].buf)};
+    index[k++] = i;
+  }
+  imagedUringRun(ring, ops, k);
+  stats->submitted += k;
+
+  for (size_t j = 0; j < k; j++) {
+    size_t i = index[j];
+    ImagedGetRequest *r = &reqs[i];
+    BatchItem *item = &items[i];
+    if (parseHeader(item->buf, ops[j].result, &item->header) != IMAGED_OK) {
+      close_unlock_key(item->fd, &item->lock, false);
+      r->status = IMAGED_ERR_INVALID_FILE;
+      continue;
+    }
+
+    r->status = mapKey(db, r->key, r->keylen, item->path, item->fd,
+                       &item->lock, false, true, &item->header, &r->handle);
+  }
+}
+
+ImagedStatus imagedGetBatch(Imaged *db, ImagedGetRequest *reqs, size_t n,
+                            const ImagedBatchOptions *options) {
+  ImagedBatchOptions defaults = {0};
+  if (options == NULL) {
+    options = &defaults;
+  }
+
+  ImagedBatchStats stats = {0};
+  if (n == 0) {
+    return batchFinish(options, &stats);
+  }
+
+  ImagedUring *ring = options->disable_uring ? NULL : imagedUringNew(n);
+  BatchItem *items = ring != NULL ? calloc(n, sizeof(BatchItem)) : NULL;
+  ImagedUringRequest *ops =
+      items != NULL ? malloc(n * sizeof(ImagedUringRequest)) : NULL;
+  size_t *index = ops != NULL ? malloc(n * sizeof(size_t)) : NULL;
+  if (index != NULL) {
+    getBatchUring(db, ring, reqs, n, items, ops, index, &stats);
+    for (size_t i = 0; i < n; i++) {
+      free(items[i].path);
+    }
+  } else {
+    BatchState state = {.db = db, .reqs = reqs};
+    ImagedPool *pool = options->pool ? options->pool : imagedPoolDefault();
+    imagedPoolRun(pool, n, getBatchTask, &state);
+    stats.fallback = n;
+  }
+
+  free(index);
+  free(ops);
+  free(items);
+  imagedUringFree(ring);
+
+  for (size_t i = 0; i < n; i++) {
+    if (reqs[i].status != IMAGED_OK) {
+      stats.failed += 1;
+    }
+  }
+  return batchFinish(options, &stats);
+}
+
+// Write the rest of a short write
+static bool writeRest(int fd, const uint8_t *buf, size_t size, off_t offset,
+                      int64_t written) {
+  if (written < 0) {
+    return false;
+  }
+
+  for (size_t done = written; done < size;) {
+    ssize_t n = pwrite(fd, buf + done, size - done, offset + done);
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+// Release everything held by a request that did not replace its key
+static void setBatchAbort(BatchItem *item) {
+  if (item->fd >= 0) {
+    close(item->fd);
+    unlink(item->tmp);
+  }
+  if (item->old >= 0) {
+    close(item->old);
+  }
+  item->fd = item->old = -1;
+}
+
+static void setBatchUring(Imaged *db, ImagedUring *ring, ImagedSetRequest *reqs,
+                          size_t n, BatchItem *items, ImagedUringRequest *ops,
+                          size_t *index, ImagedBatchStats *stats) {
+  // The temporary file and the current file of each key are opened together
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    ImagedSetRequest *r = &reqs[i];
+    BatchItem *item = &items[i];
+    item->fd = item->old = -1;
+    if (!isValidKey(r->key, r->keylen)) {
+      r->status = IMAGED_ERR_INVALID_KEY;
+      continue;
+    }
+
+    headerInit(&item->header, &r->meta, NULL);
+    item->path = pathJoin(db->root, r->key, r->keylen);
+    item->tmp = imagedStringPrintf(
+        "%s%c%s%d.%llu", db->root, IMAGED_PATH_SEP, IMAGED_RESERVED "tmp.",
+        (int)getpid(),
+        (unsigned long long)__atomic_add_fetch(&_batch_tmp, 1,
+                                               __ATOMIC_RELAXED));
+    if (item->path == NULL || item->tmp == NULL) {
+      r->status = IMAGED_ERR;
+      continue;
+    }
+
+    ops[m] = (ImagedUringRequest){.op = IMAGED_URING_OPEN,
+                                  .path = item->tmp,
+                                  .flags = O_CREAT | O_EXCL | O_WRONLY,
+                                  .mode = 0644};
+    ops[m + 1] = (ImagedUringRequest){
+        .op = IMAGED_URING_OPEN, .path = item->path, .flags = O_RDONLY};
+    index[m / 2] = i;
+    m += 2;
+  }
+  imagedUringRun(ring, ops, m);
+  stats->submitted += m;
+
+  // The header and the pixels are written separately, the file is complete
+  // before it is renamed so the header does not need to be written last
+  size_t k = 0;
+  for (size_t j = 0; j < m; j += 2) {
+    size_t i = index[j / 2];
+    ImagedSetRequest *r = &reqs[i];
+    BatchItem *item = &items[i];
+    item->old = ops[j + 1].result >= 0 ? ops[j + 1].result : -1;
+    if (ops[j].result == -EEXIST) {
+      // Left behind by an earlier process with the same pid
+      free(item->tmp);
+      item->tmp = pathJoin(db->root, IMAGED_RESERVED "tmp.XXXXXX", -1);
+      item->fd = item->tmp != NULL ? mkstemp(item->tmp) : -1;
+      if (item->fd >= 0) {
+        fchmod(item->fd, 0644);
+      }
+    } else {
+      item->fd = ops[j].result >= 0 ? ops[j].result : -1;
+    }
+
+    if (item->fd < 0) {
+      r->status = IMAGED_ERR_CANNOT_CREATE_FILE;
+      setBatchAbort(item);
+      continue;
+    }
+
+    if (item->old < 0 && imagedEphemeralExists(db, r->key, r->keylen)) {
+      r->status = IMAGED_ERR_FILE_ALREADY_EXISTS;
+      setBatchAbort(item);
+      continue;
+    }
+
+    const ImagedHeader *header = &item->header;
+    if ((r->data == NULL || header->size == 0) &&
+        ftruncate(item->fd, header->offset + header->size) != 0) {
+      r->status = IMAGED_ERR_SEEK;
+      setBatchAbort(item);
+      continue;
+    }
+
+    ops[k] = (ImagedUringRequest){.op = IMAGED_URING_WRITE,
+                                  .fd = item->fd,
+                                  .buf = (void *)header,
+                                  .size = sizeof(ImagedHeader)};
+    ops[k + 1] = (ImagedUringRequest){
+        .op = IMAGED_URING_WRITE,
+        .fd = item->fd,
+        .buf = (void *)r->data,
+        .size = r->data != NULL ? header->size : 0,
+        .offset = header->offset};
+    index[k / 2] = i;
+    k += 2;
+  }
+  imagedUringRun(ring, ops, k);
+  stats->submitted += k;
+
+  // Keys are replaced the same way as an atomic write, only editable handles
+  // block the rename
+  size_t l = 0;
+  for (size_t j = 0; j < k; j += 2) {
+    size_t i = index[j / 2];
+    ImagedSetRequest *r = &reqs[i];
+    BatchItem *item = &items[i];
+    if (!writeRest(item->fd, ops[j].buf, ops[j].size, ops[j].offset,
+                   ops[j].result) ||
+        !writeRest(item->fd, ops[j + 1].buf, ops[j + 1].size,
+                   ops[j + 1].offset, ops[j + 1].result)) {
+      r->status = IMAGED_ERR_SEEK;
+      setBatchAbort(item);
+      continue;
+    }
+
+    if ((item->old >= 0 || db->lock_table != NULL) &&
+        imagedLockKey(db, r->key, r->keylen, item->old, false, 0,
+                      &item->lock) != IMAGED_OK) {
+      r->status = IMAGED_ERR_LOCKED;
+      setBatchAbort(item);
+      continue;
+    }
+
+    imagedHandleCacheInvalidate(db->handles, r->key, r->keylen);
+    ops[l] = (ImagedUringRequest){
+        .op = IMAGED_URING_RENAME, .path = item->tmp, .target = item->path};
+    index[l++] = i;
+  }
+  imagedUringRun(ring, ops, l);
+  stats->submitted += l;
+
+  for (size_t j = 0; j < l; j++) {
+    size_t i = index[j];
+    ImagedSetRequest *r = &reqs[i];
+    BatchItem *item = &items[i];
+    imagedUnlockKey(item->old, &item->lock, false);
+    if (ops[j].result != 0) {
+      errno = -ops[j].result;
+      r->status = IMAGED_ERR;
+      setBatchAbort(item);
+      continue;
+    }
+
+    imagedDedupRelease(db, item->old);
+    imagedCatalogUpdate(db, r->key, r->keylen);
+    r->status = IMAGED_OK;
+    close(item->fd);
+    if (item->old >= 0) {
+      close(item->old);
+    }
+  }
+}
+
+static bool isPlain(const ImagedSetOptions *options) {
+  return options == NULL ||
+         (options->tile_width == 0 && options->tile_height == 0 &&
+          !options->compress && options->levels == 0 && !options->ephemeral &&
+          !options->dedup);
+}
+
+ImagedStatus imagedSetBatch(Imaged *db, ImagedSetRequest *reqs, size_t n,
+                            const ImagedBatchOptions *options) {
+  ImagedBatchOptions defaults = {0};
+  if (options == NULL) {
+    options = &defaults;
+  }
+
+  ImagedBatchStats stats = {0};
+  if (n == 0) {
+    return batchFinish(options, &stats);
+  }
+
+  // Room is made for the whole batch before anything is written, reserving
+  // for each key on its own would compare every key against the same usage
+  uint64_t *sizes = calloc(n, sizeof(uint64_t));
+  bool ephemeral = options->set != NULL && options->set->ephemeral;
+  for (size_t i = 0; sizes != NULL && !ephemeral && i < n; i++) {
+    if (isValidKey(reqs[i].key, reqs[i].keylen)) {
+      ImagedHeader header;
+      headerInit(&header, &reqs[i].meta, options->set);
+      sizes[i] = headerFileSize(&header);
+    }
+  }
+  if (sizes != NULL) {
+    imagedCapacityReserveBatch(db, reqs, n, sizes);
+  }
+
+  ImagedUring *ring =
+      options->disable_uring || !isPlain(options->set) || sizes == NULL
+          ? NULL
+          : imagedUringNew(n * 2);
+  BatchItem *items = ring != NULL ? calloc(n, sizeof(BatchItem)) : NULL;
+  ImagedUringRequest *ops =
+      items != NULL ? malloc(2 * n * sizeof(ImagedUringRequest)) : NULL;
+  size_t *index = ops != NULL ? malloc(n * sizeof(size_t)) : NULL;
+  if (index != NULL) {
+    setBatchUring(db, ring, reqs, n, items, ops, index, &stats);
+    for (size_t i = 0; i < n; i++) {
+      free(items[i].path);
+      free(items[i].tmp);
+    }
+  } else {
+    BatchState state = {.db = db, .reqs = reqs};
+    if (options->set != NULL) {
+      state.options = *options->set;
+    }
+    state.options.atomic = true;
+
+    ImagedPool *pool = options->pool ? options->pool : imagedPoolDefault();
+    imagedPoolRun(pool, n, setBatchTask, &state);
+    stats.fallback = n;
+  }
+
+  free(sizes);
+  free(index);
+  free(ops);
+  free(items);
+  imagedUringFree(ring);
+
+  for (size_t i = 0; i < n; i++) {
+    if (reqs[i].status != IMAGED_OK) {
+      stats.failed += 1;
+    }
+  }
+  return batchFinish(options, &stats);
+}
+
 void imagedHandleInit(ImagedHandle *handle) {
   if (handle) {
     bzero(&handle->image, sizeof(Image));
     handle->fd = -1;
+    handle->map = NULL;
+    handle->mapsize = 0;
+    handle->flags = 0;
+    handle->tile_width = handle->tile_height = 0;
+    handle->tiles = NULL;
+    handle->cache = NULL;
+    handle->shared = NULL;
+    handle->lock = (ImagedKeyLock){0};
+    handle->exclusive = false;
   }
 }
 
@@ -460,17 +2252,28 @@ void imagedHandleClose(ImagedHandle *handle) {
     return;
   }
 
-  if (handle->image.data != NULL && handle->fd >= 0) {
-    void *ptr = handle->image.data - _header_size - sizeof(ImageMeta);
-    size_t size = _header_size + sizeof(ImageMeta) +
-                  imageMetaTotalBytes(&handle->image.meta);
-    // msync(ptr, size, MS_SYNC);
-    munmap(ptr, size);
-    handle->image.data = NULL;
+  if (handle->shared != NULL) {
+    // The mapping belongs to the handle cache
+    imagedHandleFreeTileCache(handle);
+    imagedHandleCacheRelease(handle->shared);
+    imagedHandleInit(handle);
+    return;
+  }
+
+  if (handle->map != NULL) {
+    // msync(handle->map, handle->mapsize, MS_SYNC);
+    munmap(handle->map, handle->mapsize);
+    handle->map = NULL;
+    handle->mapsize = 0;
   }
+  handle->image.data = NULL;
+  handle->tiles = NULL;
+  imagedHandleFreeTileCache(handle);
 
   if (handle->fd >= 0) {
-    close_unlock(handle->fd);
+    close_unlock_key(handle->fd, &handle->lock, handle->exclusive);
     handle->fd = -1;
   }
+  handle->lock = (ImagedKeyLock){0};
+  handle->exclusive = false;
 }
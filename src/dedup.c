@@ -0,0 +1,295 @@
+#define _DEFAULT_SOURCE
+#include "imaged.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Deduplicated keys are hard links to an object file named after the hash of
+// the image, so the link count of the object is its reference count and reads
+// map the shared file like any other key. Keys are never modified in place
+// while they are shared: writers replace the key with a new file and editable
+// handles copy it first. Linking a key to an object and deleting an object
+// that is no longer used are serialized with flock on the database directory
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input) {
+  acc += input * XXH_P2;
+  return rotl(acc, 31) * XXH_P1;
+}
+
+static uint64_t xxhMerge(uint64_t acc, uint64_t val) {
+  acc ^= xxhRound(0, val);
+  return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t imagedHash(const void *data, size_t size, uint64_t seed) {
+  const uint8_t *p = data;
+  const uint8_t *end = p + size;
+  uint64_t h;
+
+  if (size >= 32) {
+    uint64_t v1 = seed + XXH_P1 + XXH_P2;
+    uint64_t v2 = seed + XXH_P2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_P1;
+    do {
+      v1 = xxhRound(v1, read64(p));
+      v2 = xxhRound(v2, read64(p + 8));
+      v3 = xxhRound(v3, read64(p + 16));
+      v4 = xxhRound(v4, read64(p + 24));
+      p += 32;
+    } while (p + 32 <= end);
+
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = xxhMerge(h, v1);
+    h = xxhMerge(h, v2);
+    h = xxhMerge(h, v3);
+    h = xxhMerge(h, v4);
+  } else {
+    h = seed + XXH_P5;
+  }
+
+  h += (uint64_t)size;
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxhRound(0, read64(p));
+    h = rotl(h, 27) * XXH_P1 + XXH_P4;
+  }
+
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read32(p) * XXH_P1;
+    h = rotl(h, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+
+  for (; p < end; p++) {
+    h ^= *p * XXH_P5;
+    h = rotl(h, 11) * XXH_P1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+static bool sameMeta(const ImageMeta *a, const ImageMeta *b) {
+  return a->width == b->width && a->height == b->height &&
+         a->color == b->color && a->kind == b->kind && a->bits == b->bits;
+}
+
+char *imagedDedupObjectPath(const Imaged *db, const ImageMeta *meta,
+                            const void *imagedata) {
+  uint64_t fields[5] = {meta->width, meta->height, meta->color, meta->kind,
+                        meta->bits};
+  uint64_t h = imagedHash(fields, sizeof(fields), 0);
+  h = imagedHash(imagedata, imageMetaTotalBytes(meta), h);
+  return imagedStringPrintf("%s%c%s%016llx", db->root, IMAGED_PATH_SEP,
+                            IMAGED_OBJECT, (unsigned long long)h);
+}
+
+bool imagedDedupMatch(int fd, const ImageMeta *meta, const void *imagedata) {
+  ImagedHeader header;
+  struct stat st;
+  if (imagedReadHeader(fd, &header) != IMAGED_OK || header.flags != 0 ||
+      header.levels != 0 || !sameMeta(&header.meta, meta) ||
+      fstat(fd, &st) != 0 ||
+      (uint64_t)st.st_size != header.offset + imageMetaTotalBytes(meta)) {
+    return false;
+  }
+
+  size_t size = st.st_size;
+  if (size == header.offset) {
+    return true;
+  }
+
+  void *map = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  bool match = memcmp((uint8_t *)map + header.offset, imagedata,
+                      size - header.offset) == 0;
+  munmap(map, size);
+  return match;
+}
+
+int imagedDedupLock(const Imaged *db) {
+  int fd = open(db->root, O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    flock(fd, LOCK_EX);
+  }
+  return fd;
+}
+
+void imagedDedupUnlock(int fd) {
+  if (fd >= 0) {
+    flock(fd, LOCK_UN);
+    close(fd);
+  }
+}
+
+// Unlink the object backing `fd` if it is the only name left, the directory
+// must be locked
+static bool dedupCollect(const Imaged *db, int fd, const struct stat *st) {
+  ImagedHeader header;
+  if (imagedReadHeader(fd, &header) != IMAGED_OK || header.flags != 0 ||
+      header.levels != 0 ||
+      (uint64_t)st->st_size !=
+          header.offset + imageMetaTotalBytes(&header.meta)) {
+    return false;
+  }
+
+  void *map = mmap(0, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  char *path =
+      imagedDedupObjectPath(db, &header.meta, (uint8_t *)map + header.offset);
+  munmap(map, st->st_size);
+
+  struct stat obj;
+  bool removed = path != NULL && stat(path, &obj) == 0 &&
+                 obj.st_dev == st->st_dev && obj.st_ino == st->st_ino &&
+                 unlink(path) == 0;
+  free(path);
+  return removed;
+}
+
+void imagedDedupRelease(const Imaged *db, int fd) {
+  // Files that were never shared have no names left once the key is gone,
+  // a single remaining name is the object
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_nlink != 1) {
+    return;
+  }
+
+  int lock = imagedDedupLock(db);
+  if (fstat(fd, &st) == 0 && st.st_nlink == 1) {
+    dedupCollect(db, fd, &st);
+  }
+  imagedDedupUnlock(lock);
+}
+
+ImagedStatus imagedDedupUnshare(Imaged *db, const char *key, ssize_t keylen) {
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  char *path = imagedStringPrintf("%s%c%.*s", db->root, IMAGED_PATH_SEP,
+                                  (int)keylen, key);
+  char *tmp = imagedStringPrintf("%s%c%s", db->root, IMAGED_PATH_SEP,
+                                 IMAGED_RESERVED "tmp.XXXXXX");
+  int src = path != NULL ? open(path, O_RDONLY) : -1;
+  int dst = src >= 0 && tmp != NULL ? mkstemp(tmp) : -1;
+  struct stat st;
+  ImagedStatus status = IMAGED_OK;
+  if (src < 0 || dst < 0 || fstat(src, &st) != 0) {
+    status = src < 0 ? IMAGED_ERR_FILE_DOES_NOT_EXIST
+                     : IMAGED_ERR_CANNOT_CREATE_FILE;
+  } else if (st.st_nlink > 1) {
+    // A reflink keeps sharing the data on disk until the copy is written
+    fchmod(dst, st.st_mode & 0777);
+    status = imagedCopyFile(src, dst, NULL);
+
+    // Readers of the shared file are unaffected, the contents are the same
+    if (status == IMAGED_OK) {
+      imagedHandleCacheInvalidate(db->handles, key, keylen);
+      status = rename(tmp, path) == 0 ? IMAGED_OK : IMAGED_ERR;
+    }
+
+    if (status == IMAGED_OK) {
+      imagedDedupRelease(db, src);
+      imagedCatalogUpdate(db, key, keylen);
+    }
+  }
+
+  if (dst >= 0) {
+    close(dst);
+    if (status != IMAGED_OK || st.st_nlink <= 1) {
+      unlink(tmp);
+    }
+  }
+  if (src >= 0) {
+    close(src);
+  }
+  free(tmp);
+  free(path);
+  return status;
+}
+
+void imagedGetDedupStats(const Imaged *db, ImagedDedupStats *stats) {
+  bzero(stats, sizeof(ImagedDedupStats));
+  DIR *dir = opendir(db->root);
+  if (dir == NULL) {
+    return;
+  }
+
+  size_t n = strlen(IMAGED_OBJECT);
+  struct dirent *ent;
+  struct stat st;
+  while ((ent = readdir(dir))) {
+    if (strncmp(ent->d_name, IMAGED_OBJECT, n) != 0 ||
+        fstatat(dirfd(dir), ent->d_name, &st, 0) != 0) {
+      continue;
+    }
+
+    stats->objects += 1;
+    stats->bytes += st.st_size;
+    if (st.st_nlink > 1) {
+      stats->references += st.st_nlink - 1;
+      stats->saved_bytes += (uint64_t)st.st_size * (st.st_nlink - 2);
+    }
+  }
+  closedir(dir);
+}
+
+size_t imagedDedupCollect(Imaged *db) {
+  int lock = imagedDedupLock(db);
+  DIR *dir = opendir(db->root);
+  if (dir == NULL) {
+    imagedDedupUnlock(lock);
+    return 0;
+  }
+
+  size_t n = strlen(IMAGED_OBJECT), removed = 0;
+  struct dirent *ent;
+  struct stat st;
+  while ((ent = readdir(dir))) {
+    if (strncmp(ent->d_name, IMAGED_OBJECT, n) == 0 &&
+        fstatat(dirfd(dir), ent->d_name, &st, 0) == 0 && st.st_nlink == 1 &&
+        unlinkat(dirfd(dir), ent->d_name, 0) == 0) {
+      removed += 1;
+    }
+  }
+  closedir(dir);
+  imagedDedupUnlock(lock);
+  return removed;
+}
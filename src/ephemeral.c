@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+#include "imaged.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Ephemeral keys are POSIX shared memory objects, so they live in memory and
+// are never written back to disk. The object name is derived from the device
+// and inode of the database directory rather than its path, so every process
+// finds the same object however it spelled the path passed to imagedOpen
+
+#define EPHEMERAL_PREFIX "imaged."
+
+static bool ephemeralPrefix(const Imaged *db, char *buf, size_t size) {
+  struct stat st;
+  if (stat(db->root, &st) != 0) {
+    return false;
+  }
+
+  int n = snprintf(buf, size, EPHEMERAL_PREFIX "%llx.%llx.",
+                   (unsigned long long)st.st_dev,
+                   (unsigned long long)st.st_ino);
+  return n > 0 && (size_t)n < size;
+}
+
+static bool ephemeralName(const Imaged *db, const char *key, ssize_t keylen,
+                          char *buf, size_t size) {
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  char prefix[64];
+  if (!ephemeralPrefix(db, prefix, sizeof(prefix))) {
+    return false;
+  }
+
+  int n = snprintf(buf, size, "/%s%.*s", prefix, (int)keylen, key);
+  return n > 0 && (size_t)n < size;
+}
+
+int imagedEphemeralOpen(const Imaged *db, const char *key, ssize_t keylen,
+                        int flags) {
+  char name[NAME_MAX + 1];
+  if (!ephemeralName(db, key, keylen, name, sizeof(name))) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  return shm_open(name, flags, 0644);
+}
+
+bool imagedEphemeralExists(const Imaged *db, const char *key,
+                           ssize_t keylen) {
+  int fd = imagedEphemeralOpen(db, key, keylen, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  close(fd);
+  return true;
+}
+
+ImagedStatus imagedEphemeralUnlink(const Imaged *db, const char *key,
+                                   ssize_t keylen) {
+  char name[NAME_MAX + 1];
+  if (!ephemeralName(db, key, keylen, name, sizeof(name))) {
+    return IMAGED_ERR_INVALID_KEY;
+  }
+
+  return shm_unlink(name) == 0 ? IMAGED_OK : IMAGED_ERR_FILE_DOES_NOT_EXIST;
+}
+
+void imagedEphemeralRemoveAll(const Imaged *db) {
+#ifdef __linux__
+  // Shared memory objects are files in /dev/shm on Linux, other platforms
+  // have no way to list them
+  char prefix[64];
+  if (!ephemeralPrefix(db, prefix, sizeof(prefix))) {
+    return;
+  }
+
+  DIR *dir = opendir("/dev/shm");
+  if (dir == NULL) {
+    return;
+  }
+
+  size_t n = strlen(prefix);
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    if (strncmp(ent->d_name, prefix, n) == 0) {
+      char name[NAME_MAX + 2];
+      snprintf(name, sizeof(name), "/%s", ent->d_name);
+      shm_unlink(name);
+    }
+  }
+  closedir(dir);
+#else
+  (void)db;
+#endif
+}
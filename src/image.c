@@ -136,188 +136,224 @@ void *imageAt(Image *image, size_t x, size_t y) {
 }
 
 #define norm(x, min, max) (((float)x - (float)min) / ((float)max - (float)min))
+#define denorm(x, min, max)                                                    \
+  ((((float)max - (float)min) * ((float)x / 1.0)) + (float)min)
 
-#define GET(t, min, max)                                                       \
-  for (i = 0; i < channels; i++) {                                             \
-    pixel->data[i] = norm(((t *)px)[i], min, max);                             \
-  }
+// Span kernels convert runs of pixels between an image's native storage type
+// and Pixel values. Each kernel is specialized for a storage type and channel
+// count and is selected once per span, the inner loops have no branches so
+// they can be vectorized by the compiler
 
-Pixel imageGetNewPixel(Image *image, size_t x, size_t y) {
-  Pixel px = pixelEmpty();
-  imageGetPixel(image, x, y, &px);
-  return px;
+typedef void (*imageSpanGetFn)(const void *, size_t, Pixel *);
+typedef void (*imageSpanSetFn)(const Pixel *, size_t, void *);
+
+static inline float halfToFloat(uint16_t h) {
+  return ((uint32_t)(h & 0x8000) << 16) |
+         ((uint32_t)((h & 0x7c00) + 0x1C000) << 13) |
+         ((uint32_t)(h & 0x03FF) << 13);
 }
 
-bool imageGetPixel(Image *image, size_t x, size_t y, Pixel *pixel) {
-  size_t channels = imageColorNumChannels(image->meta.color);
-  if (channels > 4) {
-    channels = 4;
+static inline uint16_t floatToHalf(float f) {
+  uint32_t x = (uint32_t)f;
+  return ((x >> 16) & 0x8000) |
+         ((((x & 0x7f800000) - 0x38000000) >> 13) & 0x7c00) |
+         ((x >> 13) & 0x03ff);
+}
+
+#define SPAN_FN(name, t, GET, SET)                                             \
+  __attribute__((always_inline)) static inline void spanGet_##name(           \
+      const void *_src, size_t n, size_t channels, size_t stride, Pixel *px) { \
+    const t *src = _src;                                                       \
+    float *dst = (float *)px;                                                  \
+    for (size_t i = 0; i < n; i++) {                                           \
+      for (size_t c = 0; c < channels; c++) {                                  \
+        dst[i * 4 + c] = GET(src[i * stride + c]);                             \
+      }                                                                        \
+      if (channels == 1) {                                                     \
+        dst[i * 4 + 1] = dst[i * 4 + 2] = dst[i * 4];                          \
+      } else if (channels == 2) {                                              \
+        dst[i * 4 + 2] = 0.0f;                                                 \
+      }                                                                        \
+      if (channels < 4) {                                                      \
+        dst[i * 4 + 3] = 1.0f;                                                 \
+      }                                                                        \
+    }                                                                          \
+  }                                                                            \
+  __attribute__((always_inline)) static inline void spanSet_##name(           \
+      const Pixel *px, size_t n, size_t channels, size_t stride, void *_dst) { \
+    const float *src = (const float *)px;                                      \
+    t *dst = _dst;                                                             \
+    for (size_t i = 0; i < n; i++) {                                           \
+      for (size_t c = 0; c < channels; c++) {                                  \
+        dst[i * stride + c] = SET(src[i * 4 + c]);                             \
+      }                                                                        \
+    }                                                                          \
+  }                                                                            \
+  static void spanGet_##name##_1(const void *s, size_t n, Pixel *p) {          \
+    spanGet_##name(s, n, 1, 1, p);                                             \
+  }                                                                            \
+  static void spanGet_##name##_2(const void *s, size_t n, Pixel *p) {          \
+    spanGet_##name(s, n, 2, 2, p);                                             \
+  }                                                                            \
+  static void spanGet_##name##_3(const void *s, size_t n, Pixel *p) {          \
+    spanGet_##name(s, n, 3, 3, p);                                             \
+  }                                                                            \
+  static void spanGet_##name##_4(const void *s, size_t n, Pixel *p) {          \
+    spanGet_##name(s, n, 4, 4, p);                                             \
+  }                                                                            \
+  static void spanGet_##name##_5(const void *s, size_t n, Pixel *p) {          \
+    spanGet_##name(s, n, 4, 5, p);                                             \
+  }                                                                            \
+  static void spanSet_##name##_1(const Pixel *p, size_t n, void *d) {          \
+    spanSet_##name(p, n, 1, 1, d);                                             \
+  }                                                                            \
+  static void spanSet_##name##_2(const Pixel *p, size_t n, void *d) {          \
+    spanSet_##name(p, n, 2, 2, d);                                             \
+  }                                                                            \
+  static void spanSet_##name##_3(const Pixel *p, size_t n, void *d) {          \
+    spanSet_##name(p, n, 3, 3, d);                                             \
+  }                                                                            \
+  static void spanSet_##name##_4(const Pixel *p, size_t n, void *d) {          \
+    spanSet_##name(p, n, 4, 4, d);                                             \
+  }                                                                            \
+  static void spanSet_##name##_5(const Pixel *p, size_t n, void *d) {          \
+    spanSet_##name(p, n, 4, 5, d);                                             \
+  }
+
+#define SPAN_INT(name, t, min, max)                                            \
+  static inline float get_##name(t x) { return norm(x, min, max); }           \
+  static inline t set_##name(float x) { return (t)denorm(x, min, max); }      \
+  SPAN_FN(name, t, get_##name, set_##name)
+
+SPAN_INT(i8, int8_t, INT8_MIN, INT8_MAX)
+SPAN_INT(i16, int16_t, INT16_MIN, INT16_MAX)
+SPAN_INT(i32, int32_t, INT32_MIN, INT32_MAX)
+SPAN_INT(i64, int64_t, INT64_MIN, INT64_MAX)
+SPAN_INT(u8, uint8_t, 0, UINT8_MAX)
+SPAN_INT(u16, uint16_t, 0, UINT16_MAX)
+SPAN_INT(u32, uint32_t, 0, UINT32_MAX)
+SPAN_INT(u64, uint64_t, 0, UINT64_MAX)
+
+static inline float get_f32(float x) { return x; }
+static inline float set_f32(float x) { return x; }
+static inline float get_f64(double x) { return (float)x; }
+static inline double set_f64(float x) { return (double)x; }
+
+SPAN_FN(f16, uint16_t, halfToFloat, floatToHalf)
+SPAN_FN(f32, float, get_f32, set_f32)
+SPAN_FN(f64, double, get_f64, set_f64)
+
+#define SPAN_TABLE(name)                                                       \
+  {{spanGet_##name##_1, spanGet_##name##_2, spanGet_##name##_3,               \
+    spanGet_##name##_4, spanGet_##name##_5},                                   \
+   {spanSet_##name##_1, spanSet_##name##_2, spanSet_##name##_3,               \
+    spanSet_##name##_4, spanSet_##name##_5}}
+
+static const struct {
+  imageSpanGetFn get[5];
+  imageSpanSetFn set[5];
+} spanKernels[] = {
+    SPAN_TABLE(i8),  SPAN_TABLE(i16), SPAN_TABLE(i32), SPAN_TABLE(i64),
+    SPAN_TABLE(u8),  SPAN_TABLE(u16), SPAN_TABLE(u32), SPAN_TABLE(u64),
+    SPAN_TABLE(f16), SPAN_TABLE(f32), SPAN_TABLE(f64),
+};
+
+static int spanKernelIndex(const ImageMeta *meta) {
+  int bits;
+  switch (meta->bits) {
+  case 8:
+    bits = 0;
+    break;
+  case 16:
+    bits = 1;
+    break;
+  case 32:
+    bits = 2;
+    break;
+  case 64:
+    bits = 3;
+    break;
+  default:
+    return -1;
   }
 
-  pixel->data[3] = 1.0;
-  void *px = imageAt(image, x, y);
-  if (!px) {
-    return false;
+  size_t channels = imageColorNumChannels(meta->color);
+  if (channels == 0 || channels > 5) {
+    return -1;
   }
 
-  size_t i = 0;
-  switch (image->meta.kind) {
+  int index;
+  switch (meta->kind) {
   case IMAGE_KIND_INT:
-    switch (image->meta.bits) {
-    case 8:
-      GET(int8_t, INT8_MIN, INT8_MAX);
-      break;
-    case 16:
-      GET(int16_t, INT16_MIN, INT16_MAX);
-      break;
-    case 32:
-      GET(int32_t, INT32_MIN, INT32_MAX);
-      break;
-    case 64:
-      GET(int64_t, INT64_MIN, INT64_MAX);
-      break;
-    default:
-      return false;
-    }
+    index = bits;
     break;
   case IMAGE_KIND_UINT:
-    switch (image->meta.bits) {
-    case 8:
-      GET(uint8_t, 0, UINT8_MAX);
-      break;
-    case 16:
-      GET(uint16_t, 0, UINT16_MAX);
-      break;
-    case 32:
-      GET(uint32_t, 0, UINT32_MAX);
-      break;
-    case 64:
-      GET(uint64_t, 0, UINT64_MAX);
-      break;
-    default:
-      return false;
-    }
+    index = 4 + bits;
     break;
   case IMAGE_KIND_FLOAT:
-    switch (image->meta.bits) {
-    case 16:
-      for (i = 0; i < channels; i++) {
-        uint16_t h = ((uint16_t *)px)[i];
-        pixel->data[i] = ((h & 0x8000) << 16) |
-                         (((h & 0x7c00) + 0x1C000) << 13) |
-                         ((h & 0x03FF) << 13);
-      }
-      break;
-    case 32:
-      for (i = 0; i < channels; i++) {
-        pixel->data[i] = ((float *)px)[i];
-      }
-      break;
-    case 64:
-      for (i = 0; i < channels; i++) {
-        pixel->data[i] = (float)(((double *)px)[i]);
-      }
-      break;
-    default:
-      return false;
+    if (bits == 0) {
+      return -1;
     }
+    index = 7 + bits;
     break;
+  default:
+    return -1;
   }
 
-  if (channels == 1) {
-    pixel->data[1] = pixel->data[2] = pixel->data[0];
+  return index * 5 + (int)channels - 1;
+}
+
+bool imageGetPixels(Image *image, size_t x, size_t y, size_t n,
+                    Pixel *pixels) {
+  if (x >= image->meta.width || y >= image->meta.height ||
+      n > image->meta.width - x) {
+    return false;
   }
 
+  int k = spanKernelIndex(&image->meta);
+  if (k < 0) {
+    return false;
+  }
+
+  spanKernels[k / 5].get[k % 5]((uint8_t *)image->data +
+                                    imageIndex(image, x, y),
+                                n, pixels);
   return true;
 }
 
-#define denorm(x, min, max)                                                    \
-  ((((float)max - (float)min) * ((float)x / 1.0)) + (float)min)
-
-#define SET(t, min, max)                                                       \
-  for (i = 0; i < channels; i++) {                                             \
-    ((t *)px)[i] = (t)denorm(pixel->data[i], min, max);                        \
+bool imageSetPixels(Image *image, size_t x, size_t y, size_t n,
+                    const Pixel *pixels) {
+  if (x >= image->meta.width || y >= image->meta.height ||
+      n > image->meta.width - x) {
+    return false;
   }
 
-bool imageSetPixel(Image *image, size_t x, size_t y, const Pixel *pixel) {
-  void *px = imageAt(image, x, y);
-  if (px == NULL) {
+  int k = spanKernelIndex(&image->meta);
+  if (k < 0) {
     return false;
   }
 
-  size_t channels = imageColorNumChannels(image->meta.color);
-  if (channels > 4) {
-    channels = 4;
-  }
+  spanKernels[k / 5].set[k % 5](
+      pixels, n, (uint8_t *)image->data + imageIndex(image, x, y));
+  return true;
+}
 
-  size_t i = 0;
+bool imageMetaHasPixels(const ImageMeta *meta) {
+  return spanKernelIndex(meta) >= 0;
+}
 
-  switch (image->meta.kind) {
-  case IMAGE_KIND_INT:
-    switch (image->meta.bits) {
-    case 8:
-      SET(int8_t, INT8_MIN, INT8_MAX);
-      break;
-    case 16:
-      SET(int16_t, INT16_MIN, INT16_MAX);
-      break;
-    case 32:
-      SET(int32_t, INT32_MIN, INT32_MAX);
-      break;
-    case 64:
-      SET(int64_t, INT64_MIN, INT64_MAX);
-      break;
-    default:
-      return false;
-    }
-    break;
-  case IMAGE_KIND_UINT:
-    switch (image->meta.bits) {
-    case 8:
-      SET(uint8_t, 0, UINT8_MAX);
-      break;
-    case 16:
-      SET(uint16_t, 0, UINT16_MAX);
-      break;
-    case 32:
-      SET(uint32_t, 0, UINT32_MAX);
-      break;
-    case 64:
-      SET(uint64_t, 0, UINT64_MAX);
-      break;
+Pixel imageGetNewPixel(Image *image, size_t x, size_t y) {
+  Pixel px = pixelEmpty();
+  imageGetPixel(image, x, y, &px);
+  return px;
+}
 
-    default:
-      return false;
-    }
-    break;
-  case IMAGE_KIND_FLOAT:
-    switch (image->meta.bits) {
-    case 16:
-      for (i = 0; i < channels; i++) {
-        uint32_t x = (uint32_t)pixel->data[i];
-        uint16_t h = ((x >> 16) & 0x8000) |
-                     ((((x & 0x7f800000) - 0x38000000) >> 13) & 0x7c00) |
-                     ((x >> 13) & 0x03ff);
-        ((uint16_t *)px)[i] = h;
-      }
-      break;
-    case 32:
-      for (i = 0; i < channels; i++) {
-        ((float *)px)[i] = (float)pixel->data[i];
-      }
-      break;
-    case 64:
-      for (i = 0; i < channels; i++) {
-        ((double *)px)[i] = (double)pixel->data[i];
-      }
-      break;
-    default:
-      return false;
-    }
-    break;
-  }
+bool imageGetPixel(Image *image, size_t x, size_t y, Pixel *pixel) {
+  return imageGetPixels(image, x, y, 1, pixel);
+}
 
-  return true;
+bool imageSetPixel(Image *image, size_t x, size_t y, const Pixel *pixel) {
+  return imageSetPixels(image, x, y, 1, pixel);
 }
 
 const Babl *format(ImageColor color, ImageKind kind, uint8_t bits) {
@@ -390,44 +426,104 @@ bool imageConvertInPlace(Image **src, ImageColor color, ImageKind kind,
   return imageConsume(imageConvert(*src, color, kind, bits), src) != NULL;
 }
 
+// Returns the converted contents of row y, rows are cached in slot y % n so
+// any n consecutive rows can be used at the same time
+static Pixel *imageCachedRow(Image *image, int64_t y, Pixel *rows,
+                             int64_t *tags, size_t n) {
+  if (y < 0 || (uint64_t)y >= image->meta.height) {
+    return NULL;
+  }
+
+  size_t slot = (size_t)y % n;
+  Pixel *row = rows + slot * image->meta.width;
+  if (tags[slot] != y) {
+    if (!imageGetPixels(image, 0, y, image->meta.width, row)) {
+      return NULL;
+    }
+    tags[slot] = y;
+  }
+
+  return row;
+}
+
 void imageAdjustGamma(Image *src, float gamma) {
-  Pixel px = pixelEmpty();
-#define X(i) px.data[i] = pow(px.data[i], 1.0 / gamma)
-  IMAGE_ITER_ALL(src, x, y) {
-    imageGetPixel(src, x, y, &px);
-    X(0);
-    X(1);
-    X(2);
-    X(3);
-    pixelClamp(&px);
-    imageSetPixel(src, x, y, &px);
+  size_t width = src->meta.width;
+  if (width == 0) {
+    return;
+  }
+
+  Pixel *row = malloc(sizeof(Pixel) * width);
+  if (row == NULL) {
+    return;
+  }
+
+#define X(i) px->data[i] = pow(px->data[i], 1.0 / gamma)
+  for (uint64_t y = 0; y < src->meta.height; y++) {
+    if (!imageGetPixels(src, 0, y, width, row)) {
+      break;
+    }
+
+    for (size_t x = 0; x < width; x++) {
+      Pixel *px = &row[x];
+      X(0);
+      X(1);
+      X(2);
+      X(3);
+      pixelClamp(px);
+    }
+
+    imageSetPixels(src, 0, y, width, row);
   }
 #undef X
+
+  free(row);
 }
 
 void imageRotate(Image *im, Image *dst, float deg) {
   float midX, midY;
   float dx, dy;
-  int32_t rotX, rotY;
+  int64_t rotX, rotY;
 
   midX = im->meta.width / 2.0f;
   midY = im->meta.height / 2.0f;
 
   float angle = 2 * M_PI * deg / 360.0f;
 
-  Pixel px;
-  IMAGE_ITER_ALL(dst, i, j) {
-    dx = i + 0.5 - midX;
-    dy = j + 0.5 - midY;
-
-    rotX = (uint64_t)(midX + dx * cos(angle) - dy * sin(angle));
-    rotY = (uint64_t)(midY + dx * sin(angle) + dy * cos(angle));
-    if (rotX >= 0 && rotY >= 0) {
-      if (imageGetPixel(im, rotX, rotY, &px)) {
-        imageSetPixel(dst, i, j, &px);
+  size_t width = dst->meta.width;
+  if (width == 0) {
+    return;
+  }
+
+  Pixel *row = malloc(sizeof(Pixel) * width);
+  if (row == NULL) {
+    return;
+  }
+
+  for (uint64_t j = 0; j < dst->meta.height; j++) {
+    // Rotated coordinates change monotonically along a row, so the pixels
+    // that land inside the source image form a single span
+    size_t start = width, end = 0;
+    for (size_t i = 0; i < width; i++) {
+      dx = i + 0.5 - midX;
+      dy = j + 0.5 - midY;
+
+      rotX = (int64_t)floor(midX + dx * cos(angle) - dy * sin(angle));
+      rotY = (int64_t)floor(midY + dx * sin(angle) + dy * cos(angle));
+      if (rotX >= 0 && rotY >= 0 &&
+          imageGetPixel(im, rotX, rotY, &row[i])) {
+        if (i < start) {
+          start = i;
+        }
+        end = i + 1;
       }
     }
+
+    if (start < end) {
+      imageSetPixels(dst, start, j, end - start, row + start);
+    }
   }
+
+  free(row);
 }
 
 void imageFilter(Image *im, Image *dst, float *K, int Ks, float divisor,
@@ -435,7 +531,7 @@ void imageFilter(Image *im, Image *dst, float *K, int Ks, float divisor,
   Ks = Ks / 2;
 
   int kx, ky;
-  Pixel p, px;
+  Pixel px;
   px.data[3] = 1.0;
 
   // Divisor can never be zero
@@ -443,24 +539,63 @@ void imageFilter(Image *im, Image *dst, float *K, int Ks, float divisor,
     divisor = 1.0;
   }
 
-  IMAGE_ITER_ALL(im, ix, iy) {
-    px.data[0] = px.data[1] = px.data[2] = 0.0;
-    for (kx = -Ks; kx <= Ks; kx++) {
-      for (ky = -Ks; ky <= Ks; ky++) {
-        if (imageGetPixel(im, ix + kx, iy + ky, &p)) {
+  int64_t width = im->meta.width;
+  uint64_t height = im->meta.height < dst->meta.height ? im->meta.height
+                                                       : dst->meta.height;
+  size_t outWidth = width < (int64_t)dst->meta.width ? (size_t)width
+                                                     : dst->meta.width;
+  if (outWidth == 0) {
+    return;
+  }
+
+  size_t nrows = 2 * (size_t)Ks + 1;
+  Pixel *rows = malloc(sizeof(Pixel) * (size_t)width * nrows);
+  int64_t *tags = malloc(sizeof(int64_t) * nrows);
+  Pixel *out = malloc(sizeof(Pixel) * outWidth);
+  if (rows == NULL || tags == NULL || out == NULL) {
+    goto done;
+  }
+
+  for (size_t i = 0; i < nrows; i++) {
+    tags[i] = -1;
+  }
+
+  for (uint64_t iy = 0; iy < height; iy++) {
+    for (size_t ix = 0; ix < outWidth; ix++) {
+      px.data[0] = px.data[1] = px.data[2] = 0.0;
+      for (kx = -Ks; kx <= Ks; kx++) {
+        int64_t sx = (int64_t)ix + kx;
+        if (sx < 0 || sx >= width) {
+          continue;
+        }
+
+        for (ky = -Ks; ky <= Ks; ky++) {
+          Pixel *row =
+              imageCachedRow(im, (int64_t)iy + ky, rows, tags, nrows);
+          if (row == NULL) {
+            continue;
+          }
+
+          Pixel *p = &row[sx];
 #define X(l)                                                                   \
   px.data[l] +=                                                                \
-      (K[(kx + Ks) + (ky + Ks) * (2 * Ks + 1)] / divisor) * p.data[l] + offset
+      (K[(kx + Ks) + (ky + Ks) * (2 * Ks + 1)] / divisor) * p->data[l] + offset
           X(0);
           X(1);
           X(2);
 #undef X
         }
       }
+      pixelClamp(&px);
+      out[ix] = px;
     }
-    pixelClamp(&px);
-    imageSetPixel(dst, ix, iy, &px);
+    imageSetPixels(dst, 0, iy, outWidth, out);
   }
+
+done:
+  free(rows);
+  free(tags);
+  free(out);
 }
 
 Image *imageConsume(Image *x, Image **dest) {
@@ -489,40 +624,66 @@ void imageResizeTo(Image *src, Image *dest) {
   double xr = sourceWidth / targetWidth;
   double yr = sourceHeight / targetHeight;
 
-  Pixel px = pixelEmpty(), tmp = pixelEmpty();
-  IMAGE_ITER_ALL(dest, x, y) {
-    size_t xx = floor((double)x * xr);
-    size_t yy = floor((double)y * yr);
-    size_t count = 0;
+  size_t width = dest->meta.width;
+  if (width == 0 || src->meta.width == 0) {
+    return;
+  }
 
-#define X(yy)                                                                  \
-  if (imageGetPixel(src, xx - 1, yy, &tmp)) {                                  \
-    pixelAdd(&tmp, &px);                                                       \
-    count += 1;                                                                \
-  }                                                                            \
-  if (imageGetPixel(src, xx, yy, &tmp)) {                                      \
-    pixelAdd(&tmp, &px);                                                       \
-    count += 1;                                                                \
-  }                                                                            \
-  if (imageGetPixel(src, xx + 1, yy, &tmp)) {                                  \
-    pixelAdd(&tmp, &px);                                                       \
-    count += 1;                                                                \
+  Pixel *rows = malloc(sizeof(Pixel) * src->meta.width * 3);
+  Pixel *out = malloc(sizeof(Pixel) * width);
+  int64_t tags[3] = {-1, -1, -1};
+  if (rows == NULL || out == NULL) {
+    free(rows);
+    free(out);
+    return;
   }
-    X(yy - 1);
-    X(yy);
-    X(yy + 1);
+
+  Pixel px;
+  for (uint64_t y = 0; y < dest->meta.height; y++) {
+    int64_t yy = floor((double)y * yr);
+    Pixel *above = imageCachedRow(src, yy - 1, rows, tags, 3);
+    Pixel *row = imageCachedRow(src, yy, rows, tags, 3);
+    Pixel *below = imageCachedRow(src, yy + 1, rows, tags, 3);
+
+    // Only the pixels that have at least one source pixel are written
+    size_t start = width, end = 0;
+    for (size_t x = 0; x < width; x++) {
+      int64_t xx = floor((double)x * xr);
+      size_t count = 0;
+      px = pixelEmpty();
+
+#define X(r)                                                                   \
+  if (r != NULL) {                                                             \
+    for (int64_t i = xx - 1; i <= xx + 1; i++) {                               \
+      if (i >= 0 && (uint64_t)i < src->meta.width) {                           \
+        pixelAdd(&px, &r[i]);                                                  \
+        count += 1;                                                            \
+      }                                                                        \
+    }                                                                          \
+  }
+      X(above);
+      X(row);
+      X(below);
 #undef X
 
-    if (count > 0) {
-      px.data[0] /= (float)count;
-      px.data[1] /= (float)count;
-      px.data[2] /= (float)count;
-      px.data[3] /= (float)count;
+      if (count > 0) {
+        pixelDivF(&px, (float)count);
+        pixelClamp(&px);
+        out[x] = px;
+        if (x < start) {
+          start = x;
+        }
+        end = x + 1;
+      }
+    }
 
-      pixelClamp(&px);
-      imageSetPixel(dest, x, y, &px);
+    if (start < end) {
+      imageSetPixels(dest, start, y, end - start, out + start);
     }
   }
+
+  free(rows);
+  free(out);
 }
 
 Image *imageResize(Image *src, size_t x, size_t y) {
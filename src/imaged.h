@@ -26,6 +26,12 @@ extern "C" {
 /** Utility for creating new strings */
 char *imagedStringPrintf(const char *fmt, ...);
 
+/** FNV-1a hash of a key, used by the in-memory and shared hash tables */
+uint64_t imagedHashKey(const char *key, size_t keylen);
+
+/** Monotonic clock in nanoseconds, used for timeouts and timing */
+uint64_t imagedNanotime(void);
+
 /** Status types: IMAGED_OK implies the function executed successfully, while
  * any other response signifies failure */
 typedef enum {
@@ -49,9 +55,47 @@ void imagedPrintError(ImagedStatus status, const char *message);
 
 struct ImagedHandle;
 
+/** Files in the database root starting with this prefix are used internally
+ * (the catalog and temporary files), keys may not start with it */
+#define IMAGED_RESERVED ".imaged-"
+
+/** Name of the catalog file stored in the database root */
+#define IMAGED_CATALOG IMAGED_RESERVED "catalog"
+
+/** Name of the shared-memory lock table stored in the database root, see
+ * imagedEnableSharedLocks */
+#define IMAGED_LOCK_TABLE IMAGED_RESERVED "locks"
+
+/** Number of slots in a new lock table. Each key locked at the same time uses
+ * its own slot, a key waits when every slot near its hash is locked */
+#define IMAGED_LOCK_SLOTS 65536
+
+/** Name of the recency table stored in the database root, see
+ * imagedSetCapacity */
+#define IMAGED_RECENCY IMAGED_RESERVED "recency"
+
+/** Number of slots in a new recency table. Keys are mapped to slots by hash,
+ * keys that share a slot also share their access time */
+#define IMAGED_RECENCY_SLOTS (1 << 20)
+
+/** Lock contention counters, only lock acquisitions that had to wait are
+ * counted */
+typedef struct {
+  uint64_t waits;       // number of times a lock was waited for
+  uint64_t timeouts;    // waits that ended without the lock
+  uint64_t wait_ns;     // total time spent waiting
+  uint64_t max_wait_ns; // longest single wait
+} ImagedLockStats;
+
 /** Image database */
 typedef struct {
   char *root;
+  struct ImagedCatalog *catalog;
+  struct ImagedHandleCache *handles;
+  struct ImagedLockTable *lock_table; // NULL when images are locked with flock
+  int64_t lock_table_mtime; // root mtime when the lock table was found missing
+  ImagedLockStats locks;
+  struct ImagedRecency *recency; // NULL when no capacity limit was ever set
 } Imaged;
 
 /** Image kinds, specifies the image data base type */
@@ -211,6 +255,20 @@ Pixel imageGetNewPixel(Image *image, size_t x, size_t y);
 /** Set pixel at position (x, y) */
 bool imageSetPixel(Image *image, size_t x, size_t y, const Pixel *pixel);
 
+/** Get n consecutive pixels starting at position (x, y), the span must not
+ * extend past the end of the row. The conversion routine is selected once per
+ * call based on the image type and channel count */
+bool imageGetPixels(Image *image, size_t x, size_t y, size_t n,
+                    Pixel *pixels);
+
+/** Set n consecutive pixels starting at position (x, y) */
+bool imageSetPixels(Image *image, size_t x, size_t y, size_t n,
+                    const Pixel *pixels);
+
+/** Returns true when imageGetPixels and imageSetPixels support the type and
+ * channel count of `meta` */
+bool imageMetaHasPixels(const ImageMeta *meta);
+
 /** Ensures pixel values are between 0 and 1 */
 void pixelClamp(Pixel *px);
 
@@ -250,6 +308,12 @@ void pixelMulF(Pixel *src, float f);
 /** Pixel/float division */
 void pixelDivF(Pixel *src, float f);
 
+/** Per-channel minimum, the result is stored in a */
+void pixelMin(Pixel *a, const Pixel *b);
+
+/** Per-channel maximum, the result is stored in a */
+void pixelMax(Pixel *a, const Pixel *b);
+
 /** Pixel equality */
 bool pixelEq(const Pixel *a, const Pixel *b);
 
@@ -303,18 +367,118 @@ Image *imageScale(Image *src, double scale_x, double scale_y);
 
 Image *imageConsume(Image *x, Image **dest);
 
-/** A handle is used to refer to an imgd image in an Imaged database */
+/** Current version of the imgd file format */
+#define IMAGED_FORMAT_VERSION 2
+
+/** Alignment of the pixel data in imgd files */
+#define IMAGED_DATA_ALIGN 4096
+
+/** Maximum number of stored mip levels, not including the full size image */
+#define IMAGED_MAX_LEVELS 16
+
+/** A reduced size copy of the image, stored uncompressed in row-major order at
+ * `offset` which is a multiple of IMAGED_DATA_ALIGN */
+typedef struct {
+  uint64_t width, height;
+  uint64_t offset;
+  uint64_t size;
+} ImagedLevel;
+
+/** imgd file header, the pixel data starts at `offset` which is a multiple of
+ * IMAGED_DATA_ALIGN. Mip levels are stored after the pixel data, each level is
+ * half the size of the previous one. Files written before the header was
+ * versioned start with "imgd" followed directly by the ImageMeta and pixel
+ * data, they are reported with version 0. Version 1 headers end before
+ * `levels` */
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t offset;
+  uint64_t size;
+  uint64_t flags;
+  ImageMeta meta;
+  uint32_t tile_width, tile_height;
+  uint64_t tiles;
+  uint64_t levels;
+  ImagedLevel level[IMAGED_MAX_LEVELS];
+} ImagedHeader;
+
+/** Header flags */
+enum {
+  /** Pixel data is split into tiles of tile_width x tile_height pixels, stored
+   * in row-major tile order. The tile index table is found at `tiles` */
+  IMAGED_FLAG_TILED = 1,
+  /** Each tile is compressed using imagedTileEncode, tiles are decompressed
+   * when they are first accessed through a handle */
+  IMAGED_FLAG_COMPRESSED = 2,
+};
+
+/** Default number of bytes used by a handle to cache decompressed tiles */
+#define IMAGED_TILE_CACHE_SIZE (64 * 1024 * 1024)
+
+/** Number of rows in each chunk when compressing an image without tiles */
+#define IMAGED_COMPRESS_ROWS 64
+
+/** Tile index entry, offset is relative to the start of the file */
+typedef struct {
+  uint64_t offset;
+  uint64_t size;
+} ImagedTile;
+
+/** A key lock taken by imagedLockKey, `table` is NULL when the key is locked
+ * with flock on the open file */
+typedef struct {
+  struct ImagedLockTable *table;
+  struct ImagedLockSlot *slot;
+  uint64_t hash; // hash of the key, used to find its slot again
+  uint32_t gen;  // generation of the slot, changed by imagedResetLocks
+} ImagedKeyLock;
+
+/** A handle is used to refer to an imgd image in an Imaged database. For tiled
+ * images `image.data` is NULL, pixels can be accessed using
+ * imagedHandleReadRegion, imagedHandleWriteRegion and imagedHandleTile */
 typedef struct ImagedHandle {
   int fd;
   Image image;
+  void *map;
+  size_t mapsize;
+  uint64_t flags;
+  uint32_t tile_width, tile_height;
+  const ImagedTile *tiles;
+  struct ImagedTileCache *cache;
+  struct ImagedHandleCacheEntry *shared; // mapping owned by the handle cache
+  ImagedKeyLock lock; // lock held on the key
+  bool exclusive;     // the handle holds an exclusive lock
 } ImagedHandle;
 
+/** Options used when storing a new image */
+typedef struct {
+  uint32_t tile_width, tile_height; // 0 stores the image in row-major order
+  bool compress; // compress each tile, or blocks of IMAGED_COMPRESS_ROWS rows
+  uint32_t levels; // number of mip levels to generate, up to IMAGED_MAX_LEVELS
+  bool atomic; // write a new file and rename it into place, see below
+  bool ephemeral; // keep the image in shared memory instead of on disk
+  bool dedup; // share the file with keys storing the same image, see below
+} ImagedSetOptions;
+
+/** Compress a tile of width x height pixels, returns the compressed size or 0
+ * if the result does not fit in `cap` bytes */
+size_t imagedTileEncode(const ImageMeta *meta, const void *tile, size_t width,
+                        size_t height, void *dst, size_t cap);
+
+/** Decompress a tile created using imagedTileEncode */
+bool imagedTileDecode(const ImageMeta *meta, const void *src, size_t n,
+                      void *tile, size_t width, size_t height);
+
 /** Remove all image locks */
 void imagedResetLocks(Imaged *db);
 
 /** Returns true when an image is locked */
 bool imagedKeyIsLocked(const Imaged *db, const char *key, ssize_t keylen);
 
+/** Read the header of an imgd file from an open file descriptor */
+ImagedStatus imagedReadHeader(int fd, ImagedHeader *header);
+
 /** Returns true when the specified file is an valid imgd file */
 bool imagedIsValidFile(const Imaged *db, const char *key, ssize_t keylen);
 
@@ -330,15 +494,272 @@ ImagedStatus imagedDestroy(Imaged *db);
 /** Returns true when there is a value associated with the given key */
 bool imagedHasKey(const Imaged *db, const char *key, ssize_t keylen);
 
+/** Signal used to interrupt lock waits when they time out (Linux only). The
+ * first wait with a timeout installs an empty handler for it, without
+ * SA_RESTART, which stays installed for the life of the process. Nothing is
+ * installed when the application already handles the signal, and defining
+ * IMAGED_LOCK_SIGNAL as 0 when building imaged disables the signal entirely.
+ * Waits then poll the lock with an increasing delay instead */
+#ifndef IMAGED_LOCK_SIGNAL
+#define IMAGED_LOCK_SIGNAL (SIGRTMIN + 7)
+#endif
+
+/** Lock an open file, waiting up to `timeout_ms` milliseconds for other
+ * handles to release it. 0 fails immediately and a negative timeout waits
+ * forever. The wait blocks in the kernel, it does not poll */
+ImagedStatus imagedLockFile(Imaged *db, int fd, bool exclusive,
+                            int64_t timeout_ms);
+
+/** Get the lock contention counters */
+void imagedGetLockStats(const Imaged *db, ImagedLockStats *stats);
+
+/** Sleep until `*addr` is woken by imagedFutexWake or `timeout_ns` has passed,
+ * returns immediately when `*addr != val`. Works across processes when `addr`
+ * is in a shared mapping. Without futexes this sleeps for up to 1ms */
+void imagedFutexWait(uint32_t *addr, uint32_t val, uint64_t timeout_ns);
+
+/** Wake every thread waiting on `addr` */
+void imagedFutexWake(uint32_t *addr);
+
+/** Lock images using a table of reader/writer locks in shared memory instead
+ * of flock. The table is created in the database root and every imagedOpen
+ * that follows uses it, in any process: uncontended locks are taken and
+ * released without a system call and waiters sleep on a futex until the lock
+ * is released. Databases opened earlier, in any process, switch to the table
+ * the next time they lock a key, but handles they already hold keep their
+ * flock until closed, so this should be called before the database is shared.
+ * Locks held by writers that have exited are broken automatically, reader
+ * locks left by a crashed process are cleared by imagedResetLocks. Handles
+ * have to be closed before imagedClose, since they release their lock in the
+ * table */
+ImagedStatus imagedEnableSharedLocks(Imaged *db);
+
+/** Returns true when the database uses the shared-memory lock table */
+bool imagedHasSharedLocks(const Imaged *db);
+
+/** Map the lock table at `path`, creating it when `create` is set. Returns
+ * NULL when it does not exist or is invalid */
+struct ImagedLockTable *imagedLockTableOpen(const char *path, bool create);
+
+/** Modification time of the database directory in nanoseconds, or -1 when it
+ * is too recent to tell whether a lock table was created since. Creating the
+ * lock table changes it, so the table is only looked for again once it does */
+int64_t imagedLockTableStamp(const Imaged *db);
+
+/** Unmap a lock table */
+void imagedLockTableClose(struct ImagedLockTable *table);
+
+/** Release every lock in the table. Locks taken before the reset are not
+ * released again when their handles are closed */
+void imagedLockTableReset(struct ImagedLockTable *table);
+
+/** Returns true when the lock used by a key is held */
+bool imagedLockTableIsLocked(struct ImagedLockTable *table, const char *key,
+                             ssize_t keylen);
+
+/** Lock a key, using the lock table when it is enabled and the open file
+ * `fd` otherwise. `lock` is passed to imagedUnlockKey */
+ImagedStatus imagedLockKey(Imaged *db, const char *key, ssize_t keylen,
+                           int fd, bool exclusive, int64_t timeout_ms,
+                           ImagedKeyLock *lock);
+
+/** Take a lock released by imagedUnlockKey again, without waiting */
+ImagedStatus imagedRelockKey(int fd, ImagedKeyLock *lock, bool exclusive);
+
+/** Release a lock taken by imagedLockKey */
+void imagedUnlockKey(int fd, const ImagedKeyLock *lock, bool exclusive);
+
 /** Set a key */
 ImagedStatus imagedSet(Imaged *db, const char *key, ssize_t keylen,
                        const ImageMeta *meta, const void *imagedata,
                        ImagedHandle *handle);
 
+/** Set a key using the given options, options may be NULL. When
+ * `options->atomic` is set the image is written to a new file which replaces
+ * the key once it is complete: readers never see a partially written image,
+ * and read-only handles open on the previous version do not block the write,
+ * they keep using the previous version until they are closed. Only editable
+ * handles cause IMAGED_ERR_LOCKED */
+ImagedStatus imagedSetWithOptions(Imaged *db, const char *key, ssize_t keylen,
+                                  const ImageMeta *meta, const void *imagedata,
+                                  const ImagedSetOptions *options,
+                                  ImagedHandle *handle);
+
+/** Ephemeral keys, stored with `options->ephemeral`, are kept in a POSIX
+ * shared memory object instead of a file in the database directory, so they
+ * never cause disk I/O. Other processes open them by key with imagedGet and
+ * remove them with imagedRemove like any other key, but they are not listed
+ * by iterators or the catalog and do not survive a reboot. Setting an
+ * ephemeral key fails with IMAGED_ERR_FILE_ALREADY_EXISTS when the key is
+ * stored on disk, and storing a key on disk fails the same way while it exists
+ * as an ephemeral key. `atomic` has no effect on them */
+
+/** Open the shared memory object used for an ephemeral key, returns -1 and
+ * sets errno on failure */
+int imagedEphemeralOpen(const Imaged *db, const char *key, ssize_t keylen,
+                        int flags);
+
+/** Returns true when `key` exists as an ephemeral key */
+bool imagedEphemeralExists(const Imaged *db, const char *key, ssize_t keylen);
+
+/** Remove the shared memory object used for an ephemeral key */
+ImagedStatus imagedEphemeralUnlink(const Imaged *db, const char *key,
+                                   ssize_t keylen);
+
+/** Remove all ephemeral keys of a database, only supported on Linux */
+void imagedEphemeralRemoveAll(const Imaged *db);
+
+/** Prefix of deduplicated object files stored in the database root, followed
+ * by the hash of the image */
+#define IMAGED_OBJECT IMAGED_RESERVED "object."
+
+/** Keys stored with `options->dedup` are hashed and keys holding the same
+ * image share a single file through hard links, the link count of the object
+ * file is its reference count. Reads map the shared file without copying.
+ * Deduplicated keys are always written atomically and a key is copied before
+ * it is opened for editing or overwritten, so changing one key never affects
+ * the others. Dedup only applies when `imagedata` is given, no handle is
+ * requested and the image is stored uncompressed in row-major order without
+ * mip levels, otherwise the option is ignored */
+
+/** Deduplication counters */
+typedef struct {
+  uint64_t objects;     // number of object files
+  uint64_t references;  // number of keys linked to an object
+  uint64_t bytes;       // size of all object files
+  uint64_t saved_bytes; // space that would be used without deduplication
+} ImagedDedupStats;
+
+/** 64-bit xxHash (XXH64) of `size` bytes */
+uint64_t imagedHash(const void *data, size_t size, uint64_t seed);
+
+/** Get the path of the object file for an image, used by imagedSet */
+char *imagedDedupObjectPath(const Imaged *db, const ImageMeta *meta,
+                            const void *imagedata);
+
+/** Returns true when the object file `fd` holds exactly this image */
+bool imagedDedupMatch(int fd, const ImageMeta *meta, const void *imagedata);
+
+/** Lock the database directory while linking or collecting objects, returns
+ * the descriptor to pass to imagedDedupUnlock */
+int imagedDedupLock(const Imaged *db);
+void imagedDedupUnlock(int fd);
+
+/** Called with the file of a key that was just replaced or removed, deletes
+ * the object it was linked to when no other key uses it */
+void imagedDedupRelease(const Imaged *db, int fd);
+
+/** Give a key its own copy of a deduplicated file, used before the key is
+ * opened for editing. Does nothing when the file is not shared */
+ImagedStatus imagedDedupUnshare(Imaged *db, const char *key, ssize_t keylen);
+
+/** Get the deduplication counters by scanning the object files */
+void imagedGetDedupStats(const Imaged *db, ImagedDedupStats *stats);
+
+/** Delete object files that are no longer linked to any key. Objects are
+ * normally deleted with the last key that uses it, but one can be left behind
+ * after a crash or when several processes replace the same key at once.
+ * Returns the number of objects removed */
+size_t imagedDedupCollect(Imaged *db);
+
+/** How imagedCopyFile copied a file */
+typedef enum {
+  IMAGED_COPY_REFLINK,    // the copy shares its data with the source (FICLONE)
+  IMAGED_COPY_RANGE,      // copied by the kernel using copy_file_range
+  IMAGED_COPY_READ_WRITE, // copied using read and write
+} ImagedCopyMethod;
+
+/** Copy the contents of `src` to `dst`, which is truncated first. Uses a
+ * reflink when the filesystem supports it, then copy_file_range, then read and
+ * write. `method` may be NULL */
+ImagedStatus imagedCopyFile(int src, int dst, ImagedCopyMethod *method);
+
+/** Copy a key to `dst`, replacing it like an atomic write. On filesystems with
+ * reflinks (btrfs, XFS) the copy shares its data with the source until one of
+ * them is written, so cloning is nearly free even for large images. Returns
+ * IMAGED_ERR_LOCKED when either key is open for editing */
+ImagedStatus imagedClone(Imaged *db, const char *src, ssize_t srclen,
+                         const char *dst, ssize_t dstlen);
+
+/** Counters filled in by imagedSnapshot */
+typedef struct {
+  uint64_t keys;      // number of keys copied
+  uint64_t reflinked; // keys that share their data with the database
+  uint64_t locked;    // keys skipped because they were open for editing
+} ImagedSnapshotStats;
+
+/** Copy every key into a new database at `path`, which must not exist. Keys
+ * are copied with imagedCopyFile into a temporary directory that is renamed to
+ * `path` once it is complete. Each key is copied while holding a shared lock,
+ * keys changed during the snapshot may be copied before or after the change.
+ * Keys open for editing are left out and counted in `stats->locked`. `stats`
+ * may be NULL */
+ImagedStatus imagedSnapshot(Imaged *db, const char *path,
+                            ImagedSnapshotStats *stats);
+
+/** Same as imagedSetWithOptions, waiting up to `timeout_ms` milliseconds when
+ * the key is locked, see imagedLockFile */
+ImagedStatus imagedSetWithTimeout(Imaged *db, const char *key, ssize_t keylen,
+                                  const ImageMeta *meta, const void *imagedata,
+                                  const ImagedSetOptions *options,
+                                  int64_t timeout_ms, ImagedHandle *handle);
+
+/** Streaming writer, pixel data is written straight to a temporary file in the
+ * database directory which replaces the key when it is committed */
+typedef struct ImagedWriter ImagedWriter;
+
+/** Start writing a new image for a key, the key is not modified until
+ * imagedWriterCommit is called. Pixels that are never written are zero */
+ImagedStatus imagedWriterBegin(Imaged *db, const char *key, ssize_t keylen,
+                               const ImageMeta *meta,
+                               const ImagedSetOptions *options,
+                               ImagedWriter **writer);
+
+/** Write `nrows` rows starting at row `y`, `rows` contains full rows in the
+ * image's storage format. Rows of tiled images are buffered until a full row
+ * of tiles is available, so they must be written from top to bottom */
+ImagedStatus imagedWriterWriteRows(ImagedWriter *writer, uint64_t y,
+                                   uint64_t nrows, const void *rows);
+
+/** Write a single tile of a tiled image, `tile` contains tile_width x
+ * tile_height pixels. Tiles on the right and bottom edges are padded */
+ImagedStatus imagedWriterWriteTile(ImagedWriter *writer, uint64_t tx,
+                                   uint64_t ty, const void *tile);
+
+/** Finish the image and atomically replace the key with it, when handle is not
+ * NULL it is set to an editable handle. On success the writer is freed, on
+ * failure (for example IMAGED_ERR_LOCKED when another handle holds the key)
+ * it is left open so the commit can be retried or aborted. When the writer was
+ * created with the `atomic` option only editable handles block the commit */
+ImagedStatus imagedWriterCommit(ImagedWriter *writer, ImagedHandle *handle);
+
+/** Discard the image and free the writer */
+void imagedWriterAbort(ImagedWriter *writer);
+
 /** Get a key */
 ImagedStatus imagedGet(Imaged *db, const char *key, ssize_t keylen,
                        bool editable, ImagedHandle *handle);
 
+/** Get a key, waiting up to `timeout_ms` milliseconds when it is locked */
+ImagedStatus imagedGetWithTimeout(Imaged *db, const char *key, ssize_t keylen,
+                                  bool editable, int64_t timeout_ms,
+                                  ImagedHandle *handle);
+
+/** Get a read-only handle to mip level `level` of a key, level 0 is the full
+ * size image. Only the pages of the requested level are mapped */
+ImagedStatus imagedGetLevel(Imaged *db, const char *key, ssize_t keylen,
+                            uint32_t level, ImagedHandle *handle);
+
+/** Get the smallest mip level of a key that is at least width x height */
+ImagedStatus imagedGetLevelForSize(Imaged *db, const char *key, ssize_t keylen,
+                                   uint64_t width, uint64_t height,
+                                   ImagedHandle *handle);
+
+/** Generate and store `levels` mip levels for an existing key, replacing any
+ * existing levels */
+ImagedStatus imagedSetLevels(Imaged *db, const char *key, ssize_t keylen,
+                             uint32_t levels);
+
 /** Get filesystem information about a key */
 ImagedStatus imagedStat(Imaged *db, const char *key, ssize_t keylen,
                         struct stat *st);
@@ -346,6 +767,229 @@ ImagedStatus imagedStat(Imaged *db, const char *key, ssize_t keylen,
 /** &Remove the value associated with the provided key */
 ImagedStatus imagedRemove(Imaged *db, const char *key, ssize_t keylen);
 
+/** Remove a key, waiting up to `timeout_ms` milliseconds when it is locked */
+ImagedStatus imagedRemoveWithTimeout(Imaged *db, const char *key,
+                                     ssize_t keylen, int64_t timeout_ms);
+
+/** Prefix of ring files stored in the database root, followed by the key */
+#define IMAGED_RING IMAGED_RESERVED "ring."
+
+/** A ring holds the most recent frames of a stream of images with the same
+ * metadata in a single mapped file. One producer writes frames directly into
+ * the mapping and any number of readers in other processes access them without
+ * copying. Rings are separate from image keys and are not listed by iterators
+ */
+typedef struct ImagedRing ImagedRing;
+
+/** A frame in a ring, frames are numbered from 1 in the order they are
+ * published. `image.data` points into the ring mapping */
+typedef struct {
+  uint64_t seq;
+  Image image;
+} ImagedRingFrame;
+
+/** Create a ring with `nslots` frames for images described by `meta` and open
+ * it as the producer, replacing any existing ring with the same key. Readers
+ * that have the previous ring open stop receiving frames */
+ImagedStatus imagedRingCreate(Imaged *db, const char *key, ssize_t keylen,
+                              const ImageMeta *meta, uint32_t nslots,
+                              ImagedRing **ring);
+
+/** Open an existing ring. Only one producer can have a ring open, others get
+ * IMAGED_ERR_LOCKED */
+ImagedStatus imagedRingOpen(Imaged *db, const char *key, ssize_t keylen,
+                            bool producer, ImagedRing **ring);
+
+/** Close a ring, frames obtained from it can no longer be used */
+void imagedRingClose(ImagedRing *ring);
+
+/** Remove a ring, processes that have it open keep their mapping */
+ImagedStatus imagedRingRemove(Imaged *db, const char *key, ssize_t keylen);
+
+/** Get the metadata of the frames in a ring */
+const ImageMeta *imagedRingMeta(const ImagedRing *ring);
+
+/** Start writing the next frame, `frame->image` points at the slot to fill.
+ * The slot holds whatever frame was stored in it before. Producer only */
+ImagedStatus imagedRingBegin(ImagedRing *ring, ImagedRingFrame *frame);
+
+/** Publish the frame started by imagedRingBegin and wake waiting readers. No
+ * system call is made unless a reader is waiting */
+ImagedStatus imagedRingPublish(ImagedRing *ring, ImagedRingFrame *frame);
+
+/** Get the latest published frame, returns false when there is none */
+bool imagedRingLatest(const ImagedRing *ring, ImagedRingFrame *frame);
+
+/** Get the frame after `after`, waiting up to `timeout_ms` milliseconds for it
+ * to be published (negative waits forever). When the reader has fallen so far
+ * behind that the frame was overwritten the latest frame is returned instead,
+ * `frame->seq` shows how many were skipped. Returns false on timeout */
+bool imagedRingNext(ImagedRing *ring, uint64_t after, int64_t timeout_ms,
+                    ImagedRingFrame *frame);
+
+/** Returns true when a frame has not been overwritten yet. Frames are read in
+ * place, so a reader that needs a consistent image checks this after it is
+ * done with the pixels: the producer reuses a slot after `nslots - 1` newer
+ * frames */
+bool imagedRingFrameIsValid(const ImagedRing *ring,
+                            const ImagedRingFrame *frame);
+
+/** Largest size of a pack segment file, each segment is mapped with this size
+ */
+#define IMAGED_PACK_SEGMENT_SIZE (1ULL << 30)
+
+/** A pack stores many images in a few large segment files instead of one file
+ * per key, which is better suited to millions of small images. Entries are
+ * appended to the current segment and an index maps each key to a segment
+ * and offset. Packs are separate from databases and can be shared between
+ * processes */
+typedef struct ImagedPack ImagedPack;
+
+/** Pack entry returned by imagedPackNext, `key` is owned by the pack and
+ * remains valid until the pack is compacted or closed. `image.data` points
+ * into the segment mapping */
+typedef struct {
+  const char *key;
+  size_t keylen;
+  Image image;
+} ImagedPackEntry;
+
+/** Pack counters */
+typedef struct {
+  size_t keys;         // number of keys
+  uint64_t live_bytes; // segment space used by current entries
+  uint64_t dead_bytes; // space used by removed or replaced entries
+  uint64_t segment;    // id of the segment new entries are appended to
+  size_t mapped;       // number of segments mapped by this process
+} ImagedPackStats;
+
+/** Open the pack stored in the directory `path`, creating it if needed */
+ImagedPack *imagedPackOpen(const char *path);
+
+/** Close a pack, images obtained from it can no longer be used */
+void imagedPackClose(ImagedPack *pack);
+
+/** Remove all pack files and close the pack */
+ImagedStatus imagedPackDestroy(ImagedPack *pack);
+
+/** Store an image in the pack, replacing any existing entry with the same key.
+ * When `imagedata` is NULL the image is filled with zeros */
+ImagedStatus imagedPackSet(ImagedPack *pack, const char *key, ssize_t keylen,
+                           const ImageMeta *meta, const void *imagedata);
+
+/** Get an image without copying it, `image->data` points into the segment
+ * mapping and stays valid until the pack is closed or imagedPackRelease is
+ * called, even when the key is replaced, removed or compacted. The image must
+ * not be modified */
+ImagedStatus imagedPackGet(ImagedPack *pack, const char *key, ssize_t keylen,
+                           Image *image);
+
+/** Returns true when a key exists in the pack */
+bool imagedPackHasKey(ImagedPack *pack, const char *key, ssize_t keylen);
+
+/** Remove a key, the space it used is reclaimed by imagedPackCompact */
+ImagedStatus imagedPackRemove(ImagedPack *pack, const char *key,
+                              ssize_t keylen);
+
+/** Get the next entry starting at `*index`, which should be 0 for the first
+ * call. Changes made by other processes are loaded on the first call */
+bool imagedPackNext(ImagedPack *pack, size_t *index, ImagedPackEntry *entry);
+
+/** Get the pack counters */
+void imagedPackGetStats(ImagedPack *pack, ImagedPackStats *stats);
+
+/** Copy the current entries to new segments and delete the old ones,
+ * reclaiming the space used by removed and replaced entries. Writers in other
+ * processes wait until compaction is finished, readers keep using the old
+ * segments until they notice the new index. The disk space of the old
+ * segments is only freed once every process using the pack has closed it or
+ * called imagedPackRelease */
+ImagedStatus imagedPackCompact(ImagedPack *pack);
+
+/** Unmap the segments no live entry refers to, such as the ones deleted by
+ * compaction in this or another process. Images obtained from the pack that
+ * no longer match the current entry of their key may become invalid */
+void imagedPackRelease(ImagedPack *pack);
+
+/** Kinds of changes reported by imagedWatchNext */
+typedef enum {
+  IMAGED_WATCH_SET,      // the key was written, replaced or closed after editing
+  IMAGED_WATCH_REMOVE,   // the key was removed
+  IMAGED_WATCH_OVERFLOW, // events were lost, the database should be rescanned
+} ImagedWatchEventKind;
+
+/** A change to a key, `key` is valid until the next call to imagedWatchNext
+ * and is NULL for IMAGED_WATCH_OVERFLOW */
+typedef struct {
+  ImagedWatchEventKind kind;
+  const char *key;
+  size_t keylen;
+} ImagedWatchEvent;
+
+/** Subscription to changes made to a database by any process */
+typedef struct ImagedWatch ImagedWatch;
+
+/** Watch a database for changes to keys matching `pattern`, a shell wildcard
+ * pattern as used by fnmatch, or to all keys when it is NULL. Uses inotify
+ * when it is available, otherwise the directory is scanned every 50ms. A set
+ * is reported once the writer closes the file or renames it into place.
+ * Closing an editable handle without changing the image is not reported,
+ * unless the file was already modified within the last 100ms */
+ImagedWatch *imagedWatchNew(Imaged *db, const char *pattern);
+
+/** Wait up to `timeout_ms` milliseconds for the next change, a negative
+ * timeout waits forever. Returns false when no change happened */
+bool imagedWatchNext(ImagedWatch *watch, int64_t timeout_ms,
+                     ImagedWatchEvent *event);
+
+/** Get a file descriptor that becomes readable when changes are available, for
+ * use with poll or epoll. Returns -1 when the directory is being scanned */
+int imagedWatchFd(const ImagedWatch *watch);
+
+/** Stop watching and free the subscription */
+void imagedWatchFree(ImagedWatch *watch);
+
+/** Capacity counters, shared by every process using the database */
+typedef struct {
+  uint64_t max_bytes;      // byte limit, 0 when unlimited
+  uint64_t max_keys;       // key limit, 0 when unlimited
+  uint64_t bytes;          // current size of all keys
+  uint64_t keys;           // current number of keys
+  uint64_t evictions;      // keys removed to stay within the limit
+  uint64_t evicted_bytes;  // size of the evicted keys
+  uint64_t skipped_locked; // eviction candidates skipped because they were
+                           // locked
+} ImagedCapacityStats;
+
+/** Limit the total size in bytes and/or number of keys of a database, 0
+ * disables a limit. The limit is stored in the database and applies to every
+ * process. When a set would go over the limit the least recently used keys
+ * that are not locked are removed until usage is back under 90% of the limit.
+ * Access times are recorded by imagedGet and imagedSet in a shared table that
+ * is only written to memory. Sizes are the file sizes recorded in the catalog,
+ * keys sharing a deduplicated file are each counted. Keys already over a new
+ * limit are evicted right away */
+ImagedStatus imagedSetCapacity(Imaged *db, uint64_t max_bytes,
+                               uint64_t max_keys);
+
+/** Get the capacity limit, current usage and eviction counters */
+void imagedGetCapacityStats(const Imaged *db, ImagedCapacityStats *stats);
+
+/** Open the recency table, used by imagedOpen and imagedSetCapacity */
+struct ImagedRecency *imagedRecencyOpen(const char *path, bool create);
+
+/** Close the recency table, used by imagedClose */
+void imagedRecencyClose(struct ImagedRecency *recency);
+
+/** Record an access to a key, used by imagedGet */
+void imagedCapacityTouch(Imaged *db, const char *key, ssize_t keylen);
+
+/** Make room for `size` bytes stored under `key`, evicting keys when the
+ * limit would be exceeded. Used before writing a key, the set goes ahead even
+ * when every candidate is locked */
+void imagedCapacityReserve(Imaged *db, const char *key, ssize_t keylen,
+                           uint64_t size);
+
 /** Release ImagedHandle resources including all memory and file descriptors
  */
 void imagedHandleClose(ImagedHandle *handle);
@@ -353,6 +997,37 @@ void imagedHandleClose(ImagedHandle *handle);
 /** Initialize an new handle */
 void imagedHandleInit(ImagedHandle *handle);
 
+/** Copy the region starting at (x, y) with the size of `dest` out of the
+ * image, `dest` must have the same color and type. Only the tiles that
+ * overlap the region are accessed */
+ImagedStatus imagedHandleReadRegion(ImagedHandle *handle, uint64_t x,
+                                    uint64_t y, Image *dest);
+
+/** Copy `src` into the image at (x, y), the handle must be editable and the
+ * image must not be compressed */
+ImagedStatus imagedHandleWriteRegion(ImagedHandle *handle, uint64_t x,
+                                     uint64_t y, const Image *src);
+
+/** Get a pointer to the pixel data of tile (tx, ty), the tile is always
+ * tile_width x tile_height pixels, including at the edges of the image. For
+ * compressed images the tile is decompressed into the handle's tile cache, the
+ * pointer is only valid until the next tile is accessed and changes made to
+ * it are not saved */
+void *imagedHandleTile(ImagedHandle *handle, uint64_t tx, uint64_t ty);
+
+/** Set the maximum number of bytes used to cache decompressed tiles */
+void imagedHandleSetTileCacheSize(ImagedHandle *handle, size_t size);
+
+/** Release all cached decompressed tiles */
+void imagedHandleFreeTileCache(ImagedHandle *handle);
+
+/** Get the number of tiles in each direction */
+void imagedHandleNumTiles(const ImagedHandle *handle, uint64_t *nx,
+                          uint64_t *ny);
+
+/** Maximum length of a key listed by the catalog, keys are file names */
+#define IMAGED_MAX_KEYLEN 255
+
 /** Iterator over imgd files in an Imaged database */
 typedef struct {
   Imaged *db;
@@ -361,27 +1036,456 @@ typedef struct {
   const char *key;
   size_t keylen;
   ImagedHandle handle;
+  bool catalog; // keys are read from the catalog instead of the directory
+  size_t index;
+  char keybuf[IMAGED_MAX_KEYLEN + 1]; // copy of the current catalog key
 } ImagedIter;
 
-/** Create a new iterator */
+/** Create a new iterator, keys are read from the catalog when it is available
+ */
 ImagedIter *imagedIterNew(Imaged *db);
 
+/** Create a new iterator that reads keys from the database directory instead
+ * of the catalog */
+ImagedIter *imagedIterNewFromDirectory(Imaged *db);
+
 /** Get next image */
 Image *imagedIterNext(ImagedIter *iter);
 
 /** Get next key */
 const char *imagedIterNextKey(ImagedIter *iter);
 
+/** Get the metadata of the next key, `iter->key` is set to the key. Images are
+ * not opened, locked or mapped, when reading from the directory only the
+ * header of each file is read */
+const ImageMeta *imagedIterNextMeta(ImagedIter *iter);
+
 /** Free iterator */
 void imagedIterFree(ImagedIter *iter);
 void imagedIterReset(ImagedIter *iter);
 
+/** Size of the header page at the start of a log file */
+#define IMAGED_LOG_HEADER_SIZE 4096
+
+/** Header flag of a log file that was replaced by a new file */
+#define IMAGED_LOG_REPLACED 2
+
+/** Log record operations */
+enum {
+  IMAGED_LOG_SET = 1,
+  IMAGED_LOG_REMOVE = 2,
+};
+
+/** Start of the header page of a log file, the owner of the log may store
+ * more fields after it */
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t end; // bytes of complete records
+  uint64_t flags;
+} ImagedLogHeader;
+
+/** Log record, followed by the key and padded to a multiple of 8 bytes. The
+ * meaning of `value` is up to the owner of the log */
+typedef struct {
+  uint32_t size;
+  uint32_t op;
+  uint64_t keylen;
+  ImageMeta meta;
+  uint64_t value[2];
+} ImagedLogRecord;
+
+/** Latest record of a key */
+typedef struct {
+  char *key;
+  size_t keylen;
+  ImageMeta meta;
+  uint64_t value[2];
+  uint64_t size; // counted in `live_bytes` while the entry is live
+  bool live;
+} ImagedLogEntry;
+
+/** Append-only log of set/remove records replayed into an in-memory hash
+ * table, used by the catalog and packs */
+typedef struct {
+  int fd;
+  ImagedLogHeader *header; // mapped header page
+  uint64_t loaded;         // offset of the first record not applied yet
+  uint64_t records;        // records applied
+  ImagedLogEntry *entries;
+  size_t count, cap, live;
+  uint64_t live_bytes, dead_bytes;
+  uint32_t *index;
+  size_t indexcap;
+  // Size counted for a set and check rejecting corrupt sets, both may be NULL
+  uint64_t (*size)(const ImagedLogRecord *rec);
+  bool (*valid)(const ImagedLogRecord *rec);
+} ImagedLog;
+
+/** Initialize an empty log that is not backed by a file yet */
+void imagedLogInit(ImagedLog *log, uint64_t (*size)(const ImagedLogRecord *),
+                   bool (*valid)(const ImagedLogRecord *));
+
+/** Free the entries of a log, the file stays mapped */
+void imagedLogClear(ImagedLog *log);
+
+/** Unmap and close the log file, the entries are kept */
+void imagedLogUnmap(ImagedLog *log);
+
+/** Find the entry of a key, including removed keys */
+ImagedLogEntry *imagedLogFind(const ImagedLog *log, const char *key,
+                              size_t keylen);
+
+/** Apply a record to the entries */
+bool imagedLogApply(ImagedLog *log, const ImagedLogRecord *rec,
+                    const char *key);
+
+/** Apply the records written since the log was last loaded up to `end`,
+ * returns false when the log is corrupt */
+bool imagedLogReplay(ImagedLog *log, uint64_t end);
+
+/** Map the header of the log file `fd`, the log takes over `fd` on success */
+bool imagedLogMap(ImagedLog *log, int fd, const char magic[4],
+                  uint32_t version);
+
+/** Returns true when the log is not mapped or its file was replaced */
+bool imagedLogReplaced(const ImagedLog *log);
+
+/** Create a record for a key of `keylen` bytes */
+ImagedLogRecord imagedLogRecord(uint32_t op, size_t keylen);
+
+/** Append a record at `header->end` and advance it, appends to `fd` must be
+ * serialized by the caller */
+bool imagedLogWrite(int fd, ImagedLogHeader *header,
+                    const ImagedLogRecord *rec, const char *key);
+
+/** Truncate `fd` to an empty log */
+bool imagedLogWriteHeader(int fd, const char magic[4], uint32_t version);
+
+/** Open the log file at `path`, creating an empty one through `tmp` when
+ * there is none. Returns the file descriptor or -1 */
+int imagedLogOpenFile(const char *path, const char *tmp, const char magic[4],
+                      uint32_t version);
+
+/** Catalog entry, `key` is a copy so it remains valid when the catalog is
+ * compacted or rebuilt */
+typedef struct {
+  char key[IMAGED_MAX_KEYLEN + 1];
+  size_t keylen;
+  ImageMeta meta;
+  uint64_t size;  // file size in bytes
+  int64_t mtime;  // modification time in nanoseconds
+} ImagedCatalogEntry;
+
+/** Allocate the in-memory catalog state, used by imagedOpen */
+struct ImagedCatalog *imagedCatalogNew(void);
+
+/** Free the in-memory catalog state, used by imagedClose */
+void imagedCatalogFree(struct ImagedCatalog *catalog);
+
+/** Load any changes to the catalog, the catalog is built from the directory
+ * when it does not exist yet */
+ImagedStatus imagedCatalogLoad(const Imaged *db);
+
+/** Recreate the catalog by reading the header of every key */
+ImagedStatus imagedCatalogRebuild(Imaged *db);
+
+/** Update the catalog entry of a key from the file on disk, the entry is
+ * removed when the key does not exist. This is called by imagedSet and
+ * imagedRemove */
+ImagedStatus imagedCatalogUpdate(Imaged *db, const char *key, ssize_t keylen);
+
+/** Find a key in the catalog, returns IMAGED_ERR_FILE_DOES_NOT_EXIST when the
+ * key is not found and IMAGED_ERR when the catalog cannot be loaded */
+ImagedStatus imagedCatalogGet(const Imaged *db, const char *key,
+                              ssize_t keylen, ImagedCatalogEntry *entry);
+
+/** Get the number of keys in the catalog and their total size in bytes,
+ * loading any changes first */
+ImagedStatus imagedCatalogTotals(const Imaged *db, size_t *keys,
+                                 uint64_t *bytes);
+
+/** Get the next catalog entry starting at `*index`, which should be 0 for the
+ * first call. Call imagedCatalogLoad first to include recent changes */
+bool imagedCatalogNext(const Imaged *db, size_t *index,
+                       ImagedCatalogEntry *entry);
+
+/** Default number of unused read-only mappings kept open by the handle cache
+ */
+#define IMAGED_HANDLE_CACHE_SIZE 256
+
+/** Handle cache counters */
+typedef struct {
+  uint64_t hits;          // handles served from an existing mapping
+  uint64_t misses;        // handles that required opening the file
+  uint64_t invalidations; // mappings dropped because the file changed
+  uint64_t evictions;     // unused mappings closed to stay within the limit
+  size_t entries;         // mappings currently open
+} ImagedHandleCacheStats;
+
+/** Allocate a handle cache, used by imagedOpen */
+struct ImagedHandleCache *imagedHandleCacheNew(size_t size);
+
+/** Free a handle cache, used by imagedClose. Handles that are still open keep
+ * their mapping until they are closed */
+void imagedHandleCacheFree(struct ImagedHandleCache *cache);
+
+/** Get a read-only handle from the cache. Returns
+ * IMAGED_ERR_FILE_DOES_NOT_EXIST when the key is not cached or the file has
+ * changed since it was cached, used by imagedGet */
+ImagedStatus imagedHandleCacheGet(struct ImagedHandleCache *cache,
+                                  const char *key, ssize_t keylen,
+                                  ImagedHandle *handle);
+
+/** Move the mapping of a freshly opened read-only handle into the cache, the
+ * handle stays valid and shares the mapping. Used by imagedGet */
+void imagedHandleCachePut(struct ImagedHandleCache *cache, const char *key,
+                          ssize_t keylen, const char *path,
+                          ImagedHandle *handle);
+
+/** Release a cached handle, used by imagedHandleClose */
+void imagedHandleCacheRelease(struct ImagedHandleCacheEntry *entry);
+
+/** Drop the cached mapping of a key, used by imagedSet and imagedRemove */
+void imagedHandleCacheInvalidate(struct ImagedHandleCache *cache,
+                                 const char *key, ssize_t keylen);
+
+/** Set the number of unused mappings kept open, 0 disables the cache. Read-only
+ * handles returned by imagedGet share a single mapping per key, which stays
+ * open after the handle is closed so the next imagedGet only has to check that
+ * the file has not been replaced or rewritten */
+void imagedSetHandleCacheSize(Imaged *db, size_t size);
+
+/** Get the handle cache counters */
+void imagedGetHandleCacheStats(const Imaged *db, ImagedHandleCacheStats *stats);
+
+/** Reusable pool of worker threads */
+typedef struct ImagedPool ImagedPool;
+
+/** Pool task callback, receives the task index and the index of the worker
+ * thread executing it (between 0 and imagedPoolNumThreads - 1) */
+typedef void (*imagedPoolFn)(size_t, size_t, void *);
+
+/** Create a new thread pool, when nthreads <= 0 the number of online CPUs is
+ * used. The calling thread counts as one of the threads */
+ImagedPool *imagedPoolNew(int nthreads);
+
+/** Stop all worker threads and free the pool */
+void imagedPoolFree(ImagedPool *pool);
+
+/** Get the process-wide pool, it is created the first time it is requested */
+ImagedPool *imagedPoolDefault(void);
+
+/** Get the number of threads that can execute tasks in parallel */
+size_t imagedPoolNumThreads(const ImagedPool *pool);
+
+/** Call fn once for each task index in [0, ntasks), blocking until all tasks
+ * have finished. When the pool is already running tasks (for example when
+ * called from inside a task) the tasks are executed on the calling thread */
+ImagedStatus imagedPoolRun(ImagedPool *pool, size_t ntasks, imagedPoolFn fn,
+                           void *userdata);
+
+/** For-each callback, receives the key, a handle opened by the worker that is
+ * closed once the callback returns and the index of the worker thread. A
+ * status other than IMAGED_OK is reported as an error for that key */
+typedef ImagedStatus (*imagedForEachFn)(const char *, ImagedHandle *, size_t,
+                                        void *);
+
+/** For-each error callback, receives the key and the error status. It may be
+ * called from several worker threads at the same time */
+typedef void (*imagedForEachErrorFn)(const char *, ImagedStatus, void *);
+
+/** Options for imagedForEach */
+typedef struct {
+  ImagedPool *pool;           // NULL uses imagedPoolDefault
+  bool editable;              // open handles for writing
+  bool skip_locked;           // silently skip keys locked by another process
+  imagedForEachErrorFn error; // called for each key that fails, may be NULL
+} ImagedForEachOptions;
+
+/** Call fn for every key in the database in parallel, keys are listed the same
+ * way as imagedIterNew and handed out to the pool threads as they become free.
+ * Returns IMAGED_ERR if any key could not be opened or fn failed, the
+ * remaining keys are still processed. options may be NULL */
+ImagedStatus imagedForEach(Imaged *db, const ImagedForEachOptions *options,
+                           imagedForEachFn fn, void *userdata);
+
+/** A key read by imagedGetBatch */
+typedef struct {
+  const char *key;
+  ssize_t keylen;
+  ImagedHandle handle; // read-only handle, set when status is IMAGED_OK
+  ImagedStatus status;
+} ImagedGetRequest;
+
+/** An image written by imagedSetBatch */
+typedef struct {
+  const char *key;
+  ssize_t keylen;
+  ImageMeta meta;
+  const void *data; // NULL writes an image with every pixel set to zero
+  ImagedStatus status;
+} ImagedSetRequest;
+
+/** Batch statistics */
+typedef struct {
+  uint64_t submitted; // operations submitted through io_uring
+  uint64_t fallback;  // requests handled by the regular get/set functions
+  uint64_t failed;    // requests with a status other than IMAGED_OK
+} ImagedBatchStats;
+
+/** Options for imagedGetBatch and imagedSetBatch */
+typedef struct {
+  ImagedPool *pool; // used without io_uring, NULL uses imagedPoolDefault
+  const ImagedSetOptions *set; // options for imagedSetBatch, may be NULL
+  bool disable_uring;          // always use the thread pool
+  ImagedBatchStats *stats;     // filled in when not NULL
+} ImagedBatchOptions;
+
+/** Open read-only handles for many keys at once. Where io_uring is available
+ * the files are opened and their headers read with one submission for the
+ * whole batch, elsewhere the keys are handed out to the pool threads. Each
+ * request gets its own status, the function returns IMAGED_ERR if any of
+ * them failed. options may be NULL */
+ImagedStatus imagedGetBatch(Imaged *db, ImagedGetRequest *reqs, size_t n,
+                            const ImagedBatchOptions *options);
+
+/** Store many images at once, the same way as imagedSetWithOptions with the
+ * `atomic` option: each image is written to a temporary file that replaces
+ * its key once complete. With io_uring the files are created, written and
+ * renamed in one submission per step for the whole batch. Tiled, compressed,
+ * deduplicated and ephemeral images and images with mip levels always use the
+ * thread pool. The order in which requests for the same key are applied is
+ * unspecified. Returns IMAGED_ERR if any request failed */
+ImagedStatus imagedSetBatch(Imaged *db, ImagedSetRequest *reqs, size_t n,
+                            const ImagedBatchOptions *options);
+
+/** Make room for every request of a batch at once, `sizes[i]` is the size of
+ * the file written for `reqs[i]` or 0 for requests that are skipped. Used by
+ * imagedSetBatch before any of the files are written */
+void imagedCapacityReserveBatch(Imaged *db, const ImagedSetRequest *reqs,
+                                size_t n, const uint64_t *sizes);
+
+/** io_uring instance used by the batch functions */
+typedef struct ImagedUring ImagedUring;
+
+/** Operation executed by imagedUringRun */
+typedef enum {
+  IMAGED_URING_OPEN,   // open(path, flags, mode)
+  IMAGED_URING_READ,   // pread(fd, buf, size, offset)
+  IMAGED_URING_WRITE,  // pwrite(fd, buf, size, offset)
+  IMAGED_URING_RENAME, // rename(path, target)
+} ImagedUringOp;
+
+/** Request executed by imagedUringRun */
+typedef struct {
+  ImagedUringOp op;
+  int fd;
+  const char *path, *target;
+  int flags;
+  unsigned mode;
+  void *buf;
+  size_t size;
+  uint64_t offset;
+  int64_t result; // return value of the system call or -errno
+} ImagedUringRequest;
+
+/** Create an io_uring with up to `entries` requests in flight, returns NULL
+ * when io_uring or one of the operations used is not supported */
+ImagedUring *imagedUringNew(unsigned entries);
+
+/** Close the io_uring */
+void imagedUringFree(ImagedUring *ring);
+
+/** Execute requests and wait for all of them to complete. Requests that could
+ * not be submitted have their result set to -ECANCELED */
+void imagedUringRun(ImagedUring *ring, ImagedUringRequest *reqs, size_t n);
+
+/** Scheduling statistics reported by parallel image operations */
+typedef struct {
+  uint64_t blocks;     // number of row blocks scheduled
+  uint64_t grain;      // number of rows in each block
+  uint64_t threads;    // number of threads that processed at least one block
+  uint64_t min_blocks; // fewest blocks processed by one of those threads
+  uint64_t max_blocks; // most blocks processed by a single thread
+  uint64_t elapsed_ns; // wall-clock time spent in the operation
+} ImageParallelStats;
+
+/** Options for parallel image operations, rows are split into blocks of
+ * `grain` rows that are handed out to the pool threads as they become free */
+typedef struct {
+  ImagedPool *pool; // NULL uses imagedPoolDefault
+  uint64_t grain;   // rows per block, 0 picks a size based on the pool
+  ImageParallelStats *stats; // filled in when not NULL
+} ImageParallelOptions;
+
 typedef bool (*imageParallelFn)(uint64_t, uint64_t, Image *, Pixel *, void *);
+
+/** Call fn for every pixel in src in parallel, when fn returns true the
+ * modified pixel is stored in dst (or src if dst is NULL). nthreads is used as
+ * a hint for the block size, 1 runs everything on the calling thread */
 ImagedStatus imageEachPixel2(Image *src, Image *dst, imageParallelFn fn,
                              int nthreads, void *userdata);
 ImagedStatus imageEachPixel(Image *im, imageParallelFn fn, int nthreads,
                             void *userdata);
 
+/** Same as imageEachPixel2 using the provided pool, grain size and stats */
+ImagedStatus imageEachPixelWithOptions(Image *src, Image *dst,
+                                       imageParallelFn fn,
+                                       const ImageParallelOptions *opts,
+                                       void *userdata);
+
+/** Row callback, receives the row index, a pointer to the row data in the
+ * image's native format, the number of pixels in the row and the number of
+ * elements between consecutive pixels */
+typedef void (*imageRowFn)(uint64_t, void *, uint64_t, size_t, Image *,
+                           void *);
+
+/** Call fn for every row in an image in parallel, the row data is not
+ * converted so it can be modified in place using the image's storage type */
+ImagedStatus imageEachRow(Image *im, imageRowFn fn, int nthreads,
+                          void *userdata);
+
+/** Same as imageEachRow using the provided pool, grain size and stats */
+ImagedStatus imageEachRowWithOptions(Image *im, imageRowFn fn,
+                                     const ImageParallelOptions *opts,
+                                     void *userdata);
+
+/** Map-reduce over the rows of an image. Each thread gets its own accumulator
+ * of `size` bytes which is set up using `init`, `map` is called with a row of
+ * converted pixels and finally every thread's accumulator is merged into the
+ * result using `combine` */
+typedef struct {
+  size_t size;
+  void (*init)(void *acc, void *userdata);
+  void (*map)(void *acc, uint64_t y, const Pixel *row, uint64_t width,
+              void *userdata);
+  void (*combine)(void *acc, const void *other, void *userdata);
+} ImageReducer;
+
+/** Run a reduction in parallel, `result` must point to at least
+ * `reducer->size` bytes. Fails when the image type is not supported by
+ * imageGetPixels. opts may be NULL */
+ImagedStatus imageReduce(Image *im, const ImageReducer *reducer, void *result,
+                         const ImageParallelOptions *opts, void *userdata);
+
+/** Per-channel image statistics, computed on normalized pixel values */
+typedef struct {
+  uint64_t count;
+  Pixel min, max;
+  double sum[4];
+  double mean[4];
+  double variance[4];
+} ImageStats;
+
+/** Compute min/max/sum/mean/variance for each channel in parallel */
+ImagedStatus imageStats(Image *im, ImageStats *stats);
+
+/** Compute a histogram with `bins` bins for each of the 4 pixel channels,
+ * `hist` must have room for 4 * bins values and is laid out channel by
+ * channel. Values outside of [0, 1] are counted in the first or last bin */
+ImagedStatus imageHistogram(Image *im, size_t bins, uint64_t *hist);
+
 // UTIL
 #define IMAGED_UNUSED __attribute__((unused))
 
@@ -392,6 +1496,7 @@ void defer_free(void *data);
 void defer_Image(Image **db);
 void defer_Imaged(Imaged **db);
 void defer_ImagedIter(ImagedIter **iter);
+void defer_ImagedWatch(ImagedWatch **watch);
 void defer_ImagedHandle(ImagedHandle *h);
 void defer_HalideBuffer(halide_buffer_t *b);
 #define $(b, t, v) t v __attribute__((cleanup(defer_##b)))
@@ -400,6 +1505,7 @@ void defer_HalideBuffer(halide_buffer_t *b);
 #define $Imaged(v) $_(Imaged, v)
 #define $Image(v) $_(Image, v)
 #define $ImagedIter(v) $_(ImagedIter, v)
+#define $ImagedWatch(v) $_(ImagedWatch, v)
 #define $ImagedHandle(v)                                                       \
   $(ImagedHandle, ImagedHandle, v);                                            \
   imagedHandleInit(&v);
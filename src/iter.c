@@ -1,44 +1,135 @@
 #define _DEFAULT_SOURCE
 #include "imaged.h"
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-ImagedIter *imagedIterNew(Imaged *db) {
+static ImagedIter *iterNew(Imaged *db, bool catalog) {
   ImagedIter *iter = malloc(sizeof(ImagedIter));
   if (iter == NULL) {
     return NULL;
   }
 
-  iter->d = opendir(db->root);
-  if (iter->d == NULL) {
+  iter->catalog = catalog;
+  iter->index = 0;
+  iter->d = NULL;
+  if (!iter->catalog && (iter->d = opendir(db->root)) == NULL) {
     free(iter);
     return NULL;
   }
 
   iter->db = db;
   iter->ent = NULL;
-  iter->handle.image.data = NULL;
-  iter->handle.fd = -1;
+  imagedHandleInit(&iter->handle);
 
   return iter;
 }
 
+ImagedIter *imagedIterNew(Imaged *db) {
+  // Keys are listed from the catalog when it is available, otherwise the
+  // directory is scanned
+  return iterNew(db, imagedCatalogLoad(db) == IMAGED_OK);
+}
+
+ImagedIter *imagedIterNewFromDirectory(Imaged *db) {
+  return iterNew(db, false);
+}
+
 void imagedIterReset(ImagedIter *iter) {
-  if (iter != NULL && iter->d != NULL) {
+  if (iter == NULL) {
+    return;
+  }
+
+  if (iter->catalog) {
+    iter->index = 0;
+    imagedCatalogLoad(iter->db);
+  } else if (iter->d != NULL) {
     rewinddir(iter->d);
   }
 }
 
+// Get the next key from the catalog
+static const char *iterNextCatalogKey(ImagedIter *iter, ImageMeta *meta) {
+  ImagedCatalogEntry entry;
+  if (!imagedCatalogNext(iter->db, &iter->index, &entry)) {
+    return NULL;
+  }
+
+  // The catalog frees its keys when it is compacted or rebuilt
+  memcpy(iter->keybuf, entry.key, entry.keylen + 1);
+  iter->key = iter->keybuf;
+  iter->keylen = entry.keylen;
+  if (meta != NULL) {
+    *meta = entry.meta;
+  }
+  return iter->key;
+}
+
+// Get the next directory entry containing an image. Entries are opened
+// relative to the directory and only the header is read, no locks are taken
+static const char *iterNextDirectoryKey(ImagedIter *iter, ImageMeta *meta) {
+  int dir = dirfd(iter->d);
+  size_t n = strlen(IMAGED_RESERVED);
+
+  struct dirent *ent;
+  while ((ent = readdir(iter->d))) {
+    if (ent->d_type == DT_DIR || strncmp(ent->d_name, IMAGED_RESERVED, n) == 0) {
+      continue;
+    }
+
+    struct stat st;
+    if (ent->d_type == DT_UNKNOWN &&
+        (fstatat(dir, ent->d_name, &st, 0) != 0 || S_ISDIR(st.st_mode))) {
+      continue;
+    }
+
+    int fd = openat(dir, ent->d_name, O_RDONLY);
+    if (fd < 0) {
+      continue;
+    }
+
+    ImagedHeader header;
+    ImagedStatus status = imagedReadHeader(fd, &header);
+    close(fd);
+    if (status != IMAGED_OK) {
+      continue;
+    }
+
+    iter->ent = ent;
+    iter->key = ent->d_name;
+    iter->keylen = strlen(iter->key);
+    if (meta != NULL) {
+      *meta = header.meta;
+    }
+    return iter->key;
+  }
+
+  return NULL;
+}
+
 Image *imagedIterNext(ImagedIter *iter) {
   if (iter == NULL) {
     return NULL;
   }
 
-  if (iter->handle.image.data != NULL) {
+  if (iter->handle.map != NULL) {
     imagedHandleClose(&iter->handle);
   }
 
+  if (iter->catalog) {
+    while (iterNextCatalogKey(iter, NULL) != NULL) {
+      if (imagedGet(iter->db, iter->key, iter->keylen, true, &iter->handle) ==
+          IMAGED_OK) {
+        iter->handle.image.owner = false;
+        return &iter->handle.image;
+      }
+    }
+    return NULL;
+  }
+
   struct dirent *ent = readdir(iter->d);
   if (ent == NULL) {
     return NULL;
@@ -64,19 +155,27 @@ const char *imagedIterNextKey(ImagedIter *iter) {
     return NULL;
   }
 
-  struct dirent *ent = readdir(iter->d);
-  if (ent == NULL) {
+  if (iter->handle.map != NULL) {
+    imagedHandleClose(&iter->handle);
+  }
+
+  return iter->catalog ? iterNextCatalogKey(iter, NULL)
+                       : iterNextDirectoryKey(iter, NULL);
+}
+
+const ImageMeta *imagedIterNextMeta(ImagedIter *iter) {
+  if (iter == NULL) {
     return NULL;
   }
-  iter->key = ent->d_name;
-  iter->keylen = strlen(iter->key);
-  iter->handle.image.data = NULL;
 
-  if (ent->d_type == DT_DIR || !imagedIsValidFile(iter->db, ent->d_name, -1)) {
-    return imagedIterNextKey(iter);
+  if (iter->handle.map != NULL) {
+    imagedHandleClose(&iter->handle);
   }
 
-  return iter->key;
+  ImageMeta *meta = &iter->handle.image.meta;
+  const char *key = iter->catalog ? iterNextCatalogKey(iter, meta)
+                                  : iterNextDirectoryKey(iter, meta);
+  return key != NULL ? meta : NULL;
 }
 
 void imagedIterFree(ImagedIter *iter) {
@@ -84,10 +183,128 @@ void imagedIterFree(ImagedIter *iter) {
     return;
   }
 
-  if (iter->handle.image.data != NULL) {
+  if (iter->handle.map != NULL) {
     imagedHandleClose(&iter->handle);
   }
 
-  closedir(iter->d);
+  if (iter->d != NULL) {
+    closedir(iter->d);
+  }
   free(iter);
 }
+
+typedef struct {
+  Imaged *db;
+  char **keys;
+  bool editable, skip_locked;
+  imagedForEachFn fn;
+  imagedForEachErrorFn error;
+  void *userdata;
+  size_t failed;
+} ForEachState;
+
+static void forEachTask(size_t index, size_t worker, void *ud) {
+  ForEachState *state = ud;
+  const char *key = state->keys[index];
+
+  ImagedHandle handle;
+  ImagedStatus status =
+      imagedGet(state->db, key, -1, state->editable, &handle);
+  if (status == IMAGED_OK) {
+    status = state->fn(key, &handle, worker, state->userdata);
+    imagedHandleClose(&handle);
+  } else if (status == IMAGED_ERR_LOCKED && state->skip_locked) {
+    return;
+  } else if (status == IMAGED_ERR_FILE_DOES_NOT_EXIST) {
+    // Removed after the keys were listed
+    return;
+  }
+
+  if (status != IMAGED_OK) {
+    __atomic_add_fetch(&state->failed, 1, __ATOMIC_RELAXED);
+    if (state->error != NULL) {
+      state->error(key, status, state->userdata);
+    }
+  }
+}
+
+// Collect all keys up front so they can be split between the workers
+static char **forEachKeys(Imaged *db, size_t *count) {
+  ImagedIter *iter = imagedIterNew(db);
+  if (iter == NULL) {
+    return NULL;
+  }
+
+  size_t n = 0, cap = 64;
+  char **keys = malloc(sizeof(char *) * cap);
+  const char *key;
+  while (keys != NULL && (key = imagedIterNextKey(iter)) != NULL) {
+    if (n == cap) {
+      char **tmp = realloc(keys, sizeof(char *) * cap * 2);
+      if (tmp == NULL) {
+        break;
+      }
+      keys = tmp;
+      cap *= 2;
+    }
+
+    if ((keys[n] = strndup(key, iter->keylen)) == NULL) {
+      break;
+    }
+    n++;
+  }
+
+  if (keys != NULL && key != NULL) {
+    // Allocation failed before reaching the end
+    for (size_t i = 0; i < n; i++) {
+      free(keys[i]);
+    }
+    free(keys);
+    keys = NULL;
+  }
+
+  imagedIterFree(iter);
+  *count = n;
+  return keys;
+}
+
+ImagedStatus imagedForEach(Imaged *db, const ImagedForEachOptions *options,
+                           imagedForEachFn fn, void *userdata) {
+  if (db == NULL || fn == NULL) {
+    return IMAGED_ERR;
+  }
+
+  ImagedForEachOptions defaults = {0};
+  if (options == NULL) {
+    options = &defaults;
+  }
+
+  size_t count = 0;
+  char **keys = forEachKeys(db, &count);
+  if (keys == NULL) {
+    return IMAGED_ERR;
+  }
+
+  ForEachState state = {
+      .db = db,
+      .keys = keys,
+      .editable = options->editable,
+      .skip_locked = options->skip_locked,
+      .fn = fn,
+      .error = options->error,
+      .userdata = userdata,
+      .failed = 0,
+  };
+
+  ImagedPool *pool = options->pool ? options->pool : imagedPoolDefault();
+  ImagedStatus status = imagedPoolRun(pool, count, forEachTask, &state);
+  if (status == IMAGED_OK && state.failed > 0) {
+    status = IMAGED_ERR;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+  return status;
+}
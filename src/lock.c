@@ -0,0 +1,734 @@
+#define _GNU_SOURCE
+#include "imaged.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// Waiting for a lock uses a blocking flock, so the kernel wakes the waiter as
+// soon as the lock is released. On Linux the wait is bounded by a timer that
+// sends IMAGED_LOCK_SIGNAL to the waiting thread, which interrupts flock with
+// EINTR. The timer keeps firing at a short interval after the deadline in case
+// the first signal arrives before flock starts blocking. Other platforms fall
+// back to retrying with an increasing delay
+
+static struct timespec timespecFromNs(uint64_t ns) {
+  struct timespec ts = {
+      .tv_sec = ns / 1000000000ULL,
+      .tv_nsec = ns % 1000000000ULL,
+  };
+  return ts;
+}
+
+static bool lockWaitPoll(int fd, int op, uint64_t deadline) {
+  uint64_t delay = 1000000;
+  while (flock(fd, op | LOCK_NB) != 0) {
+    uint64_t now = imagedNanotime();
+    if (errno != EWOULDBLOCK || now >= deadline) {
+      return false;
+    }
+
+    struct timespec ts =
+        timespecFromNs(delay < deadline - now ? delay : deadline - now);
+    nanosleep(&ts, NULL);
+    if (delay < 32000000) {
+      delay *= 2;
+    }
+  }
+
+  return true;
+}
+
+#if defined(__linux__) && defined(SIGEV_THREAD_ID)
+#define LOCK_WAIT_TIMER
+#define LOCK_TIMER_INTERVAL 10000000
+
+// Older C libraries only provide the field under its internal name
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static pthread_once_t lockSignalOnce = PTHREAD_ONCE_INIT;
+static bool lockSignalInstalled = false;
+
+static void lockSignalHandler(int sig) { (void)sig; }
+
+static void lockSignalInit(void) {
+  // The handler is only installed when the application is not using the
+  // signal, SA_RESTART is not set so flock returns EINTR
+  struct sigaction sa, old;
+  if (IMAGED_LOCK_SIGNAL == 0 ||
+      sigaction(IMAGED_LOCK_SIGNAL, NULL, &old) != 0 ||
+      (old.sa_flags & SA_SIGINFO) || old.sa_handler != SIG_DFL) {
+    return;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = lockSignalHandler;
+  sigemptyset(&sa.sa_mask);
+  lockSignalInstalled = sigaction(IMAGED_LOCK_SIGNAL, &sa, NULL) == 0;
+}
+
+static bool lockWaitTimer(int fd, int op, uint64_t deadline) {
+  pthread_once(&lockSignalOnce, lockSignalInit);
+  if (!lockSignalInstalled) {
+    return lockWaitPoll(fd, op, deadline);
+  }
+
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = IMAGED_LOCK_SIGNAL;
+  sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+
+  timer_t timer;
+  if (timer_create(CLOCK_MONOTONIC, &sev, &timer) != 0) {
+    return lockWaitPoll(fd, op, deadline);
+  }
+
+  sigset_t set, old;
+  sigemptyset(&set);
+  sigaddset(&set, IMAGED_LOCK_SIGNAL);
+  pthread_sigmask(SIG_UNBLOCK, &set, &old);
+
+  uint64_t now = imagedNanotime();
+  struct itimerspec its = {
+      .it_value = timespecFromNs(deadline > now ? deadline - now : 1),
+      .it_interval = timespecFromNs(LOCK_TIMER_INTERVAL),
+  };
+
+  bool ok = false;
+  if (timer_settime(timer, 0, &its, NULL) == 0) {
+    while (!(ok = flock(fd, op) == 0)) {
+      if (errno != EINTR || imagedNanotime() >= deadline) {
+        break;
+      }
+    }
+  } else {
+    ok = lockWaitPoll(fd, op, deadline);
+  }
+
+  timer_delete(timer);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return ok;
+}
+#endif
+
+static void lockRecordWait(Imaged *db, uint64_t start, bool ok) {
+  if (db == NULL) {
+    return;
+  }
+
+  ImagedLockStats *stats = &db->locks;
+  uint64_t elapsed = imagedNanotime() - start;
+  __atomic_add_fetch(&stats->waits, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats->wait_ns, elapsed, __ATOMIC_RELAXED);
+  if (!ok) {
+    __atomic_add_fetch(&stats->timeouts, 1, __ATOMIC_RELAXED);
+  }
+
+  uint64_t max = __atomic_load_n(&stats->max_wait_ns, __ATOMIC_RELAXED);
+  while (elapsed > max &&
+         !__atomic_compare_exchange_n(&stats->max_wait_ns, &max, elapsed,
+                                      true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+  }
+}
+
+ImagedStatus imagedLockFile(Imaged *db, int fd, bool exclusive,
+                            int64_t timeout_ms) {
+  int op = exclusive ? LOCK_EX : LOCK_SH;
+  if (flock(fd, op | LOCK_NB) == 0) {
+    return IMAGED_OK;
+  }
+
+  if (errno != EWOULDBLOCK || timeout_ms == 0) {
+    return IMAGED_ERR_LOCKED;
+  }
+
+  uint64_t start = imagedNanotime();
+  bool ok;
+  if (timeout_ms < 0) {
+    while (!(ok = flock(fd, op) == 0) && errno == EINTR) {
+    }
+  } else {
+    uint64_t deadline = start + (uint64_t)timeout_ms * 1000000;
+#ifdef LOCK_WAIT_TIMER
+    ok = lockWaitTimer(fd, op, deadline);
+#else
+    ok = lockWaitPoll(fd, op, deadline);
+#endif
+  }
+
+  lockRecordWait(db, start, ok);
+  return ok ? IMAGED_OK : IMAGED_ERR_LOCKED;
+}
+
+void imagedGetLockStats(const Imaged *db, ImagedLockStats *stats) {
+  stats->waits = __atomic_load_n(&db->locks.waits, __ATOMIC_RELAXED);
+  stats->timeouts = __atomic_load_n(&db->locks.timeouts, __ATOMIC_RELAXED);
+  stats->wait_ns = __atomic_load_n(&db->locks.wait_ns, __ATOMIC_RELAXED);
+  stats->max_wait_ns =
+      __atomic_load_n(&db->locks.max_wait_ns, __ATOMIC_RELAXED);
+}
+
+// The shared-memory lock table is a file in the database root that every
+// process maps. Each slot holds a reader/writer lock word and the hash of the
+// key using it: the low 23 bits of the lock word count readers, LOCK_WRITER
+// marks an exclusive lock, the next 8 bits are the slot generation and the
+// high 32 bits hold the pid of the writer. Uncontended locks are a single
+// compare-and-swap, waiters sleep on a futex on the slot sequence number which
+// is incremented whenever the lock becomes free. Since the writer pid is part
+// of the lock word, a lock left behind by a writer that has exited can be
+// broken with a compare-and-swap without racing a new writer. Reader counts
+// cannot be attributed to a process, those are cleared by imagedResetLocks,
+// which also bumps the generation of every slot so that locks taken before the
+// reset are not released a second time.
+//
+// A key uses the first slot holding its hash within LOCK_PROBE slots of its
+// home slot. Slots are assigned while holding the table flock: a key without a
+// slot takes the first unused one, or one whose key is not locked when the
+// probe window is full. The hash is checked again after locking, so a locker
+// racing with the slot being given to another key retries
+
+#define LOCK_TABLE_MAGIC "IMGL"
+#define LOCK_TABLE_VERSION 2
+#define LOCK_READERS 0x7fffffULL
+#define LOCK_WRITER 0x800000ULL
+#define LOCK_GEN 0xff000000ULL
+#define LOCK_GEN_SHIFT 24
+#define LOCK_PROBE 16
+#define LOCK_CHECK_NS 100000000ULL // how often waiters look for dead writers
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t nslots;
+  uint32_t reserved[13];
+} LockTableHeader;
+
+struct ImagedLockSlot {
+  uint64_t state;   // writer pid << 32 | generation | LOCK_WRITER | readers
+  uint64_t hash;    // hash of the key using the slot, 0 when unused
+  uint32_t seq;     // incremented when the lock is released
+  uint32_t waiters; // number of threads sleeping on seq
+};
+
+struct ImagedLockTable {
+  int fd;
+  void *map;
+  size_t mapsize;
+  struct ImagedLockSlot *slots;
+  uint32_t nslots;
+  pthread_mutex_t assign; // the table flock only excludes other open files
+};
+
+static uint64_t lockHash(const char *key, ssize_t keylen) {
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  // 0 marks an unused slot
+  uint64_t h = imagedHashKey(key, keylen);
+  return h != 0 ? h : 1;
+}
+
+void imagedFutexWait(uint32_t *addr, uint32_t val, uint64_t timeout_ns) {
+#ifdef __linux__
+  struct timespec ts = timespecFromNs(timeout_ns);
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+  (void)addr;
+  (void)val;
+  struct timespec ts =
+      timespecFromNs(timeout_ns < 1000000 ? timeout_ns : 1000000);
+  nanosleep(&ts, NULL);
+#endif
+}
+
+void imagedFutexWake(uint32_t *addr) {
+#ifdef __linux__
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+  (void)addr;
+#endif
+}
+
+static uint32_t slotGen(uint64_t s) {
+  return (uint32_t)((s & LOCK_GEN) >> LOCK_GEN_SHIFT);
+}
+
+static bool slotHeld(uint64_t s) {
+  return (s & (LOCK_WRITER | LOCK_READERS)) != 0;
+}
+
+static void slotNotify(struct ImagedLockSlot *slot) {
+  __atomic_add_fetch(&slot->seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&slot->waiters, __ATOMIC_SEQ_CST) > 0) {
+    imagedFutexWake(&slot->seq);
+  }
+}
+
+static bool slotTryLock(struct ImagedLockSlot *slot, bool exclusive,
+                        uint32_t *gen) {
+  uint64_t s = __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+  for (;;) {
+    uint64_t next;
+    if (exclusive) {
+      if (slotHeld(s)) {
+        return false;
+      }
+      next = (uint64_t)(uint32_t)getpid() << 32 | (s & LOCK_GEN) | LOCK_WRITER;
+    } else {
+      if ((s & LOCK_WRITER) || (s & LOCK_READERS) == LOCK_READERS) {
+        return false;
+      }
+      next = s + 1;
+    }
+
+    if (__atomic_compare_exchange_n(&slot->state, &s, next, true,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      *gen = slotGen(s);
+      return true;
+    }
+  }
+}
+
+// Break the lock when it is held by a writer that no longer exists
+static bool slotRecover(struct ImagedLockSlot *slot) {
+  uint64_t s = __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+  pid_t owner = (pid_t)(s >> 32);
+  if (!(s & LOCK_WRITER) || owner <= 0 || owner == getpid() ||
+      kill(owner, 0) == 0 || errno != ESRCH) {
+    return false;
+  }
+
+  if (!__atomic_compare_exchange_n(&slot->state, &s, s & LOCK_GEN, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    return false;
+  }
+
+  slotNotify(slot);
+  return true;
+}
+
+// Release a lock taken in generation `gen`. Nothing is released when the
+// table was reset since, the lock is no longer held by the caller
+static void slotUnlock(struct ImagedLockSlot *slot, uint32_t gen,
+                       bool exclusive) {
+  uint64_t s = __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+  for (;;) {
+    if (slotGen(s) != gen) {
+      return;
+    }
+
+    uint64_t next;
+    if (exclusive) {
+      if (!(s & LOCK_WRITER) || (pid_t)(s >> 32) != getpid()) {
+        return;
+      }
+      next = s & LOCK_GEN;
+    } else {
+      if ((s & LOCK_WRITER) || (s & LOCK_READERS) == 0) {
+        return;
+      }
+      next = s - 1;
+    }
+
+    if (__atomic_compare_exchange_n(&slot->state, &s, next, true,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      // Only writers wait for readers
+      if (exclusive || (next & LOCK_READERS) == 0) {
+        slotNotify(slot);
+      }
+      return;
+    }
+  }
+}
+
+static ImagedStatus slotLock(Imaged *db, struct ImagedLockSlot *slot,
+                             bool exclusive, int64_t timeout_ms,
+                             uint32_t *gen) {
+  if (slotTryLock(slot, exclusive, gen) ||
+      (slotRecover(slot) && slotTryLock(slot, exclusive, gen))) {
+    return IMAGED_OK;
+  }
+
+  if (timeout_ms == 0) {
+    return IMAGED_ERR_LOCKED;
+  }
+
+  uint64_t start = imagedNanotime();
+  uint64_t deadline =
+      timeout_ms < 0 ? UINT64_MAX : start + (uint64_t)timeout_ms * 1000000;
+  bool ok = false;
+  for (;;) {
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST);
+    if (slotTryLock(slot, exclusive, gen)) {
+      ok = true;
+      break;
+    }
+
+    if (slotRecover(slot)) {
+      continue;
+    }
+
+    uint64_t now = imagedNanotime();
+    if (now >= deadline) {
+      break;
+    }
+
+    // Waits are bounded so a writer that exits without unlocking is noticed
+    uint64_t wait = deadline - now < LOCK_CHECK_NS ? deadline - now
+                                                   : LOCK_CHECK_NS;
+    __atomic_add_fetch(&slot->waiters, 1, __ATOMIC_SEQ_CST);
+    imagedFutexWait(&slot->seq, seq, wait);
+    __atomic_sub_fetch(&slot->waiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  lockRecordWait(db, start, ok);
+  return ok ? IMAGED_OK : IMAGED_ERR_LOCKED;
+}
+
+static struct ImagedLockTable *lockTableMap(int fd) {
+  struct stat st;
+  LockTableHeader header;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(header) ||
+      pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, LOCK_TABLE_MAGIC, 4) != 0 ||
+      header.version != LOCK_TABLE_VERSION || header.nslots == 0 ||
+      (header.nslots & (header.nslots - 1)) != 0) {
+    return NULL;
+  }
+
+  size_t size =
+      sizeof(header) + (size_t)header.nslots * sizeof(struct ImagedLockSlot);
+  if ((size_t)st.st_size < size) {
+    return NULL;
+  }
+
+  void *map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  struct ImagedLockTable *table = malloc(sizeof(struct ImagedLockTable));
+  if (table == NULL) {
+    munmap(map, size);
+    return NULL;
+  }
+
+  table->fd = fd;
+  table->map = map;
+  table->mapsize = size;
+  table->slots = (struct ImagedLockSlot *)((uint8_t *)map + sizeof(header));
+  table->nslots = header.nslots;
+  pthread_mutex_init(&table->assign, NULL);
+  return table;
+}
+
+struct ImagedLockTable *imagedLockTableOpen(const char *path, bool create) {
+  int fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  // The table is initialized while holding an exclusive lock, so concurrent
+  // opens never see a partially written header
+  flock(fd, create ? LOCK_EX : LOCK_SH);
+
+  struct stat st;
+  if (create && fstat(fd, &st) == 0 && st.st_size == 0) {
+    LockTableHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOCK_TABLE_MAGIC, 4);
+    header.version = LOCK_TABLE_VERSION;
+    header.nslots = IMAGED_LOCK_SLOTS;
+
+    // The slots are left as a hole in the file, which reads back as unused
+    if (ftruncate(fd, sizeof(header) + (off_t)IMAGED_LOCK_SLOTS *
+                                           sizeof(struct ImagedLockSlot)) !=
+            0 ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      ftruncate(fd, 0);
+    }
+  }
+
+  struct ImagedLockTable *table = lockTableMap(fd);
+  flock(fd, LOCK_UN);
+  if (table == NULL) {
+    close(fd);
+  }
+  return table;
+}
+
+void imagedLockTableClose(struct ImagedLockTable *table) {
+  if (table == NULL) {
+    return;
+  }
+
+  munmap(table->map, table->mapsize);
+  close(table->fd);
+  pthread_mutex_destroy(&table->assign);
+  free(table);
+}
+
+static void lockTableAssignBegin(struct ImagedLockTable *table) {
+  pthread_mutex_lock(&table->assign);
+  while (flock(table->fd, LOCK_EX) != 0 && errno == EINTR) {
+  }
+}
+
+static void lockTableAssignEnd(struct ImagedLockTable *table) {
+  flock(table->fd, LOCK_UN);
+  pthread_mutex_unlock(&table->assign);
+}
+
+// Find the slot used by a key, assigning one when `assign` is set. Returns
+// NULL when the key has no slot, or when every slot it can use is locked by
+// other keys
+static struct ImagedLockSlot *lockTableFind(struct ImagedLockTable *table,
+                                            uint64_t hash, bool assign) {
+  uint32_t mask = table->nslots - 1;
+  uint32_t probe = table->nslots < LOCK_PROBE ? table->nslots : LOCK_PROBE;
+  for (uint32_t i = 0; i < probe; i++) {
+    struct ImagedLockSlot *slot = &table->slots[(hash + i) & mask];
+    uint64_t h = __atomic_load_n(&slot->hash, __ATOMIC_SEQ_CST);
+    if (h == hash) {
+      return slot;
+    }
+    if (h == 0) {
+      break;
+    }
+  }
+
+  if (!assign) {
+    return NULL;
+  }
+
+  lockTableAssignBegin(table);
+  struct ImagedLockSlot *found = NULL;
+  for (uint32_t i = 0; found == NULL && i < probe; i++) {
+    struct ImagedLockSlot *slot = &table->slots[(hash + i) & mask];
+    uint64_t h = __atomic_load_n(&slot->hash, __ATOMIC_SEQ_CST);
+    if (h == 0) {
+      __atomic_store_n(&slot->hash, hash, __ATOMIC_SEQ_CST);
+    }
+    if (h == 0 || h == hash) {
+      found = slot;
+    }
+  }
+
+  // Take over a slot whose key is not locked. The slot is locked while its
+  // hash changes, so lockers of the previous key see the new hash afterwards
+  for (uint32_t i = 0; found == NULL && i < probe; i++) {
+    struct ImagedLockSlot *slot = &table->slots[(hash + i) & mask];
+    uint32_t gen;
+    if (slotTryLock(slot, true, &gen)) {
+      __atomic_store_n(&slot->hash, hash, __ATOMIC_SEQ_CST);
+      slotUnlock(slot, gen, true);
+      found = slot;
+    }
+  }
+  lockTableAssignEnd(table);
+  return found;
+}
+
+static ImagedStatus lockTableLock(Imaged *db, struct ImagedLockTable *table,
+                                  uint64_t hash, bool exclusive,
+                                  int64_t timeout_ms, ImagedKeyLock *lock) {
+  uint64_t deadline = timeout_ms < 0
+                          ? UINT64_MAX
+                          : imagedNanotime() + (uint64_t)timeout_ms * 1000000;
+  for (;;) {
+    uint64_t now = imagedNanotime();
+    int64_t remaining = timeout_ms < 0      ? -1
+                        : now >= deadline ? 0
+                                          : (int64_t)((deadline - now + 999999) /
+                                                      1000000);
+    struct ImagedLockSlot *slot = lockTableFind(table, hash, true);
+    if (slot != NULL) {
+      uint32_t gen;
+      ImagedStatus status = slotLock(db, slot, exclusive, remaining, &gen);
+      if (status != IMAGED_OK) {
+        return status;
+      }
+
+      if (__atomic_load_n(&slot->hash, __ATOMIC_SEQ_CST) == hash) {
+        lock->table = table;
+        lock->slot = slot;
+        lock->hash = hash;
+        lock->gen = gen;
+        return IMAGED_OK;
+      }
+
+      // The slot was given to another key while waiting
+      slotUnlock(slot, gen, exclusive);
+      continue;
+    }
+
+    // Every slot the key can use is held by other keys
+    if (remaining == 0) {
+      return IMAGED_ERR_LOCKED;
+    }
+
+    struct timespec ts =
+        timespecFromNs(deadline - now < 1000000 ? deadline - now : 1000000);
+    nanosleep(&ts, NULL);
+  }
+}
+
+void imagedLockTableReset(struct ImagedLockTable *table) {
+  if (table == NULL) {
+    return;
+  }
+
+  lockTableAssignBegin(table);
+  for (uint32_t i = 0; i < table->nslots; i++) {
+    struct ImagedLockSlot *slot = &table->slots[i];
+    uint64_t s = __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+    uint64_t next;
+    do {
+      next = (uint64_t)((slotGen(s) + 1) & 0xff) << LOCK_GEN_SHIFT;
+    } while (!__atomic_compare_exchange_n(&slot->state, &s, next, true,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    __atomic_store_n(&slot->hash, 0, __ATOMIC_SEQ_CST);
+    if (slotHeld(s)) {
+      slotNotify(slot);
+    }
+  }
+  lockTableAssignEnd(table);
+}
+
+bool imagedLockTableIsLocked(struct ImagedLockTable *table, const char *key,
+                             ssize_t keylen) {
+  struct ImagedLockSlot *slot =
+      lockTableFind(table, lockHash(key, keylen), false);
+  return slot != NULL &&
+         slotHeld(__atomic_load_n(&slot->state, __ATOMIC_SEQ_CST));
+}
+
+static char *lockTablePath(const Imaged *db) {
+  size_t n = strlen(db->root) + strlen(IMAGED_LOCK_TABLE) + 2;
+  char *path = malloc(n);
+  if (path != NULL) {
+    snprintf(path, n, "%s%c%s", db->root, IMAGED_PATH_SEP, IMAGED_LOCK_TABLE);
+  }
+  return path;
+}
+
+// Use `table` unless another thread has already set the lock table of `db`
+static struct ImagedLockTable *lockTableAttach(Imaged *db,
+                                               struct ImagedLockTable *table) {
+  struct ImagedLockTable *current = NULL;
+  if (table != NULL &&
+      !__atomic_compare_exchange_n(&db->lock_table, &current, table, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    imagedLockTableClose(table);
+    return current;
+  }
+  return table;
+}
+
+ImagedStatus imagedEnableSharedLocks(Imaged *db) {
+  if (__atomic_load_n(&db->lock_table, __ATOMIC_SEQ_CST) != NULL) {
+    return IMAGED_OK;
+  }
+
+  char *path = lockTablePath(db);
+  if (path == NULL) {
+    return IMAGED_ERR;
+  }
+
+  struct ImagedLockTable *table =
+      lockTableAttach(db, imagedLockTableOpen(path, true));
+  free(path);
+  return table != NULL ? IMAGED_OK : IMAGED_ERR_CANNOT_CREATE_FILE;
+}
+
+bool imagedHasSharedLocks(const Imaged *db) {
+  return __atomic_load_n(&db->lock_table, __ATOMIC_SEQ_CST) != NULL;
+}
+
+// Directory timestamps can be as coarse as a second, a lock table created
+// within the same tick as an earlier check would not change the mtime
+#define LOCK_STAMP_SLACK 1000000000LL
+
+int64_t imagedLockTableStamp(const Imaged *db) {
+  struct stat st;
+  struct timespec now;
+  if (stat(db->root, &st) != 0 || clock_gettime(CLOCK_REALTIME, &now) != 0) {
+    return -1;
+  }
+
+#ifdef __APPLE__
+  int64_t mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 +
+                  st.st_mtimespec.tv_nsec;
+#else
+  int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+  int64_t ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  return ns - mtime > LOCK_STAMP_SLACK ? mtime : -1;
+}
+
+ImagedStatus imagedLockKey(Imaged *db, const char *key, ssize_t keylen,
+                           int fd, bool exclusive, int64_t timeout_ms,
+                           ImagedKeyLock *lock) {
+  bzero(lock, sizeof(ImagedKeyLock));
+  struct ImagedLockTable *table =
+      __atomic_load_n(&db->lock_table, __ATOMIC_SEQ_CST);
+  if (table == NULL) {
+    // The table may have been created by another process since the database
+    // was opened, from then on it has to be used instead of flock. Creating it
+    // changes the directory mtime, so it is only looked for when that changed
+    int64_t stamp = imagedLockTableStamp(db);
+    if (stamp < 0 ||
+        stamp != __atomic_load_n(&db->lock_table_mtime, __ATOMIC_RELAXED)) {
+      char *path = lockTablePath(db);
+      if (path == NULL) {
+        return IMAGED_ERR;
+      }
+      table = lockTableAttach(db, imagedLockTableOpen(path, false));
+      free(path);
+      if (table == NULL) {
+        __atomic_store_n(&db->lock_table_mtime, stamp, __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  if (table == NULL) {
+    return imagedLockFile(db, fd, exclusive, timeout_ms);
+  }
+
+  return lockTableLock(db, table, lockHash(key, keylen), exclusive, timeout_ms,
+                       lock);
+}
+
+ImagedStatus imagedRelockKey(int fd, ImagedKeyLock *lock, bool exclusive) {
+  if (lock->table != NULL) {
+    return lockTableLock(NULL, lock->table, lock->hash, exclusive, 0, lock);
+  }
+  return imagedLockFile(NULL, fd, exclusive, 0);
+}
+
+void imagedUnlockKey(int fd, const ImagedKeyLock *lock, bool exclusive) {
+  if (lock->table != NULL) {
+    slotUnlock(lock->slot, lock->gen, exclusive);
+  } else if (fd >= 0) {
+    flock(fd, LOCK_UN);
+  }
+}
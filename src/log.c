@@ -0,0 +1,295 @@
+#define _DEFAULT_SOURCE
+#include "imaged.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Append-only log of set/remove records shared by the catalog and packs. The
+// records are replayed into an array of entries indexed by an open-addressing
+// hash table. The first page of the file is mapped by every process using
+// it: `end` is the number of bytes of complete records, so checking for new
+// records is a memory read. Writers serialize appends themselves, usually
+// with flock on the log file
+
+void imagedLogInit(ImagedLog *log, uint64_t (*size)(const ImagedLogRecord *),
+                   bool (*valid)(const ImagedLogRecord *)) {
+  bzero(log, sizeof(ImagedLog));
+  log->fd = -1;
+  log->size = size;
+  log->valid = valid;
+}
+
+void imagedLogClear(ImagedLog *log) {
+  for (size_t i = 0; i < log->count; i++) {
+    free(log->entries[i].key);
+  }
+  free(log->entries);
+  free(log->index);
+  log->entries = NULL;
+  log->index = NULL;
+  log->count = log->cap = log->live = log->indexcap = 0;
+  log->records = log->live_bytes = log->dead_bytes = 0;
+}
+
+void imagedLogUnmap(ImagedLog *log) {
+  if (log->header != NULL) {
+    munmap(log->header, IMAGED_LOG_HEADER_SIZE);
+    log->header = NULL;
+  }
+
+  if (log->fd >= 0) {
+    close(log->fd);
+    log->fd = -1;
+  }
+
+  log->loaded = 0;
+}
+
+// Index slots store entry index + 1, 0 marks an empty slot
+static bool logReindex(ImagedLog *log, size_t indexcap) {
+  uint32_t *index = calloc(indexcap, sizeof(uint32_t));
+  if (index == NULL) {
+    return false;
+  }
+
+  for (size_t i = 0; i < log->count; i++) {
+    size_t slot = imagedHashKey(log->entries[i].key, log->entries[i].keylen) &
+                  (indexcap - 1);
+    while (index[slot] != 0) {
+      slot = (slot + 1) & (indexcap - 1);
+    }
+    index[slot] = i + 1;
+  }
+
+  free(log->index);
+  log->index = index;
+  log->indexcap = indexcap;
+  return true;
+}
+
+ImagedLogEntry *imagedLogFind(const ImagedLog *log, const char *key,
+                              size_t keylen) {
+  if (log->indexcap == 0) {
+    return NULL;
+  }
+
+  size_t slot = imagedHashKey(key, keylen) & (log->indexcap - 1);
+  while (log->index[slot] != 0) {
+    ImagedLogEntry *entry = &log->entries[log->index[slot] - 1];
+    if (entry->keylen == keylen && memcmp(entry->key, key, keylen) == 0) {
+      return entry;
+    }
+    slot = (slot + 1) & (log->indexcap - 1);
+  }
+
+  return NULL;
+}
+
+bool imagedLogApply(ImagedLog *log, const ImagedLogRecord *rec,
+                    const char *key) {
+  log->records += 1;
+
+  ImagedLogEntry *entry = imagedLogFind(log, key, rec->keylen);
+  if (entry == NULL) {
+    if (rec->op == IMAGED_LOG_REMOVE) {
+      return true;
+    }
+
+    if ((log->count + 1) * 10 > log->indexcap * 7 &&
+        !logReindex(log, log->indexcap ? log->indexcap * 2 : 1024)) {
+      return false;
+    }
+
+    if (log->count == log->cap) {
+      size_t cap = log->cap ? log->cap * 2 : 256;
+      ImagedLogEntry *entries =
+          realloc(log->entries, cap * sizeof(ImagedLogEntry));
+      if (entries == NULL) {
+        return false;
+      }
+      log->entries = entries;
+      log->cap = cap;
+    }
+
+    entry = &log->entries[log->count];
+    entry->key = strndup(key, rec->keylen);
+    if (entry->key == NULL) {
+      return false;
+    }
+    entry->keylen = rec->keylen;
+    entry->live = false;
+
+    size_t slot = imagedHashKey(key, rec->keylen) & (log->indexcap - 1);
+    while (log->index[slot] != 0) {
+      slot = (slot + 1) & (log->indexcap - 1);
+    }
+    log->index[slot] = ++log->count;
+  }
+
+  // The previous value is dead once it is replaced or removed
+  if (entry->live) {
+    log->live_bytes -= entry->size;
+    log->dead_bytes += entry->size;
+    log->live -= 1;
+  }
+
+  entry->live = rec->op == IMAGED_LOG_SET;
+  entry->meta = rec->meta;
+  entry->value[0] = rec->value[0];
+  entry->value[1] = rec->value[1];
+  entry->size = 0;
+  if (entry->live) {
+    entry->size = log->size != NULL ? log->size(rec) : 0;
+    log->live_bytes += entry->size;
+    log->live += 1;
+  }
+  return true;
+}
+
+bool imagedLogReplay(ImagedLog *log, uint64_t end) {
+  size_t bufsize = 1 << 20;
+  uint8_t *buf = NULL;
+  bool ok = true;
+
+  while (ok && log->loaded < end) {
+    size_t n = end - log->loaded < bufsize ? end - log->loaded : bufsize;
+    if (buf == NULL && (buf = malloc(bufsize)) == NULL) {
+      return false;
+    }
+
+    if (pread(log->fd, buf, n, log->loaded) != (ssize_t)n) {
+      ok = false;
+      break;
+    }
+
+    size_t i = 0;
+    while (i + sizeof(ImagedLogRecord) <= n) {
+      ImagedLogRecord rec;
+      memcpy(&rec, buf + i, sizeof(rec));
+      if (rec.size < sizeof(ImagedLogRecord) + rec.keylen ||
+          rec.size > bufsize ||
+          (rec.op == IMAGED_LOG_SET && log->valid != NULL &&
+           !log->valid(&rec))) {
+        ok = false;
+        break;
+      }
+
+      if (i + rec.size > n) {
+        break;
+      }
+
+      if (!imagedLogApply(log, &rec, (const char *)buf + i + sizeof(rec))) {
+        ok = false;
+        break;
+      }
+      i += rec.size;
+    }
+
+    // Records never cross `end`, no progress means the log is corrupt
+    if (ok && i == 0) {
+      ok = false;
+    }
+    log->loaded += i;
+  }
+
+  free(buf);
+  return ok;
+}
+
+bool imagedLogMap(ImagedLog *log, int fd, const char magic[4],
+                  uint32_t version) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < IMAGED_LOG_HEADER_SIZE) {
+    return false;
+  }
+
+  ImagedLogHeader *header = mmap(0, IMAGED_LOG_HEADER_SIZE,
+                                 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED) {
+    return false;
+  }
+
+  if (memcmp(header->magic, magic, sizeof(header->magic)) != 0 ||
+      header->version != version) {
+    munmap(header, IMAGED_LOG_HEADER_SIZE);
+    return false;
+  }
+
+  log->fd = fd;
+  log->header = header;
+  log->loaded = IMAGED_LOG_HEADER_SIZE;
+  return true;
+}
+
+bool imagedLogReplaced(const ImagedLog *log) {
+  return log->header == NULL ||
+         (__atomic_load_n(&log->header->flags, __ATOMIC_ACQUIRE) &
+          IMAGED_LOG_REPLACED);
+}
+
+ImagedLogRecord imagedLogRecord(uint32_t op, size_t keylen) {
+  ImagedLogRecord rec;
+  bzero(&rec, sizeof(rec));
+  rec.op = op;
+  rec.keylen = keylen;
+  rec.size = (sizeof(ImagedLogRecord) + keylen + 7) / 8 * 8;
+  return rec;
+}
+
+bool imagedLogWrite(int fd, ImagedLogHeader *header,
+                    const ImagedLogRecord *rec, const char *key) {
+  uint8_t stackbuf[512];
+  uint8_t *buf = rec->size <= sizeof(stackbuf) ? stackbuf : malloc(rec->size);
+  if (buf == NULL) {
+    return false;
+  }
+
+  bzero(buf, rec->size);
+  memcpy(buf, rec, sizeof(ImagedLogRecord));
+  memcpy(buf + sizeof(ImagedLogRecord), key, rec->keylen);
+
+  uint64_t end = __atomic_load_n(&header->end, __ATOMIC_ACQUIRE);
+  bool ok = pwrite(fd, buf, rec->size, end) == (ssize_t)rec->size;
+  if (ok) {
+    __atomic_store_n(&header->end, end + rec->size, __ATOMIC_RELEASE);
+  }
+
+  if (buf != stackbuf) {
+    free(buf);
+  }
+  return ok;
+}
+
+bool imagedLogWriteHeader(int fd, const char magic[4], uint32_t version) {
+  ImagedLogHeader header = {
+      .version = version,
+      .end = IMAGED_LOG_HEADER_SIZE,
+  };
+  memcpy(header.magic, magic, sizeof(header.magic));
+  return ftruncate(fd, IMAGED_LOG_HEADER_SIZE) == 0 &&
+         pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+}
+
+int imagedLogOpenFile(const char *path, const char *tmp, const char magic[4],
+                      uint32_t version) {
+  int fd = open(path, O_RDWR);
+  if (fd >= 0 || errno != ENOENT) {
+    return fd;
+  }
+
+  // The header is written before the file is linked into place so other
+  // processes never see a partial header
+  fd = open(tmp, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (fd >= 0 &&
+      (!imagedLogWriteHeader(fd, magic, version) || link(tmp, path) != 0)) {
+    int err = errno;
+    close(fd);
+    fd = err == EEXIST ? open(path, O_RDWR) : -1;
+  }
+  unlink(tmp);
+  return fd;
+}
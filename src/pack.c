@@ -0,0 +1,597 @@
+#define _DEFAULT_SOURCE
+#include "imaged.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A pack is a directory holding segment files, which image data is appended
+// to, and an index: an ImagedLog of set/remove records that map keys to a
+// segment and offset. The header page of the index also holds the segment new
+// data is appended to. Appends are serialized using flock on the index. Data
+// is written before the record that refers to it, so readers never see a
+// partially written entry.
+//
+// Each segment is mapped once with a fixed size, so the mapping never moves as
+// the file grows and entries returned by imagedPackGet stay valid until the
+// pack is closed. Compaction copies the live entries to new segments and
+// writes a new index, which is renamed into place. The old index is marked as
+// replaced, which causes other processes to reload, and the old segments are
+// unlinked; processes that still have them mapped keep their data. The space
+// is only freed once every process unmaps them, which happens when the pack is
+// closed or when imagedPackRelease is called
+
+#define PACK_VERSION 1
+#define PACK_ALIGN 64
+#define PACK_INDEX "index"
+
+typedef struct {
+  ImagedLogHeader log;
+  uint64_t segment; // segment entries are appended to, 0 when there is none
+} PackHeader;
+
+// Fields of ImagedLogRecord.value
+enum {
+  PACK_SEGMENT,
+  PACK_OFFSET,
+};
+
+typedef struct {
+  uint64_t id;
+  int fd;
+  void *map;
+} PackSegment;
+
+struct ImagedPack {
+  pthread_mutex_t lock;
+  char *root;
+  ImagedLog log;
+  PackSegment *segments; // every segment mapped by this process
+  size_t nsegments;
+};
+
+static const char _pack_magic[4] = "IMGP";
+
+static uint64_t entrySize(const ImageMeta *meta) {
+  return (imageMetaTotalBytes(meta) + PACK_ALIGN - 1) / PACK_ALIGN *
+         PACK_ALIGN;
+}
+
+// Live entries count the space they take up in a segment
+static uint64_t recordSize(const ImagedLogRecord *rec) {
+  return entrySize(&rec->meta);
+}
+
+static bool recordValid(const ImagedLogRecord *rec) {
+  return rec->value[PACK_OFFSET] + entrySize(&rec->meta) <=
+         IMAGED_PACK_SEGMENT_SIZE;
+}
+
+static PackHeader *packHeader(const ImagedPack *pack) {
+  return (PackHeader *)pack->log.header;
+}
+
+static char *packPath(const ImagedPack *pack, const char *name) {
+  return imagedStringPrintf("%s%c%s", pack->root, IMAGED_PATH_SEP, name);
+}
+
+static char *segmentPath(const ImagedPack *pack, uint64_t id) {
+  return imagedStringPrintf("%s%csegment.%08llu", pack->root, IMAGED_PATH_SEP,
+                            (unsigned long long)id);
+}
+
+// Write a new index header to `fd`
+static bool packWriteHeader(int fd, uint64_t segment) {
+  return imagedLogWriteHeader(fd, _pack_magic, PACK_VERSION) &&
+         pwrite(fd, &segment, sizeof(segment),
+                offsetof(PackHeader, segment)) == sizeof(segment);
+}
+
+// Open the index, creating an empty one when there is none
+static bool packOpenIndex(ImagedPack *pack) {
+  char name[64];
+  snprintf(name, sizeof(name), PACK_INDEX ".%ld", (long)getpid());
+  char *path = packPath(pack, PACK_INDEX);
+  char *tmp = packPath(pack, name);
+
+  if (path != NULL && tmp != NULL) {
+    int fd = imagedLogOpenFile(path, tmp, _pack_magic, PACK_VERSION);
+    if (fd >= 0 && !imagedLogMap(&pack->log, fd, _pack_magic, PACK_VERSION)) {
+      close(fd);
+    }
+  }
+
+  free(path);
+  free(tmp);
+  return pack->log.header != NULL;
+}
+
+// Bring the in-memory index up to date, reloading it when the index file was
+// replaced by compaction. Called with pack->lock held
+static bool packRefresh(ImagedPack *pack) {
+  for (int attempt = 0; attempt < 4; attempt++) {
+    if (!imagedLogReplaced(&pack->log)) {
+      return imagedLogReplay(&pack->log, __atomic_load_n(&pack->log.header->end,
+                                                         __ATOMIC_ACQUIRE));
+    }
+
+    imagedLogClear(&pack->log);
+    imagedLogUnmap(&pack->log);
+    if (!packOpenIndex(pack)) {
+      return false;
+    }
+  }
+
+  return false;
+}
+
+static PackSegment *packSegment(ImagedPack *pack, uint64_t id, bool create) {
+  for (size_t i = 0; i < pack->nsegments; i++) {
+    if (pack->segments[i].id == id) {
+      return &pack->segments[i];
+    }
+  }
+
+  PackSegment *segments =
+      realloc(pack->segments, (pack->nsegments + 1) * sizeof(PackSegment));
+  if (segments == NULL) {
+    return NULL;
+  }
+  pack->segments = segments;
+
+  char *path = segmentPath(pack, id);
+  int fd = path != NULL ? open(path, O_RDWR | (create ? O_CREAT : 0), 0644)
+                        : -1;
+  if (fd < 0 && path != NULL && errno == EACCES) {
+    fd = open(path, O_RDONLY);
+  }
+  free(path);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  // The mapping covers the largest possible segment, pages past the end of
+  // the file are never accessed since records are written after the data
+  void *map =
+      mmap(0, IMAGED_PACK_SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+
+  PackSegment *seg = &pack->segments[pack->nsegments++];
+  seg->id = id;
+  seg->fd = fd;
+  seg->map = map;
+  return seg;
+}
+
+// Lock the current index for writing, reloading it if it was replaced.
+// Called with pack->lock held
+static bool packLockIndex(ImagedPack *pack) {
+  for (int attempt = 0; attempt < 4; attempt++) {
+    if (!packRefresh(pack)) {
+      return false;
+    }
+
+    // Records appended by other processes while waiting for the lock are
+    // loaded before anything is written or rewritten
+    flock(pack->log.fd, LOCK_EX);
+    if (!imagedLogReplaced(&pack->log)) {
+      if (imagedLogReplay(&pack->log, __atomic_load_n(&pack->log.header->end,
+                                                      __ATOMIC_ACQUIRE))) {
+        return true;
+      }
+      flock(pack->log.fd, LOCK_UN);
+      return false;
+    }
+    flock(pack->log.fd, LOCK_UN);
+  }
+
+  return false;
+}
+
+// Append `size` bytes to the current segment, starting a new one when it is
+// full. The index must be locked
+static ImagedStatus packAppend(ImagedPack *pack, const void *data,
+                               uint64_t size, uint64_t *segment,
+                               uint64_t *offset) {
+  uint64_t id = packHeader(pack)->segment;
+  struct stat st;
+  PackSegment *seg = id > 0 ? packSegment(pack, id, true) : NULL;
+  uint64_t off = 0;
+  if (seg != NULL && fstat(seg->fd, &st) == 0) {
+    off = ((uint64_t)st.st_size + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+  }
+
+  if (seg == NULL || off + size > IMAGED_PACK_SEGMENT_SIZE) {
+    id += 1;
+    off = 0;
+    seg = packSegment(pack, id, true);
+    if (seg == NULL) {
+      return IMAGED_ERR_CANNOT_CREATE_FILE;
+    }
+  }
+
+  // Images without data are left as a hole, which reads back as zero
+  if (data != NULL ? pwrite(seg->fd, data, size, off) != (ssize_t)size
+                   : ftruncate(seg->fd, off + size) != 0) {
+    return IMAGED_ERR_SEEK;
+  }
+
+  packHeader(pack)->segment = id;
+  *segment = id;
+  *offset = off;
+  return IMAGED_OK;
+}
+
+ImagedPack *imagedPackOpen(const char *path) {
+  mkdir(path, 0755);
+
+  ImagedPack *pack = calloc(1, sizeof(ImagedPack));
+  if (pack == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&pack->lock, NULL);
+  imagedLogInit(&pack->log, recordSize, recordValid);
+  pack->root = strdup(path);
+  if (pack->root == NULL || !packOpenIndex(pack) ||
+      !imagedLogReplay(&pack->log, __atomic_load_n(&pack->log.header->end,
+                                                   __ATOMIC_ACQUIRE))) {
+    imagedPackClose(pack);
+    return NULL;
+  }
+
+  return pack;
+}
+
+void imagedPackClose(ImagedPack *pack) {
+  if (pack == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < pack->nsegments; i++) {
+    munmap(pack->segments[i].map, IMAGED_PACK_SEGMENT_SIZE);
+    close(pack->segments[i].fd);
+  }
+
+  free(pack->segments);
+  imagedLogClear(&pack->log);
+  imagedLogUnmap(&pack->log);
+  pthread_mutex_destroy(&pack->lock);
+  free(pack->root);
+  free(pack);
+}
+
+ImagedStatus imagedPackSet(ImagedPack *pack, const char *key, ssize_t keylen,
+                           const ImageMeta *meta, const void *imagedata) {
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  uint64_t size = imageMetaTotalBytes(meta);
+  if (size > IMAGED_PACK_SEGMENT_SIZE) {
+    return IMAGED_ERR;
+  }
+
+  pthread_mutex_lock(&pack->lock);
+  if (!packLockIndex(pack)) {
+    pthread_mutex_unlock(&pack->lock);
+    return IMAGED_ERR;
+  }
+
+  ImagedLogRecord rec = imagedLogRecord(IMAGED_LOG_SET, keylen);
+  rec.meta = *meta;
+  ImagedStatus status = packAppend(pack, imagedata, size,
+                                   &rec.value[PACK_SEGMENT],
+                                   &rec.value[PACK_OFFSET]);
+  if (status == IMAGED_OK &&
+      !imagedLogWrite(pack->log.fd, pack->log.header, &rec, key)) {
+    status = IMAGED_ERR_SEEK;
+  }
+
+  flock(pack->log.fd, LOCK_UN);
+  if (status == IMAGED_OK && !packRefresh(pack)) {
+    status = IMAGED_ERR;
+  }
+  pthread_mutex_unlock(&pack->lock);
+  return status;
+}
+
+ImagedStatus imagedPackGet(ImagedPack *pack, const char *key, ssize_t keylen,
+                           Image *image) {
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  ImagedStatus status = IMAGED_ERR_FILE_DOES_NOT_EXIST;
+  pthread_mutex_lock(&pack->lock);
+  if (!packRefresh(pack)) {
+    pthread_mutex_unlock(&pack->lock);
+    return IMAGED_ERR;
+  }
+
+  ImagedLogEntry *entry = imagedLogFind(&pack->log, key, keylen);
+  if (entry != NULL && entry->live) {
+    PackSegment *seg =
+        packSegment(pack, entry->value[PACK_SEGMENT], false);
+    if (seg == NULL) {
+      status = IMAGED_ERR_INVALID_FILE;
+    } else {
+      if (image != NULL) {
+        image->owner = false;
+        image->meta = entry->meta;
+        image->data = (uint8_t *)seg->map + entry->value[PACK_OFFSET];
+      }
+      status = IMAGED_OK;
+    }
+  }
+
+  pthread_mutex_unlock(&pack->lock);
+  return status;
+}
+
+bool imagedPackHasKey(ImagedPack *pack, const char *key, ssize_t keylen) {
+  return imagedPackGet(pack, key, keylen, NULL) == IMAGED_OK;
+}
+
+ImagedStatus imagedPackRemove(ImagedPack *pack, const char *key,
+                              ssize_t keylen) {
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  pthread_mutex_lock(&pack->lock);
+  if (!packLockIndex(pack)) {
+    pthread_mutex_unlock(&pack->lock);
+    return IMAGED_ERR;
+  }
+
+  ImagedStatus status = IMAGED_OK;
+  ImagedLogEntry *entry = imagedLogFind(&pack->log, key, keylen);
+  if (entry == NULL || !entry->live) {
+    status = IMAGED_ERR_FILE_DOES_NOT_EXIST;
+  } else {
+    ImagedLogRecord rec = imagedLogRecord(IMAGED_LOG_REMOVE, keylen);
+    if (!imagedLogWrite(pack->log.fd, pack->log.header, &rec, key)) {
+      status = IMAGED_ERR_SEEK;
+    }
+  }
+
+  flock(pack->log.fd, LOCK_UN);
+  if (status == IMAGED_OK && !packRefresh(pack)) {
+    status = IMAGED_ERR;
+  }
+  pthread_mutex_unlock(&pack->lock);
+  return status;
+}
+
+bool imagedPackNext(ImagedPack *pack, size_t *index, ImagedPackEntry *entry) {
+  bool found = false;
+  pthread_mutex_lock(&pack->lock);
+  if (*index == 0 && !packRefresh(pack)) {
+    pthread_mutex_unlock(&pack->lock);
+    return false;
+  }
+
+  while (!found && *index < pack->log.count) {
+    ImagedLogEntry *e = &pack->log.entries[(*index)++];
+    PackSegment *seg =
+        e->live ? packSegment(pack, e->value[PACK_SEGMENT], false) : NULL;
+    if (seg == NULL) {
+      continue;
+    }
+
+    entry->key = e->key;
+    entry->keylen = e->keylen;
+    entry->image.owner = false;
+    entry->image.meta = e->meta;
+    entry->image.data = (uint8_t *)seg->map + e->value[PACK_OFFSET];
+    found = true;
+  }
+
+  pthread_mutex_unlock(&pack->lock);
+  return found;
+}
+
+void imagedPackGetStats(ImagedPack *pack, ImagedPackStats *stats) {
+  pthread_mutex_lock(&pack->lock);
+  packRefresh(pack);
+  stats->keys = pack->log.live;
+  stats->live_bytes = pack->log.live_bytes;
+  stats->dead_bytes = pack->log.dead_bytes;
+  stats->segment = pack->log.header != NULL ? packHeader(pack)->segment : 0;
+  stats->mapped = pack->nsegments;
+  pthread_mutex_unlock(&pack->lock);
+}
+
+// Unlink segment files with an id lower than `first`
+static void packUnlinkSegments(const ImagedPack *pack, uint64_t first) {
+  DIR *dir = opendir(pack->root);
+  if (dir == NULL) {
+    return;
+  }
+
+  struct dirent *ent;
+  unsigned long long id;
+  while ((ent = readdir(dir))) {
+    if (sscanf(ent->d_name, "segment.%llu", &id) == 1 && id < first) {
+      unlinkat(dirfd(dir), ent->d_name, 0);
+    }
+  }
+  closedir(dir);
+}
+
+// Copy the live entries to new segments and write a new index for them. The
+// index is locked and pack->lock is held
+static ImagedStatus packRewrite(ImagedPack *pack, const char *tmp,
+                                uint64_t first) {
+  int fd = open(tmp, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (fd < 0) {
+    return IMAGED_ERR_CANNOT_CREATE_FILE;
+  }
+
+  // The first new segment is created even when there are no entries, segment
+  // ids are never reused since other processes may still have an old segment
+  // with the same id mapped. Looking up a segment can move the segment array,
+  // so only the file descriptor of the destination is kept
+  uint64_t id = first, off = 0;
+  PackSegment *dst = packSegment(pack, id, true);
+  int dstfd = dst != NULL ? dst->fd : -1;
+  ImagedStatus status =
+      dstfd >= 0 && packWriteHeader(fd, id) ? IMAGED_OK : IMAGED_ERR_SEEK;
+  uint64_t end = IMAGED_LOG_HEADER_SIZE;
+
+  for (size_t i = 0; status == IMAGED_OK && i < pack->log.count; i++) {
+    ImagedLogEntry *e = &pack->log.entries[i];
+    PackSegment *src =
+        e->live ? packSegment(pack, e->value[PACK_SEGMENT], false) : NULL;
+    if (src == NULL) {
+      continue;
+    }
+
+    const uint8_t *data = (const uint8_t *)src->map + e->value[PACK_OFFSET];
+    uint64_t size = imageMetaTotalBytes(&e->meta);
+    if (off + size > IMAGED_PACK_SEGMENT_SIZE) {
+      id += 1;
+      off = 0;
+      dst = packSegment(pack, id, true);
+      if (dst == NULL) {
+        status = IMAGED_ERR_CANNOT_CREATE_FILE;
+        break;
+      }
+      dstfd = dst->fd;
+    }
+
+    ImagedLogRecord rec = imagedLogRecord(IMAGED_LOG_SET, e->keylen);
+    rec.meta = e->meta;
+    rec.value[PACK_SEGMENT] = id;
+    rec.value[PACK_OFFSET] = off;
+    if (pwrite(dstfd, data, size, off) != (ssize_t)size) {
+      status = IMAGED_ERR_SEEK;
+      break;
+    }
+    off += entrySize(&e->meta);
+
+    ImagedLogHeader cursor = {.end = end};
+    if (!imagedLogWrite(fd, &cursor, &rec, e->key)) {
+      status = IMAGED_ERR_SEEK;
+      break;
+    }
+    end = cursor.end;
+  }
+
+  // `end` and the segment are only set once all records are in place
+  PackHeader header;
+  if (status == IMAGED_OK &&
+      pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    status = IMAGED_ERR_SEEK;
+  }
+
+  header.log.end = end;
+  header.segment = id;
+  if (status == IMAGED_OK &&
+      pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    status = IMAGED_ERR_SEEK;
+  }
+
+  close(fd);
+  return status;
+}
+
+ImagedStatus imagedPackCompact(ImagedPack *pack) {
+  pthread_mutex_lock(&pack->lock);
+  if (!packLockIndex(pack)) {
+    pthread_mutex_unlock(&pack->lock);
+    return IMAGED_ERR;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), PACK_INDEX ".%ld", (long)getpid());
+  char *path = packPath(pack, PACK_INDEX);
+  char *tmp = packPath(pack, name);
+  uint64_t first = packHeader(pack)->segment + 1;
+
+  ImagedStatus status = IMAGED_ERR;
+  if (path != NULL && tmp != NULL) {
+    status = packRewrite(pack, tmp, first);
+    if (status == IMAGED_OK && rename(tmp, path) != 0) {
+      status = IMAGED_ERR;
+    }
+  }
+
+  if (status == IMAGED_OK) {
+    // Writers waiting on the old index see the flag once they get the lock
+    __atomic_or_fetch(&pack->log.header->flags, IMAGED_LOG_REPLACED,
+                      __ATOMIC_RELEASE);
+    flock(pack->log.fd, LOCK_UN);
+    packUnlinkSegments(pack, first);
+    if (!packRefresh(pack)) {
+      status = IMAGED_ERR;
+    }
+  } else {
+    // Segments written for the new index are not referenced by anything
+    if (tmp != NULL) {
+      unlink(tmp);
+    }
+    flock(pack->log.fd, LOCK_UN);
+  }
+
+  free(path);
+  free(tmp);
+  pthread_mutex_unlock(&pack->lock);
+  return status;
+}
+
+void imagedPackRelease(ImagedPack *pack) {
+  pthread_mutex_lock(&pack->lock);
+  packRefresh(pack);
+
+  // Keep the segments live entries and new appends refer to
+  size_t n = 0;
+  for (size_t i = 0; i < pack->nsegments; i++) {
+    PackSegment *seg = &pack->segments[i];
+    bool used =
+        pack->log.header != NULL && seg->id == packHeader(pack)->segment;
+    for (size_t j = 0; !used && j < pack->log.count; j++) {
+      const ImagedLogEntry *e = &pack->log.entries[j];
+      used = e->live && e->value[PACK_SEGMENT] == seg->id;
+    }
+
+    if (used) {
+      pack->segments[n++] = *seg;
+    } else {
+      munmap(seg->map, IMAGED_PACK_SEGMENT_SIZE);
+      close(seg->fd);
+    }
+  }
+  pack->nsegments = n;
+  pthread_mutex_unlock(&pack->lock);
+}
+
+ImagedStatus imagedPackDestroy(ImagedPack *pack) {
+  DIR *dir = opendir(pack->root);
+  if (dir != NULL) {
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+      if (strncmp(ent->d_name, "segment.", 8) == 0 ||
+          strncmp(ent->d_name, PACK_INDEX, strlen(PACK_INDEX)) == 0) {
+        unlinkat(dirfd(dir), ent->d_name, 0);
+      }
+    }
+    closedir(dir);
+  }
+
+  ImagedStatus status = rmdir(pack->root) == 0 ? IMAGED_OK : IMAGED_ERR;
+  imagedPackClose(pack);
+  return status;
+}
@@ -68,6 +68,30 @@ PIXEL_OP_F(Sub, -);
 PIXEL_OP_F(Mul, *);
 PIXEL_OP_F(Div, /);
 
+void pixelMin(Pixel *a, const Pixel *b) {
+#ifdef __SSE__
+  a->data = _mm_min_ps(a->data, b->data);
+#elif defined(__ARM_NEON)
+  a->data = vminq_f32(a->data, b->data);
+#else
+  for (int i = 0; i < 4; i++) {
+    a->data[i] = b->data[i] < a->data[i] ? b->data[i] : a->data[i];
+  }
+#endif
+}
+
+void pixelMax(Pixel *a, const Pixel *b) {
+#ifdef __SSE__
+  a->data = _mm_max_ps(a->data, b->data);
+#elif defined(__ARM_NEON)
+  a->data = vmaxq_f32(a->data, b->data);
+#else
+  for (int i = 0; i < 4; i++) {
+    a->data[i] = b->data[i] > a->data[i] ? b->data[i] : a->data[i];
+  }
+#endif
+}
+
 bool pixelEq(const Pixel *a, const Pixel *b) {
   return a->data[0] == b->data[0] && a->data[1] == b->data[1] &&
          a->data[2] == b->data[2];
@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+#include "imaged.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// A ring is a single file holding a header followed by `nslots` frames of the
+// same size. Frames are numbered from 1 and frame n is stored in slot
+// (n - 1) % nslots. Each slot has a sequence word used like a seqlock: it is
+// 2n - 1 while frame n is being written and 2n once it is published, so a
+// reader can check that the frame it is looking at has not been replaced.
+// Publishing a frame only stores to the mapping, the futex is only woken when
+// a reader is waiting. A reader that dies while waiting leaves the waiter
+// count too high, which only costs the producer a wake per frame, so the
+// count is reset whenever a producer opens the ring. Readers that were
+// waiting at that moment are no longer counted, their waits are split into
+// slices of RING_WAIT_SLICE so they notice new frames anyway. There is a
+// single producer per ring, enforced with flock when the ring is opened
+
+#define RING_MAGIC "IMGR"
+#define RING_VERSION 1
+#define RING_WAIT_SLICE 100000000
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  ImageMeta meta;
+  uint32_t nslots;
+  uint32_t notify;  // incremented for every published frame, used as a futex
+  uint32_t waiters; // number of readers sleeping on notify
+  uint64_t head;    // latest published frame, 0 when there is none
+  uint64_t frame_size;
+  uint64_t offset; // offset of the first slot
+  uint64_t seq[];  // per slot sequence words
+} RingHeader;
+
+struct ImagedRing {
+  int fd;
+  bool producer;
+  RingHeader *header;
+  size_t mapsize;
+  uint64_t next; // frame started by imagedRingBegin, 0 when none
+};
+
+static uint64_t alignPage(uint64_t n) {
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  return (n + page - 1) / page * page;
+}
+
+static char *ringPath(Imaged *db, const char *key, ssize_t keylen) {
+  if (keylen <= 0) {
+    keylen = (ssize_t)strlen(key);
+  }
+
+  if (memchr(key, IMAGED_PATH_SEP, keylen) != NULL) {
+    return NULL;
+  }
+
+  return imagedStringPrintf("%s%c%s%.*s", db->root, IMAGED_PATH_SEP,
+                            IMAGED_RING, (int)keylen, key);
+}
+
+static ImagedStatus ringMap(int fd, bool producer, ImagedRing **ring) {
+  struct stat st;
+  RingHeader header;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(header) ||
+      pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, RING_MAGIC, 4) != 0 ||
+      header.version != RING_VERSION || header.nslots == 0 ||
+      header.frame_size != imageMetaTotalBytes(&header.meta) ||
+      header.offset < sizeof(header) + header.nslots * sizeof(uint64_t)) {
+    return IMAGED_ERR_INVALID_FILE;
+  }
+
+  size_t size = header.offset + (size_t)header.nslots *
+                                    alignPage(header.frame_size);
+  if ((size_t)st.st_size != size) {
+    return IMAGED_ERR_INVALID_FILE;
+  }
+
+  // Readers map the ring read-only except for the header, which holds the
+  // waiter count
+  void *map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return IMAGED_ERR_MAP_FAILED;
+  }
+
+  if (!producer && mprotect((uint8_t *)map + header.offset,
+                            size - header.offset, PROT_READ) != 0) {
+    munmap(map, size);
+    return IMAGED_ERR_MAP_FAILED;
+  }
+
+  // The producer holds the ring's flock, so no other producer can be
+  // publishing while the count is reset
+  if (producer) {
+    __atomic_store_n(&((RingHeader *)map)->waiters, 0, __ATOMIC_SEQ_CST);
+  }
+
+  ImagedRing *r = malloc(sizeof(ImagedRing));
+  if (r == NULL) {
+    munmap(map, size);
+    return IMAGED_ERR;
+  }
+
+  r->fd = fd;
+  r->producer = producer;
+  r->header = map;
+  r->mapsize = size;
+  r->next = 0;
+  *ring = r;
+  return IMAGED_OK;
+}
+
+ImagedStatus imagedRingCreate(Imaged *db, const char *key, ssize_t keylen,
+                              const ImageMeta *meta, uint32_t nslots,
+                              ImagedRing **ring) {
+  *ring = NULL;
+  if (nslots < 2) {
+    return IMAGED_ERR;
+  }
+
+  char *path = ringPath(db, key, keylen);
+  if (path == NULL) {
+    return IMAGED_ERR_INVALID_KEY;
+  }
+
+  // Only one producer may use a ring, including one that is being replaced
+  int old = open(path, O_RDONLY);
+  if (old >= 0 && flock(old, LOCK_EX | LOCK_NB) != 0) {
+    close(old);
+    free(path);
+    return IMAGED_ERR_LOCKED;
+  }
+
+  // The ring is initialized in a temporary file, readers never see a partial
+  // header
+  char *tmp = imagedStringPrintf("%s%c%s", db->root, IMAGED_PATH_SEP,
+                                 IMAGED_RESERVED "tmp.XXXXXX");
+  int fd = tmp != NULL ? mkstemp(tmp) : -1;
+  if (fd < 0) {
+    if (old >= 0) {
+      close(old);
+    }
+    free(tmp);
+    free(path);
+    return IMAGED_ERR_CANNOT_CREATE_FILE;
+  }
+
+  fchmod(fd, 0644);
+  flock(fd, LOCK_EX);
+
+  uint64_t frame_size = imageMetaTotalBytes(meta);
+  uint64_t offset = alignPage(sizeof(RingHeader) + nslots * sizeof(uint64_t));
+  size_t size = offset + (size_t)nslots * alignPage(frame_size);
+
+  RingHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RING_MAGIC, 4);
+  header.version = RING_VERSION;
+  header.meta = *meta;
+  header.nslots = nslots;
+  header.frame_size = frame_size;
+  header.offset = offset;
+
+  ImagedStatus status = IMAGED_OK;
+  if (ftruncate(fd, size) != 0 ||
+      pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    status = IMAGED_ERR_SEEK;
+  } else if (rename(tmp, path) != 0) {
+    status = IMAGED_ERR;
+  } else {
+    status = ringMap(fd, true, ring);
+  }
+
+  if (status != IMAGED_OK) {
+    unlink(tmp);
+    close(fd);
+  }
+
+  if (old >= 0) {
+    close(old);
+  }
+  free(tmp);
+  free(path);
+  return status;
+}
+
+ImagedStatus imagedRingOpen(Imaged *db, const char *key, ssize_t keylen,
+                            bool producer, ImagedRing **ring) {
+  *ring = NULL;
+  char *path = ringPath(db, key, keylen);
+  if (path == NULL) {
+    return IMAGED_ERR_INVALID_KEY;
+  }
+
+  int fd = open(path, O_RDWR);
+  free(path);
+  if (fd < 0) {
+    return IMAGED_ERR_FILE_DOES_NOT_EXIST;
+  }
+
+  if (producer && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    close(fd);
+    return IMAGED_ERR_LOCKED;
+  }
+
+  ImagedStatus status = ringMap(fd, producer, ring);
+  if (status != IMAGED_OK) {
+    close(fd);
+  }
+  return status;
+}
+
+void imagedRingClose(ImagedRing *ring) {
+  if (ring == NULL) {
+    return;
+  }
+
+  munmap(ring->header, ring->mapsize);
+  close(ring->fd);
+  free(ring);
+}
+
+ImagedStatus imagedRingRemove(Imaged *db, const char *key, ssize_t keylen) {
+  char *path = ringPath(db, key, keylen);
+  if (path == NULL) {
+    return IMAGED_ERR_INVALID_KEY;
+  }
+
+  int rc = unlink(path);
+  free(path);
+  return rc == 0 ? IMAGED_OK : IMAGED_ERR_FILE_DOES_NOT_EXIST;
+}
+
+const ImageMeta *imagedRingMeta(const ImagedRing *ring) {
+  return &ring->header->meta;
+}
+
+static void ringFrame(const ImagedRing *ring, uint64_t seq,
+                      ImagedRingFrame *frame) {
+  RingHeader *h = ring->header;
+  uint64_t slot = (seq - 1) % h->nslots;
+  frame->seq = seq;
+  frame->image.owner = false;
+  frame->image.meta = h->meta;
+  frame->image.data =
+      (uint8_t *)h + h->offset + slot * alignPage(h->frame_size);
+}
+
+ImagedStatus imagedRingBegin(ImagedRing *ring, ImagedRingFrame *frame) {
+  if (!ring->producer) {
+    return IMAGED_ERR;
+  }
+
+  RingHeader *h = ring->header;
+  uint64_t seq = __atomic_load_n(&h->head, __ATOMIC_RELAXED) + 1;
+  uint64_t slot = (seq - 1) % h->nslots;
+
+  // Readers still using the previous frame in this slot see the change
+  // before any of the pixels are overwritten
+  __atomic_store_n(&h->seq[slot], 2 * seq - 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  ring->next = seq;
+  ringFrame(ring, seq, frame);
+  return IMAGED_OK;
+}
+
+ImagedStatus imagedRingPublish(ImagedRing *ring, ImagedRingFrame *frame) {
+  if (!ring->producer || ring->next == 0 || frame->seq != ring->next) {
+    return IMAGED_ERR;
+  }
+
+  RingHeader *h = ring->header;
+  uint64_t slot = (frame->seq - 1) % h->nslots;
+  __atomic_store_n(&h->seq[slot], 2 * frame->seq, __ATOMIC_RELEASE);
+  __atomic_store_n(&h->head, frame->seq, __ATOMIC_RELEASE);
+  ring->next = 0;
+
+  __atomic_add_fetch(&h->notify, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&h->waiters, __ATOMIC_SEQ_CST) > 0) {
+    imagedFutexWake(&h->notify);
+  }
+  return IMAGED_OK;
+}
+
+bool imagedRingFrameIsValid(const ImagedRing *ring,
+                            const ImagedRingFrame *frame) {
+  RingHeader *h = ring->header;
+  if (frame->seq == 0) {
+    return false;
+  }
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&h->seq[(frame->seq - 1) % h->nslots],
+                         __ATOMIC_RELAXED) == 2 * frame->seq;
+}
+
+// Get frame `seq` if it is still in the ring
+static bool ringGet(const ImagedRing *ring, uint64_t seq,
+                    ImagedRingFrame *frame) {
+  RingHeader *h = ring->header;
+  if (__atomic_load_n(&h->seq[(seq - 1) % h->nslots], __ATOMIC_ACQUIRE) !=
+      2 * seq) {
+    return false;
+  }
+
+  ringFrame(ring, seq, frame);
+  return true;
+}
+
+bool imagedRingLatest(const ImagedRing *ring, ImagedRingFrame *frame) {
+  RingHeader *h = ring->header;
+  for (;;) {
+    uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    if (head == 0) {
+      return false;
+    }
+
+    // The slot can only change if the producer went all the way around the
+    // ring since head was read
+    if (ringGet(ring, head, frame)) {
+      return true;
+    }
+  }
+}
+
+bool imagedRingNext(ImagedRing *ring, uint64_t after, int64_t timeout_ms,
+                    ImagedRingFrame *frame) {
+  RingHeader *h = ring->header;
+  uint64_t deadline = timeout_ms < 0
+                          ? UINT64_MAX
+                          : imagedNanotime() + (uint64_t)timeout_ms * 1000000;
+  for (;;) {
+    uint32_t notify = __atomic_load_n(&h->notify, __ATOMIC_SEQ_CST);
+    uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    if (head > after) {
+      return ringGet(ring, after + 1, frame) || imagedRingLatest(ring, frame);
+    }
+
+    uint64_t now = imagedNanotime();
+    if (now >= deadline) {
+      return false;
+    }
+
+    uint64_t wait = deadline - now;
+    __atomic_add_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+    imagedFutexWait(&h->notify, notify,
+                    wait < RING_WAIT_SLICE ? wait : RING_WAIT_SLICE);
+
+    // The count may have been reset by a producer while waiting
+    uint32_t waiters = __atomic_load_n(&h->waiters, __ATOMIC_SEQ_CST);
+    while (waiters > 0 &&
+           !__atomic_compare_exchange_n(&h->waiters, &waiters, waiters - 1,
+                                        true, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST)) {
+    }
+  }
+}
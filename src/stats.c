@@ -0,0 +1,142 @@
+#include "imaged.h"
+#include <float.h>
+#include <string.h>
+
+// Pixels are summed in single precision over short runs and then added to
+// double precision totals to limit rounding error on large images
+#define STATS_RUN 256
+
+typedef struct {
+  uint64_t count;
+  Pixel min, max;
+  double sum[4];
+  double sumsq[4];
+} imageStatsAcc;
+
+static void imageStatsInit(void *_acc, IMAGED_UNUSED void *userdata) {
+  imageStatsAcc *acc = _acc;
+  acc->count = 0;
+  acc->min = pixelNew(FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX);
+  acc->max = pixelNew(-FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+  for (int i = 0; i < 4; i++) {
+    acc->sum[i] = acc->sumsq[i] = 0.0;
+  }
+}
+
+static void imageStatsMap(void *_acc, IMAGED_UNUSED uint64_t y,
+                          const Pixel *row, uint64_t width,
+                          IMAGED_UNUSED void *userdata) {
+  imageStatsAcc *acc = _acc;
+  for (uint64_t x = 0; x < width; x += STATS_RUN) {
+    uint64_t end = x + STATS_RUN < width ? x + STATS_RUN : width;
+    Pixel sum = pixelEmpty(), sumsq = pixelEmpty();
+    for (uint64_t i = x; i < end; i++) {
+      Pixel sq = row[i];
+      pixelMin(&acc->min, &row[i]);
+      pixelMax(&acc->max, &row[i]);
+      pixelAdd(&sum, &row[i]);
+      pixelMul(&sq, &row[i]);
+      pixelAdd(&sumsq, &sq);
+    }
+
+    for (int i = 0; i < 4; i++) {
+      acc->sum[i] += sum.data[i];
+      acc->sumsq[i] += sumsq.data[i];
+    }
+  }
+  acc->count += width;
+}
+
+static void imageStatsCombine(void *_acc, const void *_other,
+                              IMAGED_UNUSED void *userdata) {
+  imageStatsAcc *acc = _acc;
+  const imageStatsAcc *other = _other;
+  acc->count += other->count;
+  pixelMin(&acc->min, &other->min);
+  pixelMax(&acc->max, &other->max);
+  for (int i = 0; i < 4; i++) {
+    acc->sum[i] += other->sum[i];
+    acc->sumsq[i] += other->sumsq[i];
+  }
+}
+
+static const ImageReducer imageStatsReducer = {
+    .size = sizeof(imageStatsAcc),
+    .init = imageStatsInit,
+    .map = imageStatsMap,
+    .combine = imageStatsCombine,
+};
+
+ImagedStatus imageStats(Image *im, ImageStats *stats) {
+  if (stats == NULL) {
+    return IMAGED_ERR;
+  }
+
+  imageStatsAcc acc;
+  ImagedStatus rc = imageReduce(im, &imageStatsReducer, &acc, NULL, NULL);
+  if (rc != IMAGED_OK) {
+    return rc;
+  }
+
+  stats->count = acc.count;
+  stats->min = acc.count ? acc.min : pixelEmpty();
+  stats->max = acc.count ? acc.max : pixelEmpty();
+  for (int i = 0; i < 4; i++) {
+    double n = acc.count ? (double)acc.count : 1.0;
+    stats->sum[i] = acc.sum[i];
+    stats->mean[i] = acc.sum[i] / n;
+    stats->variance[i] = acc.sumsq[i] / n - stats->mean[i] * stats->mean[i];
+    if (stats->variance[i] < 0.0) {
+      stats->variance[i] = 0.0;
+    }
+  }
+
+  return IMAGED_OK;
+}
+
+static void imageHistogramInit(void *acc, void *userdata) {
+  size_t bins = *(size_t *)userdata;
+  memset(acc, 0, sizeof(uint64_t) * 4 * bins);
+}
+
+static void imageHistogramMap(void *_acc, IMAGED_UNUSED uint64_t y,
+                              const Pixel *row, uint64_t width,
+                              void *userdata) {
+  uint64_t *acc = _acc;
+  size_t bins = *(size_t *)userdata;
+  float scale = (float)bins;
+  for (uint64_t x = 0; x < width; x++) {
+    Pixel px = row[x];
+    pixelMulF(&px, scale);
+    for (size_t c = 0; c < 4; c++) {
+      float f = px.data[c];
+      size_t bin = !(f > 0.0f) ? 0 : f >= scale ? bins - 1 : (size_t)f;
+      acc[c * bins + bin] += 1;
+    }
+  }
+}
+
+static void imageHistogramCombine(void *_acc, const void *_other,
+                                  void *userdata) {
+  uint64_t *acc = _acc;
+  const uint64_t *other = _other;
+  size_t bins = *(size_t *)userdata;
+  for (size_t i = 0; i < 4 * bins; i++) {
+    acc[i] += other[i];
+  }
+}
+
+ImagedStatus imageHistogram(Image *im, size_t bins, uint64_t *hist) {
+  if (bins == 0 || hist == NULL) {
+    return IMAGED_ERR;
+  }
+
+  ImageReducer reducer = {
+      .size = sizeof(uint64_t) * 4 * bins,
+      .init = imageHistogramInit,
+      .map = imageHistogramMap,
+      .combine = imageHistogramCombine,
+  };
+
+  return imageReduce(im, &reducer, hist, NULL, &bins);
+}
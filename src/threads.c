@@ -1,86 +1,555 @@
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "imaged.h"
 
-struct imageParallelIterator {
-  uint64_t x0, y0, x1, y1;
-  Image *im, *dst;
-  imageParallelFn f;
+#ifdef __SSE__
+#define cpuRelax() _mm_pause()
+#else
+#define cpuRelax()
+#endif
+
+// Number of times an idle worker checks for new work before sleeping
+#define POOL_SPIN 4096
+
+struct ImagedPool {
+  pthread_mutex_t lock;
+  pthread_cond_t wake, done;
+  pthread_mutex_t busy;
+  pthread_t *threads;
+  size_t nworkers;
+  atomic_uint_fast64_t generation;
+  bool shutdown;
+
+  imagedPoolFn fn;
   void *userdata;
+  size_t ntasks;
+  atomic_size_t next;
+  size_t active;
 };
 
-static void *imageParallelWrapper(void *_iter) {
-  struct imageParallelIterator *iter = (struct imageParallelIterator *)_iter;
-  uint64_t x_start = iter->x0, x_end = iter->x1;
-  uint64_t y_start = iter->y0, y_end = iter->y1;
-  for (uint64_t j = y_start; j < y_end; j++) {
-    for (uint64_t i = x_start; i < x_end; i++) {
-      Pixel px;
-      imageGetPixel(iter->im, i, j, &px);
-      if (iter->f(i, j, iter->im, &px, iter->userdata)) {
-        imageSetPixel(iter->dst, i, j, &px);
+struct imagedPoolWorker {
+  ImagedPool *pool;
+  size_t index;
+};
+
+static void imagedPoolExec(ImagedPool *pool, size_t worker) {
+  size_t i;
+  while ((i = atomic_fetch_add(&pool->next, 1)) < pool->ntasks) {
+    pool->fn(i, worker, pool->userdata);
+  }
+}
+
+static void *imagedPoolWorkerMain(void *_arg) {
+  ImagedPool *pool = ((struct imagedPoolWorker *)_arg)->pool;
+  size_t index = ((struct imagedPoolWorker *)_arg)->index;
+  free(_arg);
+
+  uint64_t seen = 0;
+  for (;;) {
+    for (int spin = 0; spin < POOL_SPIN; spin++) {
+      if (atomic_load(&pool->generation) != seen) {
+        break;
       }
+      cpuRelax();
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->shutdown && atomic_load(&pool->generation) == seen) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
     }
+    seen = atomic_load(&pool->generation);
+    pthread_mutex_unlock(&pool->lock);
+
+    imagedPoolExec(pool, index);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->active == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
   }
 
   return NULL;
 }
 
-ImagedStatus imageEachPixel2(Image *im, Image *dst, imageParallelFn fn,
-                             int nthreads, void *userdata) {
-  if (im == NULL) {
+ImagedPool *imagedPoolNew(int nthreads) {
+  if (nthreads <= 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0) {
+      nthreads = 1;
+    }
+  }
+
+  ImagedPool *pool = calloc(1, sizeof(ImagedPool));
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_mutex_init(&pool->busy, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  atomic_init(&pool->generation, 0);
+  atomic_init(&pool->next, 0);
+
+  // The calling thread always takes part in the work, so only nthreads - 1
+  // background threads are needed
+  pool->threads = calloc((size_t)nthreads, sizeof(pthread_t));
+  if (pool->threads == NULL) {
+    imagedPoolFree(pool);
+    return NULL;
+  }
+
+  for (size_t i = 1; i < (size_t)nthreads; i++) {
+    struct imagedPoolWorker *arg = malloc(sizeof(struct imagedPoolWorker));
+    if (arg == NULL) {
+      imagedPoolFree(pool);
+      return NULL;
+    }
+    arg->pool = pool;
+    arg->index = i;
+    if (pthread_create(&pool->threads[pool->nworkers], NULL,
+                       imagedPoolWorkerMain, arg) != 0) {
+      free(arg);
+      imagedPoolFree(pool);
+      return NULL;
+    }
+    pool->nworkers += 1;
+  }
+
+  return pool;
+}
+
+void imagedPoolFree(ImagedPool *pool) {
+  if (pool == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->nworkers; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_mutex_destroy(&pool->busy);
+  free(pool->threads);
+  free(pool);
+}
+
+size_t imagedPoolNumThreads(const ImagedPool *pool) {
+  return pool == NULL ? 1 : pool->nworkers + 1;
+}
+
+static ImagedPool *imagedDefaultPool = NULL;
+static pthread_once_t imagedDefaultPoolOnce = PTHREAD_ONCE_INIT;
+
+static void imagedDefaultPoolInit(void) {
+  imagedDefaultPool = imagedPoolNew(0);
+}
+
+ImagedPool *imagedPoolDefault(void) {
+  pthread_once(&imagedDefaultPoolOnce, imagedDefaultPoolInit);
+  return imagedDefaultPool;
+}
+
+ImagedStatus imagedPoolRun(ImagedPool *pool, size_t ntasks, imagedPoolFn fn,
+                           void *userdata) {
+  if (fn == NULL) {
     return IMAGED_ERR;
   }
 
-  if (dst == NULL) {
-    dst = im;
+  if (ntasks == 0) {
+    return IMAGED_OK;
+  }
+
+  // Run on the calling thread when there is nothing to gain from waking the
+  // workers, or when the pool is already busy (including nested calls from
+  // inside a task)
+  if (pool == NULL || pool->nworkers == 0 || ntasks == 1 ||
+      pthread_mutex_trylock(&pool->busy) != 0) {
+    for (size_t i = 0; i < ntasks; i++) {
+      fn(i, 0, userdata);
+    }
+    return IMAGED_OK;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->userdata = userdata;
+  pool->ntasks = ntasks;
+  pool->active = pool->nworkers;
+  atomic_store(&pool->next, 0);
+  atomic_fetch_add(&pool->generation, 1);
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  imagedPoolExec(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->active > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pool->fn = NULL;
+  pool->userdata = NULL;
+  pthread_mutex_unlock(&pool->lock);
+
+  pthread_mutex_unlock(&pool->busy);
+  return IMAGED_OK;
+}
+
+// Number of blocks each thread should get on average when no grain size is
+// specified, more blocks improves load balancing at the cost of scheduling
+#define BLOCKS_PER_THREAD 4
+
+typedef void (*imageRowBlockFn)(uint64_t, uint64_t, size_t, void *);
+
+struct imageRowScheduler {
+  uint64_t height, grain;
+  imageRowBlockFn f;
+  void *userdata;
+  uint64_t *counts;
+};
+
+static void imageRowSchedulerTask(size_t index, size_t worker, void *_sched) {
+  struct imageRowScheduler *sched = _sched;
+  uint64_t y0 = (uint64_t)index * sched->grain;
+  uint64_t y1 = y0 + sched->grain;
+  if (y1 > sched->height) {
+    y1 = sched->height;
+  }
+
+  sched->f(y0, y1, worker, sched->userdata);
+  sched->counts[worker] += 1;
+}
+
+// Split [0, height) into blocks of `grain` rows and hand them out to the pool
+// threads as they become free
+static ImagedStatus imageEachRowBlock(uint64_t height,
+                                      const ImageParallelOptions *opts,
+                                      int nthreads, imageRowBlockFn f,
+                                      void *userdata) {
+  ImagedPool *pool = NULL;
+  uint64_t grain = 0;
+  ImageParallelStats *stats = NULL;
+  if (opts != NULL) {
+    pool = opts->pool;
+    grain = opts->grain;
+    stats = opts->stats;
+  }
+
+  if (pool == NULL && nthreads != 1) {
+    pool = imagedPoolDefault();
   }
 
+  size_t threads = imagedPoolNumThreads(pool);
   if (nthreads <= 0) {
-    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
-  } else if (nthreads == 1) {
-    Pixel px = pixelEmpty();
-    IMAGE_ITER_ALL(im, i, j) {
-      imageGetPixel(im, i, j, &px);
-      if (fn(i, j, im, &px, userdata)) {
-        imageSetPixel(dst, i, j, &px);
+    nthreads = (int)threads;
+  }
+
+  if (grain == 0) {
+    grain = height / ((uint64_t)nthreads * BLOCKS_PER_THREAD);
+  }
+
+  // A single block covers the whole image, larger grains would overflow
+  if (grain > height) {
+    grain = height;
+  }
+
+  if (grain == 0) {
+    grain = 1;
+  }
+
+  uint64_t counts[threads];
+  for (size_t i = 0; i < threads; i++) {
+    counts[i] = 0;
+  }
+
+  struct imageRowScheduler sched = {
+      .height = height,
+      .grain = grain,
+      .f = f,
+      .userdata = userdata,
+      .counts = counts,
+  };
+
+  uint64_t start = stats ? imagedNanotime() : 0;
+  uint64_t nblocks = (height + grain - 1) / grain;
+  ImagedStatus rc =
+      imagedPoolRun(pool, (size_t)nblocks, imageRowSchedulerTask, &sched);
+
+  if (stats != NULL) {
+    stats->elapsed_ns = imagedNanotime() - start;
+    stats->blocks = nblocks;
+    stats->grain = grain;
+    stats->threads = 0;
+    stats->min_blocks = nblocks;
+    stats->max_blocks = 0;
+    for (size_t i = 0; i < threads; i++) {
+      if (counts[i] == 0) {
+        continue;
+      }
+      stats->threads += 1;
+      if (counts[i] < stats->min_blocks) {
+        stats->min_blocks = counts[i];
+      }
+      if (counts[i] > stats->max_blocks) {
+        stats->max_blocks = counts[i];
       }
     }
-    return IMAGED_OK;
+
+    if (stats->threads == 0) {
+      stats->min_blocks = 0;
+    }
   }
 
-  pthread_t threads[nthreads];
-  struct imageParallelIterator iter[nthreads];
-  int n = 0;
-  uint64_t chunk = im->meta.height / (uint64_t)nthreads;
-  for (int64_t x = 0; x < nthreads; x++) {
-    iter[x].x1 = im->meta.width;
-    iter[x].x0 = 0;
-    iter[x].y1 = chunk * x + chunk;
-    iter[x].y0 = chunk * x;
-    iter[x].userdata = userdata;
-    iter[x].dst = dst;
-    iter[x].im = im;
-    iter[x].f = fn;
-    if (pthread_create(&threads[x], NULL, imageParallelWrapper, &iter[x]) !=
-        0) {
-      for (n = 0; n < x; n++) {
-        pthread_join(threads[n], NULL);
+  return rc;
+}
+
+struct imageParallelIterator {
+  Image *im, *dst;
+  imageParallelFn f;
+  void *userdata;
+};
+
+static void imageParallelWrapper(uint64_t y_start, uint64_t y_end,
+                                 IMAGED_UNUSED size_t worker, void *_iter) {
+  struct imageParallelIterator *iter = (struct imageParallelIterator *)_iter;
+  uint64_t width = iter->im->meta.width;
+  if (width == 0) {
+    return;
+  }
+
+  Pixel *row = malloc(sizeof(Pixel) * width);
+  if (row == NULL) {
+    return;
+  }
+
+  for (uint64_t j = y_start; j < y_end; j++) {
+    if (!imageGetPixels(iter->im, 0, j, width, row)) {
+      break;
+    }
+
+    // Consecutive pixels that were modified are written back as one span,
+    // pixels the callback rejected are never written
+    uint64_t start = 0;
+    for (uint64_t i = 0; i <= width; i++) {
+      if (i < width && iter->f(i, j, iter->im, &row[i], iter->userdata)) {
+        continue;
+      }
+
+      if (i > start) {
+        imageSetPixels(iter->dst, start, j, i - start, row + start);
       }
-      return IMAGED_ERR;
+      start = i + 1;
     }
   }
 
-  for (n = 0; n < nthreads; n++) {
-    // Maybe do something if this fails?
-    pthread_join(threads[n], NULL);
+  free(row);
+}
+
+static ImagedStatus imageEachPixelImpl(Image *im, Image *dst,
+                                       imageParallelFn fn, int nthreads,
+                                       const ImageParallelOptions *opts,
+                                       void *userdata) {
+  if (im == NULL || fn == NULL) {
+    return IMAGED_ERR;
   }
 
-  return IMAGED_OK;
+  if (dst == NULL) {
+    dst = im;
+  }
+
+  struct imageParallelIterator iter = {
+      .im = im,
+      .dst = dst,
+      .f = fn,
+      .userdata = userdata,
+  };
+
+  return imageEachRowBlock(im->meta.height, opts, nthreads,
+                           imageParallelWrapper, &iter);
+}
+
+ImagedStatus imageEachPixelWithOptions(Image *im, Image *dst,
+                                       imageParallelFn fn,
+                                       const ImageParallelOptions *opts,
+                                       void *userdata) {
+  return imageEachPixelImpl(im, dst, fn, 0, opts, userdata);
+}
+
+ImagedStatus imageEachPixel2(Image *im, Image *dst, imageParallelFn fn,
+                             int nthreads, void *userdata) {
+  return imageEachPixelImpl(im, dst, fn, nthreads, NULL, userdata);
 }
 
 ImagedStatus imageEachPixel(Image *im, imageParallelFn fn, int nthreads,
                             void *userdata) {
   return imageEachPixel2(im, NULL, fn, nthreads, userdata);
 }
+
+struct imageRowIterator {
+  Image *im;
+  imageRowFn f;
+  void *userdata;
+};
+
+static void imageRowWrapper(uint64_t y_start, uint64_t y_end,
+                            IMAGED_UNUSED size_t worker, void *_iter) {
+  struct imageRowIterator *iter = (struct imageRowIterator *)_iter;
+  Image *im = iter->im;
+  size_t stride = imageColorNumChannels(im->meta.color);
+  size_t rowBytes = imagePixelBytes(im) * im->meta.width;
+  uint8_t *row = (uint8_t *)im->data + rowBytes * y_start;
+  for (uint64_t j = y_start; j < y_end; j++, row += rowBytes) {
+    iter->f(j, row, im->meta.width, stride, im, iter->userdata);
+  }
+}
+
+static ImagedStatus imageEachRowImpl(Image *im, imageRowFn fn, int nthreads,
+                                     const ImageParallelOptions *opts,
+                                     void *userdata) {
+  if (im == NULL || im->data == NULL || fn == NULL) {
+    return IMAGED_ERR;
+  }
+
+  struct imageRowIterator iter = {
+      .im = im,
+      .f = fn,
+      .userdata = userdata,
+  };
+
+  return imageEachRowBlock(im->meta.height, opts, nthreads, imageRowWrapper,
+                           &iter);
+}
+
+ImagedStatus imageEachRow(Image *im, imageRowFn fn, int nthreads,
+                          void *userdata) {
+  return imageEachRowImpl(im, fn, nthreads, NULL, userdata);
+}
+
+ImagedStatus imageEachRowWithOptions(Image *im, imageRowFn fn,
+                                     const ImageParallelOptions *opts,
+                                     void *userdata) {
+  return imageEachRowImpl(im, fn, 0, opts, userdata);
+}
+
+// Per-thread accumulators are padded to a cache line to avoid false sharing
+#define REDUCE_ALIGN 64
+
+struct imageReduceIterator {
+  Image *im;
+  const ImageReducer *reducer;
+  uint8_t *acc;
+  size_t stride;
+  bool *used;
+  Pixel *rows;
+  void *userdata;
+};
+
+static void imageReduceWrapper(uint64_t y_start, uint64_t y_end, size_t worker,
+                               void *_iter) {
+  struct imageReduceIterator *iter = (struct imageReduceIterator *)_iter;
+  uint64_t width = iter->im->meta.width;
+  void *acc = iter->acc + worker * iter->stride;
+  Pixel *row = iter->rows + worker * width;
+
+  if (!iter->used[worker]) {
+    iter->used[worker] = true;
+    if (iter->reducer->init) {
+      iter->reducer->init(acc, iter->userdata);
+    }
+  }
+
+  for (uint64_t j = y_start; j < y_end; j++) {
+    if (!imageGetPixels(iter->im, 0, j, width, row)) {
+      break;
+    }
+    iter->reducer->map(acc, j, row, width, iter->userdata);
+  }
+}
+
+ImagedStatus imageReduce(Image *im, const ImageReducer *reducer, void *result,
+                         const ImageParallelOptions *opts, void *userdata) {
+  if (im == NULL || reducer == NULL || reducer->map == NULL ||
+      reducer->combine == NULL || result == NULL) {
+    return IMAGED_ERR;
+  }
+
+  // Rows are read with imageGetPixels, so an unsupported type would leave
+  // every block empty without reporting an error
+  if (!imageMetaHasPixels(&im->meta)) {
+    return IMAGED_ERR;
+  }
+
+  if (reducer->init) {
+    reducer->init(result, userdata);
+  }
+
+  if (im->meta.width == 0 || im->meta.height == 0) {
+    return IMAGED_OK;
+  }
+
+  ImagedPool *pool = opts && opts->pool ? opts->pool : imagedPoolDefault();
+  size_t threads = imagedPoolNumThreads(pool);
+  size_t stride = (reducer->size + REDUCE_ALIGN - 1) / REDUCE_ALIGN *
+                  REDUCE_ALIGN;
+  if (stride == 0) {
+    stride = REDUCE_ALIGN;
+  }
+
+  uint8_t *acc = aligned_alloc(REDUCE_ALIGN, stride * threads);
+  bool *used = calloc(threads, sizeof(bool));
+  Pixel *rows = malloc(sizeof(Pixel) * im->meta.width * threads);
+  ImagedStatus rc = IMAGED_ERR;
+  if (acc == NULL || used == NULL || rows == NULL) {
+    goto done;
+  }
+
+  struct imageReduceIterator iter = {
+      .im = im,
+      .reducer = reducer,
+      .acc = acc,
+      .stride = stride,
+      .used = used,
+      .rows = rows,
+      .userdata = userdata,
+  };
+
+  ImageParallelOptions o = {.pool = pool};
+  if (opts != NULL) {
+    o.grain = opts->grain;
+    o.stats = opts->stats;
+  }
+
+  rc = imageEachRowBlock(im->meta.height, &o, 0, imageReduceWrapper, &iter);
+  if (rc != IMAGED_OK) {
+    goto done;
+  }
+
+  for (size_t i = 0; i < threads; i++) {
+    if (used[i]) {
+      reducer->combine(result, acc + i * stride, userdata);
+    }
+  }
+
+done:
+  free(acc);
+  free(used);
+  free(rows);
+  return rc;
+}
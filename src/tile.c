@@ -0,0 +1,268 @@
+#define _DEFAULT_SOURCE
+#include "imaged.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+void imagedHandleNumTiles(const ImagedHandle *handle, uint64_t *nx,
+                          uint64_t *ny) {
+  uint64_t x = 0, y = 0;
+  if (handle != NULL && handle->flags & IMAGED_FLAG_TILED) {
+    x = (handle->image.meta.width + handle->tile_width - 1) /
+        handle->tile_width;
+    y = (handle->image.meta.height + handle->tile_height - 1) /
+        handle->tile_height;
+  }
+
+  if (nx) {
+    *nx = x;
+  }
+
+  if (ny) {
+    *ny = y;
+  }
+}
+
+// Slots that hold no tile, because decoding into them failed, have tile set
+// to TILE_NONE and are reused first
+#define TILE_NONE UINT64_MAX
+
+struct ImagedTileCacheSlot {
+  uint64_t tile;
+  uint64_t tick;
+  uint8_t *data;
+};
+
+struct ImagedTileCache {
+  size_t size;
+  size_t nslots, used;
+  uint64_t tick;
+  int64_t *lookup;
+  struct ImagedTileCacheSlot *slots;
+};
+
+static size_t tileBytes(const ImagedHandle *handle) {
+  return (size_t)handle->tile_width * handle->tile_height *
+         imagePixelBytes(&handle->image);
+}
+
+void imagedHandleFreeTileCache(ImagedHandle *handle) {
+  if (handle == NULL || handle->cache == NULL) {
+    return;
+  }
+
+  struct ImagedTileCache *cache = handle->cache;
+  for (size_t i = 0; i < cache->used; i++) {
+    free(cache->slots[i].data);
+  }
+  free(cache->slots);
+  free(cache->lookup);
+  free(cache);
+  handle->cache = NULL;
+}
+
+static struct ImagedTileCache *tileCacheNew(ImagedHandle *handle,
+                                            size_t size) {
+  uint64_t nx, ny;
+  imagedHandleNumTiles(handle, &nx, &ny);
+
+  struct ImagedTileCache *cache = calloc(1, sizeof(struct ImagedTileCache));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->size = size;
+  cache->nslots = size / tileBytes(handle);
+  if (cache->nslots == 0) {
+    cache->nslots = 1;
+  }
+
+  cache->lookup = malloc(sizeof(int64_t) * nx * ny);
+  cache->slots = calloc(cache->nslots, sizeof(struct ImagedTileCacheSlot));
+  if (cache->lookup == NULL || cache->slots == NULL) {
+    free(cache->lookup);
+    free(cache->slots);
+    free(cache);
+    return NULL;
+  }
+
+  for (uint64_t i = 0; i < nx * ny; i++) {
+    cache->lookup[i] = -1;
+  }
+
+  return cache;
+}
+
+void imagedHandleSetTileCacheSize(ImagedHandle *handle, size_t size) {
+  if (handle == NULL || !(handle->flags & IMAGED_FLAG_COMPRESSED)) {
+    return;
+  }
+
+  imagedHandleFreeTileCache(handle);
+  handle->cache = tileCacheNew(handle, size);
+}
+
+static void *tileCacheGet(ImagedHandle *handle, uint64_t index) {
+  if (handle->cache == NULL) {
+    handle->cache = tileCacheNew(handle, IMAGED_TILE_CACHE_SIZE);
+    if (handle->cache == NULL) {
+      return NULL;
+    }
+  }
+
+  struct ImagedTileCache *cache = handle->cache;
+  int64_t s = cache->lookup[index];
+  if (s >= 0) {
+    cache->slots[s].tick = ++cache->tick;
+    return cache->slots[s].data;
+  }
+
+  size_t size = tileBytes(handle);
+  if (cache->used < cache->nslots) {
+    uint8_t *data = malloc(size);
+    if (data == NULL) {
+      return NULL;
+    }
+    s = cache->used++;
+    cache->slots[s].data = data;
+  } else {
+    // Evict the least recently used tile
+    s = 0;
+    for (size_t i = 1; i < cache->nslots; i++) {
+      if (cache->slots[i].tick < cache->slots[s].tick) {
+        s = i;
+      }
+    }
+    if (cache->slots[s].tile != TILE_NONE) {
+      cache->lookup[cache->slots[s].tile] = -1;
+    }
+  }
+
+  // The slot is left empty until the tile has been decoded into it
+  struct ImagedTileCacheSlot *slot = &cache->slots[s];
+  slot->tile = TILE_NONE;
+  slot->tick = 0;
+
+  const ImagedTile *tile = &handle->tiles[index];
+  if (tile->offset > handle->mapsize ||
+      tile->size > handle->mapsize - tile->offset) {
+    return NULL;
+  }
+
+  const uint8_t *src = (const uint8_t *)handle->map + tile->offset;
+  if (tile->size == size) {
+    memcpy(slot->data, src, size);
+  } else if (!imagedTileDecode(&handle->image.meta, src, tile->size,
+                               slot->data, handle->tile_width,
+                               handle->tile_height)) {
+    return NULL;
+  }
+
+  slot->tile = index;
+  slot->tick = ++cache->tick;
+  cache->lookup[index] = s;
+  return slot->data;
+}
+
+void *imagedHandleTile(ImagedHandle *handle, uint64_t tx, uint64_t ty) {
+  uint64_t nx, ny;
+  imagedHandleNumTiles(handle, &nx, &ny);
+  if (tx >= nx || ty >= ny) {
+    return NULL;
+  }
+
+  if (handle->flags & IMAGED_FLAG_COMPRESSED) {
+    return tileCacheGet(handle, ty * nx + tx);
+  }
+
+  return (uint8_t *)handle->map + handle->tiles[ty * nx + tx].offset;
+}
+
+static bool isEditable(const ImagedHandle *handle) {
+  int flags = fcntl(handle->fd, F_GETFL);
+  return flags >= 0 && (flags & O_ACCMODE) == O_RDWR;
+}
+
+static bool regionIsValid(const ImagedHandle *handle, uint64_t x, uint64_t y,
+                          const Image *image) {
+  const ImageMeta *a = &handle->image.meta, *b = &image->meta;
+  return handle->map != NULL && image->data != NULL && a->color == b->color &&
+         a->kind == b->kind && a->bits == b->bits && x <= a->width &&
+         y <= a->height && b->width <= a->width - x &&
+         b->height <= a->height - y;
+}
+
+// Copy between a region of the stored image and a row-major image, only the
+// tiles overlapping the region are touched
+static bool regionCopy(ImagedHandle *handle, uint64_t x, uint64_t y,
+                       Image *image, bool write) {
+  size_t pixelBytes = imagePixelBytes(&handle->image);
+  uint64_t width = image->meta.width, height = image->meta.height;
+  size_t rowBytes = pixelBytes * width;
+  uint8_t *data = image->data;
+
+  if (!(handle->flags & IMAGED_FLAG_TILED)) {
+    uint8_t *src = (uint8_t *)handle->image.data +
+                   imageIndex(&handle->image, x, y);
+    size_t stride = pixelBytes * handle->image.meta.width;
+    for (uint64_t j = 0; j < height; j++) {
+      if (write) {
+        memcpy(src + j * stride, data + j * rowBytes, rowBytes);
+      } else {
+        memcpy(data + j * rowBytes, src + j * stride, rowBytes);
+      }
+    }
+    return true;
+  }
+
+  uint64_t tw = handle->tile_width, th = handle->tile_height;
+  size_t tileStride = pixelBytes * tw;
+  for (uint64_t ty = y / th; ty * th < y + height; ty++) {
+    uint64_t y0 = ty * th > y ? ty * th : y;
+    uint64_t y1 = (ty + 1) * th < y + height ? (ty + 1) * th : y + height;
+
+    for (uint64_t tx = x / tw; tx * tw < x + width; tx++) {
+      uint64_t x0 = tx * tw > x ? tx * tw : x;
+      uint64_t x1 = (tx + 1) * tw < x + width ? (tx + 1) * tw : x + width;
+      size_t n = (x1 - x0) * pixelBytes;
+
+      uint8_t *tile = imagedHandleTile(handle, tx, ty);
+      if (tile == NULL) {
+        return false;
+      }
+
+      for (uint64_t j = y0; j < y1; j++) {
+        uint8_t *a = tile + (j - ty * th) * tileStride +
+                     (x0 - tx * tw) * pixelBytes;
+        uint8_t *b = data + (j - y) * rowBytes + (x0 - x) * pixelBytes;
+        if (write) {
+          memcpy(a, b, n);
+        } else {
+          memcpy(b, a, n);
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+ImagedStatus imagedHandleReadRegion(ImagedHandle *handle, uint64_t x,
+                                    uint64_t y, Image *dest) {
+  if (handle == NULL || dest == NULL || !regionIsValid(handle, x, y, dest)) {
+    return IMAGED_ERR;
+  }
+
+  return regionCopy(handle, x, y, dest, false) ? IMAGED_OK : IMAGED_ERR;
+}
+
+ImagedStatus imagedHandleWriteRegion(ImagedHandle *handle, uint64_t x,
+                                     uint64_t y, const Image *src) {
+  if (handle == NULL || src == NULL || !regionIsValid(handle, x, y, src) ||
+      handle->flags & IMAGED_FLAG_COMPRESSED || !isEditable(handle)) {
+    return IMAGED_ERR;
+  }
+
+  return regionCopy(handle, x, y, (Image *)src, true) ? IMAGED_OK
+                                                       : IMAGED_ERR;
+}
@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include "imaged.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// IORING_OP_RENAMEAT is an enum, the headers that define it (Linux 5.11) also
+// added IORING_FEAT_SQPOLL_NONFIXED
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_SQPOLL_NONFIXED)
+#define IMAGED_URING
+#endif
+#endif
+#endif
+
+// io_uring is used through the raw system calls so there is no dependency on
+// liburing. The ring is only used from the thread that created it: requests
+// are copied into the submission queue, submitted together with a single
+// io_uring_enter and their results collected from the completion queue. At
+// most `entries` requests are in flight, so the completion queue (twice the
+// size of the submission queue) can never overflow
+
+#define URING_MAX_ENTRIES 256
+
+#ifdef IMAGED_URING
+
+struct ImagedUring {
+  int fd;
+  unsigned entries;
+  void *sqmap, *cqmap;
+  size_t sqmapsize, cqmapsize;
+  struct io_uring_sqe *sqes;
+  size_t sqesize;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_cqe *cqes;
+};
+
+static const uint8_t _uring_ops[] = {IORING_OP_OPENAT, IORING_OP_READ,
+                                     IORING_OP_WRITE, IORING_OP_RENAMEAT};
+
+// Older kernels accept the ring but fail unknown operations with EINVAL, so
+// every operation used is checked up front
+static bool uringSupported(int fd) {
+  size_t size = sizeof(struct io_uring_probe) +
+                256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  if (probe == NULL) {
+    return false;
+  }
+
+  bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                    256) == 0;
+  for (size_t i = 0; ok && i < sizeof(_uring_ops); i++) {
+    ok = _uring_ops[i] <= probe->last_op &&
+         (probe->ops[_uring_ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return ok;
+}
+
+ImagedUring *imagedUringNew(unsigned entries) {
+  if (entries == 0 || entries > URING_MAX_ENTRIES) {
+    entries = URING_MAX_ENTRIES;
+  }
+
+  struct io_uring_params p;
+  bzero(&p, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0) {
+    // Not supported by the kernel or blocked by a seccomp filter
+    return NULL;
+  }
+
+  ImagedUring *ring = calloc(1, sizeof(ImagedUring));
+  if (ring == NULL || !uringSupported(fd)) {
+    free(ring);
+    close(fd);
+    return NULL;
+  }
+
+  ring->fd = fd;
+  ring->entries = p.sq_entries;
+  ring->sqmapsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cqmapsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cqmapsize > ring->sqmapsize) {
+      ring->sqmapsize = ring->cqmapsize;
+    }
+    ring->cqmapsize = 0;
+  }
+
+  ring->sqmap = mmap(0, ring->sqmapsize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->cqmap = ring->cqmapsize == 0 || ring->sqmap == MAP_FAILED
+                    ? ring->sqmap
+                    : mmap(0, ring->cqmapsize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(0, ring->sqesize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqmap == MAP_FAILED || ring->cqmap == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    imagedUringFree(ring);
+    return NULL;
+  }
+
+  uint8_t *sq = ring->sqmap, *cq = ring->cqmap;
+  ring->sqhead = (unsigned *)(sq + p.sq_off.head);
+  ring->sqtail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sqarray = (unsigned *)(sq + p.sq_off.array);
+  ring->cqhead = (unsigned *)(cq + p.cq_off.head);
+  ring->cqtail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return ring;
+}
+
+void imagedUringFree(ImagedUring *ring) {
+  if (ring == NULL) {
+    return;
+  }
+
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, ring->sqesize);
+  }
+  if (ring->cqmapsize > 0 && ring->cqmap != NULL &&
+      ring->cqmap != MAP_FAILED) {
+    munmap(ring->cqmap, ring->cqmapsize);
+  }
+  if (ring->sqmap != NULL && ring->sqmap != MAP_FAILED) {
+    munmap(ring->sqmap, ring->sqmapsize);
+  }
+  close(ring->fd);
+  free(ring);
+}
+
+static void uringPrep(struct io_uring_sqe *sqe, const ImagedUringRequest *req,
+                      size_t index) {
+  bzero(sqe, sizeof(*sqe));
+  sqe->user_data = index;
+  switch (req->op) {
+  case IMAGED_URING_OPEN:
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)req->path;
+    sqe->len = req->mode;
+    sqe->open_flags = req->flags;
+    break;
+  case IMAGED_URING_READ:
+  case IMAGED_URING_WRITE:
+    sqe->opcode =
+        req->op == IMAGED_URING_READ ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = req->fd;
+    sqe->addr = (uintptr_t)req->buf;
+    sqe->len = req->size > UINT32_MAX ? UINT32_MAX : req->size;
+    sqe->off = req->offset;
+    break;
+  case IMAGED_URING_RENAME:
+    sqe->opcode = IORING_OP_RENAMEAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)req->path;
+    sqe->len = AT_FDCWD;
+    sqe->off = (uintptr_t)req->target;
+    break;
+  }
+}
+
+void imagedUringRun(ImagedUring *ring, ImagedUringRequest *reqs, size_t n) {
+  size_t next = 0, inflight = 0;
+  for (size_t i = 0; i < n; i++) {
+    reqs[i].result = -ECANCELED;
+  }
+
+  while (next < n || inflight > 0) {
+    // Queue as many requests as there is room for
+    unsigned tail = *ring->sqtail;
+    unsigned head = __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+    while (next < n && inflight < ring->entries &&
+           tail - head < ring->entries) {
+      unsigned index = tail & *ring->sqmask;
+      uringPrep(&ring->sqes[index], &reqs[next], next);
+      ring->sqarray[index] = index;
+      tail++;
+      next++;
+      inflight++;
+    }
+    __atomic_store_n(ring->sqtail, tail, __ATOMIC_RELEASE);
+
+    unsigned pending = tail - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+    int rc = syscall(__NR_io_uring_enter, ring->fd, pending, 1,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+    if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      // Requests that were never consumed by the kernel are taken back, the
+      // ones already submitted still have to complete before returning
+      unsigned consumed = __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+      size_t dropped = tail - consumed;
+      __atomic_store_n(ring->sqtail, consumed, __ATOMIC_RELEASE);
+      inflight -= dropped;
+      next = n;
+      if (inflight == 0) {
+        break;
+      }
+    }
+
+    head = *ring->cqhead;
+    unsigned ctail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+    while (head != ctail) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqmask];
+      reqs[cqe->user_data].result = cqe->res;
+      head++;
+      inflight--;
+    }
+    __atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+  }
+}
+
+#else
+
+struct ImagedUring {
+  int unused;
+};
+
+ImagedUring *imagedUringNew(unsigned entries) {
+  (void)entries;
+  return NULL;
+}
+
+void imagedUringFree(ImagedUring *ring) { (void)ring; }
+
+void imagedUringRun(ImagedUring *ring, ImagedUringRequest *reqs, size_t n) {
+  (void)ring;
+  for (size_t i = 0; i < n; i++) {
+    reqs[i].result = -ENOSYS;
+  }
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 void defer_free(void *data) {
   void **ptr = (void **)data;
@@ -33,6 +34,13 @@ void defer_ImagedIter(ImagedIter **iter) {
   }
 }
 
+void defer_ImagedWatch(ImagedWatch **watch) {
+  if (watch && *watch) {
+    imagedWatchFree(*watch);
+    *watch = NULL;
+  }
+}
+
 void defer_ImagedHandle(ImagedHandle *h) {
   if (h) {
     imagedHandleClose(h);
@@ -49,3 +57,17 @@ char *imagedStringPrintf(const char *fmt, ...) {
   va_end(args);
   return ptr;
 }
+
+uint64_t imagedHashKey(const char *key, size_t keylen) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < keylen; i++) {
+    h = (h ^ (uint8_t)key[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+uint64_t imagedNanotime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
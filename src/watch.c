@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+#include "imaged.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// Changes are read from inotify when it is available: a key is reported as set
+// when a file opened for writing is closed or a new file is renamed over it,
+// and as removed when it is deleted. Without inotify the database directory is
+// scanned at a short interval and compared with the previous scan.
+//
+// inotify reports a close for every file descriptor opened for writing, even
+// when nothing was written, for example an editable handle that was only read.
+// The inode, size and mtime last seen for each key are kept, and a close that
+// leaves them unchanged is not reported. File timestamps have a coarse
+// granularity, so this is only done when the recorded mtime was already older
+// than WATCH_STABLE_NS, otherwise a write in the same tick would be missed
+
+#define WATCH_SCAN_NS 50000000ULL
+#define WATCH_STABLE_NS 100000000LL
+#define WATCH_BUFFER 16384
+
+typedef struct {
+  char *name;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  bool stable; // the mtime was at least WATCH_STABLE_NS old when recorded
+} WatchFile;
+
+typedef struct {
+  ImagedWatchEventKind kind;
+  char *key;
+} WatchPending;
+
+struct ImagedWatch {
+  char *root;
+  char *pattern;
+  int fd; // inotify descriptor, -1 when scanning
+  char *buf;
+  size_t pos, len;
+  WatchFile *files; // previous scan or last state reported, sorted by name
+  size_t nfiles, filescap;
+  WatchPending *pending; // events found by the last scan
+  size_t npending, next, cap;
+  char *key; // key of the last event returned
+};
+
+static bool watchMatch(const ImagedWatch *watch, const char *name) {
+  if (strncmp(name, IMAGED_RESERVED, strlen(IMAGED_RESERVED)) == 0 ||
+      strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return false;
+  }
+
+  return watch->pattern == NULL || fnmatch(watch->pattern, name, 0) == 0;
+}
+
+static int watchFileCompare(const void *a, const void *b) {
+  return strcmp(((const WatchFile *)a)->name, ((const WatchFile *)b)->name);
+}
+
+static void watchFilesFree(WatchFile *files, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    free(files[i].name);
+  }
+  free(files);
+}
+
+static bool watchFileChanged(const WatchFile *a, const WatchFile *b) {
+  return a->ino != b->ino || a->size != b->size ||
+         a->mtime.tv_sec != b->mtime.tv_sec ||
+         a->mtime.tv_nsec != b->mtime.tv_nsec;
+}
+
+static void watchFileInit(WatchFile *f, const struct stat *st) {
+  f->ino = st->st_ino;
+  f->size = st->st_size;
+#ifdef __APPLE__
+  f->mtime = st->st_mtimespec;
+#else
+  f->mtime = st->st_mtim;
+#endif
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  int64_t age = (int64_t)(now.tv_sec - f->mtime.tv_sec) * 1000000000LL +
+                (now.tv_nsec - f->mtime.tv_nsec);
+  f->stable = age >= WATCH_STABLE_NS;
+}
+
+static bool watchScanFiles(ImagedWatch *watch, WatchFile **files,
+                           size_t *nfiles) {
+  DIR *dir = opendir(watch->root);
+  if (dir == NULL) {
+    return false;
+  }
+
+  WatchFile *list = NULL;
+  size_t n = 0, cap = 0;
+  struct dirent *ent;
+  struct stat st;
+  while ((ent = readdir(dir))) {
+    if (!watchMatch(watch, ent->d_name) ||
+        fstatat(dirfd(dir), ent->d_name, &st, 0) != 0 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    if (n == cap) {
+      cap = cap == 0 ? 64 : cap * 2;
+      WatchFile *tmp = realloc(list, cap * sizeof(WatchFile));
+      if (tmp == NULL) {
+        break;
+      }
+      list = tmp;
+    }
+
+    WatchFile *f = &list[n];
+    f->name = strdup(ent->d_name);
+    if (f->name == NULL) {
+      break;
+    }
+    watchFileInit(f, &st);
+    n += 1;
+  }
+  closedir(dir);
+
+  if (n > 0) {
+    qsort(list, n, sizeof(WatchFile), watchFileCompare);
+  }
+  *files = list;
+  *nfiles = n;
+  return true;
+}
+
+static void watchPush(ImagedWatch *watch, ImagedWatchEventKind kind,
+                      const char *name) {
+  if (watch->npending == watch->cap) {
+    size_t cap = watch->cap == 0 ? 16 : watch->cap * 2;
+    WatchPending *tmp = realloc(watch->pending, cap * sizeof(WatchPending));
+    if (tmp == NULL) {
+      return;
+    }
+    watch->pending = tmp;
+    watch->cap = cap;
+  }
+
+  char *key = strdup(name);
+  if (key != NULL) {
+    watch->pending[watch->npending].kind = kind;
+    watch->pending[watch->npending].key = key;
+    watch->npending += 1;
+  }
+}
+
+// Compare the directory with the previous scan and queue the differences
+static void watchScan(ImagedWatch *watch) {
+  WatchFile *files;
+  size_t nfiles;
+  if (!watchScanFiles(watch, &files, &nfiles)) {
+    return;
+  }
+
+  size_t i = 0, j = 0;
+  while (i < watch->nfiles || j < nfiles) {
+    int c = i == watch->nfiles ? 1
+            : j == nfiles      ? -1
+                               : strcmp(watch->files[i].name, files[j].name);
+    if (c < 0) {
+      watchPush(watch, IMAGED_WATCH_REMOVE, watch->files[i++].name);
+    } else if (c > 0) {
+      watchPush(watch, IMAGED_WATCH_SET, files[j++].name);
+    } else {
+      if (watchFileChanged(&watch->files[i], &files[j])) {
+        watchPush(watch, IMAGED_WATCH_SET, files[j].name);
+      }
+      i++;
+      j++;
+    }
+  }
+
+  watchFilesFree(watch->files, watch->nfiles);
+  watch->files = files;
+  watch->nfiles = watch->filescap = nfiles;
+}
+
+static bool watchPop(ImagedWatch *watch, ImagedWatchEvent *event) {
+  if (watch->next == watch->npending) {
+    watch->next = watch->npending = 0;
+    return false;
+  }
+
+  WatchPending *p = &watch->pending[watch->next++];
+  free(watch->key);
+  watch->key = p->key;
+  event->kind = p->kind;
+  event->key = watch->key;
+  event->keylen = strlen(watch->key);
+  return true;
+}
+
+#ifdef __linux__
+// Binary search for the record of a file, returns the position it would be
+// inserted at when there is none
+static size_t watchFind(const ImagedWatch *watch, const char *name,
+                        bool *found) {
+  size_t lo = 0, hi = watch->nfiles;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int c = strcmp(watch->files[mid].name, name);
+    if (c == 0) {
+      *found = true;
+      return mid;
+    }
+    if (c < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  *found = false;
+  return lo;
+}
+
+// Update the record of a file after an event, returns false when the file is
+// unchanged since it was last reported
+static bool watchUpdate(ImagedWatch *watch, const struct inotify_event *ev) {
+  bool found;
+  size_t i = watchFind(watch, ev->name, &found);
+  if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    if (found) {
+      free(watch->files[i].name);
+      memmove(&watch->files[i], &watch->files[i + 1],
+              (watch->nfiles - i - 1) * sizeof(WatchFile));
+      watch->nfiles -= 1;
+    }
+    return true;
+  }
+
+  char path[PATH_MAX];
+  int n = snprintf(path, sizeof(path), "%s%c%s", watch->root, IMAGED_PATH_SEP,
+                   ev->name);
+  struct stat st;
+  WatchFile f;
+  if (n < 0 || (size_t)n >= sizeof(path) || stat(path, &st) != 0) {
+    // Removed in the meantime, the removal is reported by its own event
+    return !(ev->mask & IN_CLOSE_WRITE);
+  }
+  watchFileInit(&f, &st);
+
+  if (found) {
+    WatchFile *prev = &watch->files[i];
+    if ((ev->mask & IN_CLOSE_WRITE) && prev->stable &&
+        !watchFileChanged(prev, &f)) {
+      return false;
+    }
+    f.name = prev->name;
+    *prev = f;
+    return true;
+  }
+
+  if (watch->nfiles == watch->filescap) {
+    size_t cap = watch->filescap == 0 ? 64 : watch->filescap * 2;
+    WatchFile *tmp = realloc(watch->files, cap * sizeof(WatchFile));
+    if (tmp == NULL) {
+      return true;
+    }
+    watch->files = tmp;
+    watch->filescap = cap;
+  }
+
+  if ((f.name = strdup(ev->name)) != NULL) {
+    memmove(&watch->files[i + 1], &watch->files[i],
+            (watch->nfiles - i) * sizeof(WatchFile));
+    watch->files[i] = f;
+    watch->nfiles += 1;
+  }
+  return true;
+}
+
+static bool watchReadEvent(ImagedWatch *watch, ImagedWatchEvent *event) {
+  while (watch->pos < watch->len) {
+    struct inotify_event *ev =
+        (struct inotify_event *)(watch->buf + watch->pos);
+    watch->pos += sizeof(struct inotify_event) + ev->len;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+      event->kind = IMAGED_WATCH_OVERFLOW;
+      event->key = NULL;
+      event->keylen = 0;
+      return true;
+    }
+
+    if (ev->len == 0 || (ev->mask & IN_ISDIR) ||
+        !watchMatch(watch, ev->name) || !watchUpdate(watch, ev)) {
+      continue;
+    }
+
+    free(watch->key);
+    watch->key = strdup(ev->name);
+    if (watch->key == NULL) {
+      continue;
+    }
+
+    event->kind = (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                      ? IMAGED_WATCH_REMOVE
+                      : IMAGED_WATCH_SET;
+    event->key = watch->key;
+    event->keylen = strlen(watch->key);
+    return true;
+  }
+
+  ssize_t n = read(watch->fd, watch->buf, WATCH_BUFFER);
+  watch->pos = 0;
+  watch->len = n > 0 ? (size_t)n : 0;
+  return false;
+}
+#endif
+
+ImagedWatch *imagedWatchNew(Imaged *db, const char *pattern) {
+  ImagedWatch *watch = calloc(1, sizeof(ImagedWatch));
+  if (watch == NULL) {
+    return NULL;
+  }
+
+  watch->fd = -1;
+  watch->root = strdup(db->root);
+  watch->pattern = pattern != NULL ? strdup(pattern) : NULL;
+  if (watch->root == NULL || (pattern != NULL && watch->pattern == NULL)) {
+    imagedWatchFree(watch);
+    return NULL;
+  }
+
+#ifdef __linux__
+  watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch->fd >= 0 &&
+      (inotify_add_watch(watch->fd, watch->root,
+                         IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE |
+                             IN_MOVED_FROM | IN_ONLYDIR) < 0 ||
+       (watch->buf = malloc(WATCH_BUFFER)) == NULL)) {
+    close(watch->fd);
+    watch->fd = -1;
+  }
+#endif
+
+  // The first scan records the current state, inotify only uses it to ignore
+  // files that are closed without being changed
+  if (!watchScanFiles(watch, &watch->files, &watch->nfiles)) {
+    imagedWatchFree(watch);
+    return NULL;
+  }
+  watch->filescap = watch->nfiles;
+
+  return watch;
+}
+
+int imagedWatchFd(const ImagedWatch *watch) { return watch->fd; }
+
+bool imagedWatchNext(ImagedWatch *watch, int64_t timeout_ms,
+                     ImagedWatchEvent *event) {
+  uint64_t deadline = timeout_ms < 0
+                          ? UINT64_MAX
+                          : imagedNanotime() + (uint64_t)timeout_ms * 1000000;
+  for (;;) {
+#ifdef __linux__
+    if (watch->fd >= 0) {
+      if (watchReadEvent(watch, event)) {
+        return true;
+      }
+
+      if (watch->len > 0) {
+        continue;
+      }
+    }
+#endif
+
+    if (watch->fd < 0) {
+      if (watchPop(watch, event)) {
+        return true;
+      }
+      watchScan(watch);
+      if (watchPop(watch, event)) {
+        return true;
+      }
+    }
+
+    uint64_t now = imagedNanotime();
+    if (now >= deadline) {
+      return false;
+    }
+
+    uint64_t wait = deadline - now;
+    if (watch->fd >= 0) {
+      struct pollfd pfd = {.fd = watch->fd, .events = POLLIN};
+      int ms = -1;
+      if (timeout_ms >= 0) {
+        uint64_t n = (wait + 999999) / 1000000;
+        ms = n > INT_MAX ? INT_MAX : (int)n;
+      }
+      if (poll(&pfd, 1, ms) < 0 && errno != EINTR) {
+        return false;
+      }
+    } else {
+      if (wait > WATCH_SCAN_NS) {
+        wait = WATCH_SCAN_NS;
+      }
+      struct timespec ts = {
+          .tv_sec = wait / 1000000000ULL,
+          .tv_nsec = wait % 1000000000ULL,
+      };
+      nanosleep(&ts, NULL);
+    }
+  }
+}
+
+void imagedWatchFree(ImagedWatch *watch) {
+  if (watch == NULL) {
+    return;
+  }
+
+  if (watch->fd >= 0) {
+    close(watch->fd);
+  }
+
+  for (size_t i = watch->next; i < watch->npending; i++) {
+    free(watch->pending[i].key);
+  }
+  free(watch->pending);
+  watchFilesFree(watch->files, watch->nfiles);
+  free(watch->buf);
+  free(watch->key);
+  free(watch->pattern);
+  free(watch->root);
+  free(watch);
+}
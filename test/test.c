@@ -1,9 +1,15 @@
 #define _DEFAULT_SOURCE
 #include "../src/imaged.h"
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <check.h>
 
@@ -78,6 +84,423 @@ START_TEST(test_set) {
 }
 END_TEST
 
+START_TEST(test_format) {
+  ImageMeta meta = {
+      .width = 3,
+      .height = 2,
+      .color = IMAGE_COLOR_GRAY,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 8,
+  };
+
+  // Files written before the header was versioned can still be read
+  FILE *f = fopen("test/db/legacy", "wb");
+  ck_assert(f != NULL);
+  fwrite("imgd", 1, 4, f);
+  fwrite(&meta, sizeof(ImageMeta), 1, f);
+  fwrite("abcdef", 1, 7, f);
+  fclose(f);
+
+  $ImagedHandle(handle);
+  ASSERT_OK(imagedGet(db, "legacy", -1, false, &handle));
+  ck_assert(handle.image.meta.width == 3);
+  ck_assert(memcmp(handle.image.data, "abcdef", 6) == 0);
+  imagedHandleClose(&handle);
+
+  // Adding levels rewrites the key in the current format
+  ASSERT_OK(imagedSetLevels(db, "legacy", -1, 1));
+  ASSERT_OK(imagedGetLevel(db, "legacy", -1, 1, &handle));
+  ck_assert(handle.image.meta.width == 1 && handle.image.meta.height == 1);
+  imagedHandleClose(&handle);
+  ASSERT_OK(imagedGet(db, "legacy", -1, false, &handle));
+  ck_assert(memcmp(handle.image.data, "abcdef", 6) == 0);
+  imagedHandleClose(&handle);
+  ASSERT_OK(imagedRemove(db, "legacy", -1));
+
+  ASSERT_OK(imagedSet(db, "aligned", -1, &meta, "abcdef", &handle));
+  ck_assert((uintptr_t)handle.image.data % IMAGED_DATA_ALIGN == 0);
+  imagedHandleClose(&handle);
+
+  ASSERT_OK(imagedGet(db, "aligned", -1, false, &handle));
+  ck_assert((uintptr_t)handle.image.data % IMAGED_DATA_ALIGN == 0);
+  ck_assert(memcmp(handle.image.data, "abcdef", 6) == 0);
+  imagedHandleClose(&handle);
+  ASSERT_OK(imagedRemove(db, "aligned", -1));
+}
+END_TEST
+
+START_TEST(test_tiled) {
+  ImageMeta meta = {
+      .width = 100,
+      .height = 70,
+      .color = IMAGE_COLOR_RGB,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 16,
+  };
+  ImagedSetOptions options = {.tile_width = 32, .tile_height = 16};
+
+  $Image(src) = imageNew(meta);
+  uint16_t *data = src->data;
+  for (size_t i = 0; i < 100 * 70 * 3; i++) {
+    data[i] = (uint16_t)i;
+  }
+
+  $ImagedHandle(handle);
+  ASSERT_OK(imagedSetWithOptions(db, "tiled", -1, &meta, src->data, &options,
+                                 &handle));
+  imagedHandleClose(&handle);
+
+  ASSERT_OK(imagedGet(db, "tiled", -1, false, &handle));
+  ck_assert(handle.image.data == NULL);
+  ck_assert(handle.tile_width == 32 && handle.tile_height == 16);
+
+  uint64_t nx, ny;
+  imagedHandleNumTiles(&handle, &nx, &ny);
+  ck_assert(nx == 4 && ny == 5);
+  uint16_t *tile = imagedHandleTile(&handle, 1, 2);
+  ck_assert(tile[0] == (uint16_t)((32 * 100 + 32) * 3));
+
+  $Image(region) =
+      imageAlloc(40, 30, IMAGE_COLOR_RGB, IMAGE_KIND_UINT, 16, NULL);
+  ASSERT_OK(imagedHandleReadRegion(&handle, 50, 35, region));
+  for (size_t y = 0; y < 30; y++) {
+    ck_assert(memcmp(imageAt(region, 0, y), imageAt(src, 50, y + 35),
+                     40 * 3 * 2) == 0);
+  }
+  ck_assert(imagedHandleReadRegion(&handle, 61, 35, region) != IMAGED_OK);
+  ck_assert(imagedHandleWriteRegion(&handle, 0, 0, region) != IMAGED_OK);
+  imagedHandleClose(&handle);
+
+  ASSERT_OK(imagedGet(db, "tiled", -1, true, &handle));
+  ASSERT_OK(imagedHandleWriteRegion(&handle, 0, 0, region));
+  ASSERT_OK(imagedHandleReadRegion(&handle, 0, 0, region));
+  ck_assert(((uint16_t *)region->data)[0] == (uint16_t)((35 * 100 + 50) * 3));
+  imagedHandleClose(&handle);
+
+  // A tile outside of the file is rejected when the key is opened
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/tiled", db->root);
+  FILE *f = fopen(path, "r+b");
+  ck_assert(f != NULL);
+  ImagedHeader header;
+  ASSERT_OK(imagedReadHeader(fileno(f), &header));
+  ImagedTile bad = {.offset = UINT64_MAX - 8, .size = 16};
+  ck_assert(fseek(f, header.tiles + 5 * sizeof(ImagedTile), SEEK_SET) == 0);
+  ck_assert(fwrite(&bad, sizeof(bad), 1, f) == 1);
+  fclose(f);
+  $Imaged(other) = imagedOpen(db->root);
+  ck_assert(imagedGet(other, "tiled", -1, false, &handle) ==
+            IMAGED_ERR_INVALID_FILE);
+  ck_assert(!imagedIsValidFile(other, "tiled", -1));
+  ASSERT_OK(imagedRemove(db, "tiled", -1));
+}
+END_TEST
+
+START_TEST(test_compressed) {
+  ImageMeta meta = {
+      .width = 300,
+      .height = 200,
+      .color = IMAGE_COLOR_RGB,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 16,
+  };
+  ImagedSetOptions options = {.compress = true};
+
+  $Image(src) = imageNew(meta);
+  uint16_t *data = src->data;
+  for (size_t y = 0; y < 200; y++) {
+    for (size_t x = 0; x < 300 * 3; x++) {
+      data[y * 300 * 3 + x] = (uint16_t)(x * 50 + y * 20);
+    }
+  }
+
+  $ImagedHandle(handle);
+  ASSERT_OK(imagedSetWithOptions(db, "compressed", -1, &meta, src->data,
+                                 &options, &handle));
+  ck_assert(handle.flags & IMAGED_FLAG_COMPRESSED);
+  ck_assert(handle.mapsize < imageMetaTotalBytes(&meta) / 2);
+  imagedHandleClose(&handle);
+
+  ASSERT_OK(imagedGet(db, "compressed", -1, false, &handle));
+  ck_assert(handle.tile_width == 300 &&
+            handle.tile_height == IMAGED_COMPRESS_ROWS);
+
+  // Limit the cache to a single tile so the region below evicts tiles
+  imagedHandleSetTileCacheSize(&handle, 1);
+  $Image(region) =
+      imageAlloc(120, 150, IMAGE_COLOR_RGB, IMAGE_KIND_UINT, 16, NULL);
+  ASSERT_OK(imagedHandleReadRegion(&handle, 100, 30, region));
+  for (size_t y = 0; y < 150; y++) {
+    ck_assert(memcmp(imageAt(region, 0, y), imageAt(src, 100, y + 30),
+                     120 * 3 * 2) == 0);
+  }
+  ck_assert(imagedHandleWriteRegion(&handle, 0, 0, region) != IMAGED_OK);
+  imagedHandleClose(&handle);
+  ASSERT_OK(imagedRemove(db, "compressed", -1));
+}
+END_TEST
+
+START_TEST(test_writer) {
+  ImageMeta meta = {
+      .width = 100,
+      .height = 70,
+      .color = IMAGE_COLOR_GRAY,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 8,
+  };
+
+  $Image(src) = imageNew(meta);
+  uint8_t *data = src->data;
+  for (size_t i = 0; i < 100 * 70; i++) {
+    data[i] = (uint8_t)(i / 100 + i % 100);
+  }
+
+  // Compressed tiles are written as soon as a full row of tiles is available
+  ImagedSetOptions options = {
+      .tile_width = 32, .tile_height = 16, .compress = true, .levels = 2};
+  ImagedWriter *writer;
+  ASSERT_OK(imagedWriterBegin(db, "writer", -1, &meta, &options, &writer));
+  ck_assert(!imagedHasKey(db, "writer", -1));
+  for (size_t y = 0; y < 70; y += 10) {
+    ASSERT_OK(imagedWriterWriteRows(writer, y, 10, imageAt(src, 0, y)));
+  }
+  ck_assert(imagedWriterWriteRows(writer, 0, 1, data) != IMAGED_OK);
+
+  $ImagedHandle(handle);
+  ASSERT_OK(imagedWriterCommit(writer, &handle));
+  ck_assert(handle.flags & IMAGED_FLAG_COMPRESSED);
+  $Image(dest) = imageNewLike(src);
+  ASSERT_OK(imagedHandleReadRegion(&handle, 0, 0, dest));
+  ck_assert(memcmp(dest->data, src->data, 100 * 70) == 0);
+  imagedHandleClose(&handle);
+
+  ASSERT_OK(imagedGetLevel(db, "writer", -1, 2, &handle));
+  ck_assert(handle.image.meta.width == 25 && handle.image.meta.height == 17);
+  imagedHandleClose(&handle);
+
+  // The key cannot be replaced while a handle is open
+  ASSERT_OK(imagedGet(db, "writer", -1, false, &handle));
+  ASSERT_OK(imagedWriterBegin(db, "writer", -1, &meta, NULL, &writer));
+  ASSERT_OK(imagedWriterWriteRows(writer, 20, 1, imageAt(src, 0, 20)));
+  ck_assert(imagedWriterCommit(writer, NULL) == IMAGED_ERR_LOCKED);
+  imagedHandleClose(&handle);
+  ASSERT_OK(imagedWriterCommit(writer, NULL));
+
+  ASSERT_OK(imagedGet(db, "writer", -1, false, &handle));
+  ck_assert(handle.flags == 0);
+  ck_assert(memcmp(imageAt(&handle.image, 0, 20), imageAt(src, 0, 20), 100) ==
+            0);
+  ck_assert(((uint8_t *)handle.image.data)[0] == 0);
+  imagedHandleClose(&handle);
+
+  ASSERT_OK(imagedWriterBegin(db, "aborted", -1, &meta, NULL, &writer));
+  imagedWriterAbort(writer);
+  ck_assert(!imagedHasKey(db, "aborted", -1));
+  ASSERT_OK(imagedRemove(db, "writer", -1));
+}
+END_TEST
+
+START_TEST(test_atomic) {
+  ImageMeta meta = {
+      .width = 10,
+      .height = 10,
+      .color = IMAGE_COLOR_GRAY,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 8,
+  };
+  uint8_t data[20 * 10];
+  memset(data, 1, sizeof(data));
+  ASSERT_OK(imagedSet(db, "atomic", -1, &meta, data, NULL));
+
+  // Readers keep the previous version and do not block the writer
+  ImagedHandle reader;
+  ASSERT_OK(imagedGet(db, "atomic", -1, false, &reader));
+  ImagedSetOptions options = {.atomic = true};
+  meta.width = 20;
+  memset(data, 2, sizeof(data));
+  ASSERT_OK(imagedSetWithOptions(db, "atomic", -1, &meta, data, &options,
+                                 NULL));
+  ck_assert(reader.image.meta.width == 10);
+  ck_assert(((uint8_t *)reader.image.data)[99] == 1);
+
+  $ImagedHandle(handle);
+  ASSERT_OK(imagedGet(db, "atomic", -1, false, &handle));
+  ck_assert(handle.image.meta.width == 20);
+  ck_assert(((uint8_t *)handle.image.data)[199] == 2);
+  imagedHandleClose(&handle);
+  imagedHandleClose(&reader);
+
+  // Editable handles still block it
+  ASSERT_OK(imagedGet(db, "atomic", -1, true, &handle));
+  ck_assert(imagedSetWithOptions(db, "atomic", -1, &meta, data, &options,
+                                 NULL) == IMAGED_ERR_LOCKED);
+  imagedHandleClose(&handle);
+  ASSERT_OK(imagedRemove(db, "atomic", -1));
+}
+END_TEST
+
+START_TEST(test_levels) {
+  ImageMeta meta = {
+      .width = 256,
+      .height = 100,
+      .color = IMAGE_COLOR_GRAY,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 8,
+  };
+  ImagedSetOptions options = {.levels = 3};
+
+  $Image(src) = imageNew(meta);
+  memset(src->data, 200, imageDataNumBytes(src));
+  ASSERT_OK(
+      imagedSetWithOptions(db, "levels", -1, &meta, src->data, &options, NULL));
+
+  $ImagedHandle(handle);
+  ASSERT_OK(imagedGetLevel(db, "levels", -1, 2, &handle));
+  ck_assert(handle.image.meta.width == 64 && handle.image.meta.height == 25);
+  ck_assert(((uint8_t *)handle.image.data)[64 * 12 + 30] == 200);
+  imagedHandleClose(&handle);
+  ck_assert(imagedGetLevel(db, "levels", -1, 4, &handle) != IMAGED_OK);
+
+  ASSERT_OK(imagedGetLevelForSize(db, "levels", -1, 100, 40, &handle));
+  ck_assert(handle.image.meta.width == 128 && handle.image.meta.height == 50);
+  imagedHandleClose(&handle);
+
+  ASSERT_OK(imagedSetLevels(db, "levels", -1, 16));
+  ASSERT_OK(imagedGetLevelForSize(db, "levels", -1, 1, 1, &handle));
+  ck_assert(handle.image.meta.width == 1 && handle.image.meta.height == 1);
+  imagedHandleClose(&handle);
+  ck_assert(imagedIsValidFile(db, "levels", -1));
+  ASSERT_OK(imagedRemove(db, "levels", -1));
+}
+END_TEST
+
+START_TEST(test_catalog) {
+  ImageMeta meta = {
+      .width = 20,
+      .height = 10,
+      .color = IMAGE_COLOR_RGBA,
+      .kind = IMAGE_KIND_FLOAT,
+      .bits = 32,
+  };
+  ASSERT_OK(imagedSet(db, "catalog", -1, &meta, NULL, NULL));
+  ck_assert(imagedHasKey(db, "catalog", -1));
+  ck_assert(imagedSet(db, IMAGED_CATALOG, -1, &meta, NULL, NULL) ==
+            IMAGED_ERR_INVALID_KEY);
+
+  // Changes made through another database handle are visible
+  $Imaged(other) = imagedOpen(db->root);
+  ImagedCatalogEntry entry;
+  ASSERT_OK(imagedCatalogGet(other, "catalog", -1, &entry));
+  ck_assert(entry.meta.width == 20 && entry.meta.height == 10 &&
+            entry.meta.color == IMAGE_COLOR_RGBA);
+  ASSERT_OK(imagedRemove(other, "catalog", -1));
+  ck_assert(!imagedHasKey(db, "catalog", -1));
+
+  ASSERT_OK(imagedCatalogRebuild(db));
+  size_t index = 0, count = 0;
+  while (imagedCatalogNext(db, &index, &entry)) {
+    ck_assert(strncmp(entry.key, "testing", entry.keylen) == 0);
+    count += 1;
+  }
+  ck_assert(count == 1);
+  ck_assert(imagedCatalogGet(other, "catalog", -1, NULL) ==
+            IMAGED_ERR_FILE_DOES_NOT_EXIST);
+
+  // Keys returned by an iterator outlive a rebuild of the catalog
+  $ImagedIter(iter) = imagedIterNew(db);
+  const char *key = imagedIterNextKey(iter);
+  ck_assert(key != NULL);
+  ASSERT_OK(imagedCatalogRebuild(db));
+  ck_assert(strcmp(key, "testing") == 0);
+
+  // A catalog left incomplete by a rebuild that never finished is rebuilt
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", db->root, IMAGED_CATALOG);
+  FILE *f = fopen(path, "r+b");
+  ck_assert(f != NULL);
+  uint64_t flags = 0;
+  fseek(f, 16, SEEK_SET);
+  ck_assert(fwrite(&flags, sizeof(flags), 1, f) == 1);
+  fclose(f);
+
+  $Imaged(fresh) = imagedOpen(db->root);
+  ASSERT_OK(imagedCatalogLoad(fresh));
+  ASSERT_OK(imagedCatalogGet(fresh, "testing", -1, NULL));
+  ASSERT_OK(imagedCatalogGet(db, "testing", -1, NULL));
+}
+END_TEST
+
+START_TEST(test_iter_meta) {
+  ImagedHandle handle;
+  ASSERT_OK(imagedGet(db, "testing", -1, true, &handle));
+
+  // Locked keys are still listed since no locks are taken
+  $ImagedIter(iter) = imagedIterNewFromDirectory(db);
+  const ImageMeta *meta = imagedIterNextMeta(iter);
+  ck_assert(meta != NULL);
+  ck_assert(strcmp(iter->key, "testing") == 0);
+  ck_assert(meta->width == 800 && meta->height == 600);
+  ck_assert(iter->handle.image.data == NULL);
+  ck_assert(imagedIterNextMeta(iter) == NULL);
+  imagedHandleClose(&handle);
+}
+END_TEST
+
+START_TEST(test_handle_cache) {
+  ImageMeta meta = {
+      .width = 20,
+      .height = 10,
+      .color = IMAGE_COLOR_RGB,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 8,
+  };
+  ASSERT_OK(imagedSet(db, "cached", -1, &meta, NULL, NULL));
+
+  // Read-only handles share a mapping, which stays open after closing them
+  ImagedHandle a, b;
+  ASSERT_OK(imagedGet(db, "cached", -1, false, &a));
+  ASSERT_OK(imagedGet(db, "cached", -1, false, &b));
+  ck_assert(a.map == b.map);
+  ck_assert(imagedSet(db, "cached", -1, &meta, NULL, NULL) ==
+            IMAGED_ERR_LOCKED);
+  imagedHandleClose(&a);
+  imagedHandleClose(&b);
+
+  ImagedHandleCacheStats before, after;
+  imagedGetHandleCacheStats(db, &before);
+  ASSERT_OK(imagedGet(db, "cached", -1, false, &a));
+  imagedHandleClose(&a);
+  imagedGetHandleCacheStats(db, &after);
+  ck_assert(after.hits == before.hits + 1);
+
+  // Rewriting the key from another database handle invalidates the mapping
+  $Imaged(other) = imagedOpen(db->root);
+  meta.width = 30;
+  ASSERT_OK(imagedSet(other, "cached", -1, &meta, NULL, NULL));
+  ASSERT_OK(imagedGet(db, "cached", -1, false, &a));
+  ck_assert(a.image.meta.width == 30);
+  imagedHandleClose(&a);
+  imagedGetHandleCacheStats(db, &after);
+  ck_assert(after.invalidations == before.invalidations + 1);
+
+  // An atomic write is seen even while a handle for the key is open
+  ASSERT_OK(imagedGet(db, "cached", -1, false, &b));
+  ImagedSetOptions atomic = {.atomic = true};
+  meta.width = 40;
+  ASSERT_OK(
+      imagedSetWithOptions(other, "cached", -1, &meta, NULL, &atomic, NULL));
+  ASSERT_OK(imagedGet(db, "cached", -1, false, &a));
+  ck_assert(a.image.meta.width == 40);
+  ck_assert(b.image.meta.width == 30);
+  imagedHandleClose(&a);
+  imagedHandleClose(&b);
+
+  ASSERT_OK(imagedRemove(other, "cached", -1));
+  ck_assert(imagedGet(db, "cached", -1, false, &a) ==
+            IMAGED_ERR_FILE_DOES_NOT_EXIST);
+}
+END_TEST
+
 START_TEST(test_iter) {
   $ImagedIter(iter) = imagedIterNew(db);
   ck_assert(iter != NULL);
@@ -88,6 +511,629 @@ START_TEST(test_iter) {
 }
 END_TEST
 
+static ImagedStatus forEachCount(const char *key, ImagedHandle *handle,
+                                 size_t worker, void *ud) {
+  (void)worker;
+  if (strcmp(key, "testing") != 0 || handle->image.data == NULL) {
+    return IMAGED_ERR;
+  }
+  __atomic_add_fetch((size_t *)ud, 1, __ATOMIC_RELAXED);
+  return IMAGED_OK;
+}
+
+static void forEachError(const char *key, ImagedStatus status, void *ud) {
+  if (strcmp(key, "testing") == 0 && status == IMAGED_ERR_LOCKED) {
+    __atomic_add_fetch((size_t *)ud, 100, __ATOMIC_RELAXED);
+  }
+}
+
+START_TEST(test_for_each) {
+  ImagedHandle handle;
+  ASSERT_OK(imagedGet(db, "testing", -1, true, &handle));
+
+  size_t count = 0;
+  ImagedForEachOptions opts = {.skip_locked = true, .error = forEachError};
+  ASSERT_OK(imagedForEach(db, &opts, forEachCount, &count));
+  ck_assert(count == 0);
+
+  opts.skip_locked = false;
+  ck_assert(imagedForEach(db, &opts, forEachCount, &count) == IMAGED_ERR);
+  ck_assert(count == 100);
+  imagedHandleClose(&handle);
+
+  count = 0;
+  opts.editable = true;
+  ASSERT_OK(imagedForEach(db, &opts, forEachCount, &count));
+  ck_assert(count == 1);
+}
+END_TEST
+
+static void *lockRelease(void *ud) {
+  usleep(100000);
+  imagedHandleClose(ud);
+  return NULL;
+}
+
+START_TEST(test_lock_timeout) {
+  ImagedHandle handle;
+  ASSERT_OK(imagedGet(db, "testing", -1, true, &handle));
+
+  ImagedLockStats before, after;
+  imagedGetLockStats(db, &before);
+  ck_assert(imagedRemoveWithTimeout(db, "testing", -1, 20) ==
+            IMAGED_ERR_LOCKED);
+  imagedGetLockStats(db, &after);
+  ck_assert(after.timeouts == before.timeouts + 1);
+  ck_assert(after.wait_ns - before.wait_ns >= 20000000);
+
+  // The waiter is woken up when the handle is closed by another thread
+  pthread_t thread;
+  pthread_create(&thread, NULL, lockRelease, &handle);
+  ImagedHandle reader;
+  ASSERT_OK(imagedGetWithTimeout(db, "testing", -1, false, 5000, &reader));
+  pthread_join(thread, NULL);
+  imagedHandleClose(&reader);
+
+  imagedGetLockStats(db, &after);
+  ck_assert(after.waits == before.waits + 2);
+  ck_assert(after.max_wait_ns < 5000000000ULL);
+}
+END_TEST
+
+START_TEST(test_shared_locks) {
+  // With an old directory mtime the missing table is not looked for again
+  // until the mtime changes
+  mkdir("test/db-shared", 0755);
+  struct timeval old[2] = {{.tv_sec = 1000000000}, {.tv_sec = 1000000000}};
+  ck_assert(utimes("test/db-shared", old) == 0);
+  $Imaged(early) = imagedOpen("test/db-shared");
+  ck_assert(early != NULL);
+  $Imaged(shared) = imagedOpen("test/db-shared");
+  ck_assert(shared != NULL);
+  ASSERT_OK(imagedEnableSharedLocks(shared));
+  imagedResetLocks(shared);
+
+  ImageMeta meta = {
+      .width = 16,
+      .height = 16,
+      .color = IMAGE_COLOR_RGB,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 8,
+  };
+  ImagedHandle writer, reader;
+  ASSERT_OK(imagedSet(shared, "frame", -1, &meta, NULL, &writer));
+
+  // Databases opened after the table was created use it too
+  $Imaged(other) = imagedOpen("test/db-shared");
+  ck_assert(imagedHasSharedLocks(other));
+  ck_assert(imagedKeyIsLocked(other, "frame", -1));
+  ck_assert(imagedGet(other, "frame", -1, false, &reader) ==
+            IMAGED_ERR_LOCKED);
+
+  // So do databases that were already open
+  ck_assert(imagedGet(early, "frame", -1, false, &reader) ==
+            IMAGED_ERR_LOCKED);
+  ck_assert(imagedHasSharedLocks(early));
+
+  // Readers can wait for the writer to finish
+  pthread_t thread;
+  pthread_create(&thread, NULL, lockRelease, &writer);
+  ASSERT_OK(imagedGetWithTimeout(other, "frame", -1, false, 5000, &reader));
+  pthread_join(thread, NULL);
+  ck_assert(imagedGet(shared, "frame", -1, true, &writer) ==
+            IMAGED_ERR_LOCKED);
+  imagedHandleClose(&reader);
+  ck_assert(!imagedKeyIsLocked(shared, "frame", -1));
+
+  // Closing a handle after a reset does not release a lock taken since
+  ASSERT_OK(imagedGet(other, "frame", -1, false, &reader));
+  imagedResetLocks(shared);
+  ASSERT_OK(imagedGet(shared, "frame", -1, true, &writer));
+  imagedHandleClose(&reader);
+  ck_assert(imagedKeyIsLocked(other, "frame", -1));
+  imagedHandleClose(&writer);
+  ck_assert(!imagedKeyIsLocked(other, "frame", -1));
+
+  // A writer that exits without closing its handle does not keep the lock,
+  // readers that exit are cleared by imagedResetLocks
+  for (int editable = 1; editable >= 0; editable--) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      Imaged *child = imagedOpen("test/db-shared");
+      ImagedHandle handle;
+      _exit(child != NULL &&
+                    imagedGet(child, "frame", -1, editable, &handle) ==
+                        IMAGED_OK
+                ? 0
+                : 1);
+    }
+
+    int wstatus;
+    ck_assert(waitpid(pid, &wstatus, 0) == pid && WIFEXITED(wstatus) &&
+              WEXITSTATUS(wstatus) == 0);
+    ck_assert(imagedKeyIsLocked(shared, "frame", -1));
+    if (editable) {
+      ASSERT_OK(imagedGet(shared, "frame", -1, true, &writer));
+      imagedHandleClose(&writer);
+    } else {
+      ck_assert(imagedGet(shared, "frame", -1, true, &writer) ==
+                IMAGED_ERR_LOCKED);
+      imagedResetLocks(shared);
+      ASSERT_OK(imagedRemove(shared, "frame", -1));
+    }
+  }
+
+  ASSERT_OK(imagedDestroy(shared));
+}
+END_TEST
+
+// Wait for an event of the given kind, earlier events for the same key are
+// skipped since a write may be reported more than once
+static bool watchWaitFor(ImagedWatch *watch, ImagedWatchEventKind kind) {
+  ImagedWatchEvent event;
+  while (imagedWatchNext(watch, 1000, &event)) {
+    if (event.kind == IMAGED_WATCH_OVERFLOW ||
+        strcmp(event.key, "watch-a") != 0) {
+      return false;
+    }
+
+    if (event.kind == kind) {
+      return true;
+    }
+  }
+  return false;
+}
+
+START_TEST(test_watch) {
+  $ImagedWatch(watch) = imagedWatchNew(db, "watch-*");
+  ck_assert(watch != NULL);
+
+  ImageMeta meta = {
+      .width = 8,
+      .height = 8,
+      .color = IMAGE_COLOR_GRAY,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 8,
+  };
+  ImagedSetOptions atomic = {.atomic = true};
+  ASSERT_OK(imagedSet(db, "watch-a", -1, &meta, NULL, NULL));
+  ASSERT_OK(imagedSet(db, "unwatched", -1, &meta, NULL, NULL));
+  ck_assert(watchWaitFor(watch, IMAGED_WATCH_SET));
+
+  ASSERT_OK(imagedSetWithOptions(db, "watch-a", -1, &meta, NULL, &atomic,
+                                 NULL));
+  usleep(150000);
+  ck_assert(watchWaitFor(watch, IMAGED_WATCH_SET));
+
+  // Closing an editable handle without writing to it is not a change
+  ImagedWatchEvent event;
+  ImagedHandle handle;
+  ASSERT_OK(imagedGet(db, "watch-a", -1, true, &handle));
+  imagedHandleClose(&handle);
+  ck_assert(!imagedWatchNext(watch, 20, &event));
+
+  ASSERT_OK(imagedRemove(db, "unwatched", -1));
+  ASSERT_OK(imagedRemove(db, "watch-a", -1));
+  ck_assert(watchWaitFor(watch, IMAGED_WATCH_REMOVE));
+  ck_assert(!imagedWatchNext(watch, 20, &event));
+}
+END_TEST
+
+static void *ringProduce(void *ud) {
+  ImagedRing *ring = ud;
+  ImagedRingFrame frame;
+  usleep(50000);
+  imagedRingBegin(ring, &frame);
+  memset(frame.image.data, 2, imageMetaTotalBytes(&frame.image.meta));
+  imagedRingPublish(ring, &frame);
+  return NULL;
+}
+
+START_TEST(test_ring) {
+  ImageMeta meta = {
+      .width = 8,
+      .height = 8,
+      .color = IMAGE_COLOR_GRAY,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 8,
+  };
+  ImagedRing *producer, *reader;
+  ASSERT_OK(imagedRingCreate(db, "camera", -1, &meta, 3, &producer));
+  ck_assert(imagedRingOpen(db, "camera", -1, true, &reader) ==
+            IMAGED_ERR_LOCKED);
+  ASSERT_OK(imagedRingOpen(db, "camera", -1, false, &reader));
+  ck_assert(!imagedHasKey(db, "camera", -1));
+
+  ImagedRingFrame frame, latest;
+  ck_assert(!imagedRingLatest(reader, &latest));
+  ASSERT_OK(imagedRingBegin(producer, &frame));
+  memset(frame.image.data, 1, imageMetaTotalBytes(&meta));
+  ASSERT_OK(imagedRingPublish(producer, &frame));
+  ck_assert(imagedRingLatest(reader, &latest) && latest.seq == 1);
+  ck_assert(((uint8_t *)latest.image.data)[63] == 1);
+  ck_assert(imagedRingBegin(reader, &frame) == IMAGED_ERR);
+
+  // Readers sleep until the next frame is published
+  pthread_t thread;
+  pthread_create(&thread, NULL, ringProduce, producer);
+  ImagedRingFrame next;
+  ck_assert(imagedRingNext(reader, latest.seq, 5000, &next));
+  pthread_join(thread, NULL);
+  ck_assert(next.seq == 2 && ((uint8_t *)next.image.data)[0] == 2);
+  ck_assert(!imagedRingNext(reader, next.seq, 10, &next));
+
+  // Once the producer wraps around old frames are no longer valid
+  for (int i = 0; i < 3; i++) {
+    ASSERT_OK(imagedRingBegin(producer, &frame));
+    ASSERT_OK(imagedRingPublish(producer, &frame));
+  }
+  ck_assert(!imagedRingFrameIsValid(reader, &latest));
+  ck_assert(imagedRingNext(reader, latest.seq, 0, &next) && next.seq == 5);
+  ck_assert(imagedRingFrameIsValid(reader, &next));
+
+  imagedRingClose(reader);
+  imagedRingClose(producer);
+  ASSERT_OK(imagedRingRemove(db, "camera", -1));
+}
+END_TEST
+
+START_TEST(test_ephemeral) {
+  ImageMeta meta = {
+      .width = 8,
+      .height = 8,
+      .color = IMAGE_COLOR_GRAY,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 8,
+  };
+  ImagedSetOptions options = {.ephemeral = true};
+  ImagedHandle handle;
+  ASSERT_OK(imagedSetWithOptions(db, "scratch", -1, &meta, NULL, &options,
+                                 &handle));
+  memset(handle.image.data, 7, imageMetaTotalBytes(&meta));
+  imagedHandleClose(&handle);
+
+  // Nothing is written to the database directory
+  char path[PATH_MAX];
+  struct stat st;
+  snprintf(path, sizeof(path), "%s/scratch", db->root);
+  ck_assert(stat(path, &st) != 0);
+  ck_assert(imagedHasKey(db, "scratch", -1));
+
+  // Other databases opened on the same directory see the key
+  $Imaged(other) = imagedOpen(db->root);
+  ASSERT_OK(imagedGet(other, "scratch", -1, true, &handle));
+  ck_assert(((uint8_t *)handle.image.data)[63] == 7);
+  ck_assert(imagedGet(db, "scratch", -1, false, NULL) == IMAGED_OK);
+  ImagedHandle reader;
+  ck_assert(imagedGet(db, "scratch", -1, false, &reader) ==
+            IMAGED_ERR_LOCKED);
+  imagedHandleClose(&handle);
+
+  ck_assert(imagedSetWithOptions(db, "testing", -1, &meta, NULL, &options,
+                                 NULL) == IMAGED_ERR_FILE_ALREADY_EXISTS);
+  ck_assert(imagedSet(db, "scratch", -1, &meta, NULL, NULL) ==
+            IMAGED_ERR_FILE_ALREADY_EXISTS);
+  ck_assert(stat(path, &st) != 0);
+
+  ASSERT_OK(imagedRemove(other, "scratch", -1));
+  ck_assert(!imagedHasKey(db, "scratch", -1));
+  ck_assert(imagedGet(db, "scratch", -1, false, &reader) ==
+            IMAGED_ERR_FILE_DOES_NOT_EXIST);
+}
+END_TEST
+
+START_TEST(test_pack) {
+  ImageMeta meta = {
+      .width = 4,
+      .height = 4,
+      .color = IMAGE_COLOR_GRAY,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 8,
+  };
+  uint8_t data[16];
+  char key[32];
+
+  ImagedPack *pack = imagedPackOpen("test/pack");
+  ck_assert(pack != NULL);
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "image-%d", i);
+    memset(data, i & 0xff, sizeof(data));
+    ASSERT_OK(imagedPackSet(pack, key, -1, &meta, data));
+  }
+
+  // Reads point into the segment mapping
+  Image image;
+  ASSERT_OK(imagedPackGet(pack, "image-42", -1, &image));
+  ck_assert(!image.owner && image.meta.width == 4);
+  ck_assert(((uint8_t *)image.data)[15] == 42);
+
+  for (int i = 0; i < 1000; i += 2) {
+    snprintf(key, sizeof(key), "image-%d", i);
+    ASSERT_OK(imagedPackRemove(pack, key, -1));
+  }
+  ck_assert(imagedPackRemove(pack, "image-0", -1) ==
+            IMAGED_ERR_FILE_DOES_NOT_EXIST);
+
+  // Another pack opened on the same directory sees the changes
+  ImagedPack *other = imagedPackOpen("test/pack");
+  ck_assert(other != NULL);
+  ck_assert(!imagedPackHasKey(other, "image-42", -1));
+  ASSERT_OK(imagedPackGet(other, "image-43", -1, &image));
+  ck_assert(((uint8_t *)image.data)[0] == 43);
+
+  ImagedPackStats stats;
+  imagedPackGetStats(pack, &stats);
+  ck_assert(stats.keys == 500);
+  ck_assert(stats.dead_bytes == stats.live_bytes);
+
+  // Compaction keeps the old mapping of the other pack usable and makes it
+  // reload the index
+  ASSERT_OK(imagedPackCompact(pack));
+  imagedPackGetStats(pack, &stats);
+  ck_assert(stats.keys == 500 && stats.dead_bytes == 0);
+  ck_assert(((uint8_t *)image.data)[0] == 43);
+  ASSERT_OK(imagedPackSet(other, "image-43", -1, &meta, NULL));
+  ASSERT_OK(imagedPackGet(pack, "image-43", -1, &image));
+  ck_assert(((uint8_t *)image.data)[0] == 0);
+
+  // The segments removed by compaction stay mapped until they are released
+  imagedPackGetStats(other, &stats);
+  size_t mapped = stats.mapped;
+  imagedPackRelease(other);
+  imagedPackGetStats(other, &stats);
+  ck_assert(stats.mapped < mapped && stats.mapped == 1);
+
+  size_t index = 0, n = 0;
+  ImagedPackEntry entry;
+  while (imagedPackNext(pack, &index, &entry)) {
+    int i = atoi(entry.key + strlen("image-"));
+    ck_assert(i % 2 == 1);
+    ck_assert(((uint8_t *)entry.image.data)[7] == (i == 43 ? 0 : i & 0xff));
+    n += 1;
+  }
+  ck_assert(n == 500);
+
+  imagedPackClose(other);
+  ASSERT_OK(imagedPackDestroy(pack));
+}
+END_TEST
+
+START_TEST(test_dedup) {
+  ImageMeta meta = {
+      .width = 64,
+      .height = 64,
+      .color = IMAGE_COLOR_RGB,
+      .kind = IMAGE_KIND_UINT,
+      .bits = 8,
+  };
+  size_t size = imageMetaTotalBytes(&meta);
+  uint8_t *data = malloc(size);
+  ck_assert(data != NULL);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = i * 7;
+  }
+
+  ImagedSetOptions options = {.dedup = true};
+  ASSERT_OK(imagedSetWithOptions(db, "alias-a", -1, &meta, data, &options,
+                                 NULL));
+  ASSERT_OK(imagedSetWithOptions(db, "alias-b", -1, &meta, data, &options,
+                                 NULL));
+  ASSERT_OK(imagedSetWithOptions(db, "alias-c", -1, &meta, data, &options,
+                                 NULL));
+
+  struct stat a, b;
+  ASSERT_OK(imagedStat(db, "alias-a", -1, &a));
+  ASSERT_OK(imagedStat(db, "alias-b", -1, &b));
+  ck_assert(a.st_ino == b.st_ino && a.st_nlink == 4);
+
+  ImagedDedupStats stats;
+  imagedGetDedupStats(db, &stats);
+  ck_assert(stats.objects == 1 && stats.references == 3);
+  ck_assert(stats.saved_bytes == 2 * (uint64_t)a.st_size);
+
+  // Editing one key leaves the others unchanged
+  ImagedHandle handle;
+  ASSERT_OK(imagedGet(db, "alias-a", -1, true, &handle));
+  ((uint8_t *)handle.image.data)[0] = 255;
+  imagedHandleClose(&handle);
+  ASSERT_OK(imagedGet(db, "alias-b", -1, false, &handle));
+  ck_assert(((uint8_t *)handle.image.data)[0] == 0);
+  ck_assert(memcmp(handle.image.data, data, size) == 0);
+  imagedHandleClose(&handle);
+
+  // Keys sharing a file do not block each other
+  ImagedHandle reader;
+  ASSERT_OK(imagedGet(db, "alias-c", -1, false, &reader));
+  ASSERT_OK(imagedSet(db, "alias-b", -1, &meta, NULL, NULL));
+  ASSERT_OK(imagedSetWithOptions(db, "alias-d", -1, &meta, data, &options,
+                                 NULL));
+  ASSERT_OK(imagedRemove(db, "alias-d", -1));
+  imagedHandleClose(&reader);
+  ASSERT_OK(imagedStat(db, "alias-c", -1, &b));
+  ck_assert(b.st_nlink == 2);
+
+  // The object is deleted with the last key that uses it
+  ASSERT_OK(imagedRemove(db, "alias-c", -1));
+  imagedGetDedupStats(db, &stats);
+  ck_assert(stats.objects == 0);
+
+  ASSERT_OK(imagedRemove(db, "alias-a", -1));
+  ASSERT_OK(imagedRemove(db, "alias-b", -1));
+  free(data);
+}
+END_TEST
+
+START_TEST(test_clone) {
+  ASSERT_OK(imagedClone(db, "testing", -1, "testing-clone", -1));
+  ck_assert(imagedClone(db, "missing", -1, "other", -1) ==
+            IMAGED_ERR_FILE_DOES_NOT_EXIST);
+
+  // The clone is independent of the source
+  ImagedHandle handle, clone;
+  ASSERT_OK(imagedGet(db, "testing-clone", -1, true, &clone));
+  ASSERT_OK(imagedGet(db, "testing", -1, false, &handle));
+  ck_assert(clone.image.meta.width == handle.image.meta.width);
+  size_t size = imageMetaTotalBytes(&handle.image.meta);
+  ck_assert(memcmp(clone.image.data, handle.image.data, size) == 0);
+  ((uint8_t *)clone.image.data)[0] ^= 0xff;
+  ck_assert(((uint8_t *)clone.image.data)[0] !=
+            ((uint8_t *)handle.image.data)[0]);
+  imagedHandleClose(&handle);
+
+  // Keys open for editing are not copied
+  ImagedSnapshotStats stats;
+  ASSERT_OK(imagedSnapshot(db, "test/db-snapshot-locked", &stats));
+  ck_assert(stats.locked == 1);
+  $Imaged(partial) = imagedOpen("test/db-snapshot-locked");
+  ck_assert(partial != NULL);
+  ck_assert(!imagedHasKey(partial, "testing-clone", -1));
+  ck_assert(imagedHasKey(partial, "testing", -1));
+  imagedDestroy(partial);
+  imagedHandleClose(&clone);
+
+  ASSERT_OK(imagedSnapshot(db, "test/db-snapshot", &stats));
+  ck_assert(stats.locked == 0);
+  ck_assert(imagedSnapshot(db, "test/db-snapshot", NULL) ==
+            IMAGED_ERR_FILE_ALREADY_EXISTS);
+
+  $Imaged(snapshot) = imagedOpen("test/db-snapshot");
+  ck_assert(snapshot != NULL);
+  size_t n = 0;
+  $ImagedIter(iter) = imagedIterNew(snapshot);
+  while (imagedIterNextKey(iter) != NULL) {
+    n += 1;
+  }
+  ck_assert(n == stats.keys && n >= 2);
+  ck_assert(imagedHasKey(snapshot, "testing-clone", -1));
+  imagedDestroy(snapshot);
+
+  ASSERT_OK(imagedRemove(db, "testing-clone", -1));
+}
+END_TEST
+
+START_TEST(test_capacity) {
+  $Imaged(capped) = imagedOpen("test/db-capacity");
+  ck_assert(capped != NULL);
+  ASSERT_OK(imagedSetCapacity(capped, 0, 4));
+
+  ImageMeta meta = {.width = 8,
+                    .height = 8,
+                    .color = IMAGE_COLOR_RGB,
+                    .kind = IMAGE_KIND_INT,
+                    .bits = 8};
+  const char *keys[] = {"a", "b", "c", "d", "e"};
+  for (size_t i = 0; i < 4; i++) {
+    ASSERT_OK(imagedSet(capped, keys[i], -1, &meta, NULL, NULL));
+    usleep(5000);
+  }
+
+  // Reading "a" makes "b" the least recently used key
+  ImagedHandle handle;
+  ASSERT_OK(imagedGet(capped, "a", -1, false, &handle));
+  imagedHandleClose(&handle);
+  usleep(5000);
+
+  ASSERT_OK(imagedSet(capped, "e", -1, &meta, NULL, NULL));
+  ck_assert(imagedHasKey(capped, "a", -1));
+  ck_assert(!imagedHasKey(capped, "b", -1));
+  ck_assert(imagedHasKey(capped, "e", -1));
+
+  ImagedCapacityStats stats;
+  imagedGetCapacityStats(capped, &stats);
+  ck_assert(stats.max_keys == 4 && stats.keys == 4);
+  ck_assert(stats.evictions == 1 && stats.evicted_bytes > 0);
+
+  // Shrinking the limit evicts right away
+  ASSERT_OK(imagedSetCapacity(capped, 0, 2));
+  imagedGetCapacityStats(capped, &stats);
+  ck_assert(stats.keys <= 2 && stats.evictions >= 3);
+  ck_assert(imagedHasKey(capped, "e", -1));
+
+  // A batch makes room for all of its keys before writing any of them
+  ASSERT_OK(imagedSetCapacity(capped, 0, 4));
+  const char *batch[2][4] = {{"f", "g", "h", "i"}, {"j", "k", "l", "m"}};
+  for (int pass = 0; pass < 2; pass++) {
+    ImagedBatchOptions options = {.disable_uring = pass == 1};
+    ImagedSetRequest sets[4];
+    for (int i = 0; i < 4; i++) {
+      sets[i] = (ImagedSetRequest){
+          .key = batch[pass][i], .keylen = -1, .meta = meta};
+    }
+    ASSERT_OK(imagedSetBatch(capped, sets, 4, &options));
+    imagedGetCapacityStats(capped, &stats);
+    ck_assert(stats.keys == 4);
+  }
+
+  ASSERT_OK(imagedSetCapacity(capped, 0, 0));
+  imagedDestroy(capped);
+}
+END_TEST
+
+START_TEST(test_batch) {
+  ImageMeta meta = {.width = 16,
+                    .height = 16,
+                    .color = IMAGE_COLOR_GRAY,
+                    .kind = IMAGE_KIND_INT,
+                    .bits = 8};
+  uint8_t data[4][256];
+  const char *keys[] = {"batch-0", "batch-1", "batch-2", "batch-3"};
+
+  // Both the io_uring and the thread pool paths are checked
+  for (int pass = 0; pass < 2; pass++) {
+    ImagedBatchStats stats;
+    ImagedBatchOptions options = {.disable_uring = pass == 1,
+                                  .stats = &stats};
+    ImagedSetRequest sets[5];
+    for (int i = 0; i < 4; i++) {
+      memset(data[i], i + pass * 4, sizeof(data[i]));
+      sets[i] = (ImagedSetRequest){
+          .key = keys[i], .keylen = -1, .meta = meta, .data = data[i]};
+    }
+    sets[4] = (ImagedSetRequest){
+        .key = IMAGED_RESERVED "batch", .keylen = -1, .meta = meta};
+
+    ck_assert(imagedSetBatch(db, sets, 5, &options) == IMAGED_ERR);
+    for (int i = 0; i < 4; i++) {
+      ASSERT_OK(sets[i].status);
+    }
+    ck_assert(sets[4].status == IMAGED_ERR_INVALID_KEY);
+    ck_assert(stats.failed == 1);
+    ImagedUring *ring = imagedUringNew(1);
+    ck_assert(pass == 1 || ring == NULL || stats.submitted > 0);
+    ck_assert(pass == 0 || stats.fallback == 5);
+    imagedUringFree(ring);
+
+    ImagedGetRequest gets[5];
+    for (int i = 0; i < 4; i++) {
+      gets[i] = (ImagedGetRequest){.key = keys[i], .keylen = -1};
+    }
+    gets[4] = (ImagedGetRequest){.key = "batch-missing", .keylen = -1};
+
+    ck_assert(imagedGetBatch(db, gets, 5, &options) == IMAGED_ERR);
+    for (int i = 0; i < 4; i++) {
+      ASSERT_OK(gets[i].status);
+      ck_assert(gets[i].handle.image.meta.width == 16);
+      ck_assert(memcmp(gets[i].handle.image.data, data[i], 256) == 0);
+      imagedHandleClose(&gets[i].handle);
+    }
+    ck_assert(gets[4].status == IMAGED_ERR_FILE_DOES_NOT_EXIST);
+  }
+
+  // Editable handles block the batch the same way as an atomic set
+  ImagedHandle editable;
+  ASSERT_OK(imagedGet(db, keys[0], -1, true, &editable));
+  ImagedSetRequest locked = {
+      .key = keys[0], .keylen = -1, .meta = meta, .data = data[0]};
+  ck_assert(imagedSetBatch(db, &locked, 1, NULL) == IMAGED_ERR);
+  ck_assert(locked.status == IMAGED_ERR_LOCKED);
+  imagedHandleClose(&editable);
+
+  for (int i = 0; i < 4; i++) {
+    ASSERT_OK(imagedRemove(db, keys[i], -1));
+  }
+}
+END_TEST
+
 START_TEST(test_remove) {
   ASSERT_OK(imagedRemove(db, "testing", -1));
 
@@ -147,6 +1193,25 @@ START_TEST(test_image) {
 }
 END_TEST;
 
+START_TEST(test_image_span) {
+  $Image(im) = imageAlloc(64, 4, IMAGE_COLOR_RGB, IMAGE_KIND_UINT, 16, NULL);
+  Pixel row[64], q;
+  for (size_t x = 0; x < 64; x++) {
+    row[x] = pixelNew3(x / 64.0, 0.5, 1.0);
+  }
+
+  ck_assert(imageSetPixels(im, 0, 2, 64, row));
+  ck_assert(!imageSetPixels(im, 1, 2, 64, row));
+  ck_assert(imageGetPixels(im, 0, 2, 64, row));
+
+  for (size_t x = 0; x < 64; x++) {
+    ck_assert(imageGetPixel(im, x, 2, &q));
+    ck_assert(pixelEq(&row[x], &q));
+    ck_assert(q.data[3] == 1.0);
+  }
+}
+END_TEST;
+
 START_TEST(test_image_convert) {
   $Image(a) = imageAlloc(800, 600, IMAGE_COLOR_RGB, IMAGE_KIND_FLOAT, 32, NULL);
   $Image(b) = imageConvert(a, IMAGE_COLOR_RGBA, IMAGE_KIND_UINT, 16);
@@ -174,6 +1239,12 @@ START_TEST(test_image_resize) {
   ck_assert(b->meta.color == IMAGE_COLOR_RGB);
   ck_assert(b->meta.kind == IMAGE_KIND_FLOAT);
   ck_assert(b->meta.bits == 32);
+
+  Pixel p = pixelNew(0.5, 0.25, 1.0, 1.0), q;
+  imageSetPixel(a, 400, 300, &p);
+  $Image(c) = imageResize(a, 400, 300);
+  imageGetPixel(c, 200, 150, &q);
+  ck_assert(q.data[0] > 0.0);
 }
 END_TEST;
 
@@ -224,6 +1295,115 @@ START_TEST(test_each_pixel) {
 }
 END_TEST;
 
+START_TEST(test_each_pixel_remainder) {
+  // 601 rows do not divide evenly between threads, every row must be visited
+  Image *im = imageAlloc(31, 601, IMAGE_COLOR_GRAY, IMAGE_KIND_FLOAT, 32, NULL);
+  ImageParallelStats stats;
+  ImageParallelOptions opts = {
+      .pool = NULL,
+      .grain = 7,
+      .stats = &stats,
+  };
+  ck_assert(imageEachPixelWithOptions(im, NULL, parallel_fn, &opts, NULL) ==
+            IMAGED_OK);
+  ck_assert(stats.grain == 7);
+  ck_assert(stats.blocks == 86);
+  ck_assert(stats.threads >= 1);
+
+  // Grains larger than the image give a single block
+  opts.grain = UINT64_MAX;
+  ck_assert(imageEachPixelWithOptions(im, NULL, parallel_fn, &opts, NULL) ==
+            IMAGED_OK);
+  ck_assert(stats.grain == 601 && stats.blocks == 1);
+
+  float *data = im->data;
+  for (size_t i = 0; i < im->meta.width * im->meta.height; i++) {
+    ck_assert(data[i] == 1.0);
+  }
+  imageFree(im);
+}
+END_TEST;
+
+static void row_fn(uint64_t y, void *row, uint64_t width, size_t stride,
+                   IMAGED_UNUSED Image *im, IMAGED_UNUSED void *userdata) {
+  uint8_t *px = row;
+  for (uint64_t x = 0; x < width; x++) {
+    px[x * stride] = (uint8_t)y;
+    px[x * stride + 1] += 1;
+    px[x * stride + 2] = 255;
+  }
+}
+
+START_TEST(test_each_row) {
+  Image *im = imageAlloc(123, 77, IMAGE_COLOR_RGB, IMAGE_KIND_UINT, 8, NULL);
+  ck_assert(imageEachRow(im, row_fn, 0, NULL) == IMAGED_OK);
+
+  for (size_t y = 0; y < im->meta.height; y++) {
+    for (size_t x = 0; x < im->meta.width; x++) {
+      uint8_t *px = imageAt(im, x, y);
+      ck_assert(px[0] == y);
+      ck_assert(px[1] == 1);
+      ck_assert(px[2] == 255);
+    }
+  }
+  imageFree(im);
+}
+END_TEST;
+
+START_TEST(test_image_stats) {
+  $Image(im) = imageAlloc(100, 50, IMAGE_COLOR_GRAY, IMAGE_KIND_UINT, 8, NULL);
+  uint8_t *data = im->data;
+  for (size_t i = 0; i < 100 * 50; i++) {
+    data[i] = i % 2 ? 255 : 0;
+  }
+
+  ImageStats stats;
+  ASSERT_OK(imageStats(im, &stats));
+  ck_assert(stats.count == 5000);
+  ck_assert(stats.min.data[0] == 0.0);
+  ck_assert(stats.max.data[0] == 1.0);
+  ck_assert(stats.sum[0] == 2500.0);
+  ck_assert(stats.mean[0] == 0.5);
+  ck_assert(stats.variance[0] == 0.25);
+  ck_assert(stats.mean[3] == 1.0);
+
+  uint64_t hist[4 * 16];
+  ASSERT_OK(imageHistogram(im, 16, hist));
+  ck_assert(hist[0] == 2500);
+  ck_assert(hist[15] == 2500);
+  ck_assert(hist[3 * 16 + 15] == 5000);
+
+  // Types imageGetPixels cannot read are an error, not an empty result
+  im->meta.bits = 12;
+  ck_assert(imageStats(im, &stats) == IMAGED_ERR);
+  ck_assert(imageHistogram(im, 16, hist) == IMAGED_ERR);
+  im->meta.bits = 8;
+}
+END_TEST;
+
+static void pool_fn(size_t index, IMAGED_UNUSED size_t worker, void *userdata) {
+  __atomic_fetch_add((uint64_t *)userdata + index, 1, __ATOMIC_RELAXED);
+}
+
+START_TEST(test_pool) {
+  ImagedPool *pool = imagedPoolNew(4);
+  ck_assert(pool != NULL);
+  ck_assert(imagedPoolNumThreads(pool) == 4);
+
+  uint64_t counts[100] = {0};
+  for (int i = 0; i < 10; i++) {
+    ASSERT_OK(imagedPoolRun(pool, 100, pool_fn, counts));
+  }
+
+  for (int i = 0; i < 100; i++) {
+    ck_assert(counts[i] == 10);
+  }
+
+  imagedPoolFree(pool);
+  ck_assert(imagedPoolDefault() == imagedPoolDefault());
+}
+END_TEST;
+
 #define BASIC(name) tcase_add_test(basic, name);
 
 Suite *imaged_test_suite() {
@@ -236,16 +1416,41 @@ Suite *imaged_test_suite() {
   BASIC(test_image_size);
   BASIC(test_open);
   BASIC(test_set);
+  BASIC(test_format);
+  BASIC(test_tiled);
+  BASIC(test_compressed);
+  BASIC(test_writer);
+  BASIC(test_atomic);
+  BASIC(test_levels);
+  BASIC(test_catalog);
+  BASIC(test_handle_cache);
   BASIC(test_iter);
+  BASIC(test_iter_meta);
+  BASIC(test_for_each);
+  BASIC(test_lock_timeout);
+  BASIC(test_shared_locks);
+  BASIC(test_watch);
+  BASIC(test_ring);
+  BASIC(test_ephemeral);
+  BASIC(test_pack);
+  BASIC(test_dedup);
+  BASIC(test_clone);
+  BASIC(test_capacity);
+  BASIC(test_batch);
   BASIC(test_remove);
   BASIC(test_imaged_reset);
   BASIC(test_pixel);
   BASIC(test_image);
+  BASIC(test_image_span);
   BASIC(test_image_convert);
   BASIC(test_image_resize);
   BASIC(test_image_io);
   BASIC(test_image_io_exr);
   BASIC(test_each_pixel);
+  BASIC(test_each_pixel_remainder);
+  BASIC(test_each_row);
+  BASIC(test_pool);
+  BASIC(test_image_stats);
 
   suite_add_tcase(s, basic);
   return s;